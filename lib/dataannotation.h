@@ -31,10 +31,56 @@ public:
 	 */
 	virtual const char* Lookup(uint32_t value) = 0;
 
+	typedef ProtocolDefinition::AnnotationBinding Binding;
+
+	/*! \brief Resolves what an annotation action needs within a struct
+	 *  \param oStruct Struct the action is part of
+	 *  \param pBinding Receives the binding to pass to Apply(); the action becomes owner
+	 *  \returns true if the action can be applied to this struct
+	 *
+	 *  This is called once per struct, when it is prepared for decoding, so
+	 *  that Apply() need not look anything up by name.
+	 */
+	virtual bool Bind(const ProtocolDefinition::Struct& oStruct, Binding*& pBinding) { pBinding = NULL; return true; }
+
 	/*! \brief Applies an annotation action
-	 *  \param pType Current type node
+	 *  \param pBinding Binding obtained using Bind()
+	 *  \param pValues Values of the struct members, indexed by Field::GetIndex()
 	 */
-	virtual void Apply(ProtocolDefinition::Type* pType) { }
+	virtual void Apply(const Binding* pBinding, const ProtocolDefinition::Value* pValues) { }
+
+	//! \brief Field of a given type within a struct, resolved by Bind()
+	template<typename T> class BoundField {
+	public:
+		BoundField() : m_Type(NULL), m_Index(-1) { }
+
+		/*! \brief Resolves the field
+		 *  \param oStruct Struct to look in
+		 *  \param sName Field name
+		 *  \returns true if the field exists and is of type T
+		 */
+		bool Bind(const ProtocolDefinition::Struct& oStruct, const char* sName) {
+			const ProtocolDefinition::Field* pField = oStruct.FindField(sName);
+			if (pField == NULL)
+				return false;
+			m_Type = dynamic_cast<const T*>(&pField->GetType());
+			m_Index = pField->GetIndex();
+			return m_Type != NULL;
+		}
+
+		//! \brief Was the field resolved by Bind()?
+		bool IsBound() const { return m_Type != NULL; }
+
+		//! \brief Retrieves the type of the field
+		const T& GetType() const { return *m_Type; }
+
+		//! \brief Retrieves the field's value among the struct member values
+		const ProtocolDefinition::Value& GetValue(const ProtocolDefinition::Value* pValues) const { return pValues[m_Index]; }
+
+	private:
+		const T* m_Type;
+		int m_Index;
+	};
 };
 
 #endif /* __DATA_ANNOTATION_H__ */
@@ -35,12 +35,14 @@ public:
 	 */
 	virtual bool Apply(const uint8_t* pSource, int iSourceLen, uint8_t* pDest, int& oDestLen) = 0;
 
-	/*! \brief Called to guesstimate the destination buffer size
-	 *  \param pSource Source that is to be guessed
+	/*! \brief Called to determine the destination buffer size
+	 *  \param pSource Source that is to be transformed
 	 *  \param iSourceLen Source length, in bytes
-	 *  \returns Estimated size, or -1 if this cannot be decoded
+	 *  \returns Buffer size, or -1 if this cannot be decoded
 	 *
-	 *  The buffer must never be too small to contain the output.
+	 *  The buffer must never be too small to contain the output. It is
+	 *  taken from scratch memory that is kept for the entire packet, so
+	 *  returning the exact output size is preferred over a rough guess.
 	 */
 	virtual int EstimateBufferSize(const uint8_t* pSource, int iSourceLen) = 0;
 };
@@ -0,0 +1,70 @@
+/*
+ * Runes of Magic protocol analysis - decode scratch memory
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "decodearena.h"
+#include <stdlib.h>
+
+DecodeArena::DecodeArena(int iInitialSize)
+	: m_Current(NULL)
+{
+	AddChunk(iInitialSize);
+}
+
+DecodeArena::~DecodeArena()
+{
+	while (m_Current != NULL) {
+		Chunk* pPrev = m_Current->m_Prev;
+		free(m_Current);
+		m_Current = pPrev;
+	}
+}
+
+void
+DecodeArena::AddChunk(int iSize)
+{
+	// Grow geometrically so a burst of allocations needs few chunks
+	int iChunkSize = (m_Current != NULL) ? m_Current->m_Size * 2 : iSize;
+	if (iChunkSize < iSize)
+		iChunkSize = iSize;
+
+	Chunk* pChunk = static_cast<Chunk*>(malloc(sizeof(Chunk) + iChunkSize));
+	pChunk->m_Prev = m_Current;
+	pChunk->m_Size = iChunkSize;
+	pChunk->m_Used = 0;
+	m_Current = pChunk;
+}
+
+void
+DecodeArena::Reset()
+{
+	if (m_Current->m_Prev == NULL) {
+		// Common case: everything fit in a single chunk
+		m_Current->m_Used = 0;
+		return;
+	}
+
+	// Replace all chunks by a single one which can hold everything
+	int iTotal = 0;
+	while (m_Current != NULL) {
+		Chunk* pPrev = m_Current->m_Prev;
+		iTotal += m_Current->m_Size;
+		free(m_Current);
+		m_Current = pPrev;
+	}
+	AddChunk(iTotal);
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,91 @@
+/*
+ * Runes of Magic protocol analysis - decode scratch memory
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __DECODEARENA_H__
+#define __DECODEARENA_H__
+
+#include <stdint.h>
+
+/*! \brief Scratch memory used while decoding a single packet
+ *
+ *  Memory is handed out from a chunk which is only ever reset, never freed,
+ *  between packets. Should a packet need more than the chunk can hold, extra
+ *  chunks are allocated; they are merged into a single, larger chunk on the
+ *  next Reset() so that the arena settles at the largest size needed and
+ *  decoding no longer allocates at all.
+ */
+class DecodeArena {
+public:
+	/*! \brief Constructs the arena
+	 *  \param iInitialSize Initial chunk size, in bytes
+	 */
+	DecodeArena(int iInitialSize = s_DefaultSize);
+
+	//! \brief Destroys the arena and all memory handed out
+	~DecodeArena();
+
+	/*! \brief Allocates memory
+	 *  \param iSize Number of bytes needed
+	 *  \returns Memory, which remains valid until the next Reset()
+	 */
+	uint8_t* Allocate(int iSize);
+
+	//! \brief Makes all memory available again
+	void Reset();
+
+	//! \brief Default chunk size, in bytes
+	static const int s_DefaultSize = 64 * 1024;
+
+protected:
+	//! \brief Memory chunk; the data follows the header
+	struct Chunk {
+		//! \brief Previously used chunk, if any
+		Chunk* m_Prev;
+
+		//! \brief Chunk size, excluding the header
+		int m_Size;
+
+		//! \brief Number of bytes handed out
+		int m_Used;
+	};
+
+	/*! \brief Allocates a new chunk and makes it the current one
+	 *  \param iSize Number of bytes the chunk must hold
+	 */
+	void AddChunk(int iSize);
+
+	//! \brief Chunk currently used
+	Chunk* m_Current;
+
+	//! \brief Copying is forbidden
+	DecodeArena& operator=(const DecodeArena& oArena) = delete;
+	DecodeArena(const DecodeArena& oArena) = delete;
+};
+
+inline uint8_t*
+DecodeArena::Allocate(int iSize)
+{
+	// Keep everything 8-byte aligned
+	iSize = (iSize + 7) & ~7;
+	if (m_Current->m_Used + iSize > m_Current->m_Size)
+		AddChunk(iSize);
+
+	uint8_t* pData = reinterpret_cast<uint8_t*>(m_Current + 1) + m_Current->m_Used;
+	m_Current->m_Used += iSize;
+	return pData;
+}
+
+#endif /* __DECODEARENA_H__ */
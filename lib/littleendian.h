@@ -0,0 +1,127 @@
+/*
+ * Runes of Magic protocol analysis - little-endian data access
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __LITTLEENDIAN_H__
+#define __LITTLEENDIAN_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/*! \brief Reads little-endian values from unaligned data
+ *
+ *  All values are loaded using memcpy(), which compilers turn into a
+ *  single unaligned load; on big-endian hosts the bytes are swapped
+ *  afterwards. The array variants decode a whole span at once: on
+ *  little-endian hosts, arrays of values which are stored at their native
+ *  width are copied as a block, and the widening ones are simple loops the
+ *  compiler can vectorize.
+ */
+class LittleEndian {
+public:
+	//! \brief Reads a 16-bit value
+	static uint16_t Read16(const uint8_t* pData) {
+		uint16_t v;
+		memcpy(&v, pData, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		v = __builtin_bswap16(v);
+#endif
+		return v;
+	}
+
+	//! \brief Reads a 32-bit value
+	static uint32_t Read32(const uint8_t* pData) {
+		uint32_t v;
+		memcpy(&v, pData, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		v = __builtin_bswap32(v);
+#endif
+		return v;
+	}
+
+	//! \brief Reads a 64-bit value
+	static uint64_t Read64(const uint8_t* pData) {
+		uint64_t v;
+		memcpy(&v, pData, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		v = __builtin_bswap64(v);
+#endif
+		return v;
+	}
+
+	//! \brief Reads a float
+	static float ReadFloat(const uint8_t* pData) {
+		uint32_t v = Read32(pData);
+		float f;
+		memcpy(&f, &v, sizeof(f));
+		return f;
+	}
+
+	//! \brief Reads a double
+	static double ReadDouble(const uint8_t* pData) {
+		uint64_t v = Read64(pData);
+		double d;
+		memcpy(&d, &v, sizeof(d));
+		return d;
+	}
+
+	/*! \brief Reads 8-bit values, widening them to 32 bits
+	 *  \param pData Data to read
+	 *  \param pOut Receives the values
+	 *  \param iNum Number of values
+	 */
+	static void Read8Array(const uint8_t* pData, uint32_t* pOut, int iNum) {
+		for (int n = 0; n < iNum; n++)
+			pOut[n] = pData[n];
+	}
+
+	//! \brief Reads 16-bit values, widening them to 32 bits
+	static void Read16Array(const uint8_t* pData, uint32_t* pOut, int iNum) {
+		for (int n = 0; n < iNum; n++)
+			pOut[n] = Read16(pData + n * sizeof(uint16_t));
+	}
+
+	//! \brief Reads 32-bit values
+	static void Read32Array(const uint8_t* pData, uint32_t* pOut, int iNum) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		memcpy(pOut, pData, iNum * sizeof(uint32_t));
+#else
+		for (int n = 0; n < iNum; n++)
+			pOut[n] = Read32(pData + n * sizeof(uint32_t));
+#endif
+	}
+
+	//! \brief Reads floats
+	static void ReadFloatArray(const uint8_t* pData, float* pOut, int iNum) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		memcpy(pOut, pData, iNum * sizeof(float));
+#else
+		for (int n = 0; n < iNum; n++)
+			pOut[n] = ReadFloat(pData + n * sizeof(float));
+#endif
+	}
+
+	//! \brief Reads doubles
+	static void ReadDoubleArray(const uint8_t* pData, double* pOut, int iNum) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		memcpy(pOut, pData, iNum * sizeof(double));
+#else
+		for (int n = 0; n < iNum; n++)
+			pOut[n] = ReadDouble(pData + n * sizeof(double));
+#endif
+	}
+};
+
+#endif /* __LITTLEENDIAN_H__ */
@@ -0,0 +1,183 @@
+/*
+ * Runes of Magic protocol analysis - support code for generated decoders
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "nativedecoder.h"
+#include <iterator>
+#include <stdio.h>
+#include <vector>
+
+// Constant-initialized, so registrations from static constructors are safe
+NativeDecoder::Registration* NativeDecoder::s_First = NULL;
+
+NativeDecoder::Context::Context(const Registry& oRegistry)
+	: m_Registry(oRegistry)
+{
+	m_Transformation = new XDataTransformation*[oRegistry.m_NumTransformations + 1];
+	for (int n = 0; n < oRegistry.m_NumTransformations; n++)
+		m_Transformation[n] = NULL;
+	m_Annotation = new ProtocolDefinition::AnnotationAction*[oRegistry.m_NumAnnotations + 1];
+	for (int n = 0; n < oRegistry.m_NumAnnotations; n++)
+		m_Annotation[n] = NULL;
+}
+
+NativeDecoder::Context::~Context()
+{
+	delete[] m_Annotation;
+	delete[] m_Transformation;
+}
+
+bool
+NativeDecoder::Context::Bind(ProtocolDefinition& oDefinition)
+{
+	if (oDefinition.GetFingerprint() != m_Registry.m_Fingerprint)
+		return false;
+
+	for (int n = 0; n < m_Registry.m_NumTransformations; n++) {
+		ProtocolDefinition::Transformation* pTransformation = oDefinition.LookupTransformation(m_Registry.m_Transformations[n]);
+		if (pTransformation == NULL) {
+			fprintf(stderr, "NativeDecoder::Context::Bind(): transformation '%s' not found\n", m_Registry.m_Transformations[n]);
+			return false;
+		}
+		m_Transformation[n] = &pTransformation->GetProvider();
+	}
+
+	// Packets and subpackets share their indices with the registry
+	std::vector<const ProtocolDefinition::Struct*> oPackets;
+	std::vector<std::vector<const ProtocolDefinition::Struct*>> oSubpackets;
+	for (auto& pPacket: oDefinition.GetPacketTypes()) {
+		oPackets.push_back(pPacket);
+		oSubpackets.push_back(std::vector<const ProtocolDefinition::Struct*>(pPacket->GetSubpackets().begin(), pPacket->GetSubpackets().end()));
+	}
+	if ((int)oPackets.size() != m_Registry.m_NumPackets)
+		return false;
+	m_Decode.clear();
+	for (int n = 0; n < m_Registry.m_NumPackets; n++) {
+		const PacketEntry& oPacket = m_Registry.m_Packets[n];
+		if ((int)oSubpackets[n].size() != oPacket.m_NumSubpackets)
+			return false;
+		m_Decode[oPackets[n]] = oPacket.m_Decode;
+		for (int m = 0; m < oPacket.m_NumSubpackets; m++)
+			m_Decode[oSubpackets[n][m]] = oPacket.m_Subpackets[m].m_Decode;
+	}
+
+	for (int n = 0; n < m_Registry.m_NumAnnotations; n++) {
+		const AnnotationEntry& oEntry = m_Registry.m_Annotations[n];
+		const ProtocolDefinition::Struct* pStruct = NULL;
+		if (oEntry.m_Type != NULL)
+			pStruct = dynamic_cast<const ProtocolDefinition::Struct*>(oDefinition.LookupType(oEntry.m_Type));
+		else if (oEntry.m_Packet >= 0 && oEntry.m_Packet < (int)oPackets.size())
+			pStruct = oEntry.m_Subpacket < 0 ? oPackets[oEntry.m_Packet] : oSubpackets[oEntry.m_Packet][oEntry.m_Subpacket];
+
+		ProtocolDefinition::AnnotationAction* pAction = NULL;
+		if (pStruct != NULL && oEntry.m_Action < (int)pStruct->GetActions().size()) {
+			auto it = pStruct->GetActions().begin();
+			std::advance(it, oEntry.m_Action);
+			pAction = dynamic_cast<ProtocolDefinition::AnnotationAction*>(*it);
+		}
+		if (pAction == NULL || strcmp(pAction->GetAnnotation().GetName(), oEntry.m_Name) != 0) {
+			fprintf(stderr, "NativeDecoder::Context::Bind(): annotation '%s' not found\n", oEntry.m_Name);
+			return false;
+		}
+
+		// Like the decode plan, which binds annotations as it is compiled
+		pAction->Bind(*pStruct);
+		m_Annotation[n] = pAction;
+	}
+	return true;
+}
+
+void
+NativeDecoder::Context::Annotate(int iAnnotation, const ProtocolDefinition::DecodeState& oState, ProtocolDefinition::Value* pValues)
+{
+	// Annotations which cannot be bound are left out of the decode plan as well
+	ProtocolDefinition::AnnotationAction* pAction = m_Annotation[iAnnotation];
+	if (!pAction->IsUsable())
+		return;
+
+	ProtocolDefinition::DecodeState oCurrent(oState);
+	oCurrent.m_CurrentValues = pValues;
+	pAction->Process(oCurrent);
+}
+
+bool
+NativeDecoder::Context::Fill(const ProtocolDefinition::Struct& oStruct, const ProtocolDefinition::DecodeState& oState, int& iProcessed)
+{
+	auto it = m_Decode.find(&oStruct);
+	if (it == m_Decode.end())
+		return false;
+	iProcessed = it->second(*this, oState, oState.m_Data, oState.m_DataLeft, oState.m_DataOffset, oState.m_CurrentValues);
+	return true;
+}
+
+NativeDecoder::Registration::Registration(const Registry& oRegistry)
+	: m_Registry(oRegistry)
+{
+	m_Next = s_First;
+	s_First = this;
+}
+
+const NativeDecoder::Registry*
+NativeDecoder::Find(uint32_t iFingerprint)
+{
+	for (Registration* pRegistration = s_First; pRegistration != NULL; pRegistration = pRegistration->m_Next)
+		if (pRegistration->m_Registry.m_Fingerprint == iFingerprint)
+			return &pRegistration->m_Registry;
+	return NULL;
+}
+
+bool
+NativeDecoder::Classify(const Registry& oRegistry, Context& oContext, const uint8_t* pData, int iLength, int& iPacket, int& iSubpacket)
+{
+	// This follows ProtocolDefinition::Process() and Packet::Fill()
+	for (int n = 0; n < oRegistry.m_NumPackets; n++) {
+		const PacketEntry& oPacket = oRegistry.m_Packets[n];
+
+		int iNum = oPacket.m_Probe(oContext, pData, iLength);
+		if (iNum < 0)
+			iNum = 0;
+		iSubpacket = -1;
+		if (oPacket.m_NumSubpackets > 0) {
+			// If the header doesn't check out, reject the packet
+			if (iNum != oPacket.m_NumPacketBytes)
+				iNum = 0;
+		}
+		if (oPacket.m_NumSubpackets > 0 && iNum != 0) {
+			// Try all subpackets
+			int iDataLeft = iLength - oPacket.m_NumPacketBytes;
+			for (int m = 0; m < oPacket.m_NumSubpackets; m++) {
+				int iAmount = oPacket.m_Subpackets[m].m_Probe(oContext, pData + oPacket.m_NumPacketBytes, iDataLeft);
+				if (iAmount == iDataLeft) {
+					iNum += iDataLeft;
+					iSubpacket = m;
+					break;
+				}
+			}
+		}
+		if (iNum == iLength) {
+			iPacket = n;
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+NativeDecoder::RejectLength(uint32_t iValue, int iDataLeft)
+{
+	fprintf(stderr, "ProtocolDefinition::lengthType::Fill(): rejecting, got %u, left %u\n", iValue, iDataLeft);
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,261 @@
+/*
+ * Runes of Magic protocol analysis - support code for generated decoders
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __NATIVEDECODER_H__
+#define __NATIVEDECODER_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <unordered_map>
+#include "littleendian.h"
+#include "protocoldefinition.h" // XXX can't forward declare nested classes
+
+class XDataTransformation;
+
+/*! \brief Support code for decoders generated by mkdef
+ *
+ *  mkdef can turn a protocol definition into C++ code which decodes the
+ *  packets without interpreting the definition at runtime. Every generated
+ *  decoder describes itself using a Registry, which registers itself once
+ *  the code is linked in; the registry is keyed by the fingerprint of the
+ *  protocol definition it was generated from (see
+ *  ProtocolDefinition::GetFingerprint()) so that callers can fall back to
+ *  the interpreter whenever the definition in use differs.
+ *
+ *  For every struct, packet and subpacket, a class is generated with a
+ *  Probe() function, which only checks whether data matches, and a Decode()
+ *  function, which fills the same values the interpreter does; the class
+ *  itself provides typed accessors to those values.
+ */
+class NativeDecoder {
+public:
+	class Registry;
+	class Context;
+
+	/*! \brief Decodes data without keeping the result
+	 *  \param oContext Context to use
+	 *  \param pData Data to decode
+	 *  \param iDataLeft Number of bytes available
+	 *  \returns Number of bytes processed, like ProtocolDefinition::Struct::Fill()
+	 *
+	 *  Like the interpreter when classifying, transformations are only
+	 *  checked to be possible; whatever follows them is taken to match.
+	 */
+	typedef int (*TProbeFunc)(Context& oContext, const uint8_t* pData, int iDataLeft);
+
+	/*! \brief Decodes data into the values of a struct
+	 *  \param oContext Context to use
+	 *  \param oState Decoding state of the top-level structure, for scratch memory and annotations
+	 *  \param pData Data to decode
+	 *  \param iDataLeft Number of bytes available
+	 *  \param iDataOffset Offset of the data, for display purposes
+	 *  \param pValues Values of the members, laid out like the interpreter's
+	 *  \returns Number of bytes processed, like ProtocolDefinition::Struct::Fill()
+	 */
+	typedef int (*TDecodeFunc)(Context& oContext, const ProtocolDefinition::DecodeState& oState, const uint8_t* pData, int iDataLeft, uint32_t iDataOffset, ProtocolDefinition::Value* pValues);
+
+	/*! \brief Per-caller decoding context
+	 *
+	 *  A context is bound to the protocol definitions in use, and decodes
+	 *  their packets and subpackets in place of the interpreter once passed
+	 *  to ProtocolDefinition::SetNativeDecoder().
+	 */
+	class Context : public ProtocolDefinition::XNativeDecoder {
+	public:
+		/*! \brief Creates a context for a given decoder
+		 *  \param oRegistry Decoder to create the context for
+		 */
+		Context(const Registry& oRegistry);
+		~Context();
+
+		/*! \brief Binds the context to protocol definitions
+		 *  \param oDefinition Definitions to use, which must match the registry
+		 *  \returns true on success
+		 *
+		 *  This resolves the transformations and annotations the generated
+		 *  code uses; the definitions must outlive the context.
+		 */
+		bool Bind(ProtocolDefinition& oDefinition);
+
+		/*! \brief Retrieves a transformation provider
+		 *  \param iTransformation Transformation index, as generated
+		 *  \returns Provider, or NULL if none was bound
+		 */
+		XDataTransformation* GetTransformation(int iTransformation) const { return m_Transformation[iTransformation]; }
+
+		/*! \brief Applies an annotation, like ProtocolDefinition::AnnotationAction::Process()
+		 *  \param iAnnotation Annotation index, as generated
+		 *  \param oState Decoding state of the top-level structure
+		 *  \param pValues Values of the members of the struct containing the annotation
+		 */
+		void Annotate(int iAnnotation, const ProtocolDefinition::DecodeState& oState, ProtocolDefinition::Value* pValues);
+
+		virtual bool Fill(const ProtocolDefinition::Struct& oStruct, const ProtocolDefinition::DecodeState& oState, int& iProcessed);
+
+	protected:
+		//! \brief Decoder we belong to
+		const Registry& m_Registry;
+
+		//! \brief Transformation providers, by index
+		XDataTransformation** m_Transformation;
+
+		//! \brief Annotations, by index
+		ProtocolDefinition::AnnotationAction** m_Annotation;
+
+		//! \brief Decode function of every packet and subpacket
+		std::unordered_map<const ProtocolDefinition::Struct*, TDecodeFunc> m_Decode;
+
+		Context(const Context&) = delete;
+		Context& operator=(const Context&) = delete;
+	};
+
+	//! \brief Describes a generated subpacket decoder
+	struct SubpacketEntry {
+		const char* m_Name;
+		TProbeFunc m_Probe;
+		TDecodeFunc m_Decode;
+	};
+
+	//! \brief Describes a generated packet decoder
+	struct PacketEntry {
+		const char* m_Name;
+		TProbeFunc m_Probe;
+		TDecodeFunc m_Decode;
+		int m_NumPacketBytes;
+		int m_NumSubpackets;
+		const SubpacketEntry* m_Subpackets;
+	};
+
+	/*! \brief Describes where an annotation is used
+	 *
+	 *  The structure is either a struct type, by name, or a packet or
+	 *  subpacket, by index.
+	 */
+	struct AnnotationEntry {
+		//! \brief Name of the annotation
+		const char* m_Name;
+
+		//! \brief Struct type using the annotation, NULL for a packet or subpacket
+		const char* m_Type;
+
+		//! \brief Packet and subpacket using the annotation, -1 for the packet itself
+		int m_Packet;
+		int m_Subpacket;
+
+		//! \brief Index of the annotation among the actions of the structure
+		int m_Action;
+	};
+
+	//! \brief Describes an entire generated decoder
+	class Registry {
+	public:
+		//! \brief Protocol version the code was generated for, -1 for latest
+		int m_Version;
+
+		//! \brief Fingerprint of the protocol definition used
+		uint32_t m_Fingerprint;
+
+		//! \brief Packets, in protocol definition order
+		int m_NumPackets;
+		const PacketEntry* m_Packets;
+
+		//! \brief Names of the transformations used, by index
+		int m_NumTransformations;
+		const char* const* m_Transformations;
+
+		//! \brief Annotations used, by index
+		int m_NumAnnotations;
+		const AnnotationEntry* m_Annotations;
+	};
+
+	/*! \brief Makes a generated decoder available to Find()
+	 *
+	 *  Generated code contains a static instance of this class.
+	 */
+	class Registration {
+	public:
+		Registration(const Registry& oRegistry);
+
+	protected:
+		friend class NativeDecoder;
+
+		const Registry& m_Registry;
+
+		Registration* m_Next;
+	};
+
+	/*! \brief Looks up a generated decoder
+	 *  \param iFingerprint Fingerprint of the protocol definition in use
+	 *  \returns Decoder, or NULL if none was linked in
+	 */
+	static const Registry* Find(uint32_t iFingerprint);
+
+	/*! \brief Determines the packet and subpacket matching data
+	 *  \param oRegistry Decoder to use
+	 *  \param oContext Context to use
+	 *  \param pData Data to process
+	 *  \param iLength Length to process
+	 *  \param iPacket Receives the packet index on success
+	 *  \param iSubpacket Receives the subpacket index on success, -1 if none
+	 *  \returns true if a packet matches
+	 *
+	 *  The packets and subpackets are tried in the same order as
+	 *  ProtocolDefinition::Process() does, so the outcome is identical.
+	 */
+	static bool Classify(const Registry& oRegistry, Context& oContext, const uint8_t* pData, int iLength, int& iPacket, int& iSubpacket);
+
+	//! \brief Reads a little-endian 16-bit value
+	static uint16_t ReadU16(const uint8_t* pData) { return LittleEndian::Read16(pData); }
+
+	//! \brief Reads a little-endian 32-bit value
+	static uint32_t ReadU32(const uint8_t* pData) { return LittleEndian::Read32(pData); }
+
+	//! \brief Reads a little-endian float
+	static float ReadFloat(const uint8_t* pData) { return LittleEndian::ReadFloat(pData); }
+
+	//! \brief Reads a little-endian double
+	static double ReadDouble(const uint8_t* pData) { return LittleEndian::ReadDouble(pData); }
+
+	//! \brief Reads an array of 8-bit values
+	static void ReadU8Array(const uint8_t* pData, uint32_t* pValues, int iNum) { LittleEndian::Read8Array(pData, pValues, iNum); }
+
+	//! \brief Reads an array of little-endian 16-bit values
+	static void ReadU16Array(const uint8_t* pData, uint32_t* pValues, int iNum) { LittleEndian::Read16Array(pData, pValues, iNum); }
+
+	//! \brief Reads an array of little-endian 32-bit values
+	static void ReadU32Array(const uint8_t* pData, uint32_t* pValues, int iNum) { LittleEndian::Read32Array(pData, pValues, iNum); }
+
+	//! \brief Reads an array of little-endian floats
+	static void ReadFloatArray(const uint8_t* pData, float* pValues, int iNum) { LittleEndian::ReadFloatArray(pData, pValues, iNum); }
+
+	//! \brief Reads an array of little-endian doubles
+	static void ReadDoubleArray(const uint8_t* pData, double* pValues, int iNum) { LittleEndian::ReadDoubleArray(pData, pValues, iNum); }
+
+	/*! \brief Reports a length field which does not match
+	 *  \param iValue Length value, including the field itself
+	 *  \param iDataLeft Number of bytes available
+	 *
+	 *  This reports exactly what the interpreter does, so both produce the
+	 *  same diagnostics.
+	 */
+	static void RejectLength(uint32_t iValue, int iDataLeft);
+
+private:
+	//! \brief First registered decoder
+	static Registration* s_First;
+};
+
+#endif /* __NATIVEDECODER_H__ */
@@ -0,0 +1,186 @@
+/*
+ * Runes of Magic protocol analysis - buffered output
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "outputbuffer.h"
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static const char s_HexTab[16] = {
+	'0', '1', '2', '3', '4', '5', '6', '7',
+	'8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+};
+
+OutputBuffer::OutputBuffer(int iFD, int iFlushSize)
+	: m_FD(iFD), m_FlushSize(iFlushSize), m_Length(0)
+{
+	// Leave room for a full record on top of the flush size
+	m_Size = m_FlushSize * 2;
+	m_Data = new char[m_Size];
+}
+
+OutputBuffer::~OutputBuffer()
+{
+	Flush();
+	delete[] m_Data;
+}
+
+void
+OutputBuffer::Grow(int iLength)
+{
+	int iNewSize = m_Size;
+	while (m_Length + iLength > iNewSize)
+		iNewSize *= 2;
+
+	char* pNewData = new char[iNewSize];
+	memcpy(pNewData, m_Data, m_Length);
+	delete[] m_Data;
+	m_Data = pNewData;
+	m_Size = iNewSize;
+}
+
+OutputBuffer&
+OutputBuffer::GetStdout()
+{
+	static thread_local OutputBuffer s_Stdout(STDOUT_FILENO);
+	return s_Stdout;
+}
+
+void
+OutputBuffer::AppendUnsigned(uint64_t iValue, int iMinDigits)
+{
+	// Fill the digits backwards
+	char tmp[24];
+	int n = sizeof(tmp);
+	do {
+		tmp[--n] = '0' + iValue % 10;
+		iValue /= 10;
+	} while (iValue > 0);
+	while (n > (int)sizeof(tmp) - iMinDigits && n > 0)
+		tmp[--n] = '0';
+	Append(&tmp[n], sizeof(tmp) - n);
+}
+
+void
+OutputBuffer::AppendHex(uint32_t iValue, int iMinDigits)
+{
+	char tmp[16];
+	int n = sizeof(tmp);
+	do {
+		tmp[--n] = s_HexTab[iValue & 0xf];
+		iValue >>= 4;
+	} while (iValue > 0);
+	while (n > (int)sizeof(tmp) - iMinDigits && n > 0)
+		tmp[--n] = '0';
+	Append(&tmp[n], sizeof(tmp) - n);
+}
+
+void
+OutputBuffer::AppendFixed2(float fValue)
+{
+	uint32_t iBits;
+	memcpy(&iBits, &fValue, sizeof(iBits));
+	int iExponent = (iBits >> 23) & 0xff;
+	uint64_t iMantissa = iBits & 0x7fffff;
+
+	// Infinity, NaN and huge values are rare enough to leave to printf()
+	if (iExponent > 127 + 40) {
+		Printf("%.2f", fValue);
+		return;
+	}
+
+	// Value is iMantissa * 2^iShift; scale it to hundredths
+	if (iExponent == 0)
+		iExponent = 1; // denormal
+	else
+		iMantissa |= 0x800000;
+	int iShift = iExponent - 150;
+	uint64_t iHundredths = iMantissa * 100;
+	if (iShift >= 0) {
+		iHundredths <<= iShift;
+	} else if (-iShift >= 40) {
+		iHundredths = 0; // always below half a hundredth
+	} else {
+		// Round to nearest, ties to even - just like printf() does
+		uint64_t iRemainder = iHundredths & ((1ULL << -iShift) - 1);
+		uint64_t iHalf = 1ULL << (-iShift - 1);
+		iHundredths >>= -iShift;
+		if (iRemainder > iHalf || (iRemainder == iHalf && (iHundredths & 1)))
+			iHundredths++;
+	}
+
+	if (iBits & 0x80000000)
+		AppendChar('-');
+	AppendUnsigned(iHundredths / 100);
+	AppendChar('.');
+	AppendUnsigned(iHundredths % 100, 2);
+}
+
+void
+OutputBuffer::Printf(const char* sFormat, ...)
+{
+	va_list va;
+	va_start(va, sFormat);
+	VPrintf(sFormat, va);
+	va_end(va);
+}
+
+void
+OutputBuffer::VPrintf(const char* sFormat, va_list va)
+{
+	va_list vaCopy;
+	va_copy(vaCopy, va);
+	int iLength = vsnprintf(Reserve(256), 256, sFormat, va);
+	if (iLength >= 256)
+		vsnprintf(Reserve(iLength + 1), iLength + 1, sFormat, vaCopy);
+	if (iLength > 0)
+		Commit(iLength);
+	va_end(vaCopy);
+}
+
+void
+OutputBuffer::AppendSigned(int32_t iValue)
+{
+	if (iValue >= 0) {
+		AppendUnsigned(iValue);
+		return;
+	}
+	AppendChar('-');
+	AppendUnsigned(-(uint32_t)iValue);
+}
+
+bool
+OutputBuffer::Flush()
+{
+	const char* pData = m_Data;
+	int iLeft = m_Length;
+	while (iLeft > 0) {
+		ssize_t iWritten = write(m_FD, pData, iLeft);
+		if (iWritten < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("OutputBuffer::Flush(): write");
+			m_Length = 0;
+			return false;
+		}
+		pData += iWritten;
+		iLeft -= iWritten;
+	}
+	m_Length = 0;
+	return true;
+}
+
+/* vim:set ts=2 sw=2: */
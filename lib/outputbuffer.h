@@ -0,0 +1,156 @@
+/*
+ * Runes of Magic protocol analysis - buffered output
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __OUTPUTBUFFER_H__
+#define __OUTPUTBUFFER_H__
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+
+/*! \brief Reusable output buffer
+ *
+ *  Output is collected in a single buffer which is handed to write(2) as
+ *  a whole once it exceeds the flush size; this avoids going through
+ *  stdio for every value written. Numbers are formatted by hand; the
+ *  results are identical to their printf() equivalents.
+ */
+class OutputBuffer {
+public:
+	//! \brief Default amount of data to collect before writing, in bytes
+	static const int s_DefaultFlushSize = 256 * 1024;
+
+	/*! \brief Constructs an output buffer
+	 *  \param iFD File descriptor to write to
+	 *  \param iFlushSize Amount of data to collect before writing
+	 */
+	OutputBuffer(int iFD, int iFlushSize = s_DefaultFlushSize);
+
+	//! \brief Writes any pending data and destroys the buffer
+	~OutputBuffer();
+
+	/*! \brief Appends data
+	 *  \param pData Data to append
+	 *  \param iLength Number of bytes to append
+	 */
+	void Append(const char* pData, int iLength);
+
+	/*! \brief Appends a \0-terminated string
+	 *  \param sString String to append
+	 */
+	void Append(const char* sString) { Append(sString, strlen(sString)); }
+
+	//! \brief Appends a single character
+	void AppendChar(char ch);
+
+	/*! \brief Retrieves the calling thread's buffer writing to stdout
+	 *
+	 *  The buffer is flushed when the thread exits.
+	 */
+	static OutputBuffer& GetStdout();
+
+	/*! \brief Appends an unsigned value in decimal, like printf("%0*u")
+	 *  \param iValue Value to append
+	 *  \param iMinDigits Minimal number of digits, zero-padded
+	 */
+	void AppendUnsigned(uint64_t iValue, int iMinDigits = 1);
+
+	//! \brief Appends a signed value in decimal, like printf("%d")
+	void AppendSigned(int32_t iValue);
+
+	/*! \brief Appends a value in lowercase hex, like printf("%0*x")
+	 *  \param iValue Value to append
+	 *  \param iMinDigits Minimal number of digits, zero-padded
+	 */
+	void AppendHex(uint32_t iValue, int iMinDigits = 1);
+
+	//! \brief Appends a value like printf("%.2f") would
+	void AppendFixed2(float fValue);
+
+	//! \brief Appends printf()-style formatted output; this is the slow path
+	void Printf(const char* sFormat, ...) __attribute__((format(printf, 2, 3)));
+
+	//! \brief Appends vprintf()-style formatted output
+	void VPrintf(const char* sFormat, va_list va);
+
+	/*! \brief Reserves space to write to
+	 *  \param iLength Number of bytes needed
+	 *  \returns Pointer to write at most iLength bytes to
+	 *
+	 *  Commit() must be called afterwards with the amount actually used.
+	 */
+	char* Reserve(int iLength);
+
+	//! \brief Marks iLength bytes obtained using Reserve() as used
+	void Commit(int iLength) { m_Length += iLength; }
+
+	//! \brief Writes the pending data if the flush size is exceeded
+	void Batch() { if (m_Length >= m_FlushSize) Flush(); }
+
+	/*! \brief Writes all pending data
+	 *  \returns true on success
+	 */
+	bool Flush();
+
+protected:
+	/*! \brief Ensures the buffer can hold a given amount of extra bytes
+	 *  \param iLength Number of extra bytes needed
+	 */
+	void Grow(int iLength);
+
+	//! \brief File descriptor to write to
+	int m_FD;
+
+	//! \brief Amount of data to collect before writing
+	int m_FlushSize;
+
+	//! \brief Buffer data
+	char* m_Data;
+
+	//! \brief Buffer size, in bytes
+	int m_Size;
+
+	//! \brief Number of bytes used
+	int m_Length;
+
+	//! \brief Copying is forbidden
+	OutputBuffer& operator=(const OutputBuffer& oBuffer) = delete;
+	OutputBuffer(const OutputBuffer& oBuffer) = delete;
+};
+
+inline char*
+OutputBuffer::Reserve(int iLength)
+{
+	if (m_Length + iLength > m_Size)
+		Grow(iLength);
+	return &m_Data[m_Length];
+}
+
+inline void
+OutputBuffer::Append(const char* pData, int iLength)
+{
+	memcpy(Reserve(iLength), pData, iLength);
+	m_Length += iLength;
+}
+
+inline void
+OutputBuffer::AppendChar(char ch)
+{
+	*Reserve(1) = ch;
+	m_Length++;
+}
+
+#endif /* __OUTPUTBUFFER_H__ */
@@ -0,0 +1,547 @@
+/*
+ * Runes of Magic protocol analysis - protocol definition schema cache
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "protocoldefinition.h"
+#include <fcntl.h>
+#include <limits.h> // for PATH_MAX
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <map>
+#include <string>
+
+/*
+ * The schema cache holds everything Load() would have obtained from the
+ * XML, with all version filters applied and all definitions resolved, along
+ * with the fingerprint. It consists of a header, a stream of 32-bit words
+ * and a table of \0-terminated strings which the words refer to by offset.
+ * The file is only mapped while loading: the definitions are rebuilt from
+ * it and every string is copied, so the mapping is released afterwards. It
+ * is only used if the header matches the definition file content and
+ * version exactly, and the checksum holds.
+ */
+namespace {
+
+const char s_CacheMagic[8] = { 'R', 'O', 'M', 'D', 'E', 'F', 'C', '\0' };
+
+//! \brief Bump this whenever the layout below changes
+const uint32_t s_CacheFormatVersion = 1;
+
+//! \brief Written as-is; guards against caches from a different byte order
+const uint32_t s_CacheByteOrder = 0x01020304;
+
+//! \brief String offset used for 'no string'
+const uint32_t s_NoString = 0xffffffff;
+
+struct CacheHeader {
+	char m_Magic[8];
+	uint32_t m_FormatVersion;
+	uint32_t m_ByteOrder;
+	uint64_t m_SourceHash;
+	int32_t m_Version;
+	uint32_t m_Fingerprint;
+	uint32_t m_NumWords;
+	uint32_t m_StringsLength;
+	uint32_t m_Checksum;
+};
+
+//! \brief Kinds of field types
+enum FieldType {
+	FT_Shared, //!< registered type, by name
+	FT_Unsigned, //!< refined unsigned/signed type
+	FT_String, //!< refined string type
+	FT_Float, //!< refined float type
+	FT_Double, //!< refined double type
+	FT_Struct //!< refined struct type
+};
+
+//! \brief Kinds of struct actions
+enum ActionType {
+	AT_Field,
+	AT_Transformation,
+	AT_Annotation
+};
+
+uint32_t
+Checksum(const void* pData, int iLength, uint32_t iHash)
+{
+	const uint8_t* p = static_cast<const uint8_t*>(pData);
+	for (int n = 0; n < iLength; n++) {
+		iHash ^= p[n];
+		iHash *= 16777619u;
+	}
+	return iHash;
+}
+
+} // unnamed namespace
+
+//! \brief Builds the content of a schema cache
+class SchemaCacheWriter {
+public:
+	//! \brief Appends a number
+	void Put(uint32_t iValue) { m_Words.push_back(iValue); }
+
+	//! \brief Appends a string, which may be NULL
+	void PutString(const char* sValue) {
+		if (sValue == NULL) {
+			Put(s_NoString);
+			return;
+		}
+		auto it = m_Offsets.find(sValue);
+		if (it == m_Offsets.end()) {
+			it = m_Offsets.insert(std::pair<std::string, uint32_t>(sValue, m_Strings.size())).first;
+			m_Strings.append(sValue, strlen(sValue) + 1);
+		}
+		Put(it->second);
+	}
+
+	std::vector<uint32_t> m_Words;
+	std::string m_Strings;
+
+protected:
+	//! \brief Offset of every string added, so that each is stored once
+	std::map<std::string, uint32_t> m_Offsets;
+};
+
+//! \brief Reads the content of a mapped schema cache
+class SchemaCacheReader {
+public:
+	SchemaCacheReader(const uint32_t* pWords, uint32_t iNumWords, const char* pStrings, uint32_t iStringsLength)
+		: m_Words(pWords), m_NumWords(iNumWords), m_Current(0), m_Strings(pStrings), m_StringsLength(iStringsLength) { }
+
+	//! \brief Fetches a number
+	bool Get(uint32_t& iValue) {
+		if (m_Current >= m_NumWords)
+			return false;
+		iValue = m_Words[m_Current++];
+		return true;
+	}
+
+	//! \brief Fetches a signed number
+	bool Get(int& iValue) {
+		uint32_t v;
+		if (!Get(v))
+			return false;
+		iValue = static_cast<int32_t>(v);
+		return true;
+	}
+
+	/*! \brief Fetches a string
+	 *  \param sValue Receives the string, which points into the mapping
+	 *  \param bOptional Whether a missing string is acceptable
+	 */
+	bool GetString(const char*& sValue, bool bOptional = false) {
+		uint32_t iOffset;
+		if (!Get(iOffset))
+			return false;
+		if (iOffset == s_NoString) {
+			sValue = NULL;
+			return bOptional;
+		}
+		// The table is known to end in a \0, so every offset within it is a string
+		if (iOffset >= m_StringsLength)
+			return false;
+		sValue = m_Strings + iOffset;
+		return true;
+	}
+
+	//! \brief Are all words consumed?
+	bool AtEnd() const { return m_Current == m_NumWords; }
+
+protected:
+	const uint32_t* m_Words;
+	uint32_t m_NumWords;
+	uint32_t m_Current;
+	const char* m_Strings;
+	uint32_t m_StringsLength;
+};
+
+bool
+ProtocolDefinition::SaveCache(const char* sCacheFile, uint64_t iSourceHash) const
+{
+	SchemaCacheWriter oWriter;
+
+	oWriter.Put(m_Definitions.size());
+	for (auto& pDefinition: m_Definitions) {
+		oWriter.PutString(pDefinition->GetName());
+		oWriter.PutString(pDefinition->GetValue());
+	}
+
+	oWriter.Put(m_Enums.size());
+	for (auto& pEnum: m_Enums) {
+		oWriter.PutString(pEnum->GetName());
+		oWriter.Put(pEnum->GetValueMap().size());
+		for (auto& oKeyValue: pEnum->GetValueMap()) {
+			oWriter.Put(oKeyValue.first);
+			oWriter.PutString(oKeyValue.second);
+		}
+	}
+
+	// Structs are stored in definition order, so any struct used is known before
+	std::vector<const Struct*> oStructs;
+	for (auto& pType: m_Types)
+		if (const Struct* pStruct = dynamic_cast<const Struct*>(pType))
+			oStructs.push_back(pStruct);
+	oWriter.Put(oStructs.size());
+	for (auto& pStruct: oStructs) {
+		oWriter.PutString(pStruct->GetName());
+		WriteCacheStruct(oWriter, *pStruct);
+	}
+
+	oWriter.Put(m_Packet.size());
+	for (auto& pPacket: m_Packet) {
+		oWriter.PutString(pPacket->GetName());
+		oWriter.Put(pPacket->m_Source);
+		oWriter.Put(pPacket->m_NumPacketBytes);
+		WriteCacheStruct(oWriter, *pPacket);
+		oWriter.Put(pPacket->m_Subpackets.size());
+		for (auto& pSubpacket: pPacket->m_Subpackets) {
+			oWriter.PutString(pSubpacket->GetName());
+			WriteCacheStruct(oWriter, *pSubpacket);
+		}
+	}
+
+	CacheHeader oHeader;
+	memset(&oHeader, 0, sizeof(oHeader));
+	memcpy(oHeader.m_Magic, s_CacheMagic, sizeof(oHeader.m_Magic));
+	oHeader.m_FormatVersion = s_CacheFormatVersion;
+	oHeader.m_ByteOrder = s_CacheByteOrder;
+	oHeader.m_SourceHash = iSourceHash;
+	oHeader.m_Version = m_Version;
+	oHeader.m_Fingerprint = m_Fingerprint;
+	oHeader.m_NumWords = oWriter.m_Words.size();
+	oHeader.m_StringsLength = oWriter.m_Strings.size();
+	oHeader.m_Checksum = Checksum(&oWriter.m_Words[0], oWriter.m_Words.size() * sizeof(uint32_t), 2166136261u);
+	oHeader.m_Checksum = Checksum(oWriter.m_Strings.data(), oWriter.m_Strings.size(), oHeader.m_Checksum);
+
+	// Write to a temporary file first so that concurrent readers never see a partial cache
+	char sTempFile[PATH_MAX];
+	snprintf(sTempFile, sizeof(sTempFile), "%s.%d.tmp", sCacheFile, (int)getpid());
+	FILE* f = fopen(sTempFile, "wb");
+	if (f == NULL)
+		return false;
+	bool bOK = fwrite(&oHeader, sizeof(oHeader), 1, f) == 1;
+	bOK = bOK && fwrite(&oWriter.m_Words[0], sizeof(uint32_t), oWriter.m_Words.size(), f) == oWriter.m_Words.size();
+	bOK = bOK && fwrite(oWriter.m_Strings.data(), 1, oWriter.m_Strings.size(), f) == oWriter.m_Strings.size();
+	bOK = fclose(f) == 0 && bOK;
+	if (bOK)
+		bOK = rename(sTempFile, sCacheFile) == 0;
+	if (!bOK)
+		unlink(sTempFile);
+	return bOK;
+}
+
+void
+ProtocolDefinition::WriteCacheStruct(SchemaCacheWriter& oWriter, const Struct& oStruct) const
+{
+	oWriter.Put(oStruct.m_Count);
+	oWriter.Put(oStruct.m_MinCount);
+	oWriter.Put(oStruct.m_Actions.size());
+	for (auto& pAction: oStruct.m_Actions) {
+		if (const TransformationAction* pTransformation = dynamic_cast<const TransformationAction*>(pAction)) {
+			oWriter.Put(AT_Transformation);
+			oWriter.PutString(pTransformation->GetTransformation().GetName());
+		} else if (const AnnotationAction* pAnnotation = dynamic_cast<const AnnotationAction*>(pAction)) {
+			oWriter.Put(AT_Annotation);
+			oWriter.PutString(pAnnotation->GetAnnotation().GetName());
+		} else {
+			oWriter.Put(AT_Field);
+			WriteCacheField(oWriter, *static_cast<const Field*>(pAction));
+		}
+	}
+}
+
+void
+ProtocolDefinition::WriteCacheField(SchemaCacheWriter& oWriter, const Field& oField) const
+{
+	const Type& oType = oField.GetType();
+	oWriter.PutString(oField.GetName());
+
+	// Length and time fields have nothing to refine
+	if (LookupType(oType.GetName()) == &oType || dynamic_cast<const lengthType*>(&oType) != NULL || dynamic_cast<const unixtimeType*>(&oType) != NULL) {
+		oWriter.Put(FT_Shared);
+		oWriter.PutString(oType.GetName());
+	} else if (const unsignedType* pUnsigned = dynamic_cast<const unsignedType*>(&oType)) {
+		oWriter.Put(FT_Unsigned);
+		oWriter.PutString(oType.GetName());
+		oWriter.Put(pUnsigned->m_Count);
+		oWriter.Put(pUnsigned->m_MinCount);
+		oWriter.Put(pUnsigned->m_DisplayCount);
+		oWriter.Put(pUnsigned->m_HaveFixedValue);
+		oWriter.Put(pUnsigned->m_FixedValue);
+		oWriter.Put(pUnsigned->m_Format);
+		oWriter.PutString(pUnsigned->m_Enumeration != NULL ? pUnsigned->m_Enumeration->GetName() : NULL);
+		oWriter.PutString(pUnsigned->m_Annotation != NULL ? pUnsigned->m_Annotation->GetName() : NULL);
+	} else if (const stringType* pString = dynamic_cast<const stringType*>(&oType)) {
+		oWriter.Put(FT_String);
+		oWriter.PutString(oType.GetName());
+		oWriter.Put(pString->m_Length);
+		oWriter.Put(pString->m_MinLength);
+	} else if (const floatType* pFloat = dynamic_cast<const floatType*>(&oType)) {
+		oWriter.Put(FT_Float);
+		oWriter.PutString(oType.GetName());
+		oWriter.Put(pFloat->m_Count);
+		oWriter.Put(pFloat->m_DisplayCount);
+	} else if (const doubleType* pDouble = dynamic_cast<const doubleType*>(&oType)) {
+		oWriter.Put(FT_Double);
+		oWriter.PutString(oType.GetName());
+		oWriter.Put(pDouble->m_Count);
+		oWriter.Put(pDouble->m_DisplayCount);
+	} else {
+		oWriter.Put(FT_Struct);
+		oWriter.PutString(oType.GetName());
+		WriteCacheStruct(oWriter, static_cast<const Struct&>(oType));
+	}
+}
+
+bool
+ProtocolDefinition::LoadCache(const char* sCacheFile, uint64_t iSourceHash)
+{
+	int fd = open(sCacheFile, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(CacheHeader)) {
+		close(fd);
+		return false;
+	}
+	void* pMapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (pMapping == MAP_FAILED)
+		return false;
+
+	const CacheHeader& oHeader = *static_cast<const CacheHeader*>(pMapping);
+	const uint32_t* pWords = reinterpret_cast<const uint32_t*>(&oHeader + 1);
+	const char* pStrings = reinterpret_cast<const char*>(pWords + oHeader.m_NumWords);
+	bool bOK = memcmp(oHeader.m_Magic, s_CacheMagic, sizeof(oHeader.m_Magic)) == 0 &&
+	  oHeader.m_FormatVersion == s_CacheFormatVersion &&
+	  oHeader.m_ByteOrder == s_CacheByteOrder &&
+	  oHeader.m_SourceHash == iSourceHash &&
+	  oHeader.m_Version == m_Version &&
+	  (uint64_t)st.st_size == sizeof(CacheHeader) + (uint64_t)oHeader.m_NumWords * sizeof(uint32_t) + oHeader.m_StringsLength &&
+	  (oHeader.m_StringsLength == 0 || pStrings[oHeader.m_StringsLength - 1] == '\0');
+	if (bOK) {
+		uint32_t iChecksum = Checksum(pWords, oHeader.m_NumWords * sizeof(uint32_t), 2166136261u);
+		bOK = Checksum(pStrings, oHeader.m_StringsLength, iChecksum) == oHeader.m_Checksum;
+	}
+
+	SchemaCacheReader oReader(pWords, oHeader.m_NumWords, pStrings, oHeader.m_StringsLength);
+	uint32_t iNum;
+	if (bOK && oReader.Get(iNum)) {
+		for (/* nothing */; bOK && iNum > 0; iNum--) {
+			const char* sName;
+			const char* sValue;
+			bOK = oReader.GetString(sName) && oReader.GetString(sValue);
+			if (bOK)
+				m_Definitions.push_back(new Definition(sName, sValue));
+		}
+	} else
+		bOK = false;
+
+	if (bOK && oReader.Get(iNum)) {
+		for (/* nothing */; bOK && iNum > 0; iNum--) {
+			const char* sName;
+			uint32_t iNumValues;
+			bOK = oReader.GetString(sName) && oReader.Get(iNumValues);
+			if (!bOK)
+				break;
+			Enumeration* pEnum = new Enumeration(sName);
+			m_Enums.push_back(pEnum);
+			for (/* nothing */; bOK && iNumValues > 0; iNumValues--) {
+				int iKey;
+				const char* sValue;
+				bOK = oReader.Get(iKey) && oReader.GetString(sValue) && pEnum->Add(iKey, (const Enumeration::TValue)sValue);
+			}
+		}
+	} else
+		bOK = false;
+
+	if (bOK && oReader.Get(iNum)) {
+		for (/* nothing */; bOK && iNum > 0; iNum--) {
+			const char* sName;
+			bOK = oReader.GetString(sName);
+			if (!bOK)
+				break;
+			Struct* pStruct = new Struct(*this, sName);
+			m_Types.push_back(pStruct);
+			bOK = ReadCacheStruct(oReader, *pStruct);
+		}
+	} else
+		bOK = false;
+
+	if (bOK && oReader.Get(iNum)) {
+		for (/* nothing */; bOK && iNum > 0; iNum--) {
+			const char* sName;
+			uint32_t iSource, iNumSubpackets;
+			bOK = oReader.GetString(sName) && oReader.Get(iSource);
+			if (!bOK)
+				break;
+			Packet* pPacket = new Packet(*this, sName);
+			m_Packet.push_back(pPacket);
+			pPacket->m_Source = static_cast<Packet::Source>(iSource);
+			bOK = oReader.Get(pPacket->m_NumPacketBytes) && ReadCacheStruct(oReader, *pPacket) && oReader.Get(iNumSubpackets);
+			for (/* nothing */; bOK && iNumSubpackets > 0; iNumSubpackets--) {
+				bOK = oReader.GetString(sName);
+				if (!bOK)
+					break;
+				Subpacket* pSubpacket = new Subpacket(*this, sName);
+				pPacket->m_Subpackets.push_back(pSubpacket);
+				bOK = ReadCacheStruct(oReader, *pSubpacket);
+			}
+		}
+	} else
+		bOK = false;
+
+	bOK = bOK && oReader.AtEnd();
+	if (bOK)
+		m_Fingerprint = oHeader.m_Fingerprint;
+	munmap(pMapping, st.st_size);
+	if (!bOK)
+		Clear();
+	return bOK;
+}
+
+bool
+ProtocolDefinition::ReadCacheStruct(SchemaCacheReader& oReader, Struct& oStruct)
+{
+	uint32_t iNumActions;
+	if (!oReader.Get(oStruct.m_Count) || !oReader.Get(oStruct.m_MinCount) || !oReader.Get(iNumActions))
+		return false;
+	for (/* nothing */; iNumActions > 0; iNumActions--) {
+		uint32_t iAction;
+		if (!oReader.Get(iAction))
+			return false;
+		switch(iAction) {
+			case AT_Field:
+				if (!ReadCacheField(oReader, oStruct))
+					return false;
+				break;
+			case AT_Transformation: {
+				const char* sName;
+				if (!oReader.GetString(sName))
+					return false;
+				Transformation* pTransformation = LookupTransformation(sName);
+				if (pTransformation == NULL)
+					return false;
+				oStruct.AddAction(new TransformationAction(*pTransformation));
+				break;
+			}
+			case AT_Annotation: {
+				const char* sName;
+				if (!oReader.GetString(sName))
+					return false;
+				Annotation* pAnnotation = LookupAnnotation(sName);
+				if (pAnnotation == NULL)
+					return false;
+				oStruct.AddAction(new AnnotationAction(*pAnnotation));
+				break;
+			}
+			default:
+				return false;
+		}
+	}
+	return true;
+}
+
+bool
+ProtocolDefinition::ReadCacheField(SchemaCacheReader& oReader, Struct& oStruct)
+{
+	const char* sName;
+	const char* sType;
+	uint32_t iFieldType;
+	if (!oReader.GetString(sName) || !oReader.Get(iFieldType) || !oReader.GetString(sType))
+		return false;
+
+	const Type* pBaseType = LookupType(sType);
+	if (pBaseType == NULL && iFieldType != FT_Struct)
+		return false;
+
+	Type* pType = NULL;
+	bool bOK = true;
+	switch(iFieldType) {
+		case FT_Shared:
+			oStruct.AddAction(new Field(*pBaseType, sName));
+			return true;
+		case FT_Unsigned: {
+			if (dynamic_cast<const unsignedType*>(pBaseType) == NULL)
+				return false;
+			unsignedType* pUnsigned = static_cast<unsignedType*>(pBaseType->Clone());
+			pType = pUnsigned;
+			uint32_t iHaveFixedValue, iFormat;
+			const char* sEnumeration;
+			const char* sAnnotation;
+			bOK = oReader.Get(pUnsigned->m_Count) && oReader.Get(pUnsigned->m_MinCount) &&
+			  oReader.Get(pUnsigned->m_DisplayCount) && oReader.Get(iHaveFixedValue) &&
+			  oReader.Get(pUnsigned->m_FixedValue) && oReader.Get(iFormat) &&
+			  oReader.GetString(sEnumeration, true) && oReader.GetString(sAnnotation, true);
+			if (bOK) {
+				pUnsigned->m_HaveFixedValue = iHaveFixedValue != 0;
+				pUnsigned->m_Format = static_cast<unsignedType::Format>(iFormat);
+				if (sEnumeration != NULL) {
+					pUnsigned->m_Enumeration = LookupEnumeration(sEnumeration);
+					bOK = pUnsigned->m_Enumeration != NULL;
+				}
+				if (sAnnotation != NULL) {
+					pUnsigned->m_Annotation = LookupAnnotation(sAnnotation);
+					bOK = bOK && pUnsigned->m_Annotation != NULL;
+				}
+			}
+			break;
+		}
+		case FT_String: {
+			if (dynamic_cast<const stringType*>(pBaseType) == NULL)
+				return false;
+			stringType* pString = static_cast<stringType*>(pBaseType->Clone());
+			pType = pString;
+			bOK = oReader.Get(pString->m_Length) && oReader.Get(pString->m_MinLength);
+			break;
+		}
+		case FT_Float: {
+			if (dynamic_cast<const floatType*>(pBaseType) == NULL)
+				return false;
+			floatType* pFloat = static_cast<floatType*>(pBaseType->Clone());
+			pType = pFloat;
+			bOK = oReader.Get(pFloat->m_Count) && oReader.Get(pFloat->m_DisplayCount);
+			break;
+		}
+		case FT_Double: {
+			if (dynamic_cast<const doubleType*>(pBaseType) == NULL)
+				return false;
+			doubleType* pDouble = static_cast<doubleType*>(pBaseType->Clone());
+			pType = pDouble;
+			bOK = oReader.Get(pDouble->m_Count) && oReader.Get(pDouble->m_DisplayCount);
+			break;
+		}
+		case FT_Struct: {
+			Struct* pStruct = new Struct(*this, sType);
+			pType = pStruct;
+			bOK = ReadCacheStruct(oReader, *pStruct);
+			break;
+		}
+		default:
+			return false;
+	}
+
+	// Even on failure, the type must be owned by someone
+	m_FieldTypes.push_back(pType);
+	if (bOK)
+		oStruct.AddAction(new Field(*pType, sName));
+	return bOK;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -470,13 +470,16 @@ ProtocolCodeGenerator::GenerateFunctions(FILE* f)
 }
 
 bool
-ProtocolCodeGenerator::GenerateMatchCondition(const ProtocolDefinition::Struct::TXActionPtrList& oActions, const char* sPacketName, char* sOutput, int iOutputLen)
+ProtocolCodeGenerator::GenerateMatchCondition(const ProtocolDefinition::Struct::TXActionPtrList& oActions, const char* sPacketName, char* sOutput, int iOutputLen, const ProtocolDefinition::Field* pSkip)
 {
 	int iOffset = 0;
+	sOutput[0] = '\0';
 	for (auto& oAction: oActions) {
 		ProtocolDefinition::Field* pField = dynamic_cast<ProtocolDefinition::Field*>(oAction);
 		if (pField == NULL)
 			continue; // XXX skips transformations
+		if (pField == pSkip)
+			continue; // already matched by the caller
 		char sInit[1024];
 		pField->GetType().GenerateCInitialize(sInit, sizeof(sInit));
 		if (sInit[0] == '\0')
@@ -491,6 +494,218 @@ ProtocolCodeGenerator::GenerateMatchCondition(const ProtocolDefinition::Struct::
 	return iOffset > 0;
 }
 
+const ProtocolDefinition::Field*
+ProtocolCodeGenerator::FindDiscriminator(const ProtocolDefinition::Struct::TXActionPtrList& oActions, uint32_t& iOffset)
+{
+	/*
+	 * We can dispatch on the first field with a fixed value, provided we know
+	 * where it is: everything in front of it must be of constant size.
+	 */
+	iOffset = 0;
+	for (auto& oAction: oActions) {
+		ProtocolDefinition::Field* pField = dynamic_cast<ProtocolDefinition::Field*>(oAction);
+		if (pField == NULL)
+			return NULL; // transformations change the layout
+
+		char sInit[1024];
+		pField->GetType().GenerateCInitialize(sInit, sizeof(sInit));
+		if (sInit[0] != '\0') {
+			auto pUnsigned = dynamic_cast<const ProtocolDefinition::unsignedType*>(&pField->GetType());
+			if (pUnsigned == NULL || dynamic_cast<const ProtocolDefinition::signedType*>(pUnsigned) != NULL)
+				return NULL;
+			return pField;
+		}
+
+		int iSize = pField->GetConstantSize();
+		if (iSize <= 0)
+			return NULL;
+		iOffset += iSize;
+	}
+	return NULL;
+}
+
+static const char*
+Indent(int iIndent)
+{
+	static const char sTabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t";
+	return &sTabs[sizeof(sTabs) - 1 - iIndent];
+}
+
+static bool
+SameDiscriminator(const ProtocolDefinition::Field* pField1, uint32_t iOffset1, const ProtocolDefinition::Field* pField2, uint32_t iOffset2)
+{
+	if (pField1 == NULL || pField2 == NULL || iOffset1 != iOffset2)
+		return false;
+	auto pType1 = dynamic_cast<const ProtocolDefinition::unsignedType*>(&pField1->GetType());
+	auto pType2 = dynamic_cast<const ProtocolDefinition::unsignedType*>(&pField2->GetType());
+	return pType1->GetWidth() == pType2->GetWidth();
+}
+
+void
+ProtocolCodeGenerator::GenerateSubpacketMatch(FILE* f, ProtocolDefinition::Packet& oPacket, ProtocolDefinition::Subpacket& oSubpacket, const ProtocolDefinition::Field* pLengthField, const ProtocolDefinition::Field* pSkip, int iIndent)
+{
+	char sPacketName[1024];
+	snprintf(sPacketName, sizeof(sPacketName), "%s_%s", oPacket.GetName(), oSubpacket.GetName());
+	char sCriterium[1024];
+	GenerateMatchCondition(oSubpacket.GetActions(), sPacketName, sCriterium, sizeof(sCriterium), pSkip);
+
+	// Determine subpacket length
+	uint32_t iSubpacketLen = 0;
+	bool bIsConstantSize = true;
+	ProtocolDefinition::TransformationAction* pTransformation = NULL;
+	for (auto& oAction: oSubpacket.GetActions()) {
+		ProtocolDefinition::TransformationAction* pTT = dynamic_cast<ProtocolDefinition::TransformationAction*>(oAction);
+		if (pTT != NULL)
+			pTransformation = pTT;
+		ProtocolDefinition::Field* pField = dynamic_cast<ProtocolDefinition::Field*>(oAction);
+		if (pField == NULL)
+			continue;
+		unsigned int iConstantSize = pField->GetType().GetConstantSize();
+		iSubpacketLen += iConstantSize;
+		bIsConstantSize &= iConstantSize != 0;
+	}
+
+	char sCondition[2048];
+	int iLen = 0;
+	sCondition[0] = '\0';
+	if (iSubpacketLen > 0 && pLengthField != NULL && pTransformation == NULL /* skip length if a transformation */ && bIsConstantSize)
+		iLen += snprintf(sCondition + iLen, sizeof(sCondition) - iLen, "((struct %s::Packet*)pData)->m_packet_%s == 0x%x%s", sPacketName, pLengthField->GetName(), iSubpacketLen, sCriterium[0] != '\0' ? " && " : "");
+	snprintf(sCondition + iLen, sizeof(sCondition) - iLen, "%s", sCriterium);
+
+	if (sCondition[0] != '\0')
+		fprintf(f, "%sif (%s) {\n", Indent(iIndent), sCondition);
+	else
+		fprintf(f, "%s{\n", Indent(iIndent));
+	fprintf(f, "%s%s oRequest(pData, iDataLength);\n", Indent(iIndent + 1), sPacketName);
+	fprintf(f, "%sOn%s(oRequest);\n", Indent(iIndent + 1), sPacketName);
+	fprintf(f, "%sreturn true;\n", Indent(iIndent + 1));
+	fprintf(f, "%s}\n", Indent(iIndent));
+}
+
+void
+ProtocolCodeGenerator::GeneratePacketMatch(FILE* f, ProtocolDefinition::Packet& oPacket, const ProtocolDefinition::Field* pSkip, int iIndent)
+{
+	char sCriterium[1024];
+	GenerateMatchCondition(oPacket.GetActions(), oPacket.GetName(), sCriterium, sizeof(sCriterium), pSkip);
+
+	/* Find the length field; we'll use it to ensure the packet is okay */
+	ProtocolDefinition::Field* pLengthField = NULL;
+	for (auto& oAction: oPacket.GetActions()) {
+		ProtocolDefinition::Field* pField = dynamic_cast<ProtocolDefinition::Field*>(oAction);
+		if (pField == NULL || strcmp(pField->GetType().GetName(), "length") != 0)
+			continue;
+		pLengthField = pField;
+		break;
+	}
+
+	// Determine packet length
+	uint32_t iPacketLen = 0;
+	for (auto& oAction: oPacket.GetActions()) {
+		ProtocolDefinition::Field* pField = dynamic_cast<ProtocolDefinition::Field*>(oAction);
+		if (pField == NULL)
+			continue;
+		iPacketLen += pField->GetType().GetConstantSize();
+	}
+
+	// Generate match conditions; this will also check the lengths, if we can do so
+	char sCondition[4096];
+	int iLen = 0;
+	if (iPacketLen > 0) {
+		iLen += snprintf(sCondition + iLen, sizeof(sCondition) - iLen, "((struct %s::Packet*)pData)->m_header.p_length %s sizeof(struct ROM::Packet) + 0x%x",
+		 oPacket.GetName(), (pLengthField == NULL) ? "==" : ">=", iPacketLen);
+		if (pLengthField != NULL)
+			iLen += snprintf(sCondition + iLen, sizeof(sCondition) - iLen, " && ((struct %s::Packet*)pData)->m_header.p_length == ((struct %s::Packet*)pData)->m_%s + sizeof(struct ROM::Packet) + 0x%x",
+			 oPacket.GetName(), oPacket.GetName(), pLengthField->GetName(), iPacketLen);
+		if (sCriterium[0] != '\0')
+			iLen += snprintf(sCondition + iLen, sizeof(sCondition) - iLen, " && ");
+	}
+	snprintf(sCondition + iLen, sizeof(sCondition) - iLen, "%s", sCriterium);
+	if (sCondition[0] != '\0')
+		fprintf(f, "%sif (%s) {\n", Indent(iIndent), sCondition);
+	else
+		fprintf(f, "%s{\n", Indent(iIndent));
+
+	/*	
+	 * If we have no subpackets, handle the command. Otherwise, the subpackets need to sort it out
+	 */
+	if (oPacket.GetSubpackets().empty()) {
+		fprintf(f, "%s%s oRequest(pData, iDataLength);\n", Indent(iIndent + 1), oPacket.GetName());
+		fprintf(f, "%sOn%s(oRequest);\n", Indent(iIndent + 1), oPacket.GetName());
+		fprintf(f, "%sreturn true;\n", Indent(iIndent + 1));
+	}
+
+	/*
+	 * Now handle the subpackets; consecutive subpackets which can be told
+	 * apart by the same field are handled using a single switch.
+	 */
+	std::vector<ProtocolDefinition::Subpacket*> oSubpackets;
+	for (auto& oSubpacket: oPacket.GetSubpackets()) {
+		char sPacketName[1024];
+		snprintf(sPacketName, sizeof(sPacketName), "%s_%s", oPacket.GetName(), oSubpacket->GetName());
+		if (!GenerateMatchCondition(oSubpacket->GetActions(), sPacketName, sCriterium, sizeof(sCriterium)))
+			continue; // no fixed values
+		oSubpackets.push_back(oSubpacket);
+	}
+
+	for (unsigned int n = 0; n < oSubpackets.size(); ) {
+		uint32_t iOffset;
+		const ProtocolDefinition::Field* pDiscriminator = FindDiscriminator(oSubpackets[n]->GetActions(), iOffset);
+		unsigned int m = n + 1;
+		while (m < oSubpackets.size()) {
+			uint32_t iNextOffset;
+			const ProtocolDefinition::Field* pNext = FindDiscriminator(oSubpackets[m]->GetActions(), iNextOffset);
+			if (!SameDiscriminator(pDiscriminator, iOffset, pNext, iNextOffset))
+				break;
+			m++;
+		}
+		if (m - n < 2) {
+			GenerateSubpacketMatch(f, oPacket, *oSubpackets[n], pLengthField, NULL, iIndent + 1);
+			n++;
+			continue;
+		}
+
+		/*
+		 * Hoisted length check: the field we switch on must be there. The
+		 * if-chain this replaces compared the field before checking the length,
+		 * reading beyond truncated packets; those now fail to match instead.
+		 */
+		auto pType = dynamic_cast<const ProtocolDefinition::unsignedType*>(&pDiscriminator->GetType());
+		fprintf(f, "%sif (iDataLength >= (int)(sizeof(struct ROM::Packet) + 0x%x + 0x%x)) {\n", Indent(iIndent + 1), iPacketLen, iOffset + pType->GetWidth());
+		fprintf(f, "%sswitch(((struct %s_%s::Packet*)pData)->m_%s) {\n", Indent(iIndent + 2), oPacket.GetName(), oSubpackets[n]->GetName(), pDiscriminator->GetName());
+		GenerateSwitchCases(f, oSubpackets, n, m, iIndent + 2, [&](ProtocolDefinition::Struct& oStruct, const ProtocolDefinition::Field* pSkip) {
+			GenerateSubpacketMatch(f, oPacket, static_cast<ProtocolDefinition::Subpacket&>(oStruct), pLengthField, pSkip, iIndent + 3);
+		});
+		fprintf(f, "%s}\n", Indent(iIndent + 2));
+		fprintf(f, "%s}\n", Indent(iIndent + 1));
+		n = m;
+	}
+
+	fprintf(f, "%s}\n", Indent(iIndent));
+}
+
+template<typename T, typename F> void
+ProtocolCodeGenerator::GenerateSwitchCases(FILE* f, const std::vector<T*>& oStructs, unsigned int iFirst, unsigned int iLast, int iIndent, F oGenerateMatch)
+{
+	// Every value gets a single case, which tries the structs using it in order
+	std::vector<bool> oDone(iLast, false);
+	for (unsigned int n = iFirst; n < iLast; n++) {
+		if (oDone[n])
+			continue;
+		uint32_t iOffset;
+		const ProtocolDefinition::Field* pDiscriminator = FindDiscriminator(oStructs[n]->GetActions(), iOffset);
+		uint32_t iValue = dynamic_cast<const ProtocolDefinition::unsignedType&>(pDiscriminator->GetType()).GetFixedValue();
+		fprintf(f, "%scase 0x%x:\n", Indent(iIndent), iValue);
+		for (unsigned int m = n; m < iLast; m++) {
+			const ProtocolDefinition::Field* pField = FindDiscriminator(oStructs[m]->GetActions(), iOffset);
+			if (dynamic_cast<const ProtocolDefinition::unsignedType&>(pField->GetType()).GetFixedValue() != iValue)
+				continue;
+			oGenerateMatch(*oStructs[m], pField);
+			oDone[m] = true;
+		}
+		fprintf(f, "%s\tbreak;\n", Indent(iIndent));
+	}
+}
+
 void
 ProtocolCodeGenerator::GenerateParser(FILE* f, const char* sPacketPrefix)
 {
@@ -504,8 +719,8 @@ ProtocolCodeGenerator::GenerateParser(FILE* f, const char* sPacketPrefix)
 	fprintf(f, "\tif (((struct ROM::Packet*)pData)->p_length != iDataLength)\n");
 	fprintf(f, "\t\treturn false;\n");
 
-	auto oPackets = m_Definition.GetPacketTypes();
-	for (auto& oPacket: oPackets) {
+	std::vector<ProtocolDefinition::Packet*> oPackets;
+	for (auto& oPacket: m_Definition.GetPacketTypes()) {
 #if 0
 		// Skip anything not originating from the client
 		if (oPacket->GetSource() != ProtocolDefinition::Packet::S_Client)
@@ -516,81 +731,45 @@ ProtocolCodeGenerator::GenerateParser(FILE* f, const char* sPacketPrefix)
 		char sCriterium[1024];
 		if (!GenerateMatchCondition(oPacket->GetActions(), oPacket->GetName(), sCriterium, sizeof(sCriterium)))
 			continue; // no fixed values
+		oPackets.push_back(oPacket);
+	}
 
-		/* Find the length field; we'll use it to ensure the packet is okay */
-		ProtocolDefinition::Field* pLengthField = NULL;
-		for (auto& oAction: oPacket->GetActions()) {
-			ProtocolDefinition::Field* pField = dynamic_cast<ProtocolDefinition::Field*>(oAction);
-			if (pField == NULL || strcmp(pField->GetType().GetName(), "length") != 0)
-				continue;
-			pLengthField = pField;
-			break;
-		}
-
-		// Determine packet length
-		uint32_t iPacketLen = 0;
-		for (auto& oAction: oPacket->GetActions()) {
-			ProtocolDefinition::Field* pField = dynamic_cast<ProtocolDefinition::Field*>(oAction);
-			if (pField == NULL)
-				continue;
-			iPacketLen += pField->GetType().GetConstantSize();
+	/*
+	 * Packets are tried in order; consecutive packets which can be told apart
+	 * by the same field are handled using a single switch on that field, so
+	 * that only the packets with the correct value are looked at.
+	 */
+	for (unsigned int n = 0; n < oPackets.size(); ) {
+		uint32_t iOffset;
+		const ProtocolDefinition::Field* pDiscriminator = FindDiscriminator(oPackets[n]->GetActions(), iOffset);
+		unsigned int m = n + 1;
+		while (m < oPackets.size()) {
+			uint32_t iNextOffset;
+			const ProtocolDefinition::Field* pNext = FindDiscriminator(oPackets[m]->GetActions(), iNextOffset);
+			if (!SameDiscriminator(pDiscriminator, iOffset, pNext, iNextOffset))
+				break;
+			m++;
 		}
-
-		// Generate match conditions; this will also check the lengths, if we can do so
-		fprintf(f, "\tif (");
-		if (iPacketLen > 0) {
-			fprintf(f, "((struct %s::Packet*)pData)->m_header.p_length %s sizeof(struct ROM::Packet) + 0x%x && ",
-			 oPacket->GetName(), (pLengthField == NULL) ? "==" : ">=", iPacketLen);
-			if (pLengthField != NULL)
-				fprintf(f, "((struct %s::Packet*)pData)->m_header.p_length == ((struct %s::Packet*)pData)->m_%s + sizeof(struct ROM::Packet) + 0x%x &&",
-				 oPacket->GetName(), oPacket->GetName(), pLengthField->GetName(), iPacketLen);
+		if (m - n < 2) {
+			GeneratePacketMatch(f, *oPackets[n], NULL, 1);
+			n++;
+			continue;
 		}
-		fprintf(f, "%s) {\n", sCriterium);
 
-		/*	
-		 * If we have no subpackets, handle the command. Otherwise, the subpackets need to sort it out
+		/*
+		 * Hoisted length check: the field we switch on must be there. The
+		 * if-chain this replaces compared the field before checking the length,
+		 * reading beyond truncated packets; those now fail to match instead.
 		 */
-		if (oPacket->GetSubpackets().empty()) {
-			fprintf(f, "\t\t%s oRequest(pData, iDataLength);\n", oPacket->GetName());
-			fprintf(f, "\t\tOn%s(oRequest);\n", oPacket->GetName());
-			fprintf(f, "\t\treturn true;\n");
-		}
-
-		/* Now handle the subpackets */
-		for (auto& oSubpacket: oPacket->GetSubpackets()) {
-			char sPacketName[1024];
-			sPacketName[snprintf(sPacketName, sizeof(sPacketName), "%s_%s", oPacket->GetName(), oSubpacket->GetName())] = '\0';
-			if (!GenerateMatchCondition(oSubpacket->GetActions(), sPacketName, sCriterium, sizeof(sCriterium)))
-				continue; // no fixed values
-
-			// Determine subpacket length
-			uint32_t iSubpacketLen = 0;
-			bool bIsConstantSize = true;
-			ProtocolDefinition::TransformationAction* pTransformation = NULL;
-			for (auto& oAction: oSubpacket->GetActions()) {
-				ProtocolDefinition::TransformationAction* pTT = dynamic_cast<ProtocolDefinition::TransformationAction*>(oAction);
-				if (pTT != NULL)
-					pTransformation = pTT;
-				ProtocolDefinition::Field* pField = dynamic_cast<ProtocolDefinition::Field*>(oAction);
-				if (pField == NULL)
-					continue;
-				unsigned int iConstantSize = pField->GetType().GetConstantSize();
-				iSubpacketLen += iConstantSize;
-				bIsConstantSize &= iConstantSize != 0;
-			}
-
-
-			fprintf(f, "\t\tif (");
-			if (iSubpacketLen > 0 && pLengthField != NULL && pTransformation == NULL /* skip length if a transformation */ && bIsConstantSize)
-				fprintf(f, "((struct %s::Packet*)pData)->m_packet_%s == 0x%x && ", sPacketName, pLengthField->GetName(), iSubpacketLen);
-			fprintf(f, "%s) {\n", sCriterium);
-			fprintf(f, "\t\t\t%s oRequest(pData, iDataLength);\n", sPacketName);
-			fprintf(f, "\t\t\tOn%s(oRequest);\n", sPacketName);
-			fprintf(f, "\t\t\treturn true;\n");
-			fprintf(f, "\t\t}\n");
-		}
-
+		auto pType = dynamic_cast<const ProtocolDefinition::unsignedType*>(&pDiscriminator->GetType());
+		fprintf(f, "\tif (iDataLength >= (int)(sizeof(struct ROM::Packet) + 0x%x)) {\n", iOffset + pType->GetWidth());
+		fprintf(f, "\t\tswitch(((struct %s::Packet*)pData)->m_%s) {\n", oPackets[n]->GetName(), pDiscriminator->GetName());
+		GenerateSwitchCases(f, oPackets, n, m, 2, [&](ProtocolDefinition::Struct& oStruct, const ProtocolDefinition::Field* pSkip) {
+			GeneratePacketMatch(f, static_cast<ProtocolDefinition::Packet&>(oStruct), pSkip, 3);
+		});
+		fprintf(f, "\t\t}\n");
 		fprintf(f, "\t}\n");
+		n = m;
 	}
 	fprintf(f, "\treturn false; /* what's this? */\n");
 	fprintf(f, "}\n");
@@ -639,23 +818,23 @@ ProtocolCodeGenerator::GeneratePythonVariables(FILE* f, const ProtocolDefinition
 
 		const char* ctype = NULL;
 		const char* parsetype = NULL;
-		if (dynamic_cast<ProtocolDefinition::unsignedType*>(&pField->GetType()) != NULL) {
-			ProtocolDefinition::unsignedType& ut = dynamic_cast<ProtocolDefinition::unsignedType&>(pField->GetType());
+		if (dynamic_cast<const ProtocolDefinition::unsignedType*>(&pField->GetType()) != NULL) {
+			const ProtocolDefinition::unsignedType& ut = dynamic_cast<const ProtocolDefinition::unsignedType&>(pField->GetType());
 			if (ut.HaveFixedValue() || ut.GetCount() != 1)
 				continue; // can't generate this
 			ctype = "int"; parsetype = "I";
-		} else if (dynamic_cast<ProtocolDefinition::lengthType*>(&pField->GetType()) != NULL) {
+		} else if (dynamic_cast<const ProtocolDefinition::lengthType*>(&pField->GetType()) != NULL) {
 			ctype = "int"; parsetype = "I";
-		} else if (dynamic_cast<ProtocolDefinition::unixtimeType*>(&pField->GetType()) != NULL) {
+		} else if (dynamic_cast<const ProtocolDefinition::unixtimeType*>(&pField->GetType()) != NULL) {
 			ctype = "int"; parsetype = "I";
-		} else if (dynamic_cast<ProtocolDefinition::floatType*>(&pField->GetType()) != NULL) {
+		} else if (dynamic_cast<const ProtocolDefinition::floatType*>(&pField->GetType()) != NULL) {
 			ctype = "float"; parsetype = "f";
-		} else if (dynamic_cast<ProtocolDefinition::doubleType*>(&pField->GetType()) != NULL) {
+		} else if (dynamic_cast<const ProtocolDefinition::doubleType*>(&pField->GetType()) != NULL) {
 			ctype = "double"; parsetype = "d";
-		} else if (dynamic_cast<ProtocolDefinition::stringType*>(&pField->GetType()) != NULL) {
+		} else if (dynamic_cast<const ProtocolDefinition::stringType*>(&pField->GetType()) != NULL) {
 			ctype = "char*"; parsetype = "s";
-		} else if (dynamic_cast<ProtocolDefinition::Struct*>(&pField->GetType()) != NULL) {
-			ProtocolDefinition::Struct& s = dynamic_cast<ProtocolDefinition::Struct&>(pField->GetType());
+		} else if (dynamic_cast<const ProtocolDefinition::Struct*>(&pField->GetType()) != NULL) {
+			const ProtocolDefinition::Struct& s = dynamic_cast<const ProtocolDefinition::Struct&>(pField->GetType());
 
 			fprintf(f, "\t// struct: %s;\n", pField->GetType().GetName());
 			fprintf(f, "\tROMPacket::%s %s;\n", pField->GetType().GetName(), pField->GetName());
@@ -769,7 +948,7 @@ ProtocolCodeGenerator::GeneratePythonBindings(FILE* f)
 				ProtocolDefinition::Field* pField = dynamic_cast<ProtocolDefinition::Field*>(oAction);
 				if (pField == NULL)
 					continue; // XXX skips transformations
-				ProtocolDefinition::Struct* s = dynamic_cast<ProtocolDefinition::Struct*>(&pField->GetType());
+				const ProtocolDefinition::Struct* s = dynamic_cast<const ProtocolDefinition::Struct*>(&pField->GetType());
 				if (s == NULL)
 					continue;
 
@@ -807,6 +986,588 @@ ProtocolCodeGenerator::GeneratePythonBindings(FILE* f)
 	fprintf(f, "}\n");
 }
 
+/*
+ * Native decoder generation; the generated code must accept and reject
+ * exactly what the interpreter (ProtocolDefinition::Struct::Fill() and
+ * friends) does, so it can be used to classify packets in its place. The
+ * Decode() functions must fill the values exactly like the decode plan, as
+ * they replace it whenever the definitions match.
+ */
+static const char*
+DecoderCType(const ProtocolDefinition::unsignedType& oType)
+{
+	bool bSigned = dynamic_cast<const ProtocolDefinition::signedType*>(&oType) != NULL;
+	switch(oType.GetWidth()) {
+		case 1: return bSigned ? "int8_t" : "uint8_t";
+		case 2: return bSigned ? "int16_t" : "uint16_t";
+		case 4: return bSigned ? "int32_t" : "uint32_t";
+	}
+	return NULL;
+}
+
+static void
+DecoderRead(char* sOutput, int iOutputLen, int iWidth, const char* sOffset)
+{
+	char sPointer[64];
+	if (sOffset != NULL)
+		snprintf(sPointer, sizeof(sPointer), "p + %s", sOffset);
+	else
+		snprintf(sPointer, sizeof(sPointer), "p");
+
+	switch(iWidth) {
+		case 1:
+			snprintf(sOutput, iOutputLen, sOffset != NULL ? "*(%s)" : "*%s", sPointer);
+			break;
+		case 2:
+			snprintf(sOutput, iOutputLen, "NativeDecoder::ReadU16(%s)", sPointer);
+			break;
+		default:
+			snprintf(sOutput, iOutputLen, "NativeDecoder::ReadU32(%s)", sPointer);
+			break;
+	}
+}
+
+static void
+DecoderAdvance(FILE* f, const char* sIndent, const char* sAmount)
+{
+	fprintf(f, "%sp += %s;\n", sIndent, sAmount);
+	fprintf(f, "%sn -= %s;\n", sIndent, sAmount);
+	fprintf(f, "%so += %s;\n", sIndent, sAmount);
+}
+
+bool
+ProtocolCodeGenerator::GenerateDecoderClass(FILE* f, const char* sName, const ProtocolDefinition::Struct& oStruct)
+{
+	fprintf(f, "/*! \\brief Typed view of decoded '%s'\n", oStruct.GetName());
+	fprintf(f, " *\n");
+	fprintf(f, " *  The values are those filled by Decode(), or by the interpreter.\n");
+	fprintf(f, " */\n");
+	fprintf(f, "class %s {\n", sName);
+	fprintf(f, "public:\n");
+	fprintf(f, "\t%s(const ProtocolDefinition::Value* pValues) : m_Values(pValues) { }\n", sName);
+	fprintf(f, "\n");
+	fprintf(f, "\t/*! \\brief Checks whether data matches, without keeping the result\n");
+	fprintf(f, "\t *  \\returns Number of bytes processed, like ProtocolDefinition::Struct::Fill()\n");
+	fprintf(f, "\t */\n");
+	fprintf(f, "\tstatic int Probe(NativeDecoder::Context& oContext, const uint8_t* pData, int iDataLeft);\n");
+	fprintf(f, "\n");
+	fprintf(f, "\t/*! \\brief Decodes data into values laid out like the interpreter's\n");
+	fprintf(f, "\t *  \\returns Number of bytes processed, like ProtocolDefinition::Struct::Fill()\n");
+	fprintf(f, "\t */\n");
+	fprintf(f, "\tstatic int Decode(NativeDecoder::Context& oContext, const ProtocolDefinition::DecodeState& oState, const uint8_t* pData, int iDataLeft, uint32_t iDataOffset, ProtocolDefinition::Value* pValues);\n");
+	fprintf(f, "\n");
+
+	// Accessors; struct-typed ones are defined once all classes are known
+	for (auto& oAction: oStruct.GetActions()) {
+		const ProtocolDefinition::Field* pField = dynamic_cast<const ProtocolDefinition::Field*>(oAction);
+		if (pField == NULL)
+			continue;
+		const ProtocolDefinition::Type& oType = pField->GetType();
+		const char* sField = pField->GetName();
+		int iIndex = pField->GetIndex();
+		if (auto pUnsigned = dynamic_cast<const ProtocolDefinition::unsignedType*>(&oType)) {
+			const char* sCType = DecoderCType(*pUnsigned);
+			if (sCType == NULL) {
+				fprintf(stderr, "ProtocolCodeGenerator::GenerateDecoderClass(): field '%s' of '%s' has unsupported width %d\n", sField, sName, pUnsigned->GetWidth());
+				return false;
+			}
+			if (pUnsigned->GetCount() == 1) {
+				fprintf(f, "\t%s %s() const { return (%s)*static_cast<const uint32_t*>(m_Values[%d].m_Data); }\n", sCType, sField, sCType, iIndex);
+			} else {
+				fprintf(f, "\t%s %s(int n) const { return (%s)static_cast<const uint32_t*>(m_Values[%d].m_Data)[n]; }\n", sCType, sField, sCType, iIndex);
+				fprintf(f, "\tint %s_numvalues() const { return m_Values[%d].m_Num; }\n", sField, iIndex);
+			}
+		} else if (dynamic_cast<const ProtocolDefinition::stringType*>(&oType) != NULL) {
+			fprintf(f, "\tconst char* %s() const { return static_cast<const char*>(m_Values[%d].m_Data); }\n", sField, iIndex);
+			fprintf(f, "\tint %s_numbytes() const { return m_Values[%d].m_Num; }\n", sField, iIndex);
+		} else if (auto pFloat = dynamic_cast<const ProtocolDefinition::floatType*>(&oType)) {
+			if (pFloat->GetCount() == 1)
+				fprintf(f, "\tfloat %s() const { return *static_cast<const float*>(m_Values[%d].m_Data); }\n", sField, iIndex);
+			else
+				fprintf(f, "\tconst float* %s() const { return static_cast<const float*>(m_Values[%d].m_Data); }\n", sField, iIndex);
+		} else if (auto pDouble = dynamic_cast<const ProtocolDefinition::doubleType*>(&oType)) {
+			if (pDouble->GetCount() == 1)
+				fprintf(f, "\tdouble %s() const { return *static_cast<const double*>(m_Values[%d].m_Data); }\n", sField, iIndex);
+			else
+				fprintf(f, "\tconst double* %s() const { return static_cast<const double*>(m_Values[%d].m_Data); }\n", sField, iIndex);
+		} else if (dynamic_cast<const ProtocolDefinition::lengthType*>(&oType) != NULL ||
+		           dynamic_cast<const ProtocolDefinition::unixtimeType*>(&oType) != NULL) {
+			fprintf(f, "\tuint32_t %s() const { return *static_cast<const uint32_t*>(m_Values[%d].m_Data); }\n", sField, iIndex);
+		} else if (dynamic_cast<const ProtocolDefinition::Struct*>(&oType) != NULL) {
+			fprintf(f, "\t%s %s() const;\n", oType.GetName(), sField);
+		} else {
+			fprintf(stderr, "ProtocolCodeGenerator::GenerateDecoderClass(): field '%s' of '%s' has unsupported type '%s'\n", sField, sName, oType.GetName());
+			return false;
+		}
+	}
+	fprintf(f, "\n");
+	fprintf(f, "protected:\n");
+	fprintf(f, "\t//! \\brief Values of the members, indexed by field\n");
+	fprintf(f, "\tconst ProtocolDefinition::Value* m_Values;\n");
+	fprintf(f, "};\n");
+	fprintf(f, "\n");
+	return true;
+}
+
+void
+ProtocolCodeGenerator::GenerateDecoderStructAccessors(FILE* f, const char* sName, const ProtocolDefinition::Struct& oStruct)
+{
+	for (auto& oAction: oStruct.GetActions()) {
+		const ProtocolDefinition::Field* pField = dynamic_cast<const ProtocolDefinition::Field*>(oAction);
+		if (pField == NULL || dynamic_cast<const ProtocolDefinition::Struct*>(&pField->GetType()) == NULL)
+			continue;
+		const char* sType = pField->GetType().GetName();
+		fprintf(f, "inline %s %s::%s() const { return %s(static_cast<const ProtocolDefinition::Value*>(m_Values[%d].m_Data)); }\n", sType, sName, pField->GetName(), sType, pField->GetIndex());
+	}
+}
+
+bool
+ProtocolCodeGenerator::GenerateDecoderClasses(FILE* f)
+{
+	// Structs can be used before they are defined
+	for (auto& oType: m_Definition.GetTypes()) {
+		if (dynamic_cast<const ProtocolDefinition::Struct*>(oType) != NULL)
+			fprintf(f, "class %s;\n", oType->GetName());
+	}
+	fprintf(f, "\n");
+
+	for (auto& oType: m_Definition.GetTypes()) {
+		const ProtocolDefinition::Struct* pStruct = dynamic_cast<const ProtocolDefinition::Struct*>(oType);
+		if (pStruct == NULL)
+			continue;
+		if (!GenerateDecoderClass(f, pStruct->GetName(), *pStruct))
+			return false;
+	}
+
+	for (auto& oPacket: m_Definition.GetPacketTypes()) {
+		if (!GenerateDecoderClass(f, oPacket->GetName(), *oPacket))
+			return false;
+		for (auto& oSubpacket: oPacket->GetSubpackets()) {
+			char sName[1024];
+			snprintf(sName, sizeof(sName), "%s_%s", oPacket->GetName(), oSubpacket->GetName());
+			if (!GenerateDecoderClass(f, sName, *oSubpacket))
+				return false;
+		}
+	}
+
+	for (auto& oType: m_Definition.GetTypes()) {
+		const ProtocolDefinition::Struct* pStruct = dynamic_cast<const ProtocolDefinition::Struct*>(oType);
+		if (pStruct != NULL)
+			GenerateDecoderStructAccessors(f, pStruct->GetName(), *pStruct);
+	}
+	for (auto& oPacket: m_Definition.GetPacketTypes()) {
+		GenerateDecoderStructAccessors(f, oPacket->GetName(), *oPacket);
+		for (auto& oSubpacket: oPacket->GetSubpackets()) {
+			char sName[1024];
+			snprintf(sName, sizeof(sName), "%s_%s", oPacket->GetName(), oSubpacket->GetName());
+			GenerateDecoderStructAccessors(f, sName, *oSubpacket);
+		}
+	}
+	fprintf(f, "\n");
+	return true;
+}
+
+int
+ProtocolCodeGenerator::LookupDecoderTransformation(const char* sName)
+{
+	for (unsigned int n = 0; n < m_DecoderTransformations.size(); n++)
+		if (strcmp(m_DecoderTransformations[n], sName) == 0)
+			return n;
+	m_DecoderTransformations.push_back(sName);
+	return m_DecoderTransformations.size() - 1;
+}
+
+bool
+ProtocolCodeGenerator::GenerateDecoderProbe(FILE* f, const char* sName, const ProtocolDefinition::Struct& oStruct)
+{
+	fprintf(f, "int\n");
+	fprintf(f, "%s::Probe(NativeDecoder::Context& oContext, const uint8_t* pData, int iDataLeft)\n", sName);
+	fprintf(f, "{\n");
+	fprintf(f, "\tconst uint8_t* p = pData;\n");
+	fprintf(f, "\tint n = iDataLeft;\n");
+	fprintf(f, "\n");
+
+	/*
+	 * Any failure ends the struct; whatever was processed up to that point is
+	 * returned, just like the interpreter's decode plan.
+	 */
+	char sRead[256];
+	for (auto& oAction: oStruct.GetActions()) {
+		if (auto pTransformation = dynamic_cast<const ProtocolDefinition::TransformationAction*>(oAction)) {
+			const char* sTransformation = pTransformation->GetTransformation().GetName();
+			fprintf(f, "\t// transformation '%s'\n", sTransformation);
+			fprintf(f, "\t{\n");
+			fprintf(f, "\t\tXDataTransformation* pTransformation = oContext.GetTransformation(%d);\n", LookupDecoderTransformation(sTransformation));
+			fprintf(f, "\t\tif (pTransformation == NULL)\n");
+			fprintf(f, "\t\t\tgoto done;\n");
+			fprintf(f, "\t\tif (pTransformation->EstimateBufferSize(p, n) < 0)\n");
+			fprintf(f, "\t\t\tgoto done;\n");
+			fprintf(f, "\t\tn = 0; // the rest is taken to match\n");
+			fprintf(f, "\t}\n");
+			continue;
+		}
+		const ProtocolDefinition::Field* pField = dynamic_cast<const ProtocolDefinition::Field*>(oAction);
+		if (pField == NULL)
+			continue;
+
+		const ProtocolDefinition::Type& oType = pField->GetType();
+		const char* sField = pField->GetName();
+		fprintf(f, "\t// %s: %s\n", sField, oType.GetName());
+		if (auto pUnsigned = dynamic_cast<const ProtocolDefinition::unsignedType*>(&oType)) {
+			int iWidth = pUnsigned->GetWidth();
+			if (iWidth != 1 && iWidth != 2 && iWidth != 4) {
+				fprintf(stderr, "ProtocolCodeGenerator::GenerateDecoderProbe(): field '%s' of '%s' has unsupported width %d\n", sField, sName, iWidth);
+				return false;
+			}
+			DecoderRead(sRead, sizeof(sRead), iWidth, NULL);
+			if (pUnsigned->GetCount() == 1) {
+				fprintf(f, "\tif (n < %d)\n", iWidth);
+				fprintf(f, "\t\tgoto done;\n");
+				if (pUnsigned->HaveFixedValue()) {
+					fprintf(f, "\tif (%s != 0x%xu)\n", sRead, pUnsigned->GetFixedValue());
+					fprintf(f, "\t\tgoto done;\n");
+				}
+				fprintf(f, "\tp += %d;\n", iWidth);
+				fprintf(f, "\tn -= %d;\n", iWidth);
+			} else {
+				fprintf(f, "\t{\n");
+				fprintf(f, "\t\tif (n < %d)\n", iWidth * pUnsigned->GetMinCount());
+				fprintf(f, "\t\t\tgoto done;\n");
+				fprintf(f, "\t\tint iNum = n / %d;\n", iWidth);
+				fprintf(f, "\t\tif (iNum > %d)\n", pUnsigned->GetCount());
+				fprintf(f, "\t\t\tiNum = %d;\n", pUnsigned->GetCount());
+				fprintf(f, "\t\tif (iNum == 0)\n");
+				fprintf(f, "\t\t\tgoto done;\n");
+				if (pUnsigned->HaveFixedValue()) {
+					fprintf(f, "\t\tif (%s != 0x%xu)\n", sRead, pUnsigned->GetFixedValue());
+					fprintf(f, "\t\t\tgoto done;\n");
+				}
+				fprintf(f, "\t\tp += %d * iNum;\n", iWidth);
+				fprintf(f, "\t\tn -= %d * iNum;\n", iWidth);
+				fprintf(f, "\t}\n");
+			}
+		} else if (auto pString = dynamic_cast<const ProtocolDefinition::stringType*>(&oType)) {
+			fprintf(f, "\t{\n");
+			fprintf(f, "\t\tif (n < %d)\n", pString->GetMinLength());
+			fprintf(f, "\t\t\tgoto done;\n");
+			fprintf(f, "\t\tint iLength = n < %d ? n : %d;\n", pString->GetLength(), pString->GetLength());
+			fprintf(f, "\t\tif (iLength == 0)\n");
+			fprintf(f, "\t\t\tgoto done;\n");
+			fprintf(f, "\t\tp += iLength;\n");
+			fprintf(f, "\t\tn -= iLength;\n");
+			fprintf(f, "\t}\n");
+		} else if (dynamic_cast<const ProtocolDefinition::floatType*>(&oType) != NULL ||
+		           dynamic_cast<const ProtocolDefinition::doubleType*>(&oType) != NULL) {
+			auto pFloat = dynamic_cast<const ProtocolDefinition::floatType*>(&oType);
+			auto pDouble = dynamic_cast<const ProtocolDefinition::doubleType*>(&oType);
+			int iCount = pFloat != NULL ? pFloat->GetCount() : pDouble->GetCount();
+			int iWidth = pFloat != NULL ? sizeof(float) : sizeof(double);
+			if (iCount <= 0) {
+				fprintf(f, "\tgoto done;\n");
+				continue;
+			}
+			fprintf(f, "\tif (n < %d)\n", iWidth * iCount);
+			fprintf(f, "\t\tgoto done;\n");
+			fprintf(f, "\tp += %d;\n", iWidth * iCount);
+			fprintf(f, "\tn -= %d;\n", iWidth * iCount);
+		} else if (dynamic_cast<const ProtocolDefinition::lengthType*>(&oType) != NULL) {
+			fprintf(f, "\tif (n < 4)\n");
+			fprintf(f, "\t\tgoto done;\n");
+			fprintf(f, "\tif (NativeDecoder::ReadU32(p) + 4 != (uint32_t)n) {\n");
+			fprintf(f, "\t\tNativeDecoder::RejectLength(NativeDecoder::ReadU32(p) + 4, n);\n");
+			fprintf(f, "\t\tgoto done;\n");
+			fprintf(f, "\t}\n");
+			fprintf(f, "\tp += 4;\n");
+			fprintf(f, "\tn -= 4;\n");
+		} else if (dynamic_cast<const ProtocolDefinition::unixtimeType*>(&oType) != NULL) {
+			fprintf(f, "\tif (n < 4)\n");
+			fprintf(f, "\t\tgoto done;\n");
+			fprintf(f, "\tp += 4;\n");
+			fprintf(f, "\tn -= 4;\n");
+		} else if (dynamic_cast<const ProtocolDefinition::Struct*>(&oType) != NULL) {
+			fprintf(f, "\t{\n");
+			fprintf(f, "\t\tint r = %s::Probe(oContext, p, n);\n", oType.GetName());
+			fprintf(f, "\t\tif (r <= 0)\n");
+			fprintf(f, "\t\t\tgoto done;\n");
+			fprintf(f, "\t\tp += r;\n");
+			fprintf(f, "\t\tn -= r;\n");
+			fprintf(f, "\t}\n");
+		} else {
+			fprintf(stderr, "ProtocolCodeGenerator::GenerateDecoderProbe(): field '%s' of '%s' has unsupported type '%s'\n", sField, sName, oType.GetName());
+			return false;
+		}
+	}
+
+	fprintf(f, "\n");
+	fprintf(f, "done:\n");
+	fprintf(f, "\treturn iDataLeft - n;\n");
+	fprintf(f, "}\n");
+	fprintf(f, "\n");
+	return true;
+}
+
+bool
+ProtocolCodeGenerator::GenerateDecoderDecode(FILE* f, const char* sName, const ProtocolDefinition::Struct& oStruct, int iPacket, int iSubpacket)
+{
+	fprintf(f, "int\n");
+	fprintf(f, "%s::Decode(NativeDecoder::Context& oContext, const ProtocolDefinition::DecodeState& oState, const uint8_t* pData, int iDataLeft, uint32_t iDataOffset, ProtocolDefinition::Value* pValues)\n", sName);
+	fprintf(f, "{\n");
+	fprintf(f, "\tconst uint8_t* p = pData;\n");
+	fprintf(f, "\tint n = iDataLeft;\n");
+	fprintf(f, "\tuint32_t o = iDataOffset;\n");
+	fprintf(f, "\n");
+
+	/*
+	 * This follows the decode plan: a field records its offset even if it
+	 * fails, a failure ends the struct and a struct-typed field fails only if
+	 * its members consumed nothing.
+	 */
+	char sRead[256];
+	int iAction = -1;
+	for (auto& oAction: oStruct.GetActions()) {
+		iAction++;
+		if (auto pTransformation = dynamic_cast<const ProtocolDefinition::TransformationAction*>(oAction)) {
+			const char* sTransformation = pTransformation->GetTransformation().GetName();
+			fprintf(f, "\t// transformation '%s'\n", sTransformation);
+			fprintf(f, "\t{\n");
+			fprintf(f, "\t\tXDataTransformation* pTransformation = oContext.GetTransformation(%d);\n", LookupDecoderTransformation(sTransformation));
+			fprintf(f, "\t\tif (pTransformation == NULL)\n");
+			fprintf(f, "\t\t\tgoto done;\n");
+			fprintf(f, "\t\tint iBufferSize = pTransformation->EstimateBufferSize(p, n);\n");
+			fprintf(f, "\t\tif (iBufferSize < 0)\n");
+			fprintf(f, "\t\t\tgoto done;\n");
+			fprintf(f, "\t\tuint8_t* pBuffer = oState.m_Arena->Allocate(iBufferSize);\n");
+			fprintf(f, "\t\tif (!pTransformation->Apply(p, n, pBuffer, iBufferSize))\n");
+			fprintf(f, "\t\t\tgoto done;\n");
+			fprintf(f, "\t\tp = pBuffer;\n");
+			fprintf(f, "\t\tn = iBufferSize;\n");
+			fprintf(f, "\t\to = 0;\n");
+			fprintf(f, "\t}\n");
+			continue;
+		}
+		if (auto pAnnotation = dynamic_cast<const ProtocolDefinition::AnnotationAction*>(oAction)) {
+			DecoderAnnotation oAnnotation;
+			oAnnotation.m_Name = pAnnotation->GetAnnotation().GetName();
+			oAnnotation.m_Type = iPacket < 0 ? oStruct.GetName() : NULL;
+			oAnnotation.m_Packet = iPacket;
+			oAnnotation.m_Subpacket = iSubpacket;
+			oAnnotation.m_Action = iAction;
+			m_DecoderAnnotations.push_back(oAnnotation);
+			fprintf(f, "\t// annotation '%s'\n", oAnnotation.m_Name);
+			fprintf(f, "\toContext.Annotate(%d, oState, pValues);\n", (int)m_DecoderAnnotations.size() - 1);
+			continue;
+		}
+		const ProtocolDefinition::Field* pField = dynamic_cast<const ProtocolDefinition::Field*>(oAction);
+		if (pField == NULL)
+			continue;
+
+		const ProtocolDefinition::Type& oType = pField->GetType();
+		const char* sField = pField->GetName();
+		int iIndex = pField->GetIndex();
+		fprintf(f, "\t// %s: %s\n", sField, oType.GetName());
+		fprintf(f, "\tpValues[%d].m_DataOffset = o;\n", iIndex);
+		if (auto pUnsigned = dynamic_cast<const ProtocolDefinition::unsignedType*>(&oType)) {
+			int iWidth = pUnsigned->GetWidth();
+			const char* sReader = iWidth == 1 ? "ReadU8Array" : (iWidth == 2 ? "ReadU16Array" : "ReadU32Array");
+			DecoderRead(sRead, sizeof(sRead), iWidth, NULL);
+			if (pUnsigned->GetCount() == 1) {
+				fprintf(f, "\tif (n < %d)\n", iWidth);
+				fprintf(f, "\t\tgoto done;\n");
+				fprintf(f, "\t{\n");
+				fprintf(f, "\t\tuint32_t iValue = %s;\n", sRead);
+				fprintf(f, "\t\t*static_cast<uint32_t*>(pValues[%d].m_Data) = iValue;\n", iIndex);
+				fprintf(f, "\t\tpValues[%d].m_Num = 1;\n", iIndex);
+				if (pUnsigned->HaveFixedValue()) {
+					fprintf(f, "\t\tif (iValue != 0x%xu)\n", pUnsigned->GetFixedValue());
+					fprintf(f, "\t\t\tgoto done;\n");
+				}
+				fprintf(f, "\t}\n");
+				char sAmount[32];
+				snprintf(sAmount, sizeof(sAmount), "%d", iWidth);
+				DecoderAdvance(f, "\t", sAmount);
+			} else {
+				fprintf(f, "\t{\n");
+				fprintf(f, "\t\tif (n < %d)\n", iWidth * pUnsigned->GetMinCount());
+				fprintf(f, "\t\t\tgoto done;\n");
+				fprintf(f, "\t\tint iNum = n / %d;\n", iWidth);
+				fprintf(f, "\t\tif (iNum > %d)\n", pUnsigned->GetCount());
+				fprintf(f, "\t\t\tiNum = %d;\n", pUnsigned->GetCount());
+				fprintf(f, "\t\tuint32_t* pValue = static_cast<uint32_t*>(pValues[%d].m_Data);\n", iIndex);
+				fprintf(f, "\t\tNativeDecoder::%s(p, pValue, iNum);\n", sReader);
+				fprintf(f, "\t\tpValues[%d].m_Num = iNum;\n", iIndex);
+				fprintf(f, "\t\tif (iNum == 0)\n");
+				fprintf(f, "\t\t\tgoto done;\n");
+				if (pUnsigned->HaveFixedValue()) {
+					fprintf(f, "\t\tif (pValue[0] != 0x%xu)\n", pUnsigned->GetFixedValue());
+					fprintf(f, "\t\t\tgoto done;\n");
+				}
+				char sAmount[32];
+				snprintf(sAmount, sizeof(sAmount), "%d * iNum", iWidth);
+				DecoderAdvance(f, "\t\t", sAmount);
+				fprintf(f, "\t}\n");
+			}
+		} else if (auto pString = dynamic_cast<const ProtocolDefinition::stringType*>(&oType)) {
+			fprintf(f, "\t{\n");
+			fprintf(f, "\t\tif (n < %d)\n", pString->GetMinLength());
+			fprintf(f, "\t\t\tgoto done;\n");
+			fprintf(f, "\t\tint iLength = n < %d ? n : %d;\n", pString->GetLength(), pString->GetLength());
+			fprintf(f, "\t\tmemcpy(pValues[%d].m_Data, p, iLength);\n", iIndex);
+			fprintf(f, "\t\tpValues[%d].m_Num = iLength;\n", iIndex);
+			fprintf(f, "\t\tif (iLength == 0)\n");
+			fprintf(f, "\t\t\tgoto done;\n");
+			DecoderAdvance(f, "\t\t", "iLength");
+			fprintf(f, "\t}\n");
+		} else if (dynamic_cast<const ProtocolDefinition::floatType*>(&oType) != NULL ||
+		           dynamic_cast<const ProtocolDefinition::doubleType*>(&oType) != NULL) {
+			auto pFloat = dynamic_cast<const ProtocolDefinition::floatType*>(&oType);
+			auto pDouble = dynamic_cast<const ProtocolDefinition::doubleType*>(&oType);
+			int iCount = pFloat != NULL ? pFloat->GetCount() : pDouble->GetCount();
+			int iWidth = pFloat != NULL ? sizeof(float) : sizeof(double);
+			if (iCount <= 0) {
+				fprintf(f, "\tgoto done;\n");
+				continue;
+			}
+			fprintf(f, "\tif (n < %d)\n", iWidth * iCount);
+			fprintf(f, "\t\tgoto done;\n");
+			if (pFloat != NULL)
+				fprintf(f, "\tNativeDecoder::ReadFloatArray(p, static_cast<float*>(pValues[%d].m_Data), %d);\n", iIndex, iCount);
+			else
+				fprintf(f, "\tNativeDecoder::ReadDoubleArray(p, static_cast<double*>(pValues[%d].m_Data), %d);\n", iIndex, iCount);
+			fprintf(f, "\tpValues[%d].m_Num = %d;\n", iIndex, iCount);
+			char sAmount[32];
+			snprintf(sAmount, sizeof(sAmount), "%d", iWidth * iCount);
+			DecoderAdvance(f, "\t", sAmount);
+		} else if (dynamic_cast<const ProtocolDefinition::lengthType*>(&oType) != NULL) {
+			fprintf(f, "\tif (n < 4)\n");
+			fprintf(f, "\t\tgoto done;\n");
+			fprintf(f, "\t{\n");
+			fprintf(f, "\t\tuint32_t iValue = NativeDecoder::ReadU32(p) + 4;\n");
+			fprintf(f, "\t\t*static_cast<uint32_t*>(pValues[%d].m_Data) = iValue;\n", iIndex);
+			fprintf(f, "\t\tpValues[%d].m_Num = 1;\n", iIndex);
+			fprintf(f, "\t\tif (iValue != (uint32_t)n) {\n");
+			fprintf(f, "\t\t\tNativeDecoder::RejectLength(iValue, n);\n");
+			fprintf(f, "\t\t\tgoto done;\n");
+			fprintf(f, "\t\t}\n");
+			fprintf(f, "\t}\n");
+			DecoderAdvance(f, "\t", "4");
+		} else if (dynamic_cast<const ProtocolDefinition::unixtimeType*>(&oType) != NULL) {
+			fprintf(f, "\tif (n < 4)\n");
+			fprintf(f, "\t\tgoto done;\n");
+			fprintf(f, "\t*static_cast<uint32_t*>(pValues[%d].m_Data) = NativeDecoder::ReadU32(p);\n", iIndex);
+			fprintf(f, "\tpValues[%d].m_Num = 1;\n", iIndex);
+			DecoderAdvance(f, "\t", "4");
+		} else if (auto pStruct = dynamic_cast<const ProtocolDefinition::Struct*>(&oType)) {
+			// The members are decoded by the struct type's code, so they must be laid out alike
+			const ProtocolDefinition::Struct* pNamed = dynamic_cast<const ProtocolDefinition::Struct*>(m_Definition.LookupType(oType.GetName()));
+			if (pNamed == NULL || pNamed->GetActions().size() != pStruct->GetActions().size()) {
+				fprintf(stderr, "ProtocolCodeGenerator::GenerateDecoderDecode(): field '%s' of '%s' changes the members of '%s'\n", sField, sName, oType.GetName());
+				return false;
+			}
+			fprintf(f, "\t{\n");
+			fprintf(f, "\t\tint r = %s::Decode(oContext, oState, p, n, o, static_cast<ProtocolDefinition::Value*>(pValues[%d].m_Data));\n", oType.GetName(), iIndex);
+			fprintf(f, "\t\tif (r <= 0)\n");
+			fprintf(f, "\t\t\tgoto done;\n");
+			DecoderAdvance(f, "\t\t", "r");
+			fprintf(f, "\t}\n");
+		} else {
+			fprintf(stderr, "ProtocolCodeGenerator::GenerateDecoderDecode(): field '%s' of '%s' has unsupported type '%s'\n", sField, sName, oType.GetName());
+			return false;
+		}
+	}
+
+	fprintf(f, "\n");
+	fprintf(f, "done:\n");
+	fprintf(f, "\treturn iDataLeft - n;\n");
+	fprintf(f, "}\n");
+	fprintf(f, "\n");
+	return true;
+}
+
+bool
+ProtocolCodeGenerator::GenerateDecoderFunctions(FILE* f)
+{
+	m_DecoderTransformations.clear();
+	m_DecoderAnnotations.clear();
+
+	for (auto& oType: m_Definition.GetTypes()) {
+		const ProtocolDefinition::Struct* pStruct = dynamic_cast<const ProtocolDefinition::Struct*>(oType);
+		if (pStruct == NULL)
+			continue;
+		if (!GenerateDecoderProbe(f, pStruct->GetName(), *pStruct) ||
+		    !GenerateDecoderDecode(f, pStruct->GetName(), *pStruct, -1, -1))
+			return false;
+	}
+
+	auto oPackets = m_Definition.GetPacketTypes();
+	int iPacket = 0;
+	for (auto& oPacket: oPackets) {
+		if (!GenerateDecoderProbe(f, oPacket->GetName(), *oPacket) ||
+		    !GenerateDecoderDecode(f, oPacket->GetName(), *oPacket, iPacket, -1))
+			return false;
+		int iSubpacket = 0;
+		for (auto& oSubpacket: oPacket->GetSubpackets()) {
+			char sName[1024];
+			snprintf(sName, sizeof(sName), "%s_%s", oPacket->GetName(), oSubpacket->GetName());
+			if (!GenerateDecoderProbe(f, sName, *oSubpacket) ||
+			    !GenerateDecoderDecode(f, sName, *oSubpacket, iPacket, iSubpacket))
+				return false;
+			iSubpacket++;
+		}
+		iPacket++;
+	}
+
+	// Registry; the order must match the definition as the indices are shared
+	for (auto& oPacket: oPackets) {
+		if (oPacket->GetSubpackets().empty())
+			continue;
+		fprintf(f, "static const NativeDecoder::SubpacketEntry s_%s_Subpackets[] = {\n", oPacket->GetName());
+		for (auto& oSubpacket: oPacket->GetSubpackets())
+			fprintf(f, "\t{ \"%s\", %s_%s::Probe, %s_%s::Decode },\n", oSubpacket->GetName(), oPacket->GetName(), oSubpacket->GetName(), oPacket->GetName(), oSubpacket->GetName());
+		fprintf(f, "};\n");
+		fprintf(f, "\n");
+	}
+
+	fprintf(f, "static const NativeDecoder::PacketEntry s_Packets[] = {\n");
+	for (auto& oPacket: oPackets) {
+		if (oPacket->GetSubpackets().empty()) {
+			fprintf(f, "\t{ \"%s\", %s::Probe, %s::Decode, %d, 0, NULL },\n", oPacket->GetName(), oPacket->GetName(), oPacket->GetName(), oPacket->m_NumPacketBytes);
+		} else {
+			fprintf(f, "\t{ \"%s\", %s::Probe, %s::Decode, %d, %d, s_%s_Subpackets },\n", oPacket->GetName(), oPacket->GetName(), oPacket->GetName(), oPacket->m_NumPacketBytes, (int)oPacket->GetSubpackets().size(), oPacket->GetName());
+		}
+	}
+	fprintf(f, "};\n");
+	fprintf(f, "\n");
+
+	fprintf(f, "static const char* const s_Transformations[] = {\n");
+	for (auto& sTransformation: m_DecoderTransformations)
+		fprintf(f, "\t\"%s\",\n", sTransformation);
+	fprintf(f, "\tNULL\n");
+	fprintf(f, "};\n");
+	fprintf(f, "\n");
+
+	fprintf(f, "static const NativeDecoder::AnnotationEntry s_Annotations[] = {\n");
+	for (auto& oAnnotation: m_DecoderAnnotations) {
+		if (oAnnotation.m_Type != NULL)
+			fprintf(f, "\t{ \"%s\", \"%s\", -1, -1, %d },\n", oAnnotation.m_Name, oAnnotation.m_Type, oAnnotation.m_Action);
+		else
+			fprintf(f, "\t{ \"%s\", NULL, %d, %d, %d },\n", oAnnotation.m_Name, oAnnotation.m_Packet, oAnnotation.m_Subpacket, oAnnotation.m_Action);
+	}
+	fprintf(f, "\t{ NULL, NULL, -1, -1, -1 }\n");
+	fprintf(f, "};\n");
+	fprintf(f, "\n");
+
+	fprintf(f, "static const NativeDecoder::Registry s_Registry = {\n");
+	fprintf(f, "\t%d, // version\n", m_Definition.GetVersion());
+	fprintf(f, "\t0x%08xu, // fingerprint\n", m_Definition.GetFingerprint());
+	fprintf(f, "\t%d, s_Packets,\n", (int)oPackets.size());
+	fprintf(f, "\t%d, s_Transformations,\n", (int)m_DecoderTransformations.size());
+	fprintf(f, "\t%d, s_Annotations\n", (int)m_DecoderAnnotations.size());
+	fprintf(f, "};\n");
+	fprintf(f, "\n");
+	fprintf(f, "static NativeDecoder::Registration s_Registration(s_Registry);\n");
+	return true;
+}
+
 ProtocolCodeGenerator::NameType::NameType(const char* cname, const char* varname, const char* type)
 {
 	m_CName = strdup(cname);
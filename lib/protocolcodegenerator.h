@@ -19,6 +19,7 @@
 
 #include "protocoldefinition.h"
 #include <list>
+#include <vector>
 #include <stdio.h>
 
 class ProtocolDefinition;
@@ -35,6 +36,18 @@ public:
 	void GenerateParserClass(FILE* f);
 	void GeneratePythonBindings(FILE* f);
 
+	/*! \brief Generates the native decoder class declarations
+	 *  \param f File to write to
+	 *  \returns true on success
+	 */
+	bool GenerateDecoderClasses(FILE* f);
+
+	/*! \brief Generates the native decoder functions and registry
+	 *  \param f File to write to
+	 *  \returns true on success
+	 */
+	bool GenerateDecoderFunctions(FILE* f);
+
 private:
 	ProtocolDefinition& m_Definition;
 
@@ -43,7 +56,26 @@ private:
 	void GenerateFields(FILE* f, const ProtocolDefinition::Struct::TXActionPtrList& oActions, const char* sPrefix);
 	uint32_t GenerateLength(FILE* f, ProtocolDefinition::Packet& oPacket, ProtocolDefinition::Subpacket& oSubpacket, const char* sPrefix);
 
-	bool GenerateMatchCondition(const ProtocolDefinition::Struct::TXActionPtrList& oActions, const char* sPacketName, char* sOutput, int iOutputLen);
+	bool GenerateMatchCondition(const ProtocolDefinition::Struct::TXActionPtrList& oActions, const char* sPacketName, char* sOutput, int iOutputLen, const ProtocolDefinition::Field* pSkip = NULL);
+
+	/*! \brief Finds the field to dispatch on
+	 *  \param oActions Actions to look through
+	 *  \param iOffset Receives the offset of the field
+	 *  \returns First field with a fixed value, or NULL if there is none at a fixed offset
+	 */
+	const ProtocolDefinition::Field* FindDiscriminator(const ProtocolDefinition::Struct::TXActionPtrList& oActions, uint32_t& iOffset);
+
+	void GeneratePacketMatch(FILE* f, ProtocolDefinition::Packet& oPacket, const ProtocolDefinition::Field* pSkip, int iIndent);
+	void GenerateSubpacketMatch(FILE* f, ProtocolDefinition::Packet& oPacket, ProtocolDefinition::Subpacket& oSubpacket, const ProtocolDefinition::Field* pLengthField, const ProtocolDefinition::Field* pSkip, int iIndent);
+
+	/*! \brief Generates the cases of a switch on the discriminator field
+	 *  \param oStructs Structures to dispatch
+	 *  \param iFirst First structure to handle
+	 *  \param iLast One beyond the last structure to handle
+	 *  \param iIndent Indentation of the switch
+	 *  \param oGenerateMatch Called to generate the code for a structure
+	 */
+	template<typename T, typename F> void GenerateSwitchCases(FILE* f, const std::vector<T*>& oStructs, unsigned int iFirst, unsigned int iLast, int iIndent, F oGenerateMatch);
 
 	class NameType {
 	public:
@@ -61,6 +93,34 @@ private:
 	typedef std::list<NameType*> TNameTypePtrList;
 
 	void GeneratePythonVariables(FILE* f, const ProtocolDefinition::Struct::TXActionPtrList& oActions, const char* cprefix, const char* pyprefix, TNameTypePtrList& list);
+
+	bool GenerateDecoderClass(FILE* f, const char* sName, const ProtocolDefinition::Struct& oStruct);
+	void GenerateDecoderStructAccessors(FILE* f, const char* sName, const ProtocolDefinition::Struct& oStruct);
+	bool GenerateDecoderProbe(FILE* f, const char* sName, const ProtocolDefinition::Struct& oStruct);
+
+	/*! \brief Generates the Decode() function of a struct, packet or subpacket
+	 *  \param iPacket Index of the packet, -1 for a struct type
+	 *  \param iSubpacket Index of the subpacket, -1 for the packet itself
+	 */
+	bool GenerateDecoderDecode(FILE* f, const char* sName, const ProtocolDefinition::Struct& oStruct, int iPacket, int iSubpacket);
+	int LookupDecoderTransformation(const char* sName);
+
+	typedef std::vector<const char*> TCharPtrVector;
+
+	//! \brief Transformations used by the native decoder, by index
+	TCharPtrVector m_DecoderTransformations;
+
+	//! \brief Annotation used by the native decoder, see NativeDecoder::AnnotationEntry
+	struct DecoderAnnotation {
+		const char* m_Name;
+		const char* m_Type;
+		int m_Packet;
+		int m_Subpacket;
+		int m_Action;
+	};
+
+	//! \brief Annotations used by the native decoder, by index
+	std::vector<DecoderAnnotation> m_DecoderAnnotations;
 };
 
 #endif /* __PROTOCOLCODEGENERATOR_H__ */
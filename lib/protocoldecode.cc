@@ -15,14 +15,17 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "protocoldefinition.h"
+#include "littleendian.h"
+#include <algorithm>
 #include <stdio.h>
 #include <string.h>
 
 bool
 ProtocolDefinition::Field::Process(DecodeState& oState)
 {
-	m_DataOffset = oState.m_DataOffset;
-	int r = m_Type->Fill(oState);
+	Value& oValue = oState.m_CurrentValues[m_Index];
+	oValue.m_DataOffset = oState.m_DataOffset;
+	int r = m_Type->Fill(oState, oValue);
 	if (r <= 0)
 		return false;
 	oState.m_Data += r;
@@ -50,24 +53,134 @@ ProtocolDefinition::Struct::GetConstantSize() const
 	return iSize * m_Count;
 }
 
+int
+ProtocolDefinition::Struct::Fill(const DecodeState& oState, Value& oValue) const
+{
+	// Only used for structs outside of a plan; process the actions one by one
+	DecodeState oCurrent(oState);
+	oCurrent.m_CurrentStruct = this;
+	oCurrent.m_CurrentValues = static_cast<Value*>(oValue.m_Data);
+	for (auto it = m_Actions.begin(); it != m_Actions.end(); it++)
+		if (!(*it)->Process(oCurrent))
+			break;
+	return oState.m_DataLeft - oCurrent.m_DataLeft;
+}
+
 int
 ProtocolDefinition::Struct::Fill(const DecodeState& oState)
 {
+	if (m_Plan.empty() && !Compile())
+		return 0;
+	if (m_Values.empty())
+		AllocateValues();
+
+	// Fields which aren't reached must not show what an earlier decode left
+	if (!oState.m_Probe) {
+		memset(&m_ValueData[0], 0, m_ValueData.size() * sizeof(uint64_t));
+		for (auto it = m_Values.begin(); it != m_Values.end(); it++) {
+			it->m_DataOffset = 0;
+			it->m_Num = 0;
+		}
+	}
 
-	DecodeState oSubState(oState);
-	oSubState.m_CurrentStruct = this;
+	Value* pValues = &m_Values[0];
+	DecodeState oCurrent(oState);
+	oCurrent.m_CurrentStruct = this;
+	oCurrent.m_CurrentValues = pValues;
+	oCurrent.m_Owner = this;
+
+	int iProcessed;
+	if (oState.m_NativeDecoder != NULL && oState.m_NativeDecoder->Fill(*this, oCurrent, iProcessed))
+		return iProcessed;
+
+	// State of the enclosing structs; restored once the nested struct is done
+	DecodeState oStack[s_MaxPlanDepth];
+	int iDepth = 0;
+
+	const DecodeInstruction* pPlan = &m_Plan[0];
+	int iPC = 0;
+	while (true) {
+		const DecodeInstruction& oInsn = pPlan[iPC];
+		int r;
+		switch(oInsn.m_Opcode) {
+			case DecodeInstruction::I_Unsigned:
+				r = oInsn.m_Unsigned->unsignedType::Fill(oCurrent, pValues[oInsn.m_Slot]);
+				break;
+			case DecodeInstruction::I_String:
+				r = oInsn.m_String->stringType::Fill(oCurrent, pValues[oInsn.m_Slot]);
+				break;
+			case DecodeInstruction::I_Float:
+				r = oInsn.m_Float->floatType::Fill(oCurrent, pValues[oInsn.m_Slot]);
+				break;
+			case DecodeInstruction::I_Double:
+				r = oInsn.m_Double->doubleType::Fill(oCurrent, pValues[oInsn.m_Slot]);
+				break;
+			case DecodeInstruction::I_Length:
+				r = oInsn.m_Length->lengthType::Fill(oCurrent, pValues[oInsn.m_Slot]);
+				break;
+			case DecodeInstruction::I_UnixTime:
+				r = oInsn.m_UnixTime->unixtimeType::Fill(oCurrent, pValues[oInsn.m_Slot]);
+				break;
+			case DecodeInstruction::I_Field:
+				r = oInsn.m_Type->Fill(oCurrent, pValues[oInsn.m_Slot]);
+				break;
+			case DecodeInstruction::I_EnterStruct:
+				pValues[oInsn.m_Slot].m_DataOffset = oCurrent.m_DataOffset;
+				oStack[iDepth++] = oCurrent;
+				oCurrent.m_CurrentStruct = static_cast<const Struct*>(oInsn.m_Type);
+				oCurrent.m_CurrentValues = pValues + oInsn.m_MemberSlot;
+				iPC++;
+				continue;
+			case DecodeInstruction::I_LeaveStruct: {
+				// The struct-typed field consumed whatever its members did
+				const DecodeState& oParent = oStack[--iDepth];
+				r = oParent.m_DataLeft - oCurrent.m_DataLeft;
+				oCurrent = oParent;
+				if (r <= 0) {
+					iPC = oInsn.m_FailTarget;
+					continue;
+				}
+				oCurrent.m_Data += r;
+				oCurrent.m_DataLeft -= r;
+				oCurrent.m_DataOffset += r;
+				iPC++;
+				continue;
+			}
+			case DecodeInstruction::I_Transform:
+				if (!oInsn.m_Transformation->TransformationAction::Process(oCurrent))
+					iPC = oInsn.m_FailTarget;
+				else
+					iPC++;
+				continue;
+			case DecodeInstruction::I_Annotate:
+				oInsn.m_Annotation->AnnotationAction::Process(oCurrent);
+				iPC++;
+				continue;
+			case DecodeInstruction::I_End:
+				return oState.m_DataLeft - oCurrent.m_DataLeft;
+		}
 
-	for (auto it = m_Actions.begin(); it != m_Actions.end(); it++) {
-		XAction* pAction = *it;
-		if (!pAction->Process(oSubState))
-			break;
-		//printf("ProtocolDefinition::Struct::Fill(): field='%s' offset=0x%x -> %d\n", oField.GetName(), iTotalFilled, iFieldFilled);
+		// Field was read; advance past it
+		pValues[oInsn.m_Slot].m_DataOffset = oCurrent.m_DataOffset;
+		if (r <= 0) {
+			iPC = oInsn.m_FailTarget;
+			continue;
+		}
+		oCurrent.m_Data += r;
+		oCurrent.m_DataLeft -= r;
+		oCurrent.m_DataOffset += r;
+		iPC++;
 	}
-	return oState.m_DataLeft - oSubState.m_DataLeft;
 }
 
 int
 ProtocolDefinition::Packet::Fill(const DecodeState& oState)
+{
+	return Fill(oState, -1);
+}
+
+int
+ProtocolDefinition::Packet::Fill(const DecodeState& oState, int iSubpacket)
 {
 	DecodeState oSubState(oState);
 
@@ -82,7 +195,10 @@ ProtocolDefinition::Packet::Fill(const DecodeState& oState)
 
 	// Try all subpackets
 	oSubState.m_DataLeft -= m_NumPacketBytes;
-	for (auto it = m_Subpackets.begin(); it != m_Subpackets.end(); it++) {
+	int iIndex = 0;
+	for (auto it = m_Subpackets.begin(); it != m_Subpackets.end(); it++, iIndex++) {
+		if (iSubpacket >= 0 && iIndex != iSubpacket)
+			continue;
 		Subpacket& oSP = **it;
 		DecodeState oSubPacketState(oSubState);
 		oSubPacketState.m_Data += m_NumPacketBytes;
@@ -107,7 +223,7 @@ ProtocolDefinition::unsignedType::GetConstantSize() const
 }
 
 int
-ProtocolDefinition::unsignedType::Fill(const DecodeState& oState)
+ProtocolDefinition::unsignedType::Fill(const DecodeState& oState, Value& oValue) const
 {
 	if (m_Width * m_MinCount > oState.m_DataLeft)
 		return 0; // too little data
@@ -117,20 +233,44 @@ ProtocolDefinition::unsignedType::Fill(const DecodeState& oState)
 	if (num > m_Count)
 		num = m_Count;
 
+	if (oState.m_Probe) {
+		// Only a fixed value can make us mismatch, and only if it is there
+		if (m_HaveFixedValue && num > 0) {
+			uint32_t iValue;
+			switch(m_Width) {
+				case 1:
+					iValue = oState.m_Data[0];
+					break;
+				case 2:
+					iValue = LittleEndian::Read16(oState.m_Data);
+					break;
+				default:
+					iValue = LittleEndian::Read32(oState.m_Data);
+					break;
+			}
+			if (iValue != m_FixedValue)
+				return -1;
+		}
+		return m_Width * num;
+	}
+
 	// Fetch the values
-	const uint8_t* pData = oState.m_Data;
-	for (int n = 0; n < num; n++) {
-		m_Value[n] = *pData++;
-		if (m_Width > 1)
-			m_Value[n] |= *pData++ << 8;
-		if (m_Width > 2)
-			m_Value[n] |= *pData++ << 16;
-		if (m_Width > 3)
-			m_Value[n] |= *pData++ << 24;
+	uint32_t* pValue = static_cast<uint32_t*>(oValue.m_Data);
+	switch(m_Width) {
+		case 1:
+			LittleEndian::Read8Array(oState.m_Data, pValue, num);
+			break;
+		case 2:
+			LittleEndian::Read16Array(oState.m_Data, pValue, num);
+			break;
+		default:
+			LittleEndian::Read32Array(oState.m_Data, pValue, num);
+			break;
 	}
+	oValue.m_Num = num;
 
 	// If we need to correspond with a fixed value, check it
-	if (m_HaveFixedValue && m_Value[0] != m_FixedValue)
+	if (m_HaveFixedValue && num > 0 && pValue[0] != m_FixedValue)
 		return -1;
 
 	// Value read
@@ -147,7 +287,7 @@ ProtocolDefinition::stringType::GetConstantSize() const
 }
 
 int
-ProtocolDefinition::stringType::Fill(const DecodeState& oState)
+ProtocolDefinition::stringType::Fill(const DecodeState& oState, Value& oValue) const
 {
 	if (oState.m_DataLeft < m_MinLength)
 		return 0; // not enough data
@@ -155,8 +295,11 @@ ProtocolDefinition::stringType::Fill(const DecodeState& oState)
 	int iLength = m_Length;
 	if (iLength > oState.m_DataLeft)
 		iLength = oState.m_DataLeft; 
+	if (oState.m_Probe)
+		return iLength;
 
-	memcpy(&m_Data[0], oState.m_Data, iLength);
+	memcpy(oValue.m_Data, oState.m_Data, iLength);
+	oValue.m_Num = iLength;
 	return iLength;
 }
 
@@ -167,19 +310,16 @@ ProtocolDefinition::floatType::GetConstantSize() const
 }
 
 int
-ProtocolDefinition::floatType::Fill(const DecodeState& oState)
+ProtocolDefinition::floatType::Fill(const DecodeState& oState, Value& oValue) const
 {
+	float* pNumber = static_cast<float*>(oValue.m_Data);
 	if (oState.m_DataLeft < m_Count * sizeof(float))
 		return 0;
+	if (oState.m_Probe)
+		return m_Count * sizeof(float);
 
-	const uint8_t* pData = oState.m_Data;
-	for (int n = 0; n < m_Count; n++) {
-		uint32_t v = *pData++;
-		v |= *pData++ << 8;
-		v |= *pData++ << 16;
-		v |= *pData++ << 24;
-		m_Number[n] = *(float*)&v;
-	}
+	LittleEndian::ReadFloatArray(oState.m_Data, pNumber, m_Count);
+	oValue.m_Num = m_Count;
 	return m_Count * sizeof(float);
 }
 
@@ -190,23 +330,16 @@ ProtocolDefinition::doubleType::GetConstantSize() const
 }
 
 int
-ProtocolDefinition::doubleType::Fill(const DecodeState& oState)
+ProtocolDefinition::doubleType::Fill(const DecodeState& oState, Value& oValue) const
 {
+	double* pNumber = static_cast<double*>(oValue.m_Data);
 	if (oState.m_DataLeft < m_Count * sizeof(double))
 		return 0;
+	if (oState.m_Probe)
+		return m_Count * sizeof(double);
 
-	const uint8_t* pData = oState.m_Data;
-	for (int n = 0; n < m_Count; n++) {
-		uint64_t v = (uint64_t)*pData++;
-		v |= (uint64_t)*pData++ << 8;
-		v |= (uint64_t)*pData++ << 16;
-		v |= (uint64_t)*pData++ << 24;
-		v |= (uint64_t)*pData++ << 32;
-		v |= (uint64_t)*pData++ << 40;
-		v |= (uint64_t)*pData++ << 48;
-		v |= (uint64_t)*pData++ << 56;
-		m_Number[n] = *(double*)&v;
-	}
+	LittleEndian::ReadDoubleArray(oState.m_Data, pNumber, m_Count);
+	oValue.m_Num = m_Count;
 	return m_Count * sizeof(double);
 }
 
@@ -217,22 +350,20 @@ ProtocolDefinition::lengthType::GetConstantSize() const
 }
 
 int
-ProtocolDefinition::lengthType::Fill(const DecodeState& oState)
+ProtocolDefinition::lengthType::Fill(const DecodeState& oState, Value& oValue) const
 {
 	if (oState.m_DataLeft < sizeof(uint32_t))
 		return 0;
 
 	// Read the u32 of data
-	const uint8_t* pData = oState.m_Data;
-	m_Value = *pData++;
-	m_Value |= *pData++ << 8;
-	m_Value |= *pData++ << 16;
-	m_Value |= *pData++ << 24;
+	uint32_t iValue = LittleEndian::Read32(oState.m_Data);
 
 	// Add our own length
-	m_Value += sizeof(uint32_t);
-	if (m_Value != oState.m_DataLeft) {
-		printf("ProtocolDefinition::lengthType::Fill(): rejecting, got %u, left %u\n", m_Value, oState.m_DataLeft);
+	iValue += sizeof(uint32_t);
+	*static_cast<uint32_t*>(oValue.m_Data) = iValue;
+	oValue.m_Num = 1;
+	if (iValue != oState.m_DataLeft) {
+		fprintf(stderr, "ProtocolDefinition::lengthType::Fill(): rejecting, got %u, left %u\n", iValue, oState.m_DataLeft);
 		return 0;
 	}
 	return sizeof(uint32_t);
@@ -245,27 +376,44 @@ ProtocolDefinition::unixtimeType::GetConstantSize() const
 }
 
 int
-ProtocolDefinition::unixtimeType::Fill(const DecodeState& oState)
+ProtocolDefinition::unixtimeType::Fill(const DecodeState& oState, Value& oValue) const
 {
 	if (oState.m_DataLeft < sizeof(uint32_t))
 		return 0;
+	if (oState.m_Probe)
+		return sizeof(uint32_t);
 
 	// Read the u32 of data
-	const uint8_t* pData = oState.m_Data;
-	m_Value = *pData++;
-	m_Value |= *pData++ << 8;
-	m_Value |= *pData++ << 16;
-	m_Value |= *pData++ << 24;
+	uint32_t iValue = LittleEndian::Read32(oState.m_Data);
+	*static_cast<uint32_t*>(oValue.m_Data) = iValue;
+	oValue.m_Num = 1;
 	return sizeof(uint32_t);
 }
 
-ProtocolDefinition::Packet*
-ProtocolDefinition::Process(const uint8_t* pData, int iLength)
+void
+ProtocolDefinition::InitializeState(DecodeState& oState, const uint8_t* pData, int iLength, bool bProbe)
 {
-	DecodeState oState;
 	oState.m_Data = pData;
 	oState.m_DataLeft = iLength;
+	oState.m_DataOffset = 0;
+	oState.m_CurrentStruct = NULL;
+	oState.m_CurrentValues = NULL;
+	oState.m_Owner = NULL;
+	oState.m_Arena = &m_Arena;
+	oState.m_NativeDecoder = bProbe ? NULL : m_NativeDecoder;
+	oState.m_Probe = bProbe;
+	oState.m_DeferredAnnotations = m_DeferAnnotations ? &m_DeferredAnnotations : NULL;
+	m_DeferredAnnotations.clear();
+}
 
+ProtocolDefinition::Packet*
+ProtocolDefinition::Process(const uint8_t* pData, int iLength)
+{
+	m_Arena.Reset();
+	m_Pending = NULL;
+
+	DecodeState oState;
+	InitializeState(oState, pData, iLength, false);
 	for (auto it = m_Packet.begin(); it != m_Packet.end(); it++) {
 		Packet* pPacket = *it;
 		int iProcessed = pPacket->Fill(oState);
@@ -275,4 +423,206 @@ ProtocolDefinition::Process(const uint8_t* pData, int iLength)
 	return NULL;
 }
 
+ProtocolDefinition::Packet*
+ProtocolDefinition::Process(const uint8_t* pData, int iLength, int iPacket, int iSubpacket)
+{
+	m_Arena.Reset();
+	m_Pending = NULL;
+
+	DecodeState oState;
+	InitializeState(oState, pData, iLength, false);
+
+	int iIndex = 0;
+	for (auto it = m_Packet.begin(); it != m_Packet.end(); it++, iIndex++) {
+		if (iIndex != iPacket)
+			continue;
+		Packet* pPacket = *it;
+		if (pPacket->Fill(oState, iSubpacket) != iLength)
+			return NULL;
+		return pPacket;
+	}
+	return NULL;
+}
+
+ProtocolDefinition::Packet*
+ProtocolDefinition::Classify(const uint8_t* pData, int iLength)
+{
+	m_Arena.Reset();
+	m_Pending = NULL;
+
+	DecodeState oState;
+	InitializeState(oState, pData, iLength, true);
+	for (auto it = m_Packet.begin(); it != m_Packet.end(); it++) {
+		Packet* pPacket = *it;
+		if (pPacket->Fill(oState) != iLength)
+			continue;
+
+		// Remember the subpacket by index, so Materialize() need not try them all
+		int iSubpacket = -1;
+		if (pPacket->m_LastSubpacket != NULL) {
+			iSubpacket = 0;
+			for (auto it2 = pPacket->m_Subpackets.begin(); *it2 != pPacket->m_LastSubpacket; it2++)
+				iSubpacket++;
+		}
+		m_Pending = pPacket;
+		m_PendingData = pData;
+		m_PendingLength = iLength;
+		m_PendingSubpacket = iSubpacket;
+		if (pPacket->HasAnnotations() || (pPacket->m_LastSubpacket != NULL && pPacket->m_LastSubpacket->HasAnnotations()))
+			return Materialize() ? pPacket : NULL;
+		return pPacket;
+	}
+	return NULL;
+}
+
+ProtocolDefinition::Packet*
+ProtocolDefinition::Classify(const uint8_t* pData, int iLength, int iPacket, int iSubpacket)
+{
+	m_Arena.Reset();
+	m_Pending = NULL;
+	m_DeferredAnnotations.clear();
+
+	int iIndex = 0;
+	for (auto it = m_Packet.begin(); it != m_Packet.end(); it++, iIndex++) {
+		if (iIndex != iPacket)
+			continue;
+		Packet* pPacket = *it;
+		if (pPacket->m_Plan.empty() && !pPacket->Compile())
+			return NULL;
+
+		Subpacket* pSubpacket = NULL;
+		if (iSubpacket >= 0) {
+			int iSubIndex = 0;
+			for (auto it2 = pPacket->m_Subpackets.begin(); it2 != pPacket->m_Subpackets.end(); it2++, iSubIndex++)
+				if (iSubIndex == iSubpacket)
+					pSubpacket = *it2;
+			if (pSubpacket == NULL)
+				return NULL;
+		}
+		pPacket->m_LastSubpacket = pSubpacket;
+		m_Pending = pPacket;
+		m_PendingData = pData;
+		m_PendingLength = iLength;
+		m_PendingSubpacket = iSubpacket;
+		if (pPacket->HasAnnotations() || (pSubpacket != NULL && pSubpacket->HasAnnotations()))
+			return Materialize() ? pPacket : NULL;
+		return pPacket;
+	}
+	return NULL;
+}
+
+bool
+ProtocolDefinition::Materialize()
+{
+	if (m_Pending == NULL)
+		return true; // nothing left to do
+
+	// Transformations are done again, so start with a fresh arena
+	m_Arena.Reset();
+
+	// If this fails, the packet stays pending so we keep reporting failure
+	DecodeState oState;
+	InitializeState(oState, m_PendingData, m_PendingLength, false);
+	if (m_Pending->Fill(oState, m_PendingSubpacket) != m_PendingLength)
+		return false;
+	m_Pending = NULL;
+	return true;
+}
+
+void
+ProtocolDefinition::ApplyDeferredAnnotations()
+{
+	for (auto it = m_DeferredAnnotations.begin(); it != m_DeferredAnnotations.end(); it++)
+		it->m_Action->Apply(it->m_Values);
+	m_DeferredAnnotations.clear();
+}
+
+void
+ProtocolDefinition::Struct::CopyValues(std::vector<Value>& oValues, std::vector<uint64_t>& oValueData) const
+{
+	oValues = m_Values;
+	oValueData = m_ValueData;
+
+	// Values refer to their storage or, for struct-typed fields, to the members
+	const uint64_t* pDataBegin = m_ValueData.data();
+	const uint64_t* pDataEnd = pDataBegin + m_ValueData.size();
+	const Value* pValuesBegin = m_Values.data();
+	const Value* pValuesEnd = pValuesBegin + m_Values.size();
+	for (auto it = oValues.begin(); it != oValues.end(); it++) {
+		if (it->m_Data >= pDataBegin && it->m_Data < pDataEnd)
+			it->m_Data = reinterpret_cast<uint8_t*>(oValueData.data()) + (static_cast<uint8_t*>(it->m_Data) - reinterpret_cast<const uint8_t*>(pDataBegin));
+		else if (it->m_Data >= pValuesBegin && it->m_Data < pValuesEnd)
+			it->m_Data = oValues.data() + (static_cast<const Value*>(it->m_Data) - pValuesBegin);
+	}
+}
+
+ProtocolDefinition::DetachedPacket::DetachedPacket()
+	: m_Packet(NULL), m_Subpacket(NULL), m_NumCopies(0)
+{
+}
+
+const ProtocolDefinition::DetachedPacket::Copy*
+ProtocolDefinition::DetachedPacket::Find(const Struct* pStruct) const
+{
+	for (unsigned int n = 0; n < m_NumCopies; n++)
+		if (m_Copies[n].m_Struct == pStruct)
+			return &m_Copies[n];
+	return NULL;
+}
+
+void
+ProtocolDefinition::DetachedPacket::ApplyAnnotations()
+{
+	for (auto it = m_Annotations.begin(); it != m_Annotations.end(); it++)
+		it->m_Action->Apply(it->m_Values);
+	m_Annotations.clear();
+}
+
+void
+ProtocolDefinition::Detach(const Packet* pPacket, DetachedPacket& oCopy)
+{
+	oCopy.m_Packet = pPacket;
+	oCopy.m_Subpacket = pPacket != NULL ? pPacket->GetSubpacket() : NULL;
+	oCopy.m_NumCopies = 0;
+
+	// Copy the packet, its subpacket and whatever the annotations refer to
+	const Struct* pStructs[2] = { oCopy.m_Packet, oCopy.m_Subpacket };
+	std::vector<const Struct*> oStructs;
+	for (int n = 0; n < 2; n++)
+		if (pStructs[n] != NULL)
+			oStructs.push_back(pStructs[n]);
+	for (auto it = m_DeferredAnnotations.begin(); it != m_DeferredAnnotations.end(); it++)
+		if (it->m_Owner != NULL && std::find(oStructs.begin(), oStructs.end(), it->m_Owner) == oStructs.end())
+			oStructs.push_back(it->m_Owner);
+	if (oCopy.m_Copies.size() < oStructs.size())
+		oCopy.m_Copies.resize(oStructs.size());
+	for (auto it = oStructs.begin(); it != oStructs.end(); it++) {
+		DetachedPacket::Copy& oStructCopy = oCopy.m_Copies[oCopy.m_NumCopies++];
+		oStructCopy.m_Struct = *it;
+
+		// Storage is reused, but not if it would hold on to a much larger packet
+		if (oStructCopy.m_ValueData.capacity() > 2 * (*it)->m_ValueData.size()) {
+			std::vector<Value>().swap(oStructCopy.m_Values);
+			std::vector<uint64_t>().swap(oStructCopy.m_ValueData);
+		}
+		(*it)->CopyValues(oStructCopy.m_Values, oStructCopy.m_ValueData);
+	}
+	for (unsigned int n = oCopy.m_NumCopies; n < oCopy.m_Copies.size(); n++) {
+		std::vector<Value>().swap(oCopy.m_Copies[n].m_Values);
+		std::vector<uint64_t>().swap(oCopy.m_Copies[n].m_ValueData);
+	}
+
+	// Annotations are applied to the copies
+	oCopy.m_Annotations.clear();
+	for (auto it = m_DeferredAnnotations.begin(); it != m_DeferredAnnotations.end(); it++) {
+		const DetachedPacket::Copy* pStructCopy = oCopy.Find(it->m_Owner);
+		if (pStructCopy == NULL)
+			continue;
+		DeferredAnnotation oAnnotation(*it);
+		oAnnotation.m_Values = pStructCopy->m_Values.data() + (it->m_Values - it->m_Owner->GetValues());
+		oCopy.m_Annotations.push_back(oAnnotation);
+	}
+	m_DeferredAnnotations.clear();
+}
+
 /* vim:set ts=2 sw=2: */
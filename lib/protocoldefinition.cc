@@ -19,10 +19,16 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h> // for free()
+#include <fcntl.h>
+#include <limits.h> // for PATH_MAX
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "dataannotation.h"
 #include "datatransformation.h"
 
 bool ProtocolDefinition::s_MustPrintDataOffset = false;
+bool ProtocolDefinition::s_UseSchemaCache = true;
 
 ProtocolDefinition::Definition::Definition(const char* sName, const char* sValue)
 {
@@ -36,7 +42,8 @@ ProtocolDefinition::Definition::~Definition()
 	free(m_Name);
 }
 
-ProtocolDefinition::Transformation::Transformation(const char* sName, XDataTransformation& oTransformation)
+ProtocolDefinition::Transformation::Transformation(const char* sName, XDataTransformation& oTransformation, bool bOwner)
+	: m_Owner(bOwner)
 {
 	m_Name = strdup(sName);
 	m_TransformationProvider = &oTransformation;
@@ -44,11 +51,13 @@ ProtocolDefinition::Transformation::Transformation(const char* sName, XDataTrans
 
 ProtocolDefinition::Transformation::~Transformation()
 {
-	delete m_TransformationProvider;
+	if (m_Owner)
+		delete m_TransformationProvider;
 	free(m_Name);
 }
 
-ProtocolDefinition::Annotation::Annotation(const char* sName, XDataAnnotation& oAnnotation)
+ProtocolDefinition::Annotation::Annotation(const char* sName, XDataAnnotation& oAnnotation, bool bOwner)
+	: m_Owner(bOwner)
 {
 	m_Name = strdup(sName);
 	m_AnnotationProvider = &oAnnotation;
@@ -56,7 +65,8 @@ ProtocolDefinition::Annotation::Annotation(const char* sName, XDataAnnotation& o
 
 ProtocolDefinition::Annotation::~Annotation()
 {
-	delete m_AnnotationProvider;
+	if (m_Owner)
+		delete m_AnnotationProvider;
 	free(m_Name);
 }
 
@@ -103,10 +113,27 @@ ProtocolDefinition::Type::~Type()
 	free(m_Name);
 }
 
+const ProtocolDefinition::Type*
+ProtocolDefinition::Type::Refine(xmlNodePtr pNode, bool& bOK) const
+{
+	// Fields which only name their type can share it
+	bool bRefined = pNode->children != NULL;
+	for (xmlAttrPtr pAttr = pNode->properties; !bRefined && pAttr != NULL; pAttr = pAttr->next)
+		bRefined = xmlStrcmp(pAttr->name, (const xmlChar*)"name") != 0 && xmlStrcmp(pAttr->name, (const xmlChar*)"type") != 0;
+	if (!bRefined) {
+		bOK = true;
+		return this;
+	}
+
+	Type* pType = Clone();
+	bOK = pType->ParseNode(pNode);
+	return pType;
+}
+
 ProtocolDefinition::Field::Field(const Type& oType, const char* sName)
+	: m_Type(&oType), m_Index(-1)
 {
 	m_Name = strdup(sName);
-	m_Type = oType.Clone();
 }
 
 ProtocolDefinition::XAction*
@@ -117,18 +144,12 @@ ProtocolDefinition::Field::Clone() const
 
 ProtocolDefinition::Field::~Field()
 {
-	delete m_Type;
 	free(m_Name);
 }
 
 ProtocolDefinition::TransformationAction::TransformationAction(Transformation& oTransformation)
-	: m_Transformation(oTransformation), m_Buffer(NULL)
-{
-}
-
-ProtocolDefinition::TransformationAction::~TransformationAction()
+	: m_Transformation(oTransformation)
 {
-	delete[] m_Buffer;
 }
 
 ProtocolDefinition::XAction*
@@ -142,29 +163,38 @@ ProtocolDefinition::TransformationAction::Process(DecodeState& oState)
 {
 	XDataTransformation& oTransformation = m_Transformation.GetProvider();
 
-	// Throw away any buffer we had
-	delete[] m_Buffer;
-	m_Buffer = NULL;
-
 	// First of all, see if we can figure out the buffer size to use; if this
 	// fails, we can't do anything at all
 	int iBufferSize = oTransformation.EstimateBufferSize(oState.m_Data, oState.m_DataLeft);
-	if (iBufferSize <= 0)
+	if (iBufferSize < 0)
 		return false;
 
-	m_Buffer = new uint8_t[iBufferSize];
-	if (!oTransformation.Apply(oState.m_Data, oState.m_DataLeft, m_Buffer, iBufferSize))
+	// When classifying, whatever follows is taken to match; it is only
+	// transformed once the packet is materialized, which may still fail
+	if (oState.m_Probe) {
+		oState.m_DataLeft = 0;
+		return true;
+	}
+
+	// The buffer lives until the next packet is processed
+	uint8_t* pBuffer = oState.m_Arena->Allocate(iBufferSize);
+	if (!oTransformation.Apply(oState.m_Data, oState.m_DataLeft, pBuffer, iBufferSize))
 		return false;
 
-	oState.m_Data = m_Buffer;
+	oState.m_Data = pBuffer;
 	oState.m_DataOffset = 0; // Reset offset
 	oState.m_DataLeft = iBufferSize;
 	return true;
 }
 
 ProtocolDefinition::AnnotationAction::AnnotationAction(Annotation& oAnnotation)
-	: m_Annotation(oAnnotation)
+	: m_Annotation(oAnnotation), m_Bound(false), m_Usable(false), m_Binding(NULL)
+{
+}
+
+ProtocolDefinition::AnnotationAction::~AnnotationAction()
 {
+	delete m_Binding;
 }
 
 ProtocolDefinition::XAction*
@@ -173,17 +203,43 @@ ProtocolDefinition::AnnotationAction::Clone() const
 	return new AnnotationAction(m_Annotation);
 }
 
+void
+ProtocolDefinition::AnnotationAction::Bind(const Struct& oStruct)
+{
+	if (m_Bound)
+		return;
+	m_Bound = true;
+	m_Usable = m_Annotation.GetProvider().Bind(oStruct, m_Binding);
+}
+
 bool
 ProtocolDefinition::AnnotationAction::Process(DecodeState& oState)
 {
-	XDataAnnotation& oAnnotation = m_Annotation.GetProvider();
-
-	oAnnotation.Apply(oState.m_CurrentStruct);
+	if (oState.m_Probe)
+		return true; // values aren't there yet
+	if (!m_Bound)
+		Bind(*oState.m_CurrentStruct);
+	if (oState.m_DeferredAnnotations != NULL) {
+		DeferredAnnotation oDeferred;
+		oDeferred.m_Action = this;
+		oDeferred.m_Values = oState.m_CurrentValues;
+		oDeferred.m_Owner = oState.m_Owner;
+		oState.m_DeferredAnnotations->push_back(oDeferred);
+		return true;
+	}
+	Apply(oState.m_CurrentValues);
 	return true;
 }
 
+void
+ProtocolDefinition::AnnotationAction::Apply(const Value* pValues)
+{
+	if (m_Usable)
+		m_Annotation.GetProvider().Apply(m_Binding, pValues);
+}
+
 ProtocolDefinition::Struct::Struct(ProtocolDefinition& oProtocolDefinition, const char* sName)
-	: Type(oProtocolDefinition, sName), m_Count(1), m_MinCount(1)
+	: Type(oProtocolDefinition, sName), m_NumSlots(0), m_HasAnnotations(false), m_NumFields(0), m_Count(1), m_MinCount(1)
 {
 }
 
@@ -196,9 +252,22 @@ ProtocolDefinition::Struct::~Struct()
 void
 ProtocolDefinition::Struct::AddAction(XAction* pAction)
 {
+	if (Field* pField = dynamic_cast<Field*>(pAction))
+		pField->m_Index = m_NumFields++;
 	m_Actions.push_back(pAction);
 }
 
+const ProtocolDefinition::Field*
+ProtocolDefinition::Struct::FindField(const char* sName) const
+{
+	for (auto it = m_Actions.begin(); it != m_Actions.end(); it++) {
+		const Field* pField = dynamic_cast<const Field*>(*it);
+		if (pField != NULL && strcmp(pField->GetName(), sName) == 0)
+			return pField;
+	}
+	return NULL;
+}
+
 ProtocolDefinition::Type*
 ProtocolDefinition::Struct::Clone() const
 {
@@ -210,6 +279,146 @@ ProtocolDefinition::Struct::Clone() const
 	return pStruct;
 }
 
+int
+ProtocolDefinition::Struct::GetValueSize() const
+{
+	// Members have values of their own
+	return 0;
+}
+
+ProtocolDefinition::DecodeInstruction::DecodeInstruction(Opcode eOpcode, const Field* pField)
+	: m_Opcode(eOpcode), m_FailTarget(-1), m_Slot(-1), m_MemberSlot(-1), m_Field(pField), m_Type(NULL)
+{
+}
+
+bool
+ProtocolDefinition::Struct::CompileActions(TDecodeInstructionVector& oPlan, int iDepth, int iSlot, int& iNumSlots) const
+{
+	for (auto it = m_Actions.begin(); it != m_Actions.end(); it++) {
+		if (TransformationAction* pTransformationAction = dynamic_cast<TransformationAction*>(*it)) {
+			DecodeInstruction oInsn(DecodeInstruction::I_Transform, NULL);
+			oInsn.m_Transformation = pTransformationAction;
+			oPlan.push_back(oInsn);
+			continue;
+		}
+		if (AnnotationAction* pAnnotationAction = dynamic_cast<AnnotationAction*>(*it)) {
+			// An annotation which cannot be bound does nothing, so it needn't be in the plan
+			pAnnotationAction->Bind(*this);
+			if (!pAnnotationAction->IsUsable())
+				continue;
+			DecodeInstruction oInsn(DecodeInstruction::I_Annotate, NULL);
+			oInsn.m_Annotation = pAnnotationAction;
+			oPlan.push_back(oInsn);
+			continue;
+		}
+		Field* pField = dynamic_cast<Field*>(*it);
+		if (pField == NULL) {
+			fprintf(stderr, "ProtocolDefinition::Struct::CompileActions(): struct '%s' has an unknown action\n", m_Name);
+			return false;
+		}
+
+		const Type* pType = &pField->GetType();
+		if (const Struct* pStruct = dynamic_cast<const Struct*>(pType)) {
+			if (iDepth + 1 >= s_MaxPlanDepth) {
+				fprintf(stderr, "ProtocolDefinition::Struct::CompileActions(): struct '%s' is nested too deep\n", m_Name);
+				return false;
+			}
+
+			// The members get a block of values of their own
+			int iMemberSlot = iNumSlots;
+			iNumSlots += pStruct->GetNumFields();
+
+			int iEnter = oPlan.size();
+			oPlan.push_back(DecodeInstruction(DecodeInstruction::I_EnterStruct, pField));
+			oPlan.back().m_Type = pStruct;
+			oPlan.back().m_Slot = iSlot + pField->GetIndex();
+			oPlan.back().m_MemberSlot = iMemberSlot;
+			if (!pStruct->CompileActions(oPlan, iDepth + 1, iMemberSlot, iNumSlots))
+				return false;
+
+			// Any failure within the struct ends it
+			int iLeave = oPlan.size();
+			for (int n = iEnter + 1; n < iLeave; n++)
+				if (oPlan[n].m_FailTarget < 0)
+					oPlan[n].m_FailTarget = iLeave;
+			oPlan.push_back(DecodeInstruction(DecodeInstruction::I_LeaveStruct, pField));
+			continue;
+		}
+
+		// signedType only differs in display, so it can share I_Unsigned
+		DecodeInstruction oInsn(DecodeInstruction::I_Field, pField);
+		oInsn.m_Type = pType;
+		oInsn.m_Slot = iSlot + pField->GetIndex();
+		if (dynamic_cast<const unsignedType*>(pType) != NULL)
+			oInsn.m_Opcode = DecodeInstruction::I_Unsigned;
+		else if (dynamic_cast<const stringType*>(pType) != NULL)
+			oInsn.m_Opcode = DecodeInstruction::I_String;
+		else if (dynamic_cast<const floatType*>(pType) != NULL)
+			oInsn.m_Opcode = DecodeInstruction::I_Float;
+		else if (dynamic_cast<const doubleType*>(pType) != NULL)
+			oInsn.m_Opcode = DecodeInstruction::I_Double;
+		else if (dynamic_cast<const lengthType*>(pType) != NULL)
+			oInsn.m_Opcode = DecodeInstruction::I_Length;
+		else if (dynamic_cast<const unixtimeType*>(pType) != NULL)
+			oInsn.m_Opcode = DecodeInstruction::I_UnixTime;
+		oPlan.push_back(oInsn);
+	}
+	return true;
+}
+
+bool
+ProtocolDefinition::Struct::Compile()
+{
+	TDecodeInstructionVector oPlan;
+	int iNumSlots = m_NumFields;
+	if (!CompileActions(oPlan, 0, 0, iNumSlots))
+		return false;
+
+	// Failures at the top level end the plan
+	int iEnd = oPlan.size();
+	for (int n = 0; n < iEnd; n++)
+		if (oPlan[n].m_FailTarget < 0)
+			oPlan[n].m_FailTarget = iEnd;
+	oPlan.push_back(DecodeInstruction(DecodeInstruction::I_End, NULL));
+	m_Plan.swap(oPlan);
+	m_NumSlots = iNumSlots;
+	m_HasAnnotations = false;
+	for (auto it = m_Plan.begin(); it != m_Plan.end(); it++)
+		if (it->m_Opcode == DecodeInstruction::I_Annotate)
+			m_HasAnnotations = true;
+
+	// Values are allocated once the struct is actually used
+	m_Values.clear();
+	m_ValueData.clear();
+	return true;
+}
+
+void
+ProtocolDefinition::Struct::AllocateValues()
+{
+	// Figure out where every value's storage goes
+	std::vector<int> oOffset(m_NumSlots, -1);
+	int iNumWords = 0;
+	for (auto it = m_Plan.begin(); it != m_Plan.end(); it++) {
+		if (it->m_Slot < 0 || it->m_Opcode == DecodeInstruction::I_LeaveStruct || it->m_Opcode == DecodeInstruction::I_EnterStruct)
+			continue;
+		oOffset[it->m_Slot] = iNumWords;
+		iNumWords += (it->m_Type->GetValueSize() + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+	}
+
+	m_ValueData.assign(iNumWords > 0 ? iNumWords : 1, 0);
+	m_Values.resize(m_NumSlots > 0 ? m_NumSlots : 1);
+	for (int n = 0; n < (int)m_Values.size(); n++) {
+		Value& oValue = m_Values[n];
+		oValue.m_DataOffset = 0;
+		oValue.m_Num = 0;
+		oValue.m_Data = (n < m_NumSlots && oOffset[n] >= 0) ? &m_ValueData[oOffset[n]] : NULL;
+	}
+	for (auto it = m_Plan.begin(); it != m_Plan.end(); it++)
+		if (it->m_Opcode == DecodeInstruction::I_EnterStruct)
+			m_Values[it->m_Slot].m_Data = &m_Values[it->m_MemberSlot];
+}
+
 void
 ProtocolDefinition::Struct::GenerateCType(char* sType, char* sSuffix) const
 {
@@ -223,7 +432,7 @@ ProtocolDefinition::Struct::GenerateCInitialize(char* sCode, int iLength) const
 	int iCurrent = 0;
 	strcpy(sCode, "");
 	for (auto it = m_Actions.begin(); it != m_Actions.end(); it++) {
-		Field* pField = dynamic_cast<Field*>(*it);
+		const Field* pField = dynamic_cast<const Field*>(*it);
 		if (pField == NULL)
 			continue; // skips transformations!
 		pField->GetType().GenerateCInitialize(sCode + iCurrent, iLength - iCurrent);
@@ -295,10 +504,11 @@ ProtocolDefinition::Struct::ParseChildNode(xmlNodePtr pNode)
 		if (sType != NULL) {
 			const Type* poType = m_ProtocolDefinition.LookupType((const char*)sType);
 			if (poType != NULL) {
-				// Hook the type up to the struct
-				Field* pField = new Field(*poType, (const char*)sName);
-				AddAction(pField);
-				bOK = pField->GetType().ParseNode(pNode);
+				// Hook the type up to the struct, refining it if needed
+				const Type* pType = poType->Refine(pNode, bOK);
+				if (pType != poType)
+					m_ProtocolDefinition.m_FieldTypes.push_back(pType);
+				AddAction(new Field(*pType, (const char*)sName));
 			} else {
 				fprintf(stderr, "ProtocolDefinition::Struct::ParseChildNode(): type '%s' not recognized (name '%s')\n", sType, sName);
 			}
@@ -334,7 +544,7 @@ ProtocolDefinition::Struct::ParseNode(xmlNodePtr pNode)
 
 			char* ptr;
 			int version = (int)strtol((const char*)sVersion, &ptr, 10);
-			if (sVersion == '\0' || *ptr != '\0') {
+			if (*sVersion == '\0' || *ptr != '\0') {
 				fprintf(stderr, "ProtocolDefinition::Struct::ParseNode(): 'filter' node with version '%s' which cannot be parsed\n", sVersion);
 				return false;
 			}
@@ -411,6 +621,17 @@ ProtocolDefinition::Packet::ParseNode(xmlNodePtr pNode)
 	return true;
 }
 
+bool
+ProtocolDefinition::Packet::Compile()
+{
+	if (!Struct::Compile())
+		return false;
+	for (auto it = m_Subpackets.begin(); it != m_Subpackets.end(); it++)
+		if (!(*it)->Compile())
+			return false;
+	return true;
+}
+
 bool
 ProtocolDefinition::Packet::ParseExtraNode(xmlNodePtr pNode, const char* sName)
 {
@@ -426,28 +647,27 @@ ProtocolDefinition::unsignedType::unsignedType(ProtocolDefinition& oProtocolDefi
  : BuiltinType(oProtocolDefinition, sName), m_Width(iWidth), m_Enumeration(NULL), m_Annotation(NULL), m_HaveFixedValue(false), m_FixedValue(0), m_Count(1), m_MinCount(1), m_DisplayCount(-1),
    m_Format(F_HEX)
 {
-	assert(iWidth >= 1 && iWidth <= sizeof(m_Value));
-	m_Value = new uint32_t[m_Count];
-}
-
-ProtocolDefinition::unsignedType::~unsignedType()
-{
-	delete[] m_Value;
+	assert(iWidth >= 1 && iWidth <= sizeof(uint32_t));
 }
 
 uint32_t
-ProtocolDefinition::unsignedType::GetValue(int n) const
+ProtocolDefinition::unsignedType::GetValue(const Value& oValue, int n) const
 {
 	if (n < 0 || n >= m_Count)
 		return 0;
-	return m_Value[n];
+	return static_cast<const uint32_t*>(oValue.m_Data)[n];
+}
+
+int
+ProtocolDefinition::unsignedType::GetValueSize() const
+{
+	return m_Count * sizeof(uint32_t);
 }
 
 ProtocolDefinition::Type*
 ProtocolDefinition::unsignedType::Clone() const
 {
 	unsignedType* pType = new unsignedType(m_ProtocolDefinition, m_Name, m_Width);
-	pType->m_Value = new uint32_t[m_Count];
 	pType->m_Count = m_Count;
 	pType->m_DisplayCount = m_DisplayCount;
 	pType->m_MinCount = m_MinCount;
@@ -505,8 +725,6 @@ ProtocolDefinition::unsignedType::ParseNode(xmlNodePtr pNode)
 			if (m_Count == m_MinCount)
 				m_MinCount = iVal;
 			m_Count = iVal;
-			delete[] m_Value;
-			m_Value = new uint32_t[m_Count];
 		}
 		xmlFree(sCount);
 	}
@@ -575,7 +793,6 @@ ProtocolDefinition::signedType::Clone() const
 {
 	// XXX This is unfortunate; identical to unsignedType ...
 	signedType* pType = new signedType(m_ProtocolDefinition, m_Name, m_Width);
-	pType->m_Value = new uint32_t[m_Count];
 	pType->m_Count = m_Count;
 	pType->m_DisplayCount = m_DisplayCount;
 	pType->m_MinCount = m_MinCount;
@@ -588,25 +805,35 @@ ProtocolDefinition::signedType::Clone() const
 }
 
 ProtocolDefinition::stringType::stringType(ProtocolDefinition& oProtocolDefinition)
- : BuiltinType(oProtocolDefinition, "string"), m_Data(NULL)
-{
-}
-
-ProtocolDefinition::stringType::~stringType()
+ : BuiltinType(oProtocolDefinition, "string"), m_Length(0), m_MinLength(0)
 {
-	delete[] m_Data;
 }
 
 ProtocolDefinition::Type*
 ProtocolDefinition::stringType::Clone() const
 {
 	stringType* pType = new stringType(m_ProtocolDefinition);
-	pType->m_Data = new char[m_Length];
 	pType->m_MinLength = m_MinLength;
 	pType->m_Length = m_Length;
 	return pType;
 }
 
+const ProtocolDefinition::Type*
+ProtocolDefinition::stringType::Refine(xmlNodePtr pNode, bool& bOK) const
+{
+	// Every string field has a length of its own
+	Type* pType = Clone();
+	bOK = pType->ParseNode(pNode);
+	return pType;
+}
+
+int
+ProtocolDefinition::stringType::GetValueSize() const
+{
+	// Keep room for a terminating \0
+	return m_Length + 1;
+}
+
 void
 ProtocolDefinition::stringType::GenerateCType(char* sType, char* sSuffix) const
 {
@@ -631,7 +858,6 @@ ProtocolDefinition::stringType::ParseNode(xmlNodePtr pNode)
 		bOK = m_ProtocolDefinition.ResolveStringToNumber((const char*)sLength, iVal);
 		m_Length = iVal;
 		m_MinLength = iVal; // may be overwritten later
-		m_Data = new char[m_Length];
 		xmlFree(sLength);
 	} else {
 		fprintf(stderr, "ProtocolDefinition::stringType::ParseNode(): name '%s' without 'length', aborting\n", m_Name);
@@ -652,24 +878,23 @@ ProtocolDefinition::stringType::ParseNode(xmlNodePtr pNode)
 ProtocolDefinition::floatType::floatType(ProtocolDefinition& oProtocolDefinition)
  : BuiltinType(oProtocolDefinition, "float"), m_Count(1), m_DisplayCount(-1)
 {
-	m_Number = new float[m_Count];
-}
-
-ProtocolDefinition::floatType::~floatType()
-{
-	delete[] m_Number;
 }
 
 ProtocolDefinition::Type*
 ProtocolDefinition::floatType::Clone() const
 {
 	floatType* pType = new floatType(m_ProtocolDefinition);
-	pType->m_Number = new float[m_Count];
 	pType->m_Count = m_Count;
 	pType->m_DisplayCount = m_DisplayCount;
 	return pType;
 }
 
+int
+ProtocolDefinition::floatType::GetValueSize() const
+{
+	return m_Count * sizeof(float);
+}
+
 void
 ProtocolDefinition::floatType::GenerateCType(char* sType, char* sSuffix) const
 {
@@ -699,8 +924,6 @@ ProtocolDefinition::floatType::ParseNode(xmlNodePtr pNode)
 		bOK &= m_ProtocolDefinition.ResolveStringToNumber((const char*)sCount, iVal);
 		if (bOK) {
 			m_Count = iVal;
-			delete[] m_Number;
-			m_Number = new float[m_Count];
 		}
 		xmlFree(sCount);
 	}
@@ -718,24 +941,23 @@ ProtocolDefinition::floatType::ParseNode(xmlNodePtr pNode)
 ProtocolDefinition::doubleType::doubleType(ProtocolDefinition& oProtocolDefinition)
  : BuiltinType(oProtocolDefinition, "double"), m_Count(1), m_DisplayCount(-1)
 {
-	m_Number = new double[m_Count];
-}
-
-ProtocolDefinition::doubleType::~doubleType()
-{
-	delete[] m_Number;
 }
 
 ProtocolDefinition::Type*
 ProtocolDefinition::doubleType::Clone() const
 {
 	doubleType* pType = new doubleType(m_ProtocolDefinition);
-	pType->m_Number = new double[m_Count];
 	pType->m_Count = m_Count;
 	pType->m_DisplayCount = m_DisplayCount;
 	return pType;
 }
 
+int
+ProtocolDefinition::doubleType::GetValueSize() const
+{
+	return m_Count * sizeof(double);
+}
+
 void
 ProtocolDefinition::doubleType::GenerateCType(char* sType, char* sSuffix) const
 {
@@ -765,8 +987,6 @@ ProtocolDefinition::doubleType::ParseNode(xmlNodePtr pNode)
 		bOK &= m_ProtocolDefinition.ResolveStringToNumber((const char*)sCount, iVal);
 		if (bOK) {
 			m_Count = iVal;
-			delete[] m_Number;
-			m_Number = new double[m_Count];
 		}
 		xmlFree(sCount);
 	}
@@ -787,6 +1007,12 @@ ProtocolDefinition::lengthType::Clone() const
 	return new lengthType(m_ProtocolDefinition);
 }
 
+int
+ProtocolDefinition::lengthType::GetValueSize() const
+{
+	return sizeof(uint32_t);
+}
+
 bool
 ProtocolDefinition::lengthType::ParseNode(xmlNodePtr pNode)
 {
@@ -814,6 +1040,12 @@ ProtocolDefinition::unixtimeType::Clone() const
 	return new unixtimeType(m_ProtocolDefinition);
 }
 
+int
+ProtocolDefinition::unixtimeType::GetValueSize() const
+{
+	return sizeof(uint32_t);
+}
+
 bool
 ProtocolDefinition::unixtimeType::ParseNode(xmlNodePtr pNode)
 {
@@ -835,7 +1067,7 @@ ProtocolDefinition::unixtimeType::GenerateCInitialize(char* sCode, int iLength)
 }
 
 ProtocolDefinition::ProtocolDefinition()
-	: m_Version(0)
+	: m_Version(0), m_Fingerprint(0), m_NativeDecoder(NULL), m_Pending(NULL), m_PendingData(NULL), m_PendingLength(0), m_PendingSubpacket(-1), m_DeferAnnotations(false)
 {
 	m_Types.push_back(new unsignedType(*this, "u8", sizeof(uint8_t)));
 	m_Types.push_back(new unsignedType(*this, "u16", sizeof(uint16_t)));
@@ -851,17 +1083,39 @@ ProtocolDefinition::ProtocolDefinition()
 }
 
 ProtocolDefinition::~ProtocolDefinition()
+{
+	Clear();
+	for (auto it = m_Transformations.begin(); it != m_Transformations.end(); it++)
+		delete *it;
+	for (auto it = m_Annotations.begin(); it != m_Annotations.end(); it++)
+		delete *it;
+	for (auto it = m_Types.begin(); it != m_Types.end(); it++)
+		delete *it;
+}
+
+void
+ProtocolDefinition::Clear()
 {
 	for (auto it = m_Packet.begin(); it != m_Packet.end(); it++)
 		delete *it;
-	for (auto it = m_Enums.begin(); it != m_Enums.end(); it++)
+	m_Packet.clear();
+	for (auto it = m_FieldTypes.begin(); it != m_FieldTypes.end(); it++)
 		delete *it;
-	for (auto it = m_Definitions.begin(); it != m_Definitions.end(); it++)
+	m_FieldTypes.clear();
+	for (auto it = m_Types.begin(); it != m_Types.end(); /* nothing */) {
+		if (dynamic_cast<BuiltinType*>(*it) != NULL) {
+			it++;
+			continue;
+		}
 		delete *it;
-	for (auto it = m_Transformations.begin(); it != m_Transformations.end(); it++)
+		it = m_Types.erase(it);
+	}
+	for (auto it = m_Enums.begin(); it != m_Enums.end(); it++)
 		delete *it;
-	for (auto it = m_Types.begin(); it != m_Types.end(); it++)
+	m_Enums.clear();
+	for (auto it = m_Definitions.begin(); it != m_Definitions.end(); it++)
 		delete *it;
+	m_Definitions.clear();
 }
 
 const ProtocolDefinition::Type*
@@ -920,15 +1174,15 @@ ProtocolDefinition::LookupTransformation(const char* sName) const
 }
 
 void
-ProtocolDefinition::RegisterTransformation(const char* sName, XDataTransformation& oDataTransformation)
+ProtocolDefinition::RegisterTransformation(const char* sName, XDataTransformation& oDataTransformation, bool bOwner)
 {
-	m_Transformations.push_back(new Transformation(sName, oDataTransformation));
+	m_Transformations.push_back(new Transformation(sName, oDataTransformation, bOwner));
 }
 
 void
-ProtocolDefinition::RegisterAnnotation(const char* sName, XDataAnnotation& oAnnotation)
+ProtocolDefinition::RegisterAnnotation(const char* sName, XDataAnnotation& oAnnotation, bool bOwner)
 {
-	m_Annotations.push_back(new Annotation(sName, oAnnotation));
+	m_Annotations.push_back(new Annotation(sName, oAnnotation, bOwner));
 }
 
 bool
@@ -1075,14 +1329,108 @@ ProtocolDefinition::ParsePacket(xmlNodePtr pNode)
 	return pPacket->ParseNode(pNode);
 }
 
+/*
+ * The fingerprint is a FNV-1a hash over everything that influences
+ * decoding; it only needs to be stable, not secure.
+ */
+static void
+FingerprintBytes(uint32_t& iHash, const void* pData, int iLength)
+{
+	const uint8_t* p = (const uint8_t*)pData;
+	for (int n = 0; n < iLength; n++) {
+		iHash ^= p[n];
+		iHash *= 16777619u;
+	}
+}
+
+static void
+FingerprintString(uint32_t& iHash, const char* sString)
+{
+	FingerprintBytes(iHash, sString, strlen(sString) + 1);
+}
+
+static void
+FingerprintNumber(uint32_t& iHash, int64_t iNumber)
+{
+	uint8_t v[8];
+	for (int n = 0; n < 8; n++)
+		v[n] = (uint8_t)(iNumber >> (n * 8));
+	FingerprintBytes(iHash, v, sizeof(v));
+}
+
 bool
 ProtocolDefinition::Load(const char* sFilename, int iVersion)
 {
 	m_Version = iVersion;
 
-	xmlDocPtr pDoc = xmlReadFile(sFilename, NULL, 0);
+	int fd = open(sFilename, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size <= 0) {
+		if (fd >= 0)
+			close(fd);
+		fprintf(stderr, "ProtocolDefinition::Load(): cannot parse '%s'\n", sFilename);
+		return false;
+	}
+	void* pData = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (pData == MAP_FAILED) {
+		fprintf(stderr, "ProtocolDefinition::Load(): cannot parse '%s'\n", sFilename);
+		return false;
+	}
+
+	// The cache is keyed by the exact content of the definitions
+	uint64_t iSourceHash = 14695981039346656037ull;
+	for (off_t n = 0; n < st.st_size; n++) {
+		iSourceHash ^= static_cast<const uint8_t*>(pData)[n];
+		iSourceHash *= 1099511628211ull;
+	}
+
+	char sCacheFile[PATH_MAX];
+	if (m_Version < 0)
+		snprintf(sCacheFile, sizeof(sCacheFile), "%s.latest.cache", sFilename);
+	else
+		snprintf(sCacheFile, sizeof(sCacheFile), "%s.v%d.cache", sFilename, m_Version);
+
+	/*
+	 * A cache is only written once everything checks out, so there is no need
+	 * to compile or fingerprint again; plans are compiled on first use.
+	 */
+	bool bCached = s_UseSchemaCache && LoadCache(sCacheFile, iSourceHash);
+	bool bOK = bCached || ParseDocument(static_cast<const char*>(pData), st.st_size, sFilename);
+	munmap(pData, st.st_size);
+	if (bCached)
+		return true;
+
+	// Compile all packets to their decode plans
+	for (auto it = m_Packet.begin(); bOK && it != m_Packet.end(); it++)
+		bOK = (*it)->Compile();
+
+	// Fingerprint whatever we ended up with
+	m_Fingerprint = 2166136261u;
+	for (auto it = m_Packet.begin(); bOK && it != m_Packet.end(); it++) {
+		Packet& oPacket = **it;
+		FingerprintString(m_Fingerprint, "packet");
+		FingerprintString(m_Fingerprint, oPacket.GetName());
+		FingerprintNumber(m_Fingerprint, oPacket.m_NumPacketBytes);
+		FingerprintStruct(oPacket, m_Fingerprint);
+		for (auto& pSubpacket: oPacket.GetSubpackets()) {
+			FingerprintString(m_Fingerprint, "subpacket");
+			FingerprintString(m_Fingerprint, pSubpacket->GetName());
+			FingerprintStruct(*pSubpacket, m_Fingerprint);
+		}
+	}
+
+	if (bOK && s_UseSchemaCache)
+		SaveCache(sCacheFile, iSourceHash); // failure only costs speed
+	return bOK;
+}
+
+bool
+ProtocolDefinition::ParseDocument(const char* pData, int iLength, const char* sFilename)
+{
+	xmlDocPtr pDoc = xmlReadMemory(pData, iLength, sFilename, NULL, 0);
 	if (pDoc == NULL) {
-		printf("ProtocolDefinition::Load(): cannot parse '%s'\n", sFilename);
+		fprintf(stderr, "ProtocolDefinition::Load(): cannot parse '%s'\n", sFilename);
 		return false;
 	}
 
@@ -1119,4 +1467,48 @@ ProtocolDefinition::Load(const char* sFilename, int iVersion)
 	return bOK;
 }
 
+void
+ProtocolDefinition::FingerprintStruct(const Struct& oStruct, uint32_t& iHash)
+{
+	FingerprintNumber(iHash, oStruct.GetCount());
+	FingerprintNumber(iHash, oStruct.GetMinCount());
+	for (auto& pAction: oStruct.GetActions()) {
+		if (const TransformationAction* pTransformation = dynamic_cast<const TransformationAction*>(pAction)) {
+			FingerprintString(iHash, "transformation");
+			FingerprintString(iHash, pTransformation->GetTransformation().GetName());
+			continue;
+		}
+		if (const AnnotationAction* pAnnotation = dynamic_cast<const AnnotationAction*>(pAction)) {
+			FingerprintString(iHash, "annotation");
+			FingerprintString(iHash, pAnnotation->GetAnnotation().GetName());
+			continue;
+		}
+		const Field* pField = dynamic_cast<const Field*>(pAction);
+		if (pField == NULL)
+			continue;
+
+		const Type& oType = pField->GetType();
+		FingerprintString(iHash, pField->GetName());
+		FingerprintString(iHash, oType.GetName());
+		if (const unsignedType* pUnsigned = dynamic_cast<const unsignedType*>(&oType)) {
+			FingerprintNumber(iHash, dynamic_cast<const signedType*>(&oType) != NULL);
+			FingerprintNumber(iHash, pUnsigned->GetWidth());
+			FingerprintNumber(iHash, pUnsigned->GetCount());
+			FingerprintNumber(iHash, pUnsigned->GetMinCount());
+			FingerprintNumber(iHash, pUnsigned->HaveFixedValue());
+			if (pUnsigned->HaveFixedValue())
+				FingerprintNumber(iHash, pUnsigned->GetFixedValue());
+		} else if (const stringType* pString = dynamic_cast<const stringType*>(&oType)) {
+			FingerprintNumber(iHash, pString->GetLength());
+			FingerprintNumber(iHash, pString->GetMinLength());
+		} else if (const floatType* pFloat = dynamic_cast<const floatType*>(&oType)) {
+			FingerprintNumber(iHash, pFloat->GetCount());
+		} else if (const doubleType* pDouble = dynamic_cast<const doubleType*>(&oType)) {
+			FingerprintNumber(iHash, pDouble->GetCount());
+		} else if (const Struct* pStruct = dynamic_cast<const Struct*>(&oType)) {
+			FingerprintStruct(*pStruct, iHash);
+		}
+	}
+}
+
 /* vim:set ts=2 sw=2: */
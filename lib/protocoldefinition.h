@@ -19,16 +19,23 @@
 
 #include <map>
 #include <list>
+#include <vector>
 #include <stdint.h> // for uintXX_t
+#include <stddef.h> // for NULL
+#include "decodearena.h"
 
 typedef struct _xmlNode xmlNode;
 typedef xmlNode* xmlNodePtr;
 
 class XDataTransformation;
 class XDataAnnotation;
+class SchemaCacheWriter;
+class SchemaCacheReader;
+class XProtocolVisitor;
 
 class ProtocolDefinition {
 	friend class ProtocolCodeGenerator;
+	friend class NativeDecoder;
 public:
 	//! \brief Maximum generated C++ string
 	static const int s_GenerateMaxLength = 64;
@@ -36,6 +43,7 @@ public:
 	//! \brief Enumeration of values
 	class Enumeration {
 		friend class ProtocolCodeGenerator;
+		friend class ProtocolDefinition;
 	public:
 		/*! \brief Creates an enumeration with a given name
 		 *  \param sName Name to use
@@ -106,11 +114,12 @@ public:
 		/*! \brief Creates a new transformation 
 		 *  \param sName Transformation name
 		 *  \param oTransformation Transformation provider
+		 *  \param bOwner Whether to become owner of the provider
 		 *
-		 *  Note that this class will become owner of the
+		 *  Note that this class will by default become owner of the
 		 *  transformation provider and destroy it as needed.
 		 */
-		Transformation(const char* sName, XDataTransformation& oTransformation);
+		Transformation(const char* sName, XDataTransformation& oTransformation, bool bOwner = true);
 		~Transformation();
 
 		//! \brief Retrieve the definition name
@@ -125,6 +134,9 @@ public:
 
 		//! \brief Transformation provider
 		XDataTransformation* m_TransformationProvider;
+
+		//! \brief Whether the provider is to be destroyed with us
+		bool m_Owner;
 	};
 
 	//! \brief Data annotation
@@ -133,11 +145,12 @@ public:
 		/*! \brief Creates a new annotation 
 		 *  \param sName Annotation name
 		 *  \param oAnnotation Annotation provider
+		 *  \param bOwner Whether to become owner of the provider
 		 *
-		 *  Note that this class will become owner of the
+		 *  Note that this class will by default become owner of the
 		 *  annotation provider and destroy it as needed.
 		 */
-		Annotation(const char* sName, XDataAnnotation& oAnnotation);
+		Annotation(const char* sName, XDataAnnotation& oAnnotation, bool bOwner = true);
 		~Annotation();
 
 		//! \brief Retrieve the definition name
@@ -152,11 +165,42 @@ public:
 
 		//! \brief Annotation provider
 		XDataAnnotation* m_AnnotationProvider;
+
+		//! \brief Whether the provider is to be destroyed with us
+		bool m_Owner;
 	};
 
 	class DecodeState;
+	class DeferredAnnotation;
+	class XNativeDecoder;
+
+	/*! \brief Decoded content of a field
+	 *
+	 *  Types only describe how to decode; whatever a field decoded to is kept
+	 *  here. Every top-level structure owns the values of all fields it
+	 *  contains, including those within struct-typed fields.
+	 */
+	class Value {
+	public:
+		//! \brief Offset where decoded, in bytes
+		uint32_t m_DataOffset;
+
+		//! \brief Number of values (or bytes, for strings) filled by the most recent Fill()
+		int m_Num;
 
-	//! \brief Describes a given type
+		/*! \brief Backing storage, see Type::GetValueSize()
+		 *
+		 *  For struct-typed fields, this is the Value array of the members.
+		 */
+		void* m_Data;
+	};
+
+	/*! \brief Describes a given type
+	 *
+	 *  Types are immutable once loaded and are shared by all fields using
+	 *  them; fields which refine a built-in type (count, format, ...) use a
+	 *  type of their own, derived using Refine().
+	 */
 	class Type {
 	public:
 		/*! \brief Creates the type with a given name
@@ -174,16 +218,36 @@ public:
 		//! \brief Creates a copy of the type
 		virtual Type* Clone() const = 0;
 
-		/*! \brief Display type content
+		/*! \brief Determines the type to use for a field
+		 *  \param pNode Field node
+		 *  \param bOK Set to false on failure
+		 *  \returns This type if the field doesn't refine it, or a new type
+		 *
+		 *  The caller becomes owner of any new type returned.
+		 */
+		virtual const Type* Refine(xmlNodePtr pNode, bool& bOK) const;
+
+		/*! \brief Display content
+		 *  \param oValue Value to display
 		 *  \param iIndent Indentation to use
+		 *
+		 *  This is a convenience wrapper which feeds the content to a
+		 *  ProtocolTextSink writing to OutputBuffer::GetStdout().
+		 */
+		void Print(const Value& oValue, int iIndent) const;
+
+		/*! \brief Reports decoded content to a visitor
+		 *  \param oVisitor Visitor to use
+		 *  \param oValue Value to report
 		 */
-		virtual void Print(int iIndent) const = 0;
+		virtual void Accept(XProtocolVisitor& oVisitor, const Value& oValue) const = 0;
 
 		/*! \brief Retrieve the content in a human-readable fashion
+		 *  \param oValue Value to use
 		 *  \param out Output to place the content in
 		 *  \param outlen Number of bytes to write at most
 		 */
-		virtual void GetHumanReadableContent(char* out, int outlen) const = 0;
+		virtual void GetHumanReadableContent(const Value& oValue, char* out, int outlen) const = 0;
 
 		/*! \brief Parses the structured type from an XML node
 		 *  \param pNode Node to parse
@@ -193,17 +257,21 @@ public:
 		 */
 		virtual bool ParseNode(xmlNodePtr pNode) = 0;
 
-		/*! \brief Fills the type
+		/*! \brief Decodes a value of the type
 		 *  \param oState Decoding state to use
+		 *  \param oValue Value to fill
 		 *  \returns Number of bytes processed or -1 on failure
 		 */
-		virtual int Fill(const DecodeState& oState) = 0;
+		virtual int Fill(const DecodeState& oState, Value& oValue) const = 0;
 
 		/*! \brief Retrieve the type size, in bytes
 		 *  \returns Field size, or 0 if the field size is not constant
 		 */
 		virtual int GetConstantSize() const = 0;
 
+		//! \brief Retrieve the number of bytes Value::m_Data needs
+		virtual int GetValueSize() const = 0;
+
 		/*! \brief Generates the C++ type
 		 *  \param sType C++ type identifier
 		 *  \param sSuffix Suffix to use
@@ -244,12 +312,38 @@ public:
 		 *
 		 *  XXX This is a kludge to have annotations be able to look up things
 		 */
-		Struct* m_CurrentStruct;
+		const Struct* m_CurrentStruct;
+
+		//! \brief Values of the members of m_CurrentStruct
+		Value* m_CurrentValues;
+
+		//! \brief Top-level structure owning m_CurrentValues
+		const Struct* m_Owner;
+
+		//! \brief Scratch memory, reset for every packet processed
+		DecodeArena* m_Arena;
+
+		//! \brief Generated code decoding top-level structures, if any; never used when probing
+		XNativeDecoder* m_NativeDecoder;
+
+		/*! \brief Only classifying?
+		 *
+		 *  If set, fields are only decoded as far as needed to tell whether
+		 *  they match; their values are left undefined and annotations are
+		 *  not applied. Transformations are only checked to be possible, and
+		 *  whatever follows them is taken to match.
+		 */
+		bool m_Probe;
+
+		//! \brief If not NULL, annotations are collected here instead of applied
+		std::vector<DeferredAnnotation>* m_DeferredAnnotations;
 	};
 
 	//! \brief Interface of a decode action
 	class XAction {
 	public:
+		virtual ~XAction() { }
+
 		/*! \brief Processes input
 		 *  \param oState State to use and update
 		 *  \returns true on success
@@ -262,9 +356,10 @@ public:
 
 	//! \brief Field of a given value
 	class Field : public XAction {
+		friend class Struct;
 	public:
 		/*! \brief Creates a new field
-		 *  \param oType Type to use
+		 *  \param oType Type to use; this is not copied
 		 *  \param sName Name to use for the field
 		 */
 		Field(const Type& oType, const char* sName);
@@ -279,17 +374,16 @@ public:
 		const char* GetName() const { return m_Name; }
 
 		//! \brief Retrieve the field type
-		Type& GetType() { return *m_Type; }
 		const Type& GetType() const { return *m_Type; }
 
+		//! \brief Retrieve the index of the field's value within the enclosing struct
+		int GetIndex() const { return m_Index; }
+
 		/*! \brief Retrieve the field size, in bytes
 		 *  \returns Field size, or 0 if the field size is not constant
 		 */
 		int GetConstantSize() const { return m_Type->GetConstantSize(); }
 
-		//! \brief Offset where decoded, in bytes
-		uint32_t GetDataOffset() const { return m_DataOffset; }
-
 		virtual bool Process(DecodeState& oState);
 
 	protected:
@@ -297,10 +391,10 @@ public:
 		char* m_Name;
 
 		//! \brief Type of the field
-		Type* m_Type;
+		const Type* m_Type;
 
-		//! \brief Data offset, in bytes
-		uint32_t m_DataOffset;
+		//! \brief Index among the fields of the enclosing struct
+		int m_Index;
 
 		//! \brief Assignment is forbidden
 		Field& operator=(const Field& oField) = delete;
@@ -313,7 +407,6 @@ public:
 		 *  \param oTransformation Transformation to apply
 		 */
 		TransformationAction(Transformation& oTransformation);
-		virtual ~TransformationAction();
 
 		virtual XAction* Clone() const;
 		virtual bool Process(DecodeState& oState);
@@ -322,9 +415,16 @@ public:
 	protected:
 		//! \brief Transformation to use
 		Transformation& m_Transformation;
+	};
 
-		//! \brief Decode buffer
-		uint8_t* m_Buffer;
+	/*! \brief Whatever an annotation resolved within a struct
+	 *
+	 *  Annotations derive from this to keep the fields they need, see
+	 *  XDataAnnotation::Bind().
+	 */
+	class AnnotationBinding {
+	public:
+		virtual ~AnnotationBinding() { }
 	};
 
 	//! \brief Applies a annotation action
@@ -334,19 +434,140 @@ public:
 		 *  \param oAnnotation Annotation to apply
 		 */
 		AnnotationAction(Annotation& oAnnotation);
+		~AnnotationAction();
 
 		virtual XAction* Clone() const;
 		virtual bool Process(DecodeState& oState);
 		const Annotation& GetAnnotation() const { return m_Annotation; }
 
+		/*! \brief Lets the annotation resolve what it needs within a struct
+		 *  \param oStruct Struct containing the action
+		 *
+		 *  This is done when the struct is compiled, or on first use otherwise;
+		 *  if the annotation cannot be bound, the action does nothing.
+		 */
+		void Bind(const Struct& oStruct);
+
+		//! \brief Was the annotation bound successfully?
+		bool IsUsable() const { return m_Usable; }
+
+		/*! \brief Applies the annotation
+		 *  \param pValues Values of the members of the struct containing the action
+		 */
+		void Apply(const Value* pValues);
+
 	protected:
 		//! \brief Annotation to use
 		Annotation& m_Annotation;
+
+		//! \brief Has Bind() been called?
+		bool m_Bound;
+
+		//! \brief Did binding succeed?
+		bool m_Usable;
+
+		//! \brief Binding returned by the annotation, if any
+		AnnotationBinding* m_Binding;
+	};
+
+	/*! \brief Decodes top-level structures in place of their plans
+	 *
+	 *  This is implemented by code generated from the same definitions, see
+	 *  NativeDecoder, which must fill the values exactly like the plan does.
+	 */
+	class XNativeDecoder {
+	public:
+		virtual ~XNativeDecoder() { }
+
+		/*! \brief Decodes the members of a top-level structure
+		 *  \param oStruct Structure to decode
+		 *  \param oState Decoding state to use; m_CurrentValues are the values to fill
+		 *  \param iProcessed Receives the number of bytes processed, like Struct::Fill()
+		 *  \returns false if there is no code for the structure
+		 */
+		virtual bool Fill(const Struct& oStruct, const DecodeState& oState, int& iProcessed) = 0;
+	};
+
+	//! \brief Annotation encountered while decoding, see SetDeferAnnotations()
+	class DeferredAnnotation {
+	public:
+		AnnotationAction* m_Action;
+
+		//! \brief Values the annotation is to be applied to
+		const Value* m_Values;
+
+		//! \brief Top-level structure owning m_Values
+		const Struct* m_Owner;
+	};
+
+	class unsignedType;
+	class stringType;
+	class floatType;
+	class doubleType;
+	class lengthType;
+	class unixtimeType;
+
+	/*! \brief Single instruction of a compiled decode plan
+	 *
+	 *  Structs are compiled into a flat array of these; nested structs are
+	 *  inlined between I_EnterStruct and I_LeaveStruct.
+	 */
+	class DecodeInstruction {
+	public:
+		enum Opcode {
+			I_Unsigned, //!< read unsigned/signed values, check fixed value
+			I_String, //!< read string
+			I_Float, //!< read floats
+			I_Double, //!< read doubles
+			I_Length, //!< read and verify length
+			I_UnixTime, //!< read UNIX timestamp
+			I_Field, //!< read any other type using Type::Fill()
+			I_EnterStruct, //!< start of a struct-typed field
+			I_LeaveStruct, //!< end of a struct-typed field
+			I_Transform, //!< apply transformation
+			I_Annotate, //!< apply annotation
+			I_End //!< end of plan
+		};
+
+		/*! \brief Creates a new instruction
+		 *  \param eOpcode Operation to perform
+		 *  \param pField Field being decoded, if any
+		 */
+		DecodeInstruction(Opcode eOpcode, const Field* pField);
+
+		//! \brief Operation to perform
+		Opcode m_Opcode;
+
+		//! \brief Instruction to continue at if this one fails
+		int m_FailTarget;
+
+		//! \brief Index of the field's value, if any
+		int m_Slot;
+
+		//! \brief Index of the first member value, for I_EnterStruct
+		int m_MemberSlot;
+
+		//! \brief Field being decoded, if any
+		const Field* m_Field;
+
+		//! \brief Operand, depending on the opcode
+		union {
+			const Type* m_Type;
+			const unsignedType* m_Unsigned;
+			const stringType* m_String;
+			const floatType* m_Float;
+			const doubleType* m_Double;
+			const lengthType* m_Length;
+			const unixtimeType* m_UnixTime;
+			TransformationAction* m_Transformation;
+			AnnotationAction* m_Annotation;
+		};
 	};
 
 	//! \brief Structured type
 	class Struct : public Type {
 		friend class ProtocolCodeGenerator;
+		friend class ProtocolDefinition;
 	public:
 		/*! \brief Creates the type with a given name
 		 *  \param sName Name to use
@@ -362,22 +583,110 @@ public:
 		void AddAction(XAction* pAction);
 
 		virtual Type* Clone() const;
-		virtual int Fill(const DecodeState& oState);
+		virtual int Fill(const DecodeState& oState, Value& oValue) const;
 		virtual bool ParseNode(xmlNodePtr pNode);
 
-		virtual void Print(int iIndent) const;
-		virtual void GetHumanReadableContent(char* out, int outlen) const;
-		virtual void PrintFields(int iIndent) const;
+		virtual void Accept(XProtocolVisitor& oVisitor, const Value& oValue) const;
+		virtual void GetHumanReadableContent(const Value& oValue, char* out, int outlen) const;
 		virtual int GetConstantSize() const;
+		virtual int GetValueSize() const;
 		virtual void GenerateCType(char* sType, char* sSuffix) const;
 		virtual void GenerateCInitialize(char* sCode, int iLength) const;
 
+		/*! \brief Decodes the struct as a top-level structure
+		 *  \param oState Decoding state to use
+		 *  \returns Number of bytes processed
+		 *
+		 *  The values end up in the struct itself, see GetValues().
+		 */
+		virtual int Fill(const DecodeState& oState);
+
+		//! \brief Reports the content decoded by Fill() to a visitor
+		virtual void Accept(XProtocolVisitor& oVisitor) const;
+
 		typedef std::list<XAction*> TXActionPtrList;
 
 		//! \brief Retrieves all actions within the struct
 		const TXActionPtrList& GetActions() const { return m_Actions; }
 
+		//! \brief Retrieves the number of fields, which is the number of member values
+		int GetNumFields() const { return m_NumFields; }
+
+		/*! \brief Looks a field up by name
+		 *  \param sName Name to look up
+		 *  \returns Field on success or NULL
+		 */
+		const Field* FindField(const char* sName) const;
+
+		/*! \brief Retrieves the member values decoded by Fill()
+		 *
+		 *  These are indexed by Field::GetIndex().
+		 */
+		const Value* GetValues() const { return m_Values.empty() ? NULL : &m_Values[0]; }
+
+		int GetCount() const { return m_Count; }
+
+		int GetMinCount() const { return m_MinCount; }
+
+		/*! \brief Compiles the actions into a flat decode plan
+		 *  \returns true on success
+		 *
+		 *  This is done by Load(); Fill() will compile on first use otherwise.
+		 */
+		virtual bool Compile();
+
+		//! \brief Does the compiled plan apply any annotations?
+		bool HasAnnotations() const { return m_HasAnnotations; }
+
+		//! \brief Maximum nesting of struct-typed fields within a plan
+		static const int s_MaxPlanDepth = 16;
+
 	protected:
+		typedef std::vector<DecodeInstruction> TDecodeInstructionVector;
+
+		/*! \brief Appends the instructions for our actions to a plan
+		 *  \param oPlan Plan to append to
+		 *  \param iDepth Struct nesting depth
+		 *  \param iSlot Index of our first member value
+		 *  \param iNumSlots Number of values allocated so far, updated
+		 *  \returns true on success
+		 *
+		 *  Instructions which need to jump to the end of the enclosing struct on
+		 *  failure are left with a m_FailTarget of -1; the caller must patch them.
+		 */
+		bool CompileActions(TDecodeInstructionVector& oPlan, int iDepth, int iSlot, int& iNumSlots) const;
+
+		//! \brief Allocates and hooks up the values used by the plan
+		void AllocateValues();
+
+		/*! \brief Reports all fields to a visitor
+		 *  \param oVisitor Visitor to use
+		 *  \param pValues Member values to report
+		 */
+		void AcceptFields(XProtocolVisitor& oVisitor, const Value* pValues) const;
+
+		/*! \brief Copies the values decoded by Fill()
+		 *  \param oValues Receives the values
+		 *  \param oValueData Receives the storage backing them
+		 *
+		 *  The copied values refer to the copied storage.
+		 */
+		void CopyValues(std::vector<Value>& oValues, std::vector<uint64_t>& oValueData) const;
+
+		//! \brief Compiled decode plan
+		TDecodeInstructionVector m_Plan;
+
+		//! \brief Number of values the plan uses
+		int m_NumSlots;
+
+		//! \brief Whether the plan contains I_Annotate instructions
+		bool m_HasAnnotations;
+
+		//! \brief Values used by the plan; the first m_NumFields are ours
+		std::vector<Value> m_Values;
+
+		//! \brief Storage backing m_Values
+		std::vector<uint64_t> m_ValueData;
 
 		/*! \brief Called to parse an extra node type
 		 *  \param pNode Node to parse
@@ -397,6 +706,9 @@ public:
 
 		TXActionPtrList m_Actions;
 
+		//! \brief Number of fields among the actions
+		int m_NumFields;
+
 		//! \brief Number of values
 		int m_Count;
 
@@ -408,13 +720,21 @@ public:
 	class Subpacket : public Struct {
 	public:
 		Subpacket(ProtocolDefinition& oProtocolDefinition, const char* sName) : Struct(oProtocolDefinition, sName) { }
-		virtual void Print(int iIndent) const;
-		virtual void GetHumanReadableContent(char* out, int outlen) const;
+		virtual void Accept(XProtocolVisitor& oVisitor) const;
+
+		/*! \brief Reports content to a visitor
+		 *  \param oVisitor Visitor to use
+		 *  \param pValues Member values to report, such as those of a DetachedPacket
+		 */
+		void Accept(XProtocolVisitor& oVisitor, const Value* pValues) const;
+
+		virtual void GetHumanReadableContent(const Value& oValue, char* out, int outlen) const;
 	};
 
 	//! \brief Packet type
 	class Packet : public Struct {
 		friend class ProtocolCodeGenerator;
+		friend class ProtocolDefinition;
 	public:
 		Packet(ProtocolDefinition& oProtocolDefinition, const char* sName);
 		~Packet();
@@ -428,20 +748,40 @@ public:
 
 		virtual int Fill(const DecodeState& oState);
 		virtual bool ParseNode(xmlNodePtr pNode);
-		virtual void Print(int iIndent) const;
-		virtual void GetHumanReadableContent(char* out, int outlen) const;
+		virtual void Accept(XProtocolVisitor& oVisitor) const;
+		virtual void GetHumanReadableContent(const Value& oValue, char* out, int outlen) const;
+		virtual bool Compile();
 		const Subpacket* GetSubpacket() const { return m_LastSubpacket; }
 
-	protected:
-		Source m_Source;
-		virtual bool ParseExtraNode(xmlNodePtr pNode, const char* sName);
+		/*! \brief Reports content to a visitor
+		 *  \param oVisitor Visitor to use
+		 *  \param pValues Member values to report
+		 *  \param pSubpacket Subpacket to report, NULL if none
+		 *  \param pSubpacketValues Member values of the subpacket
+		 */
+		void Accept(XProtocolVisitor& oVisitor, const Value* pValues, const Subpacket* pSubpacket, const Value* pSubpacketValues) const;
+
+		/*! \brief Fills the packet using a single subpacket
+		 *  \param oState Decoding state to use
+		 *  \param iSubpacket Index of the subpacket to try, -1 to try all
+		 *  \returns Number of bytes processed
+		 */
+		int Fill(const DecodeState& oState, int iSubpacket);
 
 		typedef std::list<Subpacket*> TSubpacketPtrList;
-		TSubpacketPtrList m_Subpackets;
 
 		//! \brief Retrieve all subpackets
 		const TSubpacketPtrList& GetSubpackets() const { return m_Subpackets; }
 
+		//! \brief Retrieve the size of the packet header, which precedes the subpacket
+		int GetNumPacketBytes() const { return m_NumPacketBytes; }
+
+	protected:
+		Source m_Source;
+		virtual bool ParseExtraNode(xmlNodePtr pNode, const char* sName);
+
+		TSubpacketPtrList m_Subpackets;
+
 		//! \brief Size of packet header bytes
 		int m_NumPacketBytes;
 
@@ -449,6 +789,55 @@ public:
 		Subpacket* m_LastSubpacket;
 	};
 
+	/*! \brief Copy of a decoded packet, see Detach()
+	 *
+	 *  This remains valid while the definitions go on to decode other
+	 *  packets; the definitions themselves must be kept around. Copies are
+	 *  meant to be reused, so their storage is kept as long as it is not much
+	 *  larger than needed.
+	 */
+	class DetachedPacket {
+		friend class ProtocolDefinition;
+	public:
+		DetachedPacket();
+
+		//! \brief Retrieves the packet, NULL if only annotations were copied
+		const Packet* GetPacket() const { return m_Packet; }
+
+		//! \brief Retrieves the subpacket of the packet, if any
+		const Subpacket* GetSubpacket() const { return m_Subpacket; }
+
+		//! \brief Reports the copied content to a visitor, like Packet::Accept()
+		void Accept(XProtocolVisitor& oVisitor) const;
+
+		//! \brief Applies the annotations collected while decoding the packet
+		void ApplyAnnotations();
+
+	protected:
+		//! \brief Values of a single top-level structure
+		struct Copy {
+			const Struct* m_Struct;
+			std::vector<Value> m_Values;
+			std::vector<uint64_t> m_ValueData;
+		};
+
+		/*! \brief Finds the copied values of a structure
+		 *  \param pStruct Structure to look for
+		 *  \returns Copy, or NULL if there is none
+		 */
+		const Copy* Find(const Struct* pStruct) const;
+
+		const Packet* m_Packet;
+		const Subpacket* m_Subpacket;
+
+		//! \brief Copies in use; any beyond m_NumCopies are unused
+		std::vector<Copy> m_Copies;
+		unsigned int m_NumCopies;
+
+		//! \brief Deferred annotations, referring to the copied values
+		std::vector<DeferredAnnotation> m_Annotations;
+	};
+
 	ProtocolDefinition();
 	~ProtocolDefinition();
 
@@ -466,23 +855,115 @@ public:
 	 */
 	Packet* Process(const uint8_t* pData, int iLength);
 
+	/*! \brief Processes a decrypted packet payload of a known kind
+	 *  \param pData Data to process
+	 *  \param iLength Length to process
+	 *  \param iPacket Index of the packet to use
+	 *  \param iSubpacket Index of the subpacket to use, -1 if none
+	 *  \returns Packet on success, or NULL
+	 *
+	 *  This skips trying all other packets and subpackets; the indices are
+	 *  typically obtained using NativeDecoder::Classify().
+	 */
+	Packet* Process(const uint8_t* pData, int iLength, int iPacket, int iSubpacket);
+
+	/*! \brief Determines which packet a decrypted payload is
+	 *  \param pData Data to process
+	 *  \param iLength Length to process
+	 *  \returns Packet on success, or NULL
+	 *
+	 *  This tries the packets like Process() does, but only decodes as much
+	 *  as needed to identify the packet and subpacket; the field values are
+	 *  left alone until Materialize() is called. Packets which carry
+	 *  annotations are materialized right away, as annotations must see
+	 *  every packet. The data must remain valid until then.
+	 */
+	Packet* Classify(const uint8_t* pData, int iLength);
+
+	/*! \brief Identifies a decrypted payload of a known kind
+	 *  \param pData Data to process
+	 *  \param iLength Length to process
+	 *  \param iPacket Index of the packet to use
+	 *  \param iSubpacket Index of the subpacket to use, -1 if none
+	 *  \returns Packet on success, or NULL
+	 *
+	 *  As Classify(), but without decoding anything unless the packet carries
+	 *  annotations; the indices are typically obtained using
+	 *  NativeDecoder::Classify().
+	 */
+	Packet* Classify(const uint8_t* pData, int iLength, int iPacket, int iSubpacket);
+
+	/*! \brief Decodes the fields of the packet most recently classified
+	 *  \returns true on success, false if the packet doesn't decode after all
+	 *
+	 *  This does nothing if the fields are already decoded.
+	 */
+	bool Materialize();
+
+	/*! \brief Sets whether annotations are applied while decoding
+	 *  \param b true to only collect them, see ApplyDeferredAnnotations()
+	 *
+	 *  Annotations typically update state shared by all packets; when
+	 *  packets are decoded in parallel, this allows applying them in packet
+	 *  order nonetheless.
+	 */
+	void SetDeferAnnotations(bool b) { m_DeferAnnotations = b; }
+
+	/*! \brief Sets generated code to decode fields with
+	 *  \param pNativeDecoder Code to use, NULL to only use the decode plans
+	 *
+	 *  The code is used whenever fields are actually decoded; classifying
+	 *  is always left to the plans, or to NativeDecoder::Classify().
+	 */
+	void SetNativeDecoder(XNativeDecoder* pNativeDecoder) { m_NativeDecoder = pNativeDecoder; }
+
+	/*! \brief Applies the annotations collected while decoding the most recent packet
+	 *
+	 *  The values they refer to are kept until the next packet is processed.
+	 */
+	void ApplyDeferredAnnotations();
+
+	/*! \brief Copies the packet most recently decoded, along with the annotations collected
+	 *  \param pPacket Packet to copy, as returned by Process() or Classify(); NULL to only copy the annotations
+	 *  \param oCopy Receives the copy
+	 *
+	 *  This allows decoding the next packet before the annotations are
+	 *  applied, see SetDeferAnnotations(); they are moved to the copy and
+	 *  are to be applied using DetachedPacket::ApplyAnnotations().
+	 */
+	void Detach(const Packet* pPacket, DetachedPacket& oCopy);
+
+	//! \brief Retrieve the version in use, -1 for latest
+	int GetVersion() const { return m_Version; }
+
+	/*! \brief Retrieve the fingerprint of the loaded definitions
+	 *
+	 *  This covers everything which influences decoding, and is used to
+	 *  match code generated by mkdef to the definitions in use.
+	 */
+	uint32_t GetFingerprint() const { return m_Fingerprint; }
+
 	/*! \brief Registers a transformation
 	 *  \param sName Transformation name
 	 *  \param oDataTransformation Backing object to use
+	 *  \param bOwner Whether to become owner of the backing object
 	 *
-	 *  Note that the object becomes owner of the backing transformation
-	 *  object and will delete it as needed.
+	 *  Note that the object by default becomes owner of the backing
+	 *  transformation object and will delete it as needed; pass false to
+	 *  share a backing object between several definitions.
 	 */
-	void RegisterTransformation(const char* sName, XDataTransformation& oDataTransformation);
+	void RegisterTransformation(const char* sName, XDataTransformation& oDataTransformation, bool bOwner = true);
 
 	/*! \brief Registers an annotation
 	 *  \param sName Annotation name
 	 *  \param oAnnotation Backing object to use
+	 *  \param bOwner Whether to become owner of the backing object
 	 *
-	 *  Note that the object becomes owner of the backing annotation 
-	 *  object and will delete it as needed.
+	 *  Note that the object by default becomes owner of the backing
+	 *  annotation object and will delete it as needed; pass false to share
+	 *  a backing object between several definitions.
 	 */
-	void RegisterAnnotation(const char* sName, XDataAnnotation& oAnnotation);
+	void RegisterAnnotation(const char* sName, XDataAnnotation& oAnnotation, bool bOwner = true);
 
 	//! \brief Built-in type, which needn't be parsed
 	class BuiltinType : public Type {
@@ -492,23 +973,47 @@ public:
 
 	//! \brief Basic unsigned numeric type
 	class unsignedType : public BuiltinType {
+		friend class ProtocolDefinition;
 	public:
 		unsignedType(ProtocolDefinition& oProtocolDefinition, const char* sName, int iWidth);
-		virtual ~unsignedType();
 		virtual Type* Clone() const;
-		virtual int Fill(const DecodeState& oState);
+		virtual int Fill(const DecodeState& oState, Value& oValue) const;
 		virtual bool ParseNode(xmlNodePtr pNode);
-		virtual void Print(int iIndent) const;
-		virtual void GetHumanReadableContent(char* out, int outlen) const;
+		virtual void Accept(XProtocolVisitor& oVisitor, const Value& oValue) const;
+		virtual void GetHumanReadableContent(const Value& oValue, char* out, int outlen) const;
 		virtual int GetConstantSize() const;
+		virtual int GetValueSize() const;
 		virtual void GenerateCType(char* sType, char* sSuffix) const;
 		virtual void GenerateCInitialize(char* sCode, int iLength) const;
 
-		// XXX This is a kludge for romdump
-		uint32_t GetValue(int n) const;
+		/*! \brief Retrieve a decoded value
+		 *  \param oValue Value to use
+		 *  \param n Index of the value to retrieve
+		 *  \returns Value, or 0 if out of range
+		 */
+		uint32_t GetValue(const Value& oValue, int n) const;
 		bool HaveFixedValue() const { return m_HaveFixedValue; }
 		int GetCount() const { return m_Count; }
 
+		int GetMinCount() const { return m_MinCount; }
+
+		uint32_t GetFixedValue() const { return m_FixedValue; }
+
+		//! \brief Retrieve the number of values to display, or -1 for all
+		int GetDisplayCount() const { return m_DisplayCount; }
+
+		//! \brief Retrieve the type width, in bytes
+		int GetWidth() const { return m_Width; }
+
+		//! \brief Are values to be displayed as decimal?
+		bool IsDecimal() const { return m_Format == F_DECIMAL; }
+
+		//! \brief Retrieve the enumeration belonging to the values, if any
+		const Enumeration* GetEnumeration() const { return m_Enumeration; }
+
+		//! \brief Retrieve the annotation belonging to the values, if any
+		const Annotation* GetAnnotation() const { return m_Annotation; }
+
 	protected:
 		//! \brief Type width, in bytes
 		int m_Width;
@@ -522,9 +1027,6 @@ public:
 		//! \brief Number of values to display
 		int m_DisplayCount;
 
-		//! \brief Backing value (large so everything will fit)
-		uint32_t* m_Value;
-
 		//! \brief Is a fixed value given?
 		bool m_HaveFixedValue;
 
@@ -550,8 +1052,8 @@ public:
 	public:
 		signedType(ProtocolDefinition& oProtocolDefinition, const char* sName, int iWidth);
 		virtual Type* Clone() const;
-		virtual void Print(int iIndent) const;
-		virtual void GetHumanReadableContent(char* out, int outlen) const;
+		virtual void Accept(XProtocolVisitor& oVisitor, const Value& oValue) const;
+		virtual void GetHumanReadableContent(const Value& oValue, char* out, int outlen) const;
 	};
 
 	//! \brief length type
@@ -559,17 +1061,17 @@ public:
 	public:
 		lengthType(ProtocolDefinition& oProtocolDefinition) : BuiltinType(oProtocolDefinition, "length") { }
 		virtual Type* Clone() const;
-		virtual int Fill(const DecodeState& oState);
+		virtual int Fill(const DecodeState& oState, Value& oValue) const;
 		virtual bool ParseNode(xmlNodePtr pNode);
-		virtual void Print(int iIndent) const;
-		virtual void GetHumanReadableContent(char* out, int outlen) const;
+		virtual void Accept(XProtocolVisitor& oVisitor, const Value& oValue) const;
+		virtual void GetHumanReadableContent(const Value& oValue, char* out, int outlen) const;
 		virtual int GetConstantSize() const;
+		virtual int GetValueSize() const;
 		virtual void GenerateCType(char* sType, char* sSuffix) const;
 		virtual void GenerateCInitialize(char* sCode, int iLength) const;
 
-	private:
-		//! \brief Value read
-		uint32_t m_Value;
+		//! \brief Retrieve the value read, including the length field itself
+		uint32_t GetValue(const Value& oValue) const { return *static_cast<const uint32_t*>(oValue.m_Data); }
 	};
 
 	//! \brief UNIX timestamp type, 4 bytes
@@ -577,55 +1079,44 @@ public:
 	public:
 		unixtimeType(ProtocolDefinition& oProtocolDefinition) : BuiltinType(oProtocolDefinition, "unixtime") { }
 		virtual Type* Clone() const;
-		virtual int Fill(const DecodeState& oState);
-		virtual bool ParseNode(xmlNodePtr pNode);
-		virtual void Print(int iIndent) const;
-		virtual void GetHumanReadableContent(char* out, int outlen) const;
-		virtual int GetConstantSize() const;
-		virtual void GenerateCType(char* sType, char* sSuffix) const;
-		virtual void GenerateCInitialize(char* sCode, int iLength) const;
-
-	private:
-		//! \brief Value read
-		uint32_t m_Value;
-	};
-
-	//! \brief UNIX timestamp type, 4 bytes
-	class unixtime4Type : public BuiltinType {
-	public:
-		unixtime4Type(ProtocolDefinition& oProtocolDefinition) : BuiltinType(oProtocolDefinition, "unixtime4") { }
-		virtual Type* Clone() const;
-		virtual int Fill(const DecodeState& oState);
+		virtual int Fill(const DecodeState& oState, Value& oValue) const;
 		virtual bool ParseNode(xmlNodePtr pNode);
-		virtual void Print(int iIndent) const;
-		virtual void GetHumanReadableContent(char* out, int outlen) const;
+		virtual void Accept(XProtocolVisitor& oVisitor, const Value& oValue) const;
+		virtual void GetHumanReadableContent(const Value& oValue, char* out, int outlen) const;
 		virtual int GetConstantSize() const;
+		virtual int GetValueSize() const;
 		virtual void GenerateCType(char* sType, char* sSuffix) const;
 		virtual void GenerateCInitialize(char* sCode, int iLength) const;
 
-	private:
-		//! \brief Value read
-		uint32_t m_Value;
+		//! \brief Retrieve the timestamp read
+		uint32_t GetValue(const Value& oValue) const { return *static_cast<const uint32_t*>(oValue.m_Data); }
 	};
 
 
 	//! \brief string type
 	class stringType : public BuiltinType {
+		friend class ProtocolDefinition;
 	public:
 		stringType(ProtocolDefinition& oProtocolDefinition);
-		virtual ~stringType();
 
 		virtual Type* Clone() const;
-		virtual int Fill(const DecodeState& oState);
+		virtual const Type* Refine(xmlNodePtr pNode, bool& bOK) const;
+		virtual int Fill(const DecodeState& oState, Value& oValue) const;
 		virtual bool ParseNode(xmlNodePtr pNode);
-		virtual void Print(int iIndent) const;
-		virtual void GetHumanReadableContent(char* out, int outlen) const;
+		virtual void Accept(XProtocolVisitor& oVisitor, const Value& oValue) const;
+		virtual void GetHumanReadableContent(const Value& oValue, char* out, int outlen) const;
 		virtual int GetConstantSize() const;
+		virtual int GetValueSize() const;
 		virtual void GenerateCType(char* sType, char* sSuffix) const;
 		virtual void GenerateCInitialize(char* sCode, int iLength) const;
 
-		// XXX This is a kludge for romdump
-		const char* GetValue() const { return m_Data; }
+		//! \brief Retrieve the string read, which is always \0-terminated
+		const char* GetValue(const Value& oValue) const { return static_cast<const char*>(oValue.m_Data); }
+
+		//! \brief Retrieve the maximum string length, in bytes
+		int GetLength() const { return m_Length; }
+
+		int GetMinLength() const { return m_MinLength; }
 
 	private:
 		//! \brief String length
@@ -633,29 +1124,33 @@ public:
 
 		//! \brief Minimal string length
 		int m_MinLength;
-
-		//! \brief String data
-		char* m_Data;
 	};
 
 	//! \brief float type
 	class floatType : public BuiltinType {
+		friend class ProtocolDefinition;
 	public:
 		floatType(ProtocolDefinition& oProtocolDefinition);
-		virtual ~floatType();
 		virtual Type* Clone() const;
-		virtual int Fill(const DecodeState& oState);
+		virtual int Fill(const DecodeState& oState, Value& oValue) const;
 		virtual bool ParseNode(xmlNodePtr pNode);
-		virtual void Print(int iIndent) const;
-		virtual void GetHumanReadableContent(char* out, int outlen) const;
+		virtual void Accept(XProtocolVisitor& oVisitor, const Value& oValue) const;
+		virtual void GetHumanReadableContent(const Value& oValue, char* out, int outlen) const;
 		virtual int GetConstantSize() const;
+		virtual int GetValueSize() const;
 		virtual void GenerateCType(char* sType, char* sSuffix) const;
 		virtual void GenerateCInitialize(char* sCode, int iLength) const;
 
-	private:
-		//! \brief Float data
-		float* m_Number;
+		//! \brief Retrieve the number of values
+		int GetCount() const { return m_Count; }
 
+		//! \brief Retrieve the number of values to display, or -1 for all
+		int GetDisplayCount() const { return m_DisplayCount; }
+
+		//! \brief Retrieve a given value
+		float GetValue(const Value& oValue, int n) const { return static_cast<const float*>(oValue.m_Data)[n]; }
+
+	private:
 		//! \brief Number of values
 		int m_Count;
 
@@ -665,22 +1160,29 @@ public:
 
 	//! \brief double type
 	class doubleType : public BuiltinType {
+		friend class ProtocolDefinition;
 	public:
 		doubleType(ProtocolDefinition& oProtocolDefinition);
-		virtual ~doubleType();
 		virtual Type* Clone() const;
-		virtual int Fill(const DecodeState& oState);
+		virtual int Fill(const DecodeState& oState, Value& oValue) const;
 		virtual bool ParseNode(xmlNodePtr pNode);
-		virtual void Print(int iIndent) const;
-		virtual void GetHumanReadableContent(char* out, int outlen) const;
+		virtual void Accept(XProtocolVisitor& oVisitor, const Value& oValue) const;
+		virtual void GetHumanReadableContent(const Value& oValue, char* out, int outlen) const;
 		virtual int GetConstantSize() const;
+		virtual int GetValueSize() const;
 		virtual void GenerateCType(char* sType, char* sSuffix) const;
 		virtual void GenerateCInitialize(char* sCode, int iLength) const;
 
-	private:
-		//! \brief Float data
-		double* m_Number;
+		//! \brief Retrieve the number of values
+		int GetCount() const { return m_Count; }
+
+		//! \brief Retrieve the number of values to display, or -1 for all
+		int GetDisplayCount() const { return m_DisplayCount; }
+
+		//! \brief Retrieve a given value
+		double GetValue(const Value& oValue, int n) const { return static_cast<const double*>(oValue.m_Data)[n]; }
 
+	private:
 		//! \brief Number of values
 		int m_Count;
 
@@ -694,7 +1196,22 @@ public:
 	/*! \brief Set whether to print data offsets during printing
 	 *  \param b true to print offsets
 	 */
-	static bool SetPrintDataOffset(bool b) { s_MustPrintDataOffset = b; }
+	static void SetPrintDataOffset(bool b) { s_MustPrintDataOffset = b; }
+
+	/*! \brief Set whether Load() may use a schema cache
+	 *  \param b true to read and write cache files, the default
+	 *
+	 *  The cache lives next to the protocol definition file, as
+	 *  'protocol.xml.latest.cache' or 'protocol.xml.v<version>.cache'. It is
+	 *  keyed by the content of the definition file and only used if it
+	 *  matches exactly; it is rewritten whenever it doesn't.
+	 */
+	static void SetUseSchemaCache(bool b) { s_UseSchemaCache = b; }
+
+	typedef std::list<Packet*> TPacketPtrList;
+
+	//! \brief Fetches all registered packet types, in the order they are tried
+	const TPacketPtrList& GetPacketTypes() const { return m_Packet; }
 
 protected:
 	/*! \brief Looks a type up by name
@@ -734,20 +1251,47 @@ protected:
 	 */
 	bool ResolveStringToNumber(const char* sString, intmax_t& iNumber);
 
-	/*! \brief Indents to a given level
-	 *  \param iIndent Level to use
-	 */
-	static void PrintIndent(int iLevel);
-
 	bool ParseEnum(xmlNodePtr pNode);
 	bool ParseStruct(xmlNodePtr pNode);
 	bool ParsePacket(xmlNodePtr pNode);
 	bool ParseDefinition(xmlNodePtr pNode);
 
+	/*! \brief Parses protocol definitions
+	 *  \param pData XML content
+	 *  \param iLength Length of the content, in bytes
+	 *  \param sFilename File the content originates from
+	 *  \returns true on success
+	 */
+	bool ParseDocument(const char* pData, int iLength, const char* sFilename);
+
+	//! \brief Removes everything loaded, keeping registrations and built-in types
+	void Clear();
+
+	/*! \brief Loads definitions from a schema cache
+	 *  \param sCacheFile Cache file to use
+	 *  \param iSourceHash Hash of the protocol definition file content
+	 *  \returns true on success
+	 *
+	 *  On failure, nothing will be loaded; the cache is silently skipped if
+	 *  it does not exist or doesn't match.
+	 */
+	bool LoadCache(const char* sCacheFile, uint64_t iSourceHash);
+
+	/*! \brief Writes the loaded definitions to a schema cache
+	 *  \param sCacheFile Cache file to write
+	 *  \param iSourceHash Hash of the protocol definition file content
+	 *  \returns true on success
+	 */
+	bool SaveCache(const char* sCacheFile, uint64_t iSourceHash) const;
+
+	void WriteCacheStruct(SchemaCacheWriter& oWriter, const Struct& oStruct) const;
+	void WriteCacheField(SchemaCacheWriter& oWriter, const Field& oField) const;
+	bool ReadCacheStruct(SchemaCacheReader& oReader, Struct& oStruct);
+	bool ReadCacheField(SchemaCacheReader& oReader, Struct& oStruct);
+
 	typedef std::list<Type*> TTypePtrList;
 	typedef std::list<Enumeration*> TEnumerationPtrList;
 	typedef std::list<Annotation*> TAnnotationPtrList;
-	typedef std::list<Packet*> TPacketPtrList;
 	typedef std::list<Definition*> TDefinitionPtrList;
 	typedef std::list<Transformation*> TTransformationPtrList;
 
@@ -763,6 +1307,9 @@ protected:
 	//! \brief Fetches all registered types 
 	const TTypePtrList& GetTypes() const { return m_Types; }
 
+	//! \brief Types refined for individual fields, see Type::Refine()
+	std::list<const Type*> m_FieldTypes;
+
 	//! \brief All registered enumerations 
 	TEnumerationPtrList m_Enums;
 
@@ -781,17 +1328,54 @@ protected:
 	//! \brief All registered packet types
 	TPacketPtrList m_Packet;
 
-	//! \brief Fetches all registered packet types
-	const TPacketPtrList& GetPacketTypes() const { return m_Packet; }
-
 	/*! \brief Whether to print data offsets
 	 *
-	 *  This is here because all Type::Print() functions need to access it...
+	 *  This is here because the text output needs to access it...
 	 */
 	static bool s_MustPrintDataOffset;
 
+	//! \brief Whether Load() may use a schema cache
+	static bool s_UseSchemaCache;
+
 	//!  \brief Version to load
 	int m_Version;
+
+	//! \brief Fingerprint of the loaded definitions
+	uint32_t m_Fingerprint;
+
+	//! \brief Scratch memory used by Process()
+	DecodeArena m_Arena;
+
+	//! \brief Generated code to decode fields with, if any
+	XNativeDecoder* m_NativeDecoder;
+
+	//! \brief Packet classified but not yet materialized, if any
+	Packet* m_Pending;
+
+	//! \brief Data and subpacket index of m_Pending
+	const uint8_t* m_PendingData;
+	int m_PendingLength;
+	int m_PendingSubpacket;
+
+	//! \brief Whether annotations are collected rather than applied
+	bool m_DeferAnnotations;
+
+	//! \brief Annotations collected while decoding the most recent packet
+	std::vector<DeferredAnnotation> m_DeferredAnnotations;
+
+	/*! \brief Sets up the decoding state for a payload
+	 *  \param oState State to initialize
+	 *  \param pData Data to process
+	 *  \param iLength Length to process
+	 *  \param bProbe Whether only to classify
+	 */
+	void InitializeState(DecodeState& oState, const uint8_t* pData, int iLength, bool bProbe);
+
+	/*! \brief Adds a structure to a fingerprint
+	 *  \param oStruct Structure to add
+	 *  \param iHash Hash to update
+	 */
+	static void FingerprintStruct(const Struct& oStruct, uint32_t& iHash);
 };
 
 #endif /* __PROTOCOLDEFINITION_H__ */
@@ -17,254 +17,241 @@
 #include "protocoldefinition.h"
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <string>
 #include "dataannotation.h"
-	
+#include "outputbuffer.h"
+#include "protocoltextsink.h"
+
+void
+ProtocolDefinition::Type::Print(const Value& oValue, int iIndent) const
+{
+	ProtocolTextSink oSink(OutputBuffer::GetStdout(), iIndent);
+	Accept(oSink, oValue);
+}
+
 void
-ProtocolDefinition::Struct::GetHumanReadableContent(char* out, int outlen) const
+ProtocolDefinition::Struct::GetHumanReadableContent(const Value& oValue, char* out, int outlen) const
 {
 	snprintf(out, outlen, "<struct>");
 	out[outlen - 1] = '\0';
 }
 
 void
-ProtocolDefinition::Struct::Print(int iIndent) const
+ProtocolDefinition::Struct::Accept(XProtocolVisitor& oVisitor) const
 {
-	printf("struct '%s'\n", m_Name);
-	PrintFields(iIndent + 1);
+	oVisitor.BeginStruct(*this);
+	AcceptFields(oVisitor, GetValues());
+	oVisitor.EndStruct(*this);
 }
 
 void
-ProtocolDefinition::Struct::PrintFields(int iIndent) const
+ProtocolDefinition::Struct::Accept(XProtocolVisitor& oVisitor, const Value& oValue) const
 {
+	oVisitor.BeginStruct(*this);
+	AcceptFields(oVisitor, static_cast<const Value*>(oValue.m_Data));
+	oVisitor.EndStruct(*this);
+}
+
+void
+ProtocolDefinition::Struct::AcceptFields(XProtocolVisitor& oVisitor, const Value* pValues) const
+{
+	if (pValues == NULL)
+		return; // never filled
+
+	// Annotations may follow the final field
+	const Field* pLastField = NULL;
+	for (auto it = m_Actions.rbegin(); it != m_Actions.rend() && pLastField == NULL; it++)
+		pLastField = dynamic_cast<const Field*>(*it);
+
 	for (auto it = m_Actions.begin(); it != m_Actions.end(); it++) {
-		Field* pField = dynamic_cast<Field*>(*it);
+		const Field* pField = dynamic_cast<const Field*>(*it);
 		if (pField == NULL)
 			continue;
-		ProtocolDefinition::PrintIndent(iIndent);
-			printf("'%s'", pField->GetName());
-		if (ProtocolDefinition::MustPrintDataOffset())
-			printf(" @ 0x%x", pField->GetDataOffset());
-		printf(": ");
-		pField->GetType().Print(iIndent + 1);
-		// kludge to prevent newline after final member; Print() generally does that
-		if (*it != m_Actions.back())
-			printf("\n");
+		const Value& oValue = pValues[pField->GetIndex()];
+		bool bLast = pField == pLastField;
+		oVisitor.BeginField(*pField, oValue, bLast);
+		pField->GetType().Accept(oVisitor, oValue);
+		oVisitor.EndField(*pField, bLast);
 	}
 }
 
 void
-ProtocolDefinition::Subpacket::GetHumanReadableContent(char* out, int outlen) const
+ProtocolDefinition::Subpacket::GetHumanReadableContent(const Value& oValue, char* out, int outlen) const
 {
 	snprintf(out, outlen, "<subpacket>");
 	out[outlen - 1] = '\0';
 }
 
 void
-ProtocolDefinition::Subpacket::Print(int iIndent) const
+ProtocolDefinition::Subpacket::Accept(XProtocolVisitor& oVisitor) const
 {
-	ProtocolDefinition::PrintIndent(iIndent); printf("subpacket '%s'\n", m_Name);
-	PrintFields(iIndent + 1);
+	Accept(oVisitor, GetValues());
 }
 
 void
-ProtocolDefinition::Packet::GetHumanReadableContent(char* out, int outlen) const
+ProtocolDefinition::Subpacket::Accept(XProtocolVisitor& oVisitor, const Value* pValues) const
+{
+	oVisitor.BeginSubpacket(*this);
+	AcceptFields(oVisitor, pValues);
+	oVisitor.EndSubpacket(*this);
+}
+
+void
+ProtocolDefinition::Packet::GetHumanReadableContent(const Value& oValue, char* out, int outlen) const
 {
 	snprintf(out, outlen, "<packet>");
 	out[outlen - 1] = '\0';
 }
 
 void
-ProtocolDefinition::Packet::Print(int iIndent) const
+ProtocolDefinition::Packet::Accept(XProtocolVisitor& oVisitor) const
+{
+	Accept(oVisitor, GetValues(), m_LastSubpacket, m_LastSubpacket != NULL ? m_LastSubpacket->GetValues() : NULL);
+}
+
+void
+ProtocolDefinition::Packet::Accept(XProtocolVisitor& oVisitor, const Value* pValues, const Subpacket* pSubpacket, const Value* pSubpacketValues) const
+{
+	oVisitor.BeginPacket(*this);
+	AcceptFields(oVisitor, pValues);
+	if (pSubpacket != NULL)
+		pSubpacket->Accept(oVisitor, pSubpacketValues);
+	oVisitor.EndPacket(*this);
+}
+
+void
+ProtocolDefinition::DetachedPacket::Accept(XProtocolVisitor& oVisitor) const
 {
-	ProtocolDefinition::PrintIndent(iIndent); printf("packet '%s'\n", m_Name);
-	PrintFields(iIndent + 1);
-	if (m_LastSubpacket != NULL)
-		m_LastSubpacket->Print(iIndent + 1);
+	if (m_Packet == NULL)
+		return;
+	const Copy* pPacketCopy = Find(m_Packet);
+	const Copy* pSubpacketCopy = m_Subpacket != NULL ? Find(m_Subpacket) : NULL;
+	m_Packet->Accept(oVisitor, pPacketCopy->m_Values.data(), m_Subpacket, pSubpacketCopy != NULL ? pSubpacketCopy->m_Values.data() : NULL);
 }
 
 void
-ProtocolDefinition::unsignedType::GetHumanReadableContent(char* out, int outlen) const
+ProtocolDefinition::unsignedType::GetHumanReadableContent(const Value& oValue, char* out, int outlen) const
 {
 	out[outlen - 1] = '\0'; // ensure \0-termination
 
+	uint32_t iValue = GetValue(oValue, 0);
 	if (m_Enumeration != NULL) {
-		Enumeration::TValue sValue = m_Enumeration->Lookup(m_Value[0]);
+		Enumeration::TValue sValue = m_Enumeration->Lookup(iValue);
 		// Be careful: if we also have an annotation configured and the enumeration doesn't work, pass it through
 		if (sValue != NULL || m_Annotation == NULL) {
-			snprintf(out, outlen - 1, m_Format == F_DECIMAL ? "%s <%u>" : "%s <0x%x>", sValue != NULL ? sValue : "?", m_Value[0]);
+			snprintf(out, outlen - 1, m_Format == F_DECIMAL ? "%s <%u>" : "%s <0x%x>", sValue != NULL ? sValue : "?", iValue);
 			return;
 		}
 	}
 	if (m_Annotation != NULL) {
-		const char* sValue = m_Annotation->GetProvider().Lookup(m_Value[0]);
-		snprintf(out, outlen - 1, m_Format == F_DECIMAL ? "%s <%u>" : "%s <0x%x>", sValue, m_Value[0]);
+		const char* sValue = m_Annotation->GetProvider().Lookup(iValue);
+		snprintf(out, outlen - 1, m_Format == F_DECIMAL ? "%s <%u>" : "%s <0x%x>", sValue, iValue);
 		return;
 	}
 
 	if (m_Count != 1) {
 		snprintf(out, outlen - 1, "<length %d>", m_Count);
 	} else {
-		snprintf(out, outlen - 1, m_Format == F_DECIMAL ? "%u" : "0x%x", m_Value[0]);
+		snprintf(out, outlen - 1, m_Format == F_DECIMAL ? "%u" : "0x%x", iValue);
 	}
 }
 
 void
-ProtocolDefinition::unsignedType::Print(int iIndent) const
+ProtocolDefinition::unsignedType::Accept(XProtocolVisitor& oVisitor, const Value& oValue) const
 {
-	if (m_Count == 1) {
-		char tmp[256];
-		GetHumanReadableContent(tmp, sizeof(tmp));
-		printf("%s", tmp);
-	} else {
-		int iCount = m_Count;
-		if (m_DisplayCount >= 0)
-			iCount = m_DisplayCount;
-		for (int n = 0; n < iCount; n++) {
-			if (n > 0)
-				printf(" ");
-			printf(m_Format == F_DECIMAL ? "%u" : "0x%x", m_Value[n]);
-		}
-	}
+	oVisitor.VisitUnsigned(*this, oValue);
 }
 
 void
-ProtocolDefinition::signedType::GetHumanReadableContent(char* out, int outlen) const
+ProtocolDefinition::signedType::GetHumanReadableContent(const Value& oValue, char* out, int outlen) const
 {
 	// In case of non-decimal or enumerations, assume the user meant unsigned
 	if (m_Format != F_DECIMAL || m_Enumeration != NULL || m_Count != 1) {
-		ProtocolDefinition::unsignedType::GetHumanReadableContent(out, outlen);
+		ProtocolDefinition::unsignedType::GetHumanReadableContent(oValue, out, outlen);
 		return;
 	}
 	out[outlen - 1] = '\0'; // ensure \0-termination
-	snprintf(out, outlen - 1, "%d", m_Value[0]);
+	snprintf(out, outlen - 1, "%d", GetValue(oValue, 0));
 }
 
 void
-ProtocolDefinition::signedType::Print(int iIndent) const
+ProtocolDefinition::signedType::Accept(XProtocolVisitor& oVisitor, const Value& oValue) const
 {
-	// In case of non-decimal or enumerations, assume the user meant unsigned
-	if (m_Format != F_DECIMAL || m_Enumeration != NULL || m_Count != 1) {
-		ProtocolDefinition::unsignedType::Print(iIndent);
-		return;
-	}
-
-	int iCount = m_Count;
-	if (m_DisplayCount >= 0)
-		iCount = m_DisplayCount;
-	for (int n = 0; n < iCount; n++) {
-		if (n > 0)
-			printf(" ");
-		printf(m_Format == F_DECIMAL ? "%d" : "0x%x", m_Value[n]);
-	}
+	oVisitor.VisitSigned(*this, oValue);
 }
 
 void
-ProtocolDefinition::stringType::GetHumanReadableContent(char* out, int outlen) const
+ProtocolDefinition::stringType::GetHumanReadableContent(const Value& oValue, char* out, int outlen) const
 {
 	out[outlen - 1] = '\0'; // ensure \0-termination
-	snprintf(out, outlen - 1, "'%s'", m_Data);
+	snprintf(out, outlen - 1, "'%s'", GetValue(oValue));
 }
 
 void
-ProtocolDefinition::stringType::Print(int iIndent) const
+ProtocolDefinition::stringType::Accept(XProtocolVisitor& oVisitor, const Value& oValue) const
 {
-	printf("'");
-	for (unsigned int n = 0; n < m_Length; n++) {
-		if (m_Data[n] == '\0')
-			break;
-		printf("%c", m_Data[n]);
-	}
-	printf("'");
+	oVisitor.VisitString(*this, oValue);
 }
 
 void
-ProtocolDefinition::floatType::GetHumanReadableContent(char* out, int outlen) const
+ProtocolDefinition::floatType::GetHumanReadableContent(const Value& oValue, char* out, int outlen) const
 {
 	out[outlen - 1] = '\0'; // ensure \0-termination
 	if (m_Count != 1) {
 		snprintf(out, outlen - 1, "<length %d>", m_Count);
 	} else {
-		snprintf(out, outlen - 1, "%.2f", m_Number[0]);
+		snprintf(out, outlen - 1, "%.2f", GetValue(oValue, 0));
 	}
 }
 
 void
-ProtocolDefinition::floatType::Print(int iIndent) const
+ProtocolDefinition::floatType::Accept(XProtocolVisitor& oVisitor, const Value& oValue) const
 {
-	int iCount = m_Count;
-	if (m_DisplayCount >= 0)
-		iCount = m_DisplayCount;
-	for (int n = 0; n < iCount; n++) {
-		if (n > 0)
-			printf(" ");
-		printf("%.2f", m_Number[n]);
-	}
+	oVisitor.VisitFloat(*this, oValue);
 }
 
 void
-ProtocolDefinition::doubleType::GetHumanReadableContent(char* out, int outlen) const
+ProtocolDefinition::doubleType::GetHumanReadableContent(const Value& oValue, char* out, int outlen) const
 {
 	out[outlen - 1] = '\0'; // ensure \0-termination
 	if (m_Count != 1) {
 		snprintf(out, outlen - 1, "<length %d>", m_Count);
 	} else {
-		snprintf(out, outlen - 1, "%g", m_Number[0]);
+		snprintf(out, outlen - 1, "%g", GetValue(oValue, 0));
 	}
 }
 
 void
-ProtocolDefinition::doubleType::Print(int iIndent) const
+ProtocolDefinition::doubleType::Accept(XProtocolVisitor& oVisitor, const Value& oValue) const
 {
-	int iCount = m_Count;
-	if (m_DisplayCount >= 0)
-		iCount = m_DisplayCount;
-	for (int n = 0; n < iCount; n++) {
-		if (n > 0)
-			printf(" ");
-		printf("%g", m_Number[n]);
-	}
+	oVisitor.VisitDouble(*this, oValue);
 }
 
 void
-ProtocolDefinition::lengthType::GetHumanReadableContent(char* out, int outlen) const
+ProtocolDefinition::lengthType::GetHumanReadableContent(const Value& oValue, char* out, int outlen) const
 {
 	out[outlen - 1] = '\0'; // ensure \0-termination
-	snprintf(out, outlen - 1, "%x", m_Value);
+	snprintf(out, outlen - 1, "%x", GetValue(oValue));
 }
 
 void
-ProtocolDefinition::lengthType::Print(int iIndent) const
+ProtocolDefinition::lengthType::Accept(XProtocolVisitor& oVisitor, const Value& oValue) const
 {
-	printf("%x", m_Value);
+	oVisitor.VisitLength(*this, oValue);
 }
 
 void
-ProtocolDefinition::unixtimeType::GetHumanReadableContent(char* out, int outlen) const
+ProtocolDefinition::unixtimeType::GetHumanReadableContent(const Value& oValue, char* out, int outlen) const
 {
 	out[outlen - 1] = '\0'; // ensure \0-termination
-	snprintf(out, outlen - 1, "%x", m_Value);
-}
-
-void
-ProtocolDefinition::unixtimeType::Print(int iIndent) const
-{
-	time_t t = m_Value;
-	struct tm tm;
-	if (gmtime_r(&t, &tm) != NULL) {
-		printf("%04d-%02d-%02d %02d:%02d:%02d <%d>",
-		 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-		 m_Value);
-	} else {
-		printf("? <%d>", m_Value);
-	}
+	snprintf(out, outlen - 1, "%x", GetValue(oValue));
 }
 
 void
-ProtocolDefinition::PrintIndent(int iIndent)
+ProtocolDefinition::unixtimeType::Accept(XProtocolVisitor& oVisitor, const Value& oValue) const
 {
-	for (int n = 0; n < iIndent; n++)
-		printf(" ");
+	oVisitor.VisitUnixTime(*this, oValue);
 }
 
 /* vim:set ts=2 sw=2: */
@@ -0,0 +1,382 @@
+/*
+ * Runes of Magic protocol analysis - JSON Lines protocol output
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "protocoljsonsink.h"
+#include <math.h>
+#include <stdio.h>
+#include "dataannotation.h"
+#include "outputbuffer.h"
+
+static const char s_HexTab[16] = {
+	'0', '1', '2', '3', '4', '5', '6', '7',
+	'8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+};
+
+ProtocolJSONSink::ProtocolJSONSink(OutputBuffer& oBuffer)
+	: m_Buffer(oBuffer), m_NeedSeparator(false), m_HaveSubpacket(false)
+{
+}
+
+void
+ProtocolJSONSink::BeginRecord()
+{
+	m_Buffer.AppendChar('{');
+	m_NeedSeparator = false;
+}
+
+void
+ProtocolJSONSink::EndRecord()
+{
+	m_Buffer.Append("}\n", 2);
+	m_Buffer.Batch();
+}
+
+void
+ProtocolJSONSink::AppendKey(const char* sKey)
+{
+	if (m_NeedSeparator)
+		m_Buffer.AppendChar(',');
+	m_Buffer.AppendChar('"');
+	m_Buffer.Append(sKey); // keys are identifiers and need no escaping
+	m_Buffer.Append("\":", 2);
+}
+
+/*! \brief Determines the length of a valid UTF-8 sequence
+ *  \param pData Data to check, starting at the lead byte
+ *  \param iLength Number of bytes available
+ *  \returns Length of the sequence, or 0 if it isn't valid
+ *
+ *  Overlong forms, surrogates and anything beyond U+10FFFF are invalid.
+ */
+static int
+GetUTF8Length(const uint8_t* pData, int iLength)
+{
+	int iSeqLength;
+	uint8_t iMin = 0x80, iMax = 0xbf; // range of the second byte
+	if (pData[0] >= 0xc2 && pData[0] <= 0xdf)
+		iSeqLength = 2;
+	else if (pData[0] >= 0xe0 && pData[0] <= 0xef) {
+		iSeqLength = 3;
+		if (pData[0] == 0xe0)
+			iMin = 0xa0;
+		else if (pData[0] == 0xed)
+			iMax = 0x9f;
+	} else if (pData[0] >= 0xf0 && pData[0] <= 0xf4) {
+		iSeqLength = 4;
+		if (pData[0] == 0xf0)
+			iMin = 0x90;
+		else if (pData[0] == 0xf4)
+			iMax = 0x8f;
+	} else
+		return 0;
+
+	if (iSeqLength > iLength || pData[1] < iMin || pData[1] > iMax)
+		return 0;
+	for (int n = 2; n < iSeqLength; n++)
+		if ((pData[n] & 0xc0) != 0x80)
+			return 0;
+	return iSeqLength;
+}
+
+void
+ProtocolJSONSink::AppendString(const char* pData, int iMaxLength)
+{
+	m_Buffer.AppendChar('"');
+	for (int n = 0; n < iMaxLength; n++) {
+		uint8_t ch = pData[n];
+		if (ch == '\0')
+			break;
+		if (ch >= 0x20 && ch < 0x80 && ch != '"' && ch != '\\') {
+			m_Buffer.AppendChar(ch);
+			continue;
+		}
+		if (ch >= 0x80) {
+			// Valid UTF-8 is kept as-is; the string ends at a '\0', which is never part of a sequence
+			int iSeqLength = GetUTF8Length((const uint8_t*)pData + n, iMaxLength - n);
+			if (iSeqLength > 0) {
+				m_Buffer.Append(pData + n, iSeqLength);
+				n += iSeqLength - 1;
+				continue;
+			}
+		}
+
+		switch(ch) {
+			case '"':  m_Buffer.Append("\\\"", 2); break;
+			case '\\': m_Buffer.Append("\\\\", 2); break;
+			case '\n': m_Buffer.Append("\\n", 2); break;
+			case '\r': m_Buffer.Append("\\r", 2); break;
+			case '\t': m_Buffer.Append("\\t", 2); break;
+			default: {
+				// Control characters and bytes which aren't valid UTF-8; the latter are taken as Latin-1
+				char tmp[6] = { '\\', 'u', '0', '0', s_HexTab[ch >> 4], s_HexTab[ch & 0xf] };
+				m_Buffer.Append(tmp, sizeof(tmp));
+				break;
+			}
+		}
+	}
+	m_Buffer.AppendChar('"');
+}
+
+void
+ProtocolJSONSink::AppendReal(double dValue, int iPrecision)
+{
+	if (!isfinite(dValue)) {
+		m_Buffer.Append("null", 4); // JSON has no NaN/infinity
+		return;
+	}
+	char* pOut = m_Buffer.Reserve(32);
+	m_Buffer.Commit(snprintf(pOut, 32, "%.*g", iPrecision, dValue));
+}
+
+void
+ProtocolJSONSink::AppendNamedValue(const ProtocolDefinition::unsignedType& oType, uint32_t iValue)
+{
+	const ProtocolDefinition::Enumeration* pEnumeration = oType.GetEnumeration();
+	const ProtocolDefinition::Annotation* pAnnotation = oType.GetAnnotation();
+	if (pEnumeration == NULL && pAnnotation == NULL) {
+		m_Buffer.AppendUnsigned(iValue);
+		return;
+	}
+
+	// Same precedence as the text output: enumeration first, annotation if that fails
+	const char* sName = NULL;
+	if (pEnumeration != NULL)
+		sName = pEnumeration->Lookup(iValue);
+	if (sName == NULL && pAnnotation != NULL)
+		sName = pAnnotation->GetProvider().Lookup(iValue);
+
+	m_Buffer.Append("{\"value\":", 9);
+	m_Buffer.AppendUnsigned(iValue);
+	m_Buffer.Append(",\"name\":", 8);
+	if (sName != NULL)
+		AppendString(sName, strlen(sName));
+	else
+		m_Buffer.Append("null", 4);
+	m_Buffer.AppendChar('}');
+}
+
+void
+ProtocolJSONSink::AddUnsigned(const char* sKey, uint32_t iValue)
+{
+	AppendKey(sKey);
+	m_Buffer.AppendUnsigned(iValue);
+	m_NeedSeparator = true;
+}
+
+void
+ProtocolJSONSink::AddBool(const char* sKey, bool bValue)
+{
+	AppendKey(sKey);
+	if (bValue)
+		m_Buffer.Append("true", 4);
+	else
+		m_Buffer.Append("false", 5);
+	m_NeedSeparator = true;
+}
+
+void
+ProtocolJSONSink::AddString(const char* sKey, const char* sValue)
+{
+	AppendKey(sKey);
+	AppendString(sValue, strlen(sValue));
+	m_NeedSeparator = true;
+}
+
+void
+ProtocolJSONSink::AddHexData(const char* sKey, const uint8_t* pData, int iLength)
+{
+	AppendKey(sKey);
+	char* pOut = m_Buffer.Reserve(iLength * 2 + 2);
+	*pOut++ = '"';
+	for (int n = 0; n < iLength; n++) {
+		*pOut++ = s_HexTab[pData[n] >> 4];
+		*pOut++ = s_HexTab[pData[n] & 0xf];
+	}
+	*pOut++ = '"';
+	m_Buffer.Commit(iLength * 2 + 2);
+	m_NeedSeparator = true;
+}
+
+void
+ProtocolJSONSink::BeginPacket(const ProtocolDefinition::Packet& oPacket)
+{
+	AppendKey("packet");
+	m_Buffer.Append("{\"name\":", 8);
+	AppendString(oPacket.GetName(), strlen(oPacket.GetName()));
+	m_Buffer.Append(",\"fields\":{", 11);
+	m_NeedSeparator = false;
+	m_HaveSubpacket = false;
+}
+
+void
+ProtocolJSONSink::EndPacket(const ProtocolDefinition::Packet& oPacket)
+{
+	// The subpacket already closed the header fields
+	if (m_HaveSubpacket)
+		m_Buffer.AppendChar('}');
+	else
+		m_Buffer.Append("}}", 2);
+	m_NeedSeparator = true;
+}
+
+void
+ProtocolJSONSink::BeginSubpacket(const ProtocolDefinition::Subpacket& oSubpacket)
+{
+	m_Buffer.Append("},\"subpacket\":{\"name\":", 22);
+	AppendString(oSubpacket.GetName(), strlen(oSubpacket.GetName()));
+	m_Buffer.Append(",\"fields\":{", 11);
+	m_NeedSeparator = false;
+	m_HaveSubpacket = true;
+}
+
+void
+ProtocolJSONSink::EndSubpacket(const ProtocolDefinition::Subpacket& oSubpacket)
+{
+	m_Buffer.Append("}}", 2);
+}
+
+void
+ProtocolJSONSink::BeginStruct(const ProtocolDefinition::Struct& oStruct)
+{
+	m_Buffer.AppendChar('{');
+	m_NeedSeparator = false;
+}
+
+void
+ProtocolJSONSink::EndStruct(const ProtocolDefinition::Struct& oStruct)
+{
+	m_Buffer.AppendChar('}');
+}
+
+void
+ProtocolJSONSink::BeginField(const ProtocolDefinition::Field& oField, const ProtocolDefinition::Value& oValue, bool bLast)
+{
+	AppendKey(oField.GetName());
+}
+
+void
+ProtocolJSONSink::EndField(const ProtocolDefinition::Field& oField, bool bLast)
+{
+	m_NeedSeparator = true;
+}
+
+void
+ProtocolJSONSink::VisitUnsigned(const ProtocolDefinition::unsignedType& oType, const ProtocolDefinition::Value& oValue)
+{
+	int iNum = oValue.m_Num;
+	if (oType.GetCount() == 1) {
+		if (iNum > 0)
+			AppendNamedValue(oType, oType.GetValue(oValue, 0));
+		else
+			m_Buffer.Append("null", 4);
+		return;
+	}
+
+	m_Buffer.AppendChar('[');
+	for (int n = 0; n < iNum; n++) {
+		if (n > 0)
+			m_Buffer.AppendChar(',');
+		AppendNamedValue(oType, oType.GetValue(oValue, n));
+	}
+	m_Buffer.AppendChar(']');
+}
+
+void
+ProtocolJSONSink::VisitSigned(const ProtocolDefinition::signedType& oType, const ProtocolDefinition::Value& oValue)
+{
+	// Enumerations are looked up by their unsigned value
+	if (oType.GetEnumeration() != NULL) {
+		VisitUnsigned(oType, oValue);
+		return;
+	}
+
+	int iNum = oValue.m_Num;
+	int iShift = 32 - oType.GetWidth() * 8;
+	if (oType.GetCount() != 1)
+		m_Buffer.AppendChar('[');
+	else if (iNum == 0)
+		m_Buffer.Append("null", 4);
+	for (int n = 0; n < iNum; n++) {
+		if (n > 0)
+			m_Buffer.AppendChar(',');
+		// Sign-extend from the type width
+		m_Buffer.AppendSigned((int32_t)(oType.GetValue(oValue, n) << iShift) >> iShift);
+	}
+	if (oType.GetCount() != 1)
+		m_Buffer.AppendChar(']');
+}
+
+void
+ProtocolJSONSink::VisitLength(const ProtocolDefinition::lengthType& oType, const ProtocolDefinition::Value& oValue)
+{
+	m_Buffer.AppendUnsigned(oType.GetValue(oValue));
+}
+
+void
+ProtocolJSONSink::VisitUnixTime(const ProtocolDefinition::unixtimeType& oType, const ProtocolDefinition::Value& oValue)
+{
+	m_Buffer.AppendUnsigned(oType.GetValue(oValue));
+}
+
+void
+ProtocolJSONSink::VisitString(const ProtocolDefinition::stringType& oType, const ProtocolDefinition::Value& oValue)
+{
+	AppendString(oType.GetValue(oValue), oValue.m_Num);
+}
+
+void
+ProtocolJSONSink::VisitFloat(const ProtocolDefinition::floatType& oType, const ProtocolDefinition::Value& oValue)
+{
+	int iNum = oValue.m_Num;
+	if (oType.GetCount() == 1) {
+		if (iNum > 0)
+			AppendReal(oType.GetValue(oValue, 0), 9);
+		else
+			m_Buffer.Append("null", 4);
+		return;
+	}
+
+	m_Buffer.AppendChar('[');
+	for (int n = 0; n < iNum; n++) {
+		if (n > 0)
+			m_Buffer.AppendChar(',');
+		AppendReal(oType.GetValue(oValue, n), 9);
+	}
+	m_Buffer.AppendChar(']');
+}
+
+void
+ProtocolJSONSink::VisitDouble(const ProtocolDefinition::doubleType& oType, const ProtocolDefinition::Value& oValue)
+{
+	int iNum = oValue.m_Num;
+	if (oType.GetCount() == 1) {
+		if (iNum > 0)
+			AppendReal(oType.GetValue(oValue, 0), 17);
+		else
+			m_Buffer.Append("null", 4);
+		return;
+	}
+
+	m_Buffer.AppendChar('[');
+	for (int n = 0; n < iNum; n++) {
+		if (n > 0)
+			m_Buffer.AppendChar(',');
+		AppendReal(oType.GetValue(oValue, n), 17);
+	}
+	m_Buffer.AppendChar(']');
+}
+
+/* vim:set ts=2 sw=2: */
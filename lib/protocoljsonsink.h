@@ -0,0 +1,119 @@
+/*
+ * Runes of Magic protocol analysis - JSON Lines protocol output
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __PROTOCOLJSONSINK_H__
+#define __PROTOCOLJSONSINK_H__
+
+#include "protocolvisitor.h"
+
+class OutputBuffer;
+
+/*! \brief Writes decoded content as JSON Lines
+ *
+ *  Every record is a single JSON object on a line of its own. The caller
+ *  opens a record using BeginRecord(), may add metadata using the Add...()
+ *  functions and lets a packet Accept() the sink to add the decoded
+ *  content; EndRecord() terminates the record.
+ */
+class ProtocolJSONSink : public XProtocolVisitor {
+public:
+	/*! \brief Constructs a JSON Lines sink
+	 *  \param oBuffer Buffer to write to
+	 */
+	ProtocolJSONSink(OutputBuffer& oBuffer);
+
+	//! \brief Starts a new record
+	void BeginRecord();
+
+	//! \brief Terminates the current record
+	void EndRecord();
+
+	/*! \brief Adds an unsigned value to the current object
+	 *  \param sKey Key to use
+	 *  \param iValue Value to add
+	 */
+	void AddUnsigned(const char* sKey, uint32_t iValue);
+
+	/*! \brief Adds a boolean value to the current object
+	 *  \param sKey Key to use
+	 *  \param bValue Value to add
+	 */
+	void AddBool(const char* sKey, bool bValue);
+
+	/*! \brief Adds a string value to the current object
+	 *  \param sKey Key to use
+	 *  \param sValue \0-terminated string to add
+	 */
+	void AddString(const char* sKey, const char* sValue);
+
+	/*! \brief Adds binary data as a hex string to the current object
+	 *  \param sKey Key to use
+	 *  \param pData Data to add
+	 *  \param iLength Number of bytes to add
+	 */
+	void AddHexData(const char* sKey, const uint8_t* pData, int iLength);
+
+	virtual void BeginPacket(const ProtocolDefinition::Packet& oPacket);
+	virtual void EndPacket(const ProtocolDefinition::Packet& oPacket);
+	virtual void BeginSubpacket(const ProtocolDefinition::Subpacket& oSubpacket);
+	virtual void EndSubpacket(const ProtocolDefinition::Subpacket& oSubpacket);
+	virtual void BeginStruct(const ProtocolDefinition::Struct& oStruct);
+	virtual void EndStruct(const ProtocolDefinition::Struct& oStruct);
+	virtual void BeginField(const ProtocolDefinition::Field& oField, const ProtocolDefinition::Value& oValue, bool bLast);
+	virtual void EndField(const ProtocolDefinition::Field& oField, bool bLast);
+	virtual void VisitUnsigned(const ProtocolDefinition::unsignedType& oType, const ProtocolDefinition::Value& oValue);
+	virtual void VisitSigned(const ProtocolDefinition::signedType& oType, const ProtocolDefinition::Value& oValue);
+	virtual void VisitLength(const ProtocolDefinition::lengthType& oType, const ProtocolDefinition::Value& oValue);
+	virtual void VisitUnixTime(const ProtocolDefinition::unixtimeType& oType, const ProtocolDefinition::Value& oValue);
+	virtual void VisitString(const ProtocolDefinition::stringType& oType, const ProtocolDefinition::Value& oValue);
+	virtual void VisitFloat(const ProtocolDefinition::floatType& oType, const ProtocolDefinition::Value& oValue);
+	virtual void VisitDouble(const ProtocolDefinition::doubleType& oType, const ProtocolDefinition::Value& oValue);
+
+protected:
+	/*! \brief Appends an object key, preceded by a separator if needed
+	 *  \param sKey Key to append
+	 */
+	void AppendKey(const char* sKey);
+
+	/*! \brief Appends an escaped string
+	 *  \param pData String to append
+	 *  \param iMaxLength Maximum number of bytes; stops at \0 as well
+	 */
+	void AppendString(const char* pData, int iMaxLength);
+
+	/*! \brief Appends a floating point value
+	 *  \param dValue Value to append
+	 *  \param iPrecision Number of significant digits
+	 */
+	void AppendReal(double dValue, int iPrecision);
+
+	/*! \brief Appends an unsigned value, including its symbolic name if any
+	 *  \param oType Type to use
+	 *  \param iValue Value to append
+	 */
+	void AppendNamedValue(const ProtocolDefinition::unsignedType& oType, uint32_t iValue);
+
+	//! \brief Buffer to write to
+	OutputBuffer& m_Buffer;
+
+	//! \brief Must a separator precede the next key?
+	bool m_NeedSeparator;
+
+	//! \brief Is a subpacket object currently open?
+	bool m_HaveSubpacket;
+};
+
+#endif /* __PROTOCOLJSONSINK_H__ */
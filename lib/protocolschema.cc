@@ -0,0 +1,254 @@
+/*
+ * Runes of Magic protocol analysis - reloadable protocol definitions
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "protocolschema.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace {
+
+//! \brief Time to wait for more changes before reloading, in milliseconds
+const int s_SettleTime = 100;
+
+} // unnamed namespace
+
+ProtocolSchema::ProtocolSchema()
+	: m_Version(-1), m_Generation(0), m_NotifyFD(-1), m_Stop(false)
+{
+	m_WakeupPipe[0] = -1;
+	m_WakeupPipe[1] = -1;
+}
+
+ProtocolSchema::~ProtocolSchema()
+{
+	StopWatching();
+}
+
+void
+ProtocolSchema::RegisterTransformation(const char* sName, XDataTransformation& oDataTransformation)
+{
+	m_Transformations.push_back(Registration<XDataTransformation>(sName, oDataTransformation));
+}
+
+void
+ProtocolSchema::RegisterAnnotation(const char* sName, XDataAnnotation& oAnnotation)
+{
+	m_Annotations.push_back(Registration<XDataAnnotation>(sName, oAnnotation));
+}
+
+bool
+ProtocolSchema::Load(const char* sFilename, int iVersion)
+{
+	{
+		std::lock_guard<std::mutex> oLock(m_LoadMutex);
+		m_Filename = sFilename;
+		m_Version = iVersion;
+	}
+	return Reload();
+}
+
+bool
+ProtocolSchema::Reload()
+{
+	std::lock_guard<std::mutex> oLock(m_LoadMutex);
+
+	TDefinitionPtr pDefinition = Create();
+	if (pDefinition == NULL)
+		return false;
+
+	// Readers pick the new definitions up using the generation, so it must be
+	// bumped only once they are in place
+	std::atomic_store(&m_Current, pDefinition);
+	m_Generation.fetch_add(1, std::memory_order_release);
+	return true;
+}
+
+ProtocolSchema::TDefinitionPtr
+ProtocolSchema::Create()
+{
+	TDefinitionPtr pDefinition(new ProtocolDefinition);
+	for (auto it = m_Transformations.begin(); it != m_Transformations.end(); it++)
+		pDefinition->RegisterTransformation(it->m_Name.c_str(), *it->m_Provider, false);
+	for (auto it = m_Annotations.begin(); it != m_Annotations.end(); it++)
+		pDefinition->RegisterAnnotation(it->m_Name.c_str(), *it->m_Provider, false);
+	if (!pDefinition->Load(m_Filename.c_str(), m_Version))
+		return TDefinitionPtr();
+	return pDefinition;
+}
+
+ProtocolSchema::TDefinitionPtr
+ProtocolSchema::Instantiate(unsigned int& iGeneration)
+{
+	// Nothing can be published while we hold the lock
+	std::lock_guard<std::mutex> oLock(m_LoadMutex);
+	iGeneration = GetGeneration();
+	if (m_Filename.empty())
+		return TDefinitionPtr();
+	return Create();
+}
+
+bool
+ProtocolSchema::Refresh(TDefinitionPtr& pDefinition, unsigned int& iGeneration) const
+{
+	unsigned int iCurrent = GetGeneration();
+	if (iCurrent == iGeneration)
+		return false;
+
+	// Anything published after this load will be noticed next time
+	pDefinition = Get();
+	iGeneration = iCurrent;
+	return true;
+}
+
+bool
+ProtocolSchema::StartWatching(bool bWatchFile)
+{
+	if (m_Thread.joinable())
+		return true;
+	if (pipe2(m_WakeupPipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+		fprintf(stderr, "ProtocolSchema::StartWatching(): cannot create pipe: %s\n", strerror(errno));
+		return false;
+	}
+
+	if (bWatchFile) {
+		/*
+		 * Editors tend to write a new file and rename it over the original,
+		 * which inotify on the file itself would not notice; watch the
+		 * directory instead and match by name.
+		 */
+		std::string sDirectory(".");
+		std::string::size_type iSlash = m_Filename.rfind('/');
+		if (iSlash != std::string::npos)
+			sDirectory = m_Filename.substr(0, iSlash + 1);
+
+		m_NotifyFD = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+		if (m_NotifyFD < 0 || inotify_add_watch(m_NotifyFD, sDirectory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+			fprintf(stderr, "ProtocolSchema::StartWatching(): cannot watch '%s': %s\n", sDirectory.c_str(), strerror(errno));
+			StopWatching();
+			return false;
+		}
+	}
+
+	m_Stop = false;
+	m_Thread = std::thread(&ProtocolSchema::Watch, this);
+	return true;
+}
+
+void
+ProtocolSchema::StopWatching()
+{
+	if (m_Thread.joinable()) {
+		m_Stop = true;
+		RequestReload();
+		m_Thread.join();
+	}
+	if (m_NotifyFD >= 0)
+		close(m_NotifyFD);
+	m_NotifyFD = -1;
+	for (int n = 0; n < 2; n++) {
+		if (m_WakeupPipe[n] >= 0)
+			close(m_WakeupPipe[n]);
+		m_WakeupPipe[n] = -1;
+	}
+}
+
+void
+ProtocolSchema::RequestReload()
+{
+	// Only async-signal-safe calls here; a full pipe means a reload is pending anyway
+	int iSavedErrno = errno;
+	if (m_WakeupPipe[1] >= 0) {
+		char ch = 0;
+		if (write(m_WakeupPipe[1], &ch, 1) < 0) {
+			/* nothing */
+		}
+	}
+	errno = iSavedErrno;
+}
+
+void
+ProtocolSchema::Watch()
+{
+	std::string sName(m_Filename);
+	std::string::size_type iSlash = sName.rfind('/');
+	if (iSlash != std::string::npos)
+		sName = sName.substr(iSlash + 1);
+
+	int iTimeout = -1;
+	while (!m_Stop) {
+		struct pollfd fds[2];
+		int iNumFDs = 0;
+		fds[iNumFDs].fd = m_WakeupPipe[0];
+		fds[iNumFDs].events = POLLIN;
+		iNumFDs++;
+		if (m_NotifyFD >= 0) {
+			fds[iNumFDs].fd = m_NotifyFD;
+			fds[iNumFDs].events = POLLIN;
+			iNumFDs++;
+		}
+
+		int iResult = poll(fds, iNumFDs, iTimeout);
+		if (iResult < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "ProtocolSchema::Watch(): poll failed: %s\n", strerror(errno));
+			break;
+		}
+		if (iResult == 0) {
+			// The file has settled down; pick up the changes
+			iTimeout = -1;
+			if (!Reload())
+				fprintf(stderr, "ProtocolSchema::Watch(): cannot reload '%s', keeping previous definitions\n", m_Filename.c_str());
+			continue;
+		}
+
+		bool bReload = false;
+		if (fds[0].revents & POLLIN) {
+			char buf[64];
+			while (read(m_WakeupPipe[0], buf, sizeof(buf)) > 0)
+				bReload = true;
+		}
+		if (m_Stop)
+			break;
+		if (bReload) {
+			// Explicitly requested, so no need to wait
+			iTimeout = -1;
+			if (!Reload())
+				fprintf(stderr, "ProtocolSchema::Watch(): cannot reload '%s', keeping previous definitions\n", m_Filename.c_str());
+			continue;
+		}
+
+		if (iNumFDs > 1 && (fds[1].revents & POLLIN)) {
+			char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+			ssize_t iLength;
+			while ((iLength = read(m_NotifyFD, buf, sizeof(buf))) > 0) {
+				for (char* ptr = buf; ptr < buf + iLength; /* nothing */) {
+					const struct inotify_event* pEvent = reinterpret_cast<const struct inotify_event*>(ptr);
+					if (pEvent->len > 0 && sName == pEvent->name)
+						iTimeout = s_SettleTime;
+					ptr += sizeof(struct inotify_event) + pEvent->len;
+				}
+			}
+		}
+	}
+}
+
+/* vim:set ts=2 sw=2: */
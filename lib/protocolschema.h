@@ -0,0 +1,190 @@
+/*
+ * Runes of Magic protocol analysis - reloadable protocol definitions
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __PROTOCOLSCHEMA_H__
+#define __PROTOCOLSCHEMA_H__
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "protocoldefinition.h"
+
+class XDataAnnotation;
+class XDataTransformation;
+
+/*! \brief Protocol definitions which can be replaced while in use
+ *
+ *  Decoding fills the values of a ProtocolDefinition in place, so loaded
+ *  definitions cannot be changed while anything decodes with them. Instead,
+ *  a reload builds an entirely new ProtocolDefinition and publishes it by
+ *  swapping a pointer; every reader holds a reference to the definitions it
+ *  is decoding with, so they are only destroyed once the last reader has
+ *  moved on to a newer set.
+ *
+ *  Readers are expected to call Refresh() between packets; this costs a
+ *  single atomic load unless something was published since the last call.
+ */
+class ProtocolSchema {
+public:
+	typedef std::shared_ptr<ProtocolDefinition> TDefinitionPtr;
+
+	ProtocolSchema();
+
+	//! \brief Stops watching and releases our reference to the definitions
+	~ProtocolSchema();
+
+	/*! \brief Registers a transformation with every set of definitions loaded
+	 *  \param sName Transformation name
+	 *  \param oDataTransformation Backing object to use
+	 *
+	 *  Unlike ProtocolDefinition::RegisterTransformation(), the caller
+	 *  remains owner of the backing object; it must outlive all definitions
+	 *  loaded. Registrations only affect definitions loaded afterwards.
+	 */
+	void RegisterTransformation(const char* sName, XDataTransformation& oDataTransformation);
+
+	/*! \brief Registers an annotation with every set of definitions loaded
+	 *  \param sName Annotation name
+	 *  \param oAnnotation Backing object to use
+	 *
+	 *  The caller remains owner of the backing object, which means any state
+	 *  it collects is retained across reloads.
+	 */
+	void RegisterAnnotation(const char* sName, XDataAnnotation& oAnnotation);
+
+	/*! \brief Loads and publishes protocol definitions
+	 *  \param sFilename Filename to use
+	 *  \param iVersion Version to load, -1 for latest
+	 *  \returns true on success
+	 *
+	 *  The filename and version are remembered for Reload().
+	 */
+	bool Load(const char* sFilename, int iVersion);
+
+	/*! \brief Reloads the protocol definitions
+	 *  \returns true on success
+	 *
+	 *  The new definitions are only published if they load successfully;
+	 *  otherwise, the current ones remain in use.
+	 */
+	bool Reload();
+
+	/*! \brief Retrieves the current definitions
+	 *  \returns Definitions, or NULL if nothing has been loaded
+	 */
+	TDefinitionPtr Get() const { return std::atomic_load(&m_Current); }
+
+	//! \brief Retrieves the number of times definitions have been published
+	unsigned int GetGeneration() const { return m_Generation.load(std::memory_order_acquire); }
+
+	/*! \brief Updates a reader's definitions if newer ones were published
+	 *  \param pDefinition Definitions in use by the reader
+	 *  \param iGeneration Generation of pDefinition, see GetGeneration()
+	 *  \returns true if pDefinition was updated
+	 *
+	 *  The previous definitions are destroyed here if the caller held the
+	 *  last reference to them.
+	 */
+	bool Refresh(TDefinitionPtr& pDefinition, unsigned int& iGeneration) const;
+
+	/*! \brief Loads a private copy of the current definitions
+	 *  \param iGeneration Receives the generation the copy corresponds to
+	 *  \returns Definitions, or NULL if nothing can be loaded
+	 *
+	 *  Decoding fills definitions in place, so anything decoding in parallel
+	 *  needs definitions of its own; these are never published.
+	 */
+	TDefinitionPtr Instantiate(unsigned int& iGeneration);
+
+	/*! \brief Starts reloading in the background
+	 *  \param bWatchFile Whether to reload when the definition file changes
+	 *  \returns true on success
+	 *
+	 *  This creates a thread which performs reloads as requested using
+	 *  RequestReload() and, if bWatchFile is set, whenever the definition
+	 *  file is written or replaced (using inotify).
+	 */
+	bool StartWatching(bool bWatchFile);
+
+	/*! \brief Requests a background reload
+	 *
+	 *  This is async-signal-safe, so it can be called from a SIGHUP handler;
+	 *  it does nothing unless StartWatching() succeeded.
+	 */
+	void RequestReload();
+
+protected:
+	/*! \brief Loads definitions using the current filename and version
+	 *  \returns Definitions, or NULL on failure
+	 *
+	 *  The caller must hold m_LoadMutex.
+	 */
+	TDefinitionPtr Create();
+
+	//! \brief Background thread main loop
+	void Watch();
+
+	//! \brief Stops the background thread, if any
+	void StopWatching();
+
+	//! \brief Registered transformation or annotation
+	template<typename T> struct Registration {
+		Registration(const char* sName, T& oProvider) : m_Name(sName), m_Provider(&oProvider) { }
+		std::string m_Name;
+		T* m_Provider;
+	};
+
+	//! \brief All registered transformations
+	std::list<Registration<XDataTransformation> > m_Transformations;
+
+	//! \brief All registered annotations
+	std::list<Registration<XDataAnnotation> > m_Annotations;
+
+	//! \brief Definition file in use
+	std::string m_Filename;
+
+	//! \brief Version in use, -1 for latest
+	int m_Version;
+
+	//! \brief Definitions currently published; only accessed atomically
+	TDefinitionPtr m_Current;
+
+	//! \brief Incremented whenever definitions are published
+	std::atomic<unsigned int> m_Generation;
+
+	//! \brief Serializes loading
+	std::mutex m_LoadMutex;
+
+	//! \brief Background thread
+	std::thread m_Thread;
+
+	//! \brief Pipe used to wake up the background thread
+	int m_WakeupPipe[2];
+
+	//! \brief inotify descriptor, -1 if the file isn't watched
+	int m_NotifyFD;
+
+	//! \brief Set to have the background thread terminate
+	std::atomic<bool> m_Stop;
+
+	ProtocolSchema(const ProtocolSchema&) = delete;
+	ProtocolSchema& operator=(const ProtocolSchema&) = delete;
+};
+
+#endif /* __PROTOCOLSCHEMA_H__ */
@@ -0,0 +1,260 @@
+/*
+ * Runes of Magic protocol analysis - textual protocol output
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "protocoltextsink.h"
+#include <time.h>
+#include "dataannotation.h"
+#include "outputbuffer.h"
+
+ProtocolTextSink::ProtocolTextSink(OutputBuffer& oBuffer, int iIndent)
+	: m_Buffer(oBuffer), m_Indent(iIndent), m_FieldDepth(0)
+{
+}
+
+void
+ProtocolTextSink::PrintIndent()
+{
+	memset(m_Buffer.Reserve(m_Indent), ' ', m_Indent);
+	m_Buffer.Commit(m_Indent);
+}
+
+void
+ProtocolTextSink::BeginPacket(const ProtocolDefinition::Packet& oPacket)
+{
+	PrintIndent();
+	m_Buffer.Append("packet '", 8);
+	m_Buffer.Append(oPacket.GetName());
+	m_Buffer.Append("'\n", 2);
+	m_Indent++;
+}
+
+void
+ProtocolTextSink::EndPacket(const ProtocolDefinition::Packet& oPacket)
+{
+	m_Indent--;
+}
+
+void
+ProtocolTextSink::BeginSubpacket(const ProtocolDefinition::Subpacket& oSubpacket)
+{
+	PrintIndent();
+	m_Buffer.Append("subpacket '", 11);
+	m_Buffer.Append(oSubpacket.GetName());
+	m_Buffer.Append("'\n", 2);
+	m_Indent++;
+}
+
+void
+ProtocolTextSink::EndSubpacket(const ProtocolDefinition::Subpacket& oSubpacket)
+{
+	m_Indent--;
+}
+
+void
+ProtocolTextSink::BeginStruct(const ProtocolDefinition::Struct& oStruct)
+{
+	m_Buffer.Append("struct '", 8);
+	m_Buffer.Append(oStruct.GetName());
+	m_Buffer.Append("'\n", 2);
+	// Members of a field's struct are indented one more than the field's value
+	m_Indent += m_FieldDepth > 0 ? 2 : 1;
+}
+
+void
+ProtocolTextSink::EndStruct(const ProtocolDefinition::Struct& oStruct)
+{
+	m_Indent -= m_FieldDepth > 0 ? 2 : 1;
+}
+
+void
+ProtocolTextSink::BeginField(const ProtocolDefinition::Field& oField, const ProtocolDefinition::Value& oValue, bool bLast)
+{
+	PrintIndent();
+	m_Buffer.AppendChar('\'');
+	m_Buffer.Append(oField.GetName());
+	m_Buffer.AppendChar('\'');
+	if (ProtocolDefinition::MustPrintDataOffset()) {
+		m_Buffer.Append(" @ 0x", 5);
+		m_Buffer.AppendHex(oValue.m_DataOffset);
+	}
+	m_Buffer.Append(": ", 2);
+	m_FieldDepth++;
+}
+
+void
+ProtocolTextSink::EndField(const ProtocolDefinition::Field& oField, bool bLast)
+{
+	m_FieldDepth--;
+	// kludge to prevent newline after final member; the caller generally does that
+	if (!bLast)
+		m_Buffer.AppendChar('\n');
+}
+
+void
+ProtocolTextSink::AppendHumanReadable(const ProtocolDefinition::unsignedType& oType, const ProtocolDefinition::Value& oValue)
+{
+	uint32_t iValue = oType.GetValue(oValue, 0);
+	const char* sName = NULL;
+	if (oType.GetEnumeration() != NULL) {
+		sName = oType.GetEnumeration()->Lookup(iValue);
+		// Be careful: if we also have an annotation configured and the enumeration doesn't work, pass it through
+		if (sName == NULL && oType.GetAnnotation() == NULL)
+			sName = "?";
+	}
+	if (sName == NULL && oType.GetAnnotation() != NULL)
+		sName = oType.GetAnnotation()->GetProvider().Lookup(iValue);
+
+	if (sName == NULL) {
+		if (oType.IsDecimal()) {
+			m_Buffer.AppendUnsigned(iValue);
+		} else {
+			m_Buffer.Append("0x", 2);
+			m_Buffer.AppendHex(iValue);
+		}
+		return;
+	}
+
+	/*
+	 * GetHumanReadableContent() is limited to 254 characters; leave the
+	 * (unlikely) case of names that may need truncation to it.
+	 */
+	if (strlen(sName) + 13 /* " <0x12345678>" */ > 254) {
+		char tmp[256];
+		oType.GetHumanReadableContent(oValue, tmp, sizeof(tmp));
+		m_Buffer.Append(tmp);
+		return;
+	}
+	m_Buffer.Append(sName);
+	if (oType.IsDecimal()) {
+		m_Buffer.Append(" <", 2);
+		m_Buffer.AppendUnsigned(iValue);
+	} else {
+		m_Buffer.Append(" <0x", 4);
+		m_Buffer.AppendHex(iValue);
+	}
+	m_Buffer.AppendChar('>');
+}
+
+void
+ProtocolTextSink::VisitUnsigned(const ProtocolDefinition::unsignedType& oType, const ProtocolDefinition::Value& oValue)
+{
+	if (oType.GetCount() == 1) {
+		AppendHumanReadable(oType, oValue);
+		return;
+	}
+
+	int iCount = oType.GetCount();
+	if (oType.GetDisplayCount() >= 0)
+		iCount = oType.GetDisplayCount();
+	for (int n = 0; n < iCount; n++) {
+		if (n > 0)
+			m_Buffer.AppendChar(' ');
+		if (oType.IsDecimal()) {
+			m_Buffer.AppendUnsigned(oType.GetValue(oValue, n));
+		} else {
+			m_Buffer.Append("0x", 2);
+			m_Buffer.AppendHex(oType.GetValue(oValue, n));
+		}
+	}
+}
+
+void
+ProtocolTextSink::VisitSigned(const ProtocolDefinition::signedType& oType, const ProtocolDefinition::Value& oValue)
+{
+	// In case of non-decimal or enumerations, assume the user meant unsigned
+	if (!oType.IsDecimal() || oType.GetEnumeration() != NULL || oType.GetCount() != 1) {
+		VisitUnsigned(oType, oValue);
+		return;
+	}
+
+	int iCount = oType.GetCount();
+	if (oType.GetDisplayCount() >= 0)
+		iCount = oType.GetDisplayCount();
+	for (int n = 0; n < iCount; n++) {
+		if (n > 0)
+			m_Buffer.AppendChar(' ');
+		m_Buffer.AppendSigned(oType.GetValue(oValue, n));
+	}
+}
+
+void
+ProtocolTextSink::VisitLength(const ProtocolDefinition::lengthType& oType, const ProtocolDefinition::Value& oValue)
+{
+	m_Buffer.AppendHex(oType.GetValue(oValue));
+}
+
+void
+ProtocolTextSink::VisitUnixTime(const ProtocolDefinition::unixtimeType& oType, const ProtocolDefinition::Value& oValue)
+{
+	time_t t = oType.GetValue(oValue);
+	struct tm tm;
+	if (gmtime_r(&t, &tm) != NULL) {
+		m_Buffer.AppendUnsigned(tm.tm_year + 1900, 4);
+		m_Buffer.AppendChar('-');
+		m_Buffer.AppendUnsigned(tm.tm_mon + 1, 2);
+		m_Buffer.AppendChar('-');
+		m_Buffer.AppendUnsigned(tm.tm_mday, 2);
+		m_Buffer.AppendChar(' ');
+		m_Buffer.AppendUnsigned(tm.tm_hour, 2);
+		m_Buffer.AppendChar(':');
+		m_Buffer.AppendUnsigned(tm.tm_min, 2);
+		m_Buffer.AppendChar(':');
+		m_Buffer.AppendUnsigned(tm.tm_sec, 2);
+		m_Buffer.Append(" <", 2);
+	} else {
+		m_Buffer.Append("? <", 3);
+	}
+	m_Buffer.AppendSigned(oType.GetValue(oValue));
+	m_Buffer.AppendChar('>');
+}
+
+void
+ProtocolTextSink::VisitString(const ProtocolDefinition::stringType& oType, const ProtocolDefinition::Value& oValue)
+{
+	const char* pData = oType.GetValue(oValue);
+	const char* pEnd = (const char*)memchr(pData, '\0', oType.GetLength());
+	m_Buffer.AppendChar('\'');
+	m_Buffer.Append(pData, pEnd != NULL ? pEnd - pData : oType.GetLength());
+	m_Buffer.AppendChar('\'');
+}
+
+void
+ProtocolTextSink::VisitFloat(const ProtocolDefinition::floatType& oType, const ProtocolDefinition::Value& oValue)
+{
+	int iCount = oType.GetCount();
+	if (oType.GetDisplayCount() >= 0)
+		iCount = oType.GetDisplayCount();
+	for (int n = 0; n < iCount; n++) {
+		if (n > 0)
+			m_Buffer.AppendChar(' ');
+		m_Buffer.AppendFixed2(oType.GetValue(oValue, n));
+	}
+}
+
+void
+ProtocolTextSink::VisitDouble(const ProtocolDefinition::doubleType& oType, const ProtocolDefinition::Value& oValue)
+{
+	int iCount = oType.GetCount();
+	if (oType.GetDisplayCount() >= 0)
+		iCount = oType.GetDisplayCount();
+	for (int n = 0; n < iCount; n++) {
+		if (n > 0)
+			m_Buffer.AppendChar(' ');
+		m_Buffer.Printf("%g", oType.GetValue(oValue, n)); // rare enough not to bother
+	}
+}
+
+/* vim:set ts=2 sw=2: */
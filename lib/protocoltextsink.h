@@ -0,0 +1,69 @@
+/*
+ * Runes of Magic protocol analysis - textual protocol output
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __PROTOCOLTEXTSINK_H__
+#define __PROTOCOLTEXTSINK_H__
+
+#include "protocolvisitor.h"
+
+class OutputBuffer;
+
+//! \brief Writes decoded content in the human-readable text format
+class ProtocolTextSink : public XProtocolVisitor {
+public:
+	/*! \brief Constructs a text sink
+	 *  \param oBuffer Buffer to write to
+	 *  \param iIndent Indentation level to start at
+	 */
+	ProtocolTextSink(OutputBuffer& oBuffer, int iIndent);
+
+	virtual void BeginPacket(const ProtocolDefinition::Packet& oPacket);
+	virtual void EndPacket(const ProtocolDefinition::Packet& oPacket);
+	virtual void BeginSubpacket(const ProtocolDefinition::Subpacket& oSubpacket);
+	virtual void EndSubpacket(const ProtocolDefinition::Subpacket& oSubpacket);
+	virtual void BeginStruct(const ProtocolDefinition::Struct& oStruct);
+	virtual void EndStruct(const ProtocolDefinition::Struct& oStruct);
+	virtual void BeginField(const ProtocolDefinition::Field& oField, const ProtocolDefinition::Value& oValue, bool bLast);
+	virtual void EndField(const ProtocolDefinition::Field& oField, bool bLast);
+	virtual void VisitUnsigned(const ProtocolDefinition::unsignedType& oType, const ProtocolDefinition::Value& oValue);
+	virtual void VisitSigned(const ProtocolDefinition::signedType& oType, const ProtocolDefinition::Value& oValue);
+	virtual void VisitLength(const ProtocolDefinition::lengthType& oType, const ProtocolDefinition::Value& oValue);
+	virtual void VisitUnixTime(const ProtocolDefinition::unixtimeType& oType, const ProtocolDefinition::Value& oValue);
+	virtual void VisitString(const ProtocolDefinition::stringType& oType, const ProtocolDefinition::Value& oValue);
+	virtual void VisitFloat(const ProtocolDefinition::floatType& oType, const ProtocolDefinition::Value& oValue);
+	virtual void VisitDouble(const ProtocolDefinition::doubleType& oType, const ProtocolDefinition::Value& oValue);
+
+protected:
+	//! \brief Indents to the current level
+	void PrintIndent();
+
+	/*! \brief Appends a single value the way GetHumanReadableContent() does
+	 *  \param oType Type to use
+	 *  \param oValue Value to append
+	 */
+	void AppendHumanReadable(const ProtocolDefinition::unsignedType& oType, const ProtocolDefinition::Value& oValue);
+
+	//! \brief Buffer to write to
+	OutputBuffer& m_Buffer;
+
+	//! \brief Current indentation level
+	int m_Indent;
+
+	//! \brief Number of fields we are currently nested in
+	int m_FieldDepth;
+};
+
+#endif /* __PROTOCOLTEXTSINK_H__ */
@@ -0,0 +1,97 @@
+/*
+ * Runes of Magic protocol analysis - decoded protocol visitor
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __PROTOCOLVISITOR_H__
+#define __PROTOCOLVISITOR_H__
+
+#include "protocoldefinition.h" // XXX can't forward declare nested classes
+
+/*! \brief Visitor interface over decoded protocol content
+ *
+ *  ProtocolDefinition::Type::Accept() walks decoded content and reports it
+ *  to this interface, along with the types describing it; this keeps the decoder
+ *  independent of the output format used (text, JSON Lines, ...)
+ */
+class XProtocolVisitor {
+public:
+	virtual ~XProtocolVisitor() { }
+
+	/*! \brief Called before the packet header fields are reported
+	 *  \param oPacket Packet being reported
+	 */
+	virtual void BeginPacket(const ProtocolDefinition::Packet& oPacket) = 0;
+
+	/*! \brief Called once the packet and its subpacket are reported
+	 *  \param oPacket Packet being reported
+	 */
+	virtual void EndPacket(const ProtocolDefinition::Packet& oPacket) = 0;
+
+	/*! \brief Called before the subpacket fields are reported
+	 *  \param oSubpacket Subpacket being reported
+	 */
+	virtual void BeginSubpacket(const ProtocolDefinition::Subpacket& oSubpacket) = 0;
+
+	/*! \brief Called once all subpacket fields are reported
+	 *  \param oSubpacket Subpacket being reported
+	 */
+	virtual void EndSubpacket(const ProtocolDefinition::Subpacket& oSubpacket) = 0;
+
+	/*! \brief Called before the content of a structured value is reported
+	 *  \param oStruct Structure being reported
+	 */
+	virtual void BeginStruct(const ProtocolDefinition::Struct& oStruct) = 0;
+
+	/*! \brief Called once the content of a structured value is reported
+	 *  \param oStruct Structure being reported
+	 */
+	virtual void EndStruct(const ProtocolDefinition::Struct& oStruct) = 0;
+
+	/*! \brief Called before the value of a field is reported
+	 *  \param oField Field being reported
+	 *  \param oValue Value of the field
+	 *  \param bLast true if this is the final action of the enclosing struct
+	 */
+	virtual void BeginField(const ProtocolDefinition::Field& oField, const ProtocolDefinition::Value& oValue, bool bLast) = 0;
+
+	/*! \brief Called once the value of a field is reported
+	 *  \param oField Field being reported
+	 *  \param bLast true if this is the final action of the enclosing struct
+	 */
+	virtual void EndField(const ProtocolDefinition::Field& oField, bool bLast) = 0;
+
+	//! \brief Reports an unsigned value
+	virtual void VisitUnsigned(const ProtocolDefinition::unsignedType& oType, const ProtocolDefinition::Value& oValue) = 0;
+
+	//! \brief Reports a signed value
+	virtual void VisitSigned(const ProtocolDefinition::signedType& oType, const ProtocolDefinition::Value& oValue) = 0;
+
+	//! \brief Reports a length value
+	virtual void VisitLength(const ProtocolDefinition::lengthType& oType, const ProtocolDefinition::Value& oValue) = 0;
+
+	//! \brief Reports an UNIX timestamp value
+	virtual void VisitUnixTime(const ProtocolDefinition::unixtimeType& oType, const ProtocolDefinition::Value& oValue) = 0;
+
+	//! \brief Reports a string value
+	virtual void VisitString(const ProtocolDefinition::stringType& oType, const ProtocolDefinition::Value& oValue) = 0;
+
+	//! \brief Reports a float value
+	virtual void VisitFloat(const ProtocolDefinition::floatType& oType, const ProtocolDefinition::Value& oValue) = 0;
+
+	//! \brief Reports a double value
+	virtual void VisitDouble(const ProtocolDefinition::doubleType& oType, const ProtocolDefinition::Value& oValue) = 0;
+};
+
+#endif /* __PROTOCOLVISITOR_H__ */
@@ -217,6 +217,119 @@ try_standard:
 #undef COPY
 }
 
+int
+ROMPack::GetUnpackedLength(const uint8_t* src, int srclen)
+{
+	/*
+	 * This follows Unpack() step by step, but only keeps track of the
+	 * output length; see there for the meaning of the commands.
+	 */
+	const uint8_t* in = src;
+	const uint8_t* end = src + srclen;
+	uint32_t code, dist;
+	int len = 0;
+
+#define NEED(count) \
+	if (end - in < (int)(count)) \
+		return -1;
+
+#define HANDLE_COUNT(acc, mask) \
+	acc &= mask; \
+	if (acc == 0) { \
+		NEED(1); \
+		while (*in == 0) { \
+			(acc) += 255, in++; \
+			NEED(1); \
+		} \
+		(acc) += *in + mask; \
+		in++; \
+	}
+
+#define BACKREF(distance) \
+	if ((distance) > (uint32_t)len) \
+		return -1;
+
+	NEED(1);
+	if (*in > 0x11) {
+		code = *in - 0x11;
+		in++;
+		NEED(code);
+		in += code, len += code;
+		if (code < 4)
+			goto try_00to0F_standard;
+		goto try_00to0F_alternative;
+	}
+
+try_00to0F_standard:
+	NEED(1);
+	code = *in++;
+	if (code >= 0x10) goto try_standard;
+
+	HANDLE_COUNT(code, 15);
+	code += 3;
+	NEED(code);
+	in += code, len += code;
+
+try_00to0F_alternative:
+	NEED(1);
+	code = *in++;
+	if (code >= 0x10) goto try_standard;
+
+	NEED(1);
+	dist = (code >> 2) + *in * 4 + 0x801;
+	BACKREF(dist);
+	in++;
+	len += 3;
+
+handle_offset_count:
+	code = in[-2] & 3;
+	if (code == 0)
+		goto try_00to0F_standard;
+
+	NEED(code + 1);
+	in += code, len += code;
+	code = *in++;
+
+try_standard:
+	if (code >= 0x40) {
+		NEED(1);
+		dist = ((code >> 2) & 7) + (uint32_t)*in * 8 + 1;
+		BACKREF(dist);
+		code = (code >> 5) + 1;
+		in++;
+		len += code;
+		goto handle_offset_count;
+	}
+	if (code >= 0x20 /* && code < 0x40 */) {
+		HANDLE_COUNT(code, 31);
+		NEED(2);
+		dist = ((in[0] | in[1] << 8) >> 2) + 1;
+		in += 2;
+	} else /* code < 0x20 */ {
+		if (code < 0x10)
+			return -1; // Unpack() fails on these as well
+		dist = (code & 8) << 0xb;
+		HANDLE_COUNT(code, 7);
+		NEED(2);
+		dist += (in[0] | in[1] << 8) >> 2;
+		in += 2;
+		if (dist == 0) {
+			// End-of-stream marker; Unpack() insists all input is used
+			return in == end ? len : -1;
+		}
+		dist += 0x4000;
+	}
+	BACKREF(dist);
+
+	code += 2;
+	len += code;
+	goto handle_offset_count;
+
+#undef BACKREF
+#undef HANDLE_COUNT
+#undef NEED
+}
+
 bool
 ROMPack::Pack(const uint8_t* src, int srclen, uint8_t* dst, int* outlen)
 {
@@ -34,6 +34,18 @@ public:
 	 */
 	static bool Unpack(const uint8_t* src, int srclen, uint8_t* dst, int* outlen);
 
+	/*! \brief Determines the size of a ROMPack-compressed chunk once unpacked
+	 *  \param src Source data to examine
+	 *  \param srclen Number of bytes in source buffer
+	 *  \returns Number of bytes Unpack() will produce, or -1 on failure
+	 *
+	 *  This walks the commands without producing any output. Unlike
+	 *  Unpack(), every read is bounds checked and references before the
+	 *  start of the output are rejected, so a successful result means
+	 *  Unpack() can safely be given a buffer of exactly this size.
+	 */
+	static int GetUnpackedLength(const uint8_t* src, int srclen);
+
 	/*! \brief Packs data to a ROMPack-compressed chunk
 	 *  \param src Source data to pack
 	 *  \param srclen Number of bytes in source buffer
@@ -17,6 +17,7 @@
 #include "rompacketlogger.h"
 #include <assert.h>
 #include <fcntl.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include "../lib/romstructs.h"
 #include "address.h"
@@ -40,7 +41,7 @@ ROMPacketLogger::Open(const char* fname)
 		return false;
 
 	struct ROM::LoggerHeader lh;
-	lh.lh_magic = ROM_LOGGER_HEADER_MAGIC_2;
+	lh.lh_magic = ROM_LOGGER_HEADER_MAGIC_3;
 	return write(m_FD, &lh, sizeof(lh)) == sizeof(lh);
 }
 
@@ -68,8 +69,15 @@ ROMPacketLogger::Write(const Address& source, const Address& dest, const struct
 	lp.lp_dest_port = dst_port;
 	lp.lp_len1 = p->p_length & 0xffff;
 	lp.lp_len2 = p->p_length >> 16;
+
+	// Allows merging logs of several proxies in order
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	struct ROM::LoggerTimestamp lt;
+	lt.lt_timestamp = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 	return
 	 write(m_FD, &lp, sizeof(lp)) == sizeof(lp) &&
+	 write(m_FD, &lt, sizeof(lt)) == sizeof(lt) &&
 	 write(m_FD, (const void*)p, p->p_length) == p->p_length;
 }
 
@@ -0,0 +1,333 @@
+/*
+ * Runes of Magic proxy - packet tap in shared memory
+ * Copyright (C) 2014-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "rompackettap.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <new>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include "../lib/romstructs.h"
+#include "address.h"
+
+static_assert(sizeof(ROMTap::Header) <= ROMTap::s_DataOffset, "tap header too large");
+static_assert(sizeof(ROMTap::Record) % 8 == 0, "tap records must stay aligned");
+
+namespace {
+	//! \brief Interval at which a waiting reader checks whether the writer is still there, in ms
+	const int s_WaitInterval = 1000;
+
+	inline uint32_t Align(uint32_t n)
+	{
+		return (n + 7) & ~7;
+	}
+
+	void FutexWake(std::atomic<uint32_t>* word)
+	{
+		syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+
+	void FutexWait(std::atomic<uint32_t>* word, uint32_t value, int ms)
+	{
+		struct timespec ts;
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000;
+		syscall(SYS_futex, word, FUTEX_WAIT, value, &ts, NULL, 0);
+	}
+};
+
+ROMPacketTap::ROMPacketTap()
+	: m_Header(NULL), m_Data(NULL), m_Size(0), m_Position(0)
+{
+}
+
+ROMPacketTap::~ROMPacketTap()
+{
+	Close();
+}
+
+bool
+ROMPacketTap::Open(const char* name, uint32_t size)
+{
+	assert(m_Header == NULL);
+	if (size < 65536 || (size & (size - 1)) != 0) {
+		fprintf(stderr, "ROMPacketTap::Open(): ring size %u must be a power of two of at least 64KB\n", size);
+		return false;
+	}
+
+	// Readers still attached to a previous tap keep their own copy
+	shm_unlink(name);
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0660);
+	if (fd < 0)
+		return false;
+	size_t mapping_size = ROMTap::s_DataOffset + size;
+	void* ptr = MAP_FAILED;
+	if (ftruncate(fd, mapping_size) == 0)
+		ptr = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		int saved_errno = errno;
+		shm_unlink(name);
+		errno = saved_errno;
+		return false;
+	}
+
+	// The object is zero-filled; the magic goes last so readers never see a half-initialized header
+	m_Name = name;
+	m_Header = new(ptr) ROMTap::Header;
+	m_Data = (char*)ptr + ROMTap::s_DataOffset;
+	m_Size = size;
+	m_Position = 0;
+	m_Header->th_version = ROM_TAP_VERSION;
+	m_Header->th_size = size;
+	m_Header->th_pid = getpid();
+	m_Header->th_claimed = 0;
+	m_Header->th_published = 0;
+	m_Header->th_wakeup = 0;
+	m_Header->th_waiters = 0;
+	m_Header->th_closed = 0;
+	std::atomic_thread_fence(std::memory_order_release);
+	m_Header->th_magic = ROM_TAP_MAGIC;
+	return true;
+}
+
+void
+ROMPacketTap::Close()
+{
+	if (m_Header == NULL)
+		return;
+
+	m_Header->th_closed = 1;
+	m_Header->th_wakeup++;
+	FutexWake(&m_Header->th_wakeup);
+
+	shm_unlink(m_Name.c_str());
+	munmap(m_Header, ROMTap::s_DataOffset + m_Size);
+	m_Header = NULL;
+	m_Data = NULL;
+}
+
+bool
+ROMPacketTap::Write(uint32_t connection, int direction, const Address& source, const Address& dest, const struct ROM::Packet* p)
+{
+	if (m_Header == NULL)
+		return false;
+	uint32_t length = Align(sizeof(ROMTap::Record) + p->p_length);
+	if (length > m_Size / 4)
+		return false;
+
+	// Records never wrap; if this one doesn't fit, skip the rest of the ring
+	uint32_t offset = m_Position & (m_Size - 1);
+	uint32_t pad_length = m_Size - offset < length ? m_Size - offset : 0;
+
+	// Claim the space first, so readers can tell their copy may be damaged
+	m_Header->th_claimed.store(m_Position + pad_length + length, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	if (pad_length > 0) {
+		ROMTap::Record* pad = (ROMTap::Record*)&m_Data[offset];
+		pad->tr_length = pad_length;
+		pad->tr_type = ROM_TAP_RECORD_PAD;
+		offset = 0;
+	}
+
+	uint32_t src_ip, dst_ip;
+	uint16_t src_port, dst_port;
+	source.GetIPv4Address(src_ip, src_port);
+	dest.GetIPv4Address(dst_ip, dst_port);
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	ROMTap::Record* record = (ROMTap::Record*)&m_Data[offset];
+	record->tr_length = length;
+	record->tr_type = ROM_TAP_RECORD_PACKET;
+	record->tr_direction = direction;
+	record->tr_reserved = 0;
+	record->tr_connection = connection;
+	record->tr_source_ip = src_ip;
+	record->tr_dest_ip = dst_ip;
+	record->tr_source_port = src_port;
+	record->tr_dest_port = dst_port;
+	record->tr_timestamp = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	memcpy(record + 1, p, p->p_length);
+
+	m_Position += pad_length + length;
+	m_Header->th_published.store(m_Position);
+
+	// Only bother the kernel if someone is actually waiting
+	if (m_Header->th_waiters.load() > 0) {
+		m_Header->th_wakeup++;
+		FutexWake(&m_Header->th_wakeup);
+	}
+	return true;
+}
+
+ROMPacketTapReader::ROMPacketTapReader()
+	: m_Header(NULL), m_Data(NULL), m_Size(0), m_MappingSize(0), m_Position(0), m_LostBytes(0)
+{
+}
+
+ROMPacketTapReader::~ROMPacketTapReader()
+{
+	Close();
+}
+
+bool
+ROMPacketTapReader::Open(const char* name)
+{
+	assert(m_Header == NULL);
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	void* ptr = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > ROMTap::s_DataOffset)
+		ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		fprintf(stderr, "ROMPacketTapReader::Open(): '%s' is not a packet tap\n", name);
+		return false;
+	}
+
+	ROMTap::Header* header = (ROMTap::Header*)ptr;
+	bool ok = header->th_magic == ROM_TAP_MAGIC;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (!ok || header->th_version != ROM_TAP_VERSION || ROMTap::s_DataOffset + (off_t)header->th_size > st.st_size) {
+		fprintf(stderr, "ROMPacketTapReader::Open(): '%s' is not a usable packet tap\n", name);
+		munmap(ptr, st.st_size);
+		return false;
+	}
+
+	m_Header = header;
+	m_Data = (const char*)ptr + ROMTap::s_DataOffset;
+	m_Size = header->th_size;
+	m_MappingSize = st.st_size;
+	m_Position = header->th_published.load();
+	m_LostBytes = 0;
+	return true;
+}
+
+void
+ROMPacketTapReader::Close()
+{
+	if (m_Header != NULL)
+		munmap(m_Header, m_MappingSize);
+	m_Header = NULL;
+	m_Data = NULL;
+}
+
+bool
+ROMPacketTapReader::IsDrained() const
+{
+	return m_Header == NULL || m_Header->th_published.load() == m_Position;
+}
+
+uint64_t
+ROMPacketTapReader::TakeLostBytes()
+{
+	uint64_t lost = m_LostBytes;
+	m_LostBytes = 0;
+	return lost;
+}
+
+bool
+ROMPacketTapReader::Wait()
+{
+	// Announce ourselves before looking, so the writer either sees us or we see its record
+	uint32_t wakeup = m_Header->th_wakeup.load();
+	m_Header->th_waiters++;
+	if (m_Header->th_published.load() == m_Position && m_Header->th_closed.load() == 0)
+		FutexWait(&m_Header->th_wakeup, wakeup, s_WaitInterval);
+	m_Header->th_waiters--;
+
+	if (m_Header->th_published.load() != m_Position)
+		return true;
+	if (m_Header->th_closed.load() != 0)
+		return false;
+	// A writer which crashed cannot tell us it's gone
+	return kill(m_Header->th_pid, 0) == 0 || errno != ESRCH;
+}
+
+bool
+ROMPacketTapReader::Next(ROMTap::Record& record, const struct ROM::Packet*& p)
+{
+	if (m_Header == NULL)
+		return false;
+
+	while (true) {
+		uint64_t published = m_Header->th_published.load(std::memory_order_acquire);
+		if (published == m_Position) {
+			if (!Wait())
+				return false;
+			continue;
+		}
+		if (published - m_Position > m_Size) {
+			// Lapped by the writer; the only record boundary we know of is the latest one
+			m_LostBytes += published - m_Position;
+			m_Position = published;
+			continue;
+		}
+
+		uint32_t offset = m_Position & (m_Size - 1);
+		const ROMTap::Record* shared = (const ROMTap::Record*)&m_Data[offset];
+		uint32_t length = shared->tr_length;
+		uint16_t type = shared->tr_type;
+		bool valid = length >= 8 && length % 8 == 0 && length <= m_Size - offset;
+		if (valid && type == ROM_TAP_RECORD_PACKET) {
+			valid = length >= sizeof(ROMTap::Record) + sizeof(struct ROM::Packet);
+			if (valid) {
+				m_Record.resize(length);
+				memcpy(&m_Record[0], shared, length);
+			}
+		}
+
+		// If the writer claimed what we just read, it may have been overwritten while we did
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t claimed = m_Header->th_claimed.load(std::memory_order_relaxed);
+		if (!valid || claimed - m_Position > m_Size) {
+			published = m_Header->th_published.load();
+			m_LostBytes += published - m_Position;
+			m_Position = published;
+			continue;
+		}
+
+		m_Position += length;
+		if (type != ROM_TAP_RECORD_PACKET)
+			continue;
+
+		memcpy(&record, &m_Record[0], sizeof(record));
+		p = (const struct ROM::Packet*)&m_Record[sizeof(record)];
+		if (p->p_length > length - sizeof(record)) {
+			// Should never happen, as the copy was intact
+			m_LostBytes += length;
+			continue;
+		}
+		return true;
+	}
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,177 @@
+/*
+ * Runes of Magic proxy - packet tap in shared memory
+ * Copyright (C) 2014-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ROMPACKETTAP_H__
+#define __ROMPACKETTAP_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace ROM {
+	class Packet;
+};
+
+class Address;
+
+/*
+ * The tap is a ring of records in a POSIX shared memory object, written by a
+ * single proxy and read by any number of analysers. The writer never waits
+ * for readers: it first claims the space it is about to overwrite, then
+ * writes the record and finally publishes it. A reader copies a record and
+ * afterwards checks whether its space was claimed meanwhile; if so, the
+ * reader fell behind and the record is lost to it.
+ *
+ * Records are aligned to 8 bytes and never wrap around the end of the ring;
+ * the writer pads the remainder of the ring instead.
+ */
+namespace ROMTap {
+	//! \brief Shared memory object header; the ring follows at s_DataOffset
+	struct Header {
+		uint32_t	th_magic;
+#define ROM_TAP_MAGIC			0x404d6f52	/* RoM@ */
+		uint32_t	th_version;
+#define ROM_TAP_VERSION			1
+		//! \brief Size of the ring in bytes, a power of two
+		uint32_t	th_size;
+		//! \brief Process id of the writer
+		uint32_t	th_pid;
+		//! \brief Position up to which the writer may be writing
+		std::atomic<uint64_t>	th_claimed;
+		//! \brief Position up to which records are complete
+		std::atomic<uint64_t>	th_published;
+		//! \brief Incremented to wake up waiting readers (futex)
+		std::atomic<uint32_t>	th_wakeup;
+		//! \brief Number of readers waiting for th_wakeup
+		std::atomic<uint32_t>	th_waiters;
+		//! \brief Set once the writer is gone
+		std::atomic<uint32_t>	th_closed;
+	};
+
+	//! \brief Per-record header; the packet, decrypted, follows
+	struct Record {
+		//! \brief Length of the record including this header and alignment
+		uint32_t	tr_length;
+		uint16_t	tr_type;
+#define ROM_TAP_RECORD_PACKET		1
+#define ROM_TAP_RECORD_PAD		2	/* Skip to the start of the ring */
+		uint8_t		tr_direction;
+#define ROM_TAP_CLIENT_TO_SERVER	0
+#define ROM_TAP_SERVER_TO_CLIENT	1
+		uint8_t		tr_reserved;
+		//! \brief Proxied connection, unique within the writer
+		uint32_t	tr_connection;
+		uint32_t	tr_source_ip;
+		uint32_t	tr_dest_ip;
+		uint16_t	tr_source_port;
+		uint16_t	tr_dest_port;
+		//! \brief Microseconds since the epoch
+		uint64_t	tr_timestamp;
+	};
+
+	//! \brief Offset of the ring within the shared memory object
+	static const int s_DataOffset = 4096;
+};
+
+//! \brief Publishes packets into a shared memory tap
+class ROMPacketTap {
+public:
+	//! \brief Default ring size, in bytes
+	static const uint32_t s_DefaultSize = 16 * 1024 * 1024;
+
+	ROMPacketTap();
+	~ROMPacketTap();
+
+	/*! \brief Creates the tap, replacing any previous one of the same name
+	 *  \param name Shared memory object name, such as /romproxy
+	 *  \param size Ring size in bytes; must be a power of two
+	 *  \returns true on success
+	 */
+	bool Open(const char* name, uint32_t size = s_DefaultSize);
+
+	//! \brief Marks the tap as closed and removes it
+	void Close();
+
+	/*! \brief Publishes a packet
+	 *  \param connection Connection the packet belongs to
+	 *  \param direction ROM_TAP_CLIENT_TO_SERVER or ROM_TAP_SERVER_TO_CLIENT
+	 *  \param source Source address
+	 *  \param dest Destination address
+	 *  \param p Decrypted packet
+	 *  \returns true on success, false if the packet does not fit
+	 */
+	bool Write(uint32_t connection, int direction, const Address& source, const Address& dest, const struct ROM::Packet* p);
+
+private:
+	std::string m_Name;
+	ROMTap::Header* m_Header;
+	char* m_Data;
+	uint32_t m_Size;
+
+	//! \brief Our own copy of th_published
+	uint64_t m_Position;
+};
+
+//! \brief Reads packets from a shared memory tap
+class ROMPacketTapReader {
+public:
+	ROMPacketTapReader();
+	~ROMPacketTapReader();
+
+	/*! \brief Attaches to a tap; only packets published from now on are read
+	 *  \param name Shared memory object name
+	 *  \returns true on success
+	 */
+	bool Open(const char* name);
+
+	//! \brief Detaches from the tap
+	void Close();
+
+	/*! \brief Retrieves the next record, waiting for one if needed
+	 *  \param record Receives the record header
+	 *  \param p Receives the packet, valid until the next call
+	 *  \returns false once the writer is gone
+	 */
+	bool Next(ROMTap::Record& record, const struct ROM::Packet*& p);
+
+	//! \brief Would Next() have to wait?
+	bool IsDrained() const;
+
+	/*! \brief Retrieves and resets the number of bytes lost by falling behind
+	 *  \returns Number of bytes of records skipped since the last call
+	 */
+	uint64_t TakeLostBytes();
+
+private:
+	//! \brief Waits until something may have been published or the writer is gone
+	bool Wait();
+
+	ROMTap::Header* m_Header;
+	const char* m_Data;
+	uint32_t m_Size;
+	size_t m_MappingSize;
+
+	//! \brief Position of the next record to read
+	uint64_t m_Position;
+
+	uint64_t m_LostBytes;
+
+	//! \brief Copy of the record last returned
+	std::vector<char> m_Record;
+};
+
+#endif /* __ROMPACKETTAP_H__ */
@@ -44,6 +44,7 @@ namespace ROM {
 		uint32_t	lh_magic;
 #define ROM_LOGGER_HEADER_MAGIC_1	0x214d6f52	/* RoM! */
 #define ROM_LOGGER_HEADER_MAGIC_2	0x2b4d6f52	/* RoM+ */
+#define ROM_LOGGER_HEADER_MAGIC_3	0x234d6f52	/* RoM# */
 	} PACKED;
 
 	//! \brief ROM log file per-packet header
@@ -56,6 +57,11 @@ namespace ROM {
 		uint16_t	lp_len2;		/* Only if ROM_LOGGER_HEADER_MAGIC_2 */
 	} PACKED;
 
+	//! \brief Follows the per-packet header if ROM_LOGGER_HEADER_MAGIC_3
+	struct LoggerTimestamp {
+		uint64_t	lt_timestamp;		/* Microseconds since the epoch */
+	} PACKED;
+
 #define DECLARE_PACKET(v,type) \
 	char v##Data[sizeof(ROM::Packet) + sizeof(type)]; \
 	struct ROM::Packet* v##Packet = (struct ROM::Packet*)&v##Data[0]; \
@@ -44,7 +44,7 @@ write_header(FILE* f)
 static void
 usage(const char* progname)
 {	
-	fprintf(stderr, "usage: %s [-h?] [-v version] -d protocol.xml -c file.cc -p file.cc -i file.h\n", progname);
+	fprintf(stderr, "usage: %s [-h?] [-v version] -d protocol.xml [-c file.cc -p file.cc -i file.h] [-r file.cc -R file.h]\n", progname);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "  -h, -?             this help\n");
 	fprintf(stderr, "  -d protocol.xml    use supplied protocol definitions\n");
@@ -52,6 +52,8 @@ usage(const char* progname)
 	fprintf(stderr, "  -c file.cc         write c++ code to file.cc\n");
 	fprintf(stderr, "  -p file.cc         write python wrappers to file.cc\n");
 	fprintf(stderr, "  -i file.h          write header file to file.h\n");
+	fprintf(stderr, "  -r file.cc         write native decoder code to file.cc\n");
+	fprintf(stderr, "  -R file.h          write native decoder header file to file.h\n");
 	fprintf(stderr, "\n");
 }
 
@@ -64,15 +66,24 @@ main(int argc, char** argv)
 	oProtocolDef.RegisterAnnotation("stat_name", *new DummyAnnotation);
 	oProtocolDef.RegisterAnnotation("objectid", *new DummyAnnotation);
 	oProtocolDef.RegisterAnnotation("charid", *new DummyAnnotation);
+	static const char* const sWorldAnnotations[] = {
+		"world_create", "world_destroy", "world_position", "world_stats", "world_max_stats",
+		"world_speed", "world_died", "world_revive", "world_target", "world_buff",
+		"world_zone"
+	};
+	for (unsigned int n = 0; n < sizeof(sWorldAnnotations) / sizeof(sWorldAnnotations[0]); n++)
+		oProtocolDef.RegisterAnnotation(sWorldAnnotations[n], *new DummyAnnotation);
 
 	int iVersion = -1;
 	char* sCPPFile = NULL;
 	char* sPythonCPPFile = NULL;
 	char* sHFile = NULL;
 	char* sProtocolDefFile = NULL;
+	char* sDecoderCPPFile = NULL;
+	char* sDecoderHFile = NULL;
 	{
 		int opt;
-		while ((opt = getopt(argc, argv, "?hd:i:c:v:p:")) != -1) {
+		while ((opt = getopt(argc, argv, "?hd:i:c:v:p:r:R:")) != -1) {
 			switch(opt) {
 				case 'd':
 					sProtocolDefFile = optarg;
@@ -91,6 +102,12 @@ main(int argc, char** argv)
 				case 'p':
 					sPythonCPPFile = optarg;
 					break;
+				case 'r':
+					sDecoderCPPFile = optarg;
+					break;
+				case 'R':
+					sDecoderHFile = optarg;
+					break;
 				case 'v': {
 					char* ptr;
 					iVersion = (int)strtol(optarg, &ptr, 10);
@@ -102,7 +119,12 @@ main(int argc, char** argv)
 		}
 	}
 
-	if (sProtocolDefFile == NULL || sCPPFile == NULL || sHFile == NULL || sPythonCPPFile == NULL) {
+	// The server code and native decoder outputs each come as a set
+	bool bServerCode = sCPPFile != NULL || sHFile != NULL || sPythonCPPFile != NULL;
+	bool bDecoder = sDecoderCPPFile != NULL || sDecoderHFile != NULL;
+	if (sProtocolDefFile == NULL || (!bServerCode && !bDecoder) ||
+	    (bServerCode && (sCPPFile == NULL || sHFile == NULL || sPythonCPPFile == NULL)) ||
+	    (bDecoder && (sDecoderCPPFile == NULL || sDecoderHFile == NULL))) {
 		fprintf(stderr, "%s: missing required arguments\n", argv[0]);
 		usage(argv[0]);
 		return EXIT_FAILURE;
@@ -111,73 +133,114 @@ main(int argc, char** argv)
 	if (!oProtocolDef.Load(sProtocolDefFile, iVersion))
 		errx(1, "can't load protocol definitions");
 
-	FILE* pCFile = fopen(sCPPFile, "wt");
-	if (pCFile == NULL)
-		err(1, "can't create '%s'", sCPPFile);
-	FILE* pHFile = fopen(sHFile, "wt");
-	if (pHFile == NULL)
-		err(1, "can't create '%s'", sHFile);
-	FILE* pPythonCFile = fopen(sPythonCPPFile, "wt");
-	if (pPythonCFile == NULL)
-		err(1, "can't create '%s'", sPythonCPPFile);
-
 	ProtocolCodeGenerator oGenerator(oProtocolDef);
 
-	// Header file
-	{
-		write_header(pHFile);
-		fprintf(pHFile, "#ifndef __ROMPACKET_H__\n");
-		fprintf(pHFile, "#define __ROMPACKET_H__\n");
-		fprintf(pHFile, "#include <stdint.h>\n");
-		fprintf(pHFile, "#include \"romstructs.h\"\n");
-		fprintf(pHFile, "\n");
-		fprintf(pHFile, "class State;\n");
-		fprintf(pHFile, "\n");
-		fprintf(pHFile, "namespace ROMPacket {\n");
-		fprintf(pHFile, "\n");
-		fprintf(pHFile, "typedef uint8_t u8;\n");
-		fprintf(pHFile, "typedef uint16_t u16;\n");
-		fprintf(pHFile, "typedef uint32_t u32;\n");
-		fprintf(pHFile, "typedef uint32_t unixtime;\n");
-		fprintf(pHFile, "typedef int8_t s8;\n");
-		fprintf(pHFile, "typedef int16_t s16;\n");
-		fprintf(pHFile, "typedef int32_t s32;\n");
-		fprintf(pHFile, "typedef uint32_t ulength;\n");
-		fprintf(pHFile, "#define PACKED __attribute__((packed))\n");
-		fprintf(pHFile, "\n");
-		oGenerator.GenerateEnumerations(pHFile);
-		oGenerator.GenerateTypes(pHFile);
-		oGenerator.GeneratePackets(pHFile);
-		oGenerator.GenerateParserClass(pHFile);
-		fprintf(pHFile, "} /* namespace ROMPacket */\n");
-		fprintf(pHFile, "#endif /* __ROMPACKET_H__ */\n");
-	}
+	if (bServerCode) {
+		FILE* pCFile = fopen(sCPPFile, "wt");
+		if (pCFile == NULL)
+			err(1, "can't create '%s'", sCPPFile);
+		FILE* pHFile = fopen(sHFile, "wt");
+		if (pHFile == NULL)
+			err(1, "can't create '%s'", sHFile);
+		FILE* pPythonCFile = fopen(sPythonCPPFile, "wt");
+		if (pPythonCFile == NULL)
+			err(1, "can't create '%s'", sPythonCPPFile);
 
-	// Source file
-	{
-		write_header(pCFile);
-		fprintf(pCFile, "#include \"%s\"\n", sHFile);
-		fprintf(pCFile, "#include <assert.h>\n");
-		fprintf(pCFile, "#include <string.h> // for memset()\n");
-		fprintf(pCFile, "#include <stdio.h>\n");
-		fprintf(pCFile, "#include \"state.h\"\n");
-		fprintf(pCFile, "#include \"../lib/rompack.h\"\n");
-		fprintf(pCFile, "\n");
-		fprintf(pCFile, "using namespace ROMPacket;\n");
-		fprintf(pCFile, "typedef ROMPack rompack;\n");
-		fprintf(pCFile, "\n");
-		oGenerator.GenerateFunctions(pCFile);
-		oGenerator.GenerateParser(pCFile, "m_Packet");
-	}
+		// Header file
+		{
+			write_header(pHFile);
+			fprintf(pHFile, "#ifndef __ROMPACKET_H__\n");
+			fprintf(pHFile, "#define __ROMPACKET_H__\n");
+			fprintf(pHFile, "#include <stdint.h>\n");
+			fprintf(pHFile, "#include \"romstructs.h\"\n");
+			fprintf(pHFile, "\n");
+			fprintf(pHFile, "class State;\n");
+			fprintf(pHFile, "\n");
+			fprintf(pHFile, "namespace ROMPacket {\n");
+			fprintf(pHFile, "\n");
+			fprintf(pHFile, "typedef uint8_t u8;\n");
+			fprintf(pHFile, "typedef uint16_t u16;\n");
+			fprintf(pHFile, "typedef uint32_t u32;\n");
+			fprintf(pHFile, "typedef uint32_t unixtime;\n");
+			fprintf(pHFile, "typedef int8_t s8;\n");
+			fprintf(pHFile, "typedef int16_t s16;\n");
+			fprintf(pHFile, "typedef int32_t s32;\n");
+			fprintf(pHFile, "typedef uint32_t ulength;\n");
+			fprintf(pHFile, "#define PACKED __attribute__((packed))\n");
+			fprintf(pHFile, "\n");
+			oGenerator.GenerateEnumerations(pHFile);
+			oGenerator.GenerateTypes(pHFile);
+			oGenerator.GeneratePackets(pHFile);
+			oGenerator.GenerateParserClass(pHFile);
+			fprintf(pHFile, "} /* namespace ROMPacket */\n");
+			fprintf(pHFile, "#endif /* __ROMPACKET_H__ */\n");
+		}
 
-	// Python file
-	{
-		oGenerator.GeneratePythonBindings(pPythonCFile);
+		// Source file
+		{
+			write_header(pCFile);
+			fprintf(pCFile, "#include \"%s\"\n", sHFile);
+			fprintf(pCFile, "#include <assert.h>\n");
+			fprintf(pCFile, "#include <string.h> // for memset()\n");
+			fprintf(pCFile, "#include <stdio.h>\n");
+			fprintf(pCFile, "#include \"state.h\"\n");
+			fprintf(pCFile, "#include \"../lib/rompack.h\"\n");
+			fprintf(pCFile, "\n");
+			fprintf(pCFile, "using namespace ROMPacket;\n");
+			fprintf(pCFile, "typedef ROMPack rompack;\n");
+			fprintf(pCFile, "\n");
+			oGenerator.GenerateFunctions(pCFile);
+			oGenerator.GenerateParser(pCFile, "m_Packet");
+		}
+
+		// Python file
+		{
+			oGenerator.GeneratePythonBindings(pPythonCFile);
+		}
+
+		fclose(pHFile);
+		fclose(pCFile);
+		fclose(pPythonCFile);
 	}
 
-	fclose(pHFile);
-	fclose(pCFile);
-	fclose(pPythonCFile);
+	if (bDecoder) {
+		FILE* pDecoderHFile = fopen(sDecoderHFile, "wt");
+		if (pDecoderHFile == NULL)
+			err(1, "can't create '%s'", sDecoderHFile);
+		FILE* pDecoderCFile = fopen(sDecoderCPPFile, "wt");
+		if (pDecoderCFile == NULL)
+			err(1, "can't create '%s'", sDecoderCPPFile);
+
+		// Header file
+		write_header(pDecoderHFile);
+		fprintf(pDecoderHFile, "#ifndef __ROMDECODER_H__\n");
+		fprintf(pDecoderHFile, "#define __ROMDECODER_H__\n");
+		fprintf(pDecoderHFile, "#include <stdint.h>\n");
+		fprintf(pDecoderHFile, "#include \"nativedecoder.h\"\n");
+		fprintf(pDecoderHFile, "\n");
+		fprintf(pDecoderHFile, "namespace ROMDecoder {\n");
+		fprintf(pDecoderHFile, "\n");
+		if (!oGenerator.GenerateDecoderClasses(pDecoderHFile))
+			errx(1, "can't generate native decoder");
+		fprintf(pDecoderHFile, "} /* namespace ROMDecoder */\n");
+		fprintf(pDecoderHFile, "#endif /* __ROMDECODER_H__ */\n");
+
+		// Source file
+		write_header(pDecoderCFile);
+		fprintf(pDecoderCFile, "#include \"%s\"\n", sDecoderHFile);
+		fprintf(pDecoderCFile, "#include <string.h> // for memcpy()\n");
+		fprintf(pDecoderCFile, "#include \"datatransformation.h\"\n");
+		fprintf(pDecoderCFile, "\n");
+		fprintf(pDecoderCFile, "namespace ROMDecoder {\n");
+		fprintf(pDecoderCFile, "\n");
+		if (!oGenerator.GenerateDecoderFunctions(pDecoderCFile))
+			errx(1, "can't generate native decoder");
+		fprintf(pDecoderCFile, "\n");
+		fprintf(pDecoderCFile, "} /* namespace ROMDecoder */\n");
+
+		fclose(pDecoderCFile);
+		fclose(pDecoderHFile);
+	}
 	return EXIT_SUCCESS;
 }
 
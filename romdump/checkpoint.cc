@@ -0,0 +1,210 @@
+/*
+ * Runes of Magic protocol analysis - checkpoints of the decoding state
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include "checkpoint.h"
+
+#define CHECKPOINT_FILE_MAGIC 0x434d6f52 /* RoMC */
+#define CHECKPOINT_FILE_VERSION 3
+#define CHECKPOINT_MAGIC 0x54504b43 /* CKPT */
+
+//! \brief Precedes the state of every checkpoint
+struct CheckpointFile::Header {
+	uint32_t h_magic;
+	uint32_t h_length;
+	uint64_t h_input_offset;
+	uint32_t h_hash;
+	uint32_t h_reserved;
+};
+
+Checkpoint::Checkpoint()
+	: m_InputOffset(0), m_Position(0), m_Failed(false)
+{
+}
+
+void
+Checkpoint::Clear()
+{
+	m_InputOffset = 0;
+	m_Data.clear();
+	m_Position = 0;
+	m_Failed = false;
+}
+
+void
+Checkpoint::PutUnsigned(uint32_t iValue)
+{
+	m_Data.insert(m_Data.end(), (const char*)&iValue, (const char*)&iValue + sizeof(iValue));
+}
+
+void
+Checkpoint::PutUnsigned64(uint64_t iValue)
+{
+	m_Data.insert(m_Data.end(), (const char*)&iValue, (const char*)&iValue + sizeof(iValue));
+}
+
+void
+Checkpoint::PutBytes(const void* pData, uint32_t iLength)
+{
+	PutUnsigned(iLength);
+	m_Data.insert(m_Data.end(), (const char*)pData, (const char*)pData + iLength);
+}
+
+void
+Checkpoint::PutString(const char* sValue)
+{
+	PutBytes(sValue, strlen(sValue));
+}
+
+bool
+Checkpoint::Get(void* pData, uint32_t iLength)
+{
+	if (m_Failed || m_Data.size() - m_Position < iLength) {
+		m_Failed = true;
+		return false;
+	}
+	memcpy(pData, &m_Data[m_Position], iLength);
+	m_Position += iLength;
+	return true;
+}
+
+bool
+Checkpoint::GetUnsigned(uint32_t& iValue)
+{
+	return Get(&iValue, sizeof(iValue));
+}
+
+bool
+Checkpoint::GetUnsigned64(uint64_t& iValue)
+{
+	return Get(&iValue, sizeof(iValue));
+}
+
+bool
+Checkpoint::GetBytes(std::vector<char>& oData)
+{
+	uint32_t iLength;
+	if (!GetUnsigned(iLength) || m_Data.size() - m_Position < iLength) {
+		m_Failed = true;
+		return false;
+	}
+	oData.assign(m_Data.begin() + m_Position, m_Data.begin() + m_Position + iLength);
+	m_Position += iLength;
+	return true;
+}
+
+bool
+Checkpoint::GetString(std::string& sValue)
+{
+	std::vector<char> oData;
+	if (!GetBytes(oData))
+		return false;
+	sValue.assign(oData.begin(), oData.end());
+	return true;
+}
+
+uint32_t
+Checkpoint::Hash(const char* pData, size_t iLength)
+{
+	// FNV-1a; only meant to catch accidents, such as checkpoints not completely written
+	uint32_t iHash = 2166136261u;
+	for (size_t n = 0; n < iLength; n++)
+		iHash = (iHash ^ (uint8_t)pData[n]) * 16777619u;
+	return iHash;
+}
+
+CheckpointFile::CheckpointFile()
+	: m_End(0)
+{
+}
+
+bool
+CheckpointFile::Open(const char* sPath)
+{
+	if (!m_File.Open(sPath, CHECKPOINT_FILE_MAGIC, CHECKPOINT_FILE_VERSION, "checkpoint file"))
+		return false;
+
+	// Nothing is kept unless it is asked for
+	m_End = m_File.GetStart();
+	return true;
+}
+
+bool
+CheckpointFile::ReadHeader(Header& oHeader)
+{
+	return fread(&oHeader, sizeof(oHeader), 1, m_File.GetFile()) == 1 && oHeader.h_magic == CHECKPOINT_MAGIC;
+}
+
+bool
+CheckpointFile::Load(off_t iPosition, Checkpoint& oCheckpoint)
+{
+	oCheckpoint.Clear();
+
+	// Find the last intact checkpoint that is not too far
+	off_t iFound = -1;
+	Header oFound;
+	off_t iOffset = m_End;
+	off_t iSize = m_File.GetSize();
+	if (iSize < 0)
+		return false;
+	FILE* pFile = m_File.GetFile();
+	fseeko(pFile, iOffset, SEEK_SET);
+	Header oHeader;
+	std::vector<char> oData;
+	while (ReadHeader(oHeader) && (off_t)oHeader.h_input_offset <= iPosition) {
+		// A damaged length must not make us allocate more than the file holds
+		if (oHeader.h_length > (uint64_t)(iSize - iOffset - (off_t)sizeof(oHeader)))
+			break;
+		oData.resize(oHeader.h_length);
+		if (oHeader.h_length > 0 && fread(&oData[0], oHeader.h_length, 1, pFile) != 1)
+			break;
+		SegmentFile::Part oPart = { oData.data(), oData.size() };
+		if (SegmentFile::Hash(&oPart, 1) != oHeader.h_hash)
+			break;
+		iFound = iOffset;
+		oFound = oHeader;
+		iOffset += sizeof(oHeader) + oHeader.h_length;
+	}
+	if (iFound < 0)
+		return false;
+
+	oCheckpoint.m_InputOffset = oFound.h_input_offset;
+	oCheckpoint.m_Data.resize(oFound.h_length);
+	fseeko(pFile, iFound + sizeof(oFound), SEEK_SET);
+	if (oFound.h_length > 0 && fread(&oCheckpoint.m_Data[0], oFound.h_length, 1, pFile) != 1)
+		return false;
+	m_End = iFound + sizeof(oFound) + oFound.h_length;
+	return true;
+}
+
+bool
+CheckpointFile::Save(const Checkpoint& oCheckpoint)
+{
+	SegmentFile::Part oPart = { oCheckpoint.m_Data.data(), oCheckpoint.m_Data.size() };
+
+	Header oHeader;
+	oHeader.h_magic = CHECKPOINT_MAGIC;
+	oHeader.h_length = oCheckpoint.m_Data.size();
+	oHeader.h_input_offset = oCheckpoint.m_InputOffset;
+	oHeader.h_hash = SegmentFile::Hash(&oPart, 1);
+	oHeader.h_reserved = 0;
+	if (!m_File.Append(m_End, &oHeader, sizeof(oHeader), &oPart, 1))
+		return false;
+	m_End += sizeof(oHeader) + oHeader.h_length;
+	return true;
+}
+
+/* vim:set ts=2 sw=2: */
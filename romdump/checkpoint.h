@@ -0,0 +1,124 @@
+/*
+ * Runes of Magic protocol analysis - checkpoints of the decoding state
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include "segmentfile.h"
+
+/*! \brief Decoding state at a position in the input
+ *
+ *  The state is an opaque sequence of values; whoever restores it must get
+ *  them in the order they were put. Getting past the end fails, and keeps
+ *  failing, so the result only needs to be checked at the end.
+ */
+class Checkpoint {
+	friend class CheckpointFile;
+public:
+	Checkpoint();
+
+	//! \brief Forgets the state
+	void Clear();
+
+	//! \brief Input position the state belongs to
+	off_t GetInputOffset() const { return m_InputOffset; }
+	void SetInputOffset(off_t iOffset) { m_InputOffset = iOffset; }
+
+	void PutUnsigned(uint32_t iValue);
+	void PutUnsigned64(uint64_t iValue);
+	void PutBytes(const void* pData, uint32_t iLength);
+	void PutString(const char* sValue);
+
+	bool GetUnsigned(uint32_t& iValue);
+	bool GetUnsigned64(uint64_t& iValue);
+	bool GetBytes(std::vector<char>& oData);
+	bool GetString(std::string& sValue);
+
+	//! \brief Were all values retrieved so far present?
+	bool IsOK() const { return !m_Failed; }
+
+	/*! \brief Hashes data, such as the input leading up to the checkpoint
+	 *  \param pData Data to hash
+	 *  \param iLength Length in bytes
+	 *  \returns Hash value
+	 */
+	static uint32_t Hash(const char* pData, size_t iLength);
+
+protected:
+	//! \brief Retrieves raw bytes, if there are enough left
+	bool Get(void* pData, uint32_t iLength);
+
+	off_t m_InputOffset;
+	std::vector<char> m_Data;
+
+	//! \brief Position of the next value to get
+	size_t m_Position;
+	bool m_Failed;
+};
+
+/*! \brief Sidecar file holding checkpoints, in increasing input order
+ *
+ *  Every checkpoint carries a checksum; one which was only partially
+ *  written, as the program was interrupted, is ignored and replaced by the
+ *  next one saved.
+ */
+class CheckpointFile {
+public:
+	CheckpointFile();
+
+	/*! \brief Opens the file, creating it if needed
+	 *  \param sPath Path to use
+	 *  \returns true on success
+	 */
+	bool Open(const char* sPath);
+
+	/*! \brief Loads the last checkpoint at or before a position
+	 *  \param iPosition Input position
+	 *  \param oCheckpoint Receives the checkpoint
+	 *  \returns true if one was found
+	 *
+	 *  Checkpoints after the one found are discarded, as they will be saved
+	 *  again.
+	 */
+	bool Load(off_t iPosition, Checkpoint& oCheckpoint);
+
+	/*! \brief Appends a checkpoint
+	 *  \param oCheckpoint Checkpoint to store
+	 *  \returns true on success
+	 */
+	bool Save(const Checkpoint& oCheckpoint);
+
+protected:
+	struct Header;
+
+	//! \brief Reads the header of the checkpoint at the current position
+	bool ReadHeader(Header& oHeader);
+
+	SegmentFile m_File;
+
+	//! \brief End of the checkpoints which were found intact
+	off_t m_End;
+
+	CheckpointFile(const CheckpointFile&) = delete;
+	CheckpointFile& operator=(const CheckpointFile&) = delete;
+};
+
+#endif /* __CHECKPOINT_H__ */
@@ -15,18 +15,140 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "csvsysparser.h"
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define LINE_MAX 1024
 
+/*
+ * The dictionary consists of a header, the entries sorted by id and the
+ * \0-terminated strings they refer to. It remembers the size and
+ * modification time of the CSV file it was made from, so that it can be
+ * used without looking at the CSV file's content.
+ */
+namespace {
+
+const char s_DictionaryMagic[8] = { 'R', 'O', 'M', 'S', 'Y', 'S', 'D', '\0' };
+
+//! \brief Bump this whenever the layout changes
+const uint32_t s_DictionaryFormatVersion = 1;
+
+//! \brief Written as-is; guards against dictionaries from a different byte order
+const uint32_t s_DictionaryByteOrder = 0x01020304;
+
+struct DictionaryHeader {
+	char m_Magic[8];
+	uint32_t m_FormatVersion;
+	uint32_t m_ByteOrder;
+	uint64_t m_SourceSize;
+	int64_t m_SourceMTime;
+	int64_t m_SourceMTimeNSec;
+	uint32_t m_NumEntries;
+	uint32_t m_StringsLength;
+};
+
+} // unnamed namespace
+
 CSVSysParser::CSVSysParser()
-	: m_Default("?")
+	: m_Entries(NULL), m_NumEntries(0), m_Strings(NULL), m_StringsLength(0), m_Mapping(NULL), m_MappingLength(0), m_Default("?")
+{
+}
+
+CSVSysParser::~CSVSysParser()
+{
+	Unload();
+}
+
+void
+CSVSysParser::Unload()
 {
+	if (m_Mapping != NULL)
+		munmap(m_Mapping, m_MappingLength);
+	m_Mapping = NULL;
+	m_MappingLength = 0;
+	m_Image.clear();
+	m_Entries = NULL;
+	m_NumEntries = 0;
+	m_Strings = NULL;
+	m_StringsLength = 0;
 }
 
 bool
 CSVSysParser::Load(const char* fname)
+{
+	Unload();
+
+	// Maybe we were handed a dictionary right away
+	if (MapDictionary(fname, NULL))
+		return true;
+
+	struct stat st;
+	if (stat(fname, &st) < 0)
+		return false;
+	std::string sDictionary(fname);
+	sDictionary += ".dict";
+	if (MapDictionary(sDictionary.c_str(), &st))
+		return true;
+
+	TIdStringMap oStrings;
+	if (!ParseCSV(fname, oStrings))
+		return false;
+
+	// Build the dictionary; the map is already sorted by id
+	std::vector<Entry> oEntries;
+	std::string sStrings;
+	oEntries.reserve(oStrings.size());
+	for (auto it = oStrings.begin(); it != oStrings.end(); it++) {
+		Entry oEntry;
+		oEntry.m_Id = it->first;
+		oEntry.m_Offset = sStrings.size();
+		oEntries.push_back(oEntry);
+		sStrings.append(it->second.c_str(), it->second.size() + 1);
+	}
+
+	DictionaryHeader oHeader;
+	memset(&oHeader, 0, sizeof(oHeader));
+	memcpy(oHeader.m_Magic, s_DictionaryMagic, sizeof(oHeader.m_Magic));
+	oHeader.m_FormatVersion = s_DictionaryFormatVersion;
+	oHeader.m_ByteOrder = s_DictionaryByteOrder;
+	oHeader.m_SourceSize = st.st_size;
+	oHeader.m_SourceMTime = st.st_mtim.tv_sec;
+	oHeader.m_SourceMTimeNSec = st.st_mtim.tv_nsec;
+	oHeader.m_NumEntries = oEntries.size();
+	oHeader.m_StringsLength = sStrings.size();
+
+	m_Image.resize(sizeof(oHeader) + oEntries.size() * sizeof(Entry) + sStrings.size());
+	uint8_t* pImage = &m_Image[0];
+	memcpy(pImage, &oHeader, sizeof(oHeader));
+	pImage += sizeof(oHeader);
+	if (!oEntries.empty())
+		memcpy(pImage, &oEntries[0], oEntries.size() * sizeof(Entry));
+	pImage += oEntries.size() * sizeof(Entry);
+	memcpy(pImage, sStrings.data(), sStrings.size());
+
+	// Store it for next time; write to a temporary file first so that concurrent readers never see a partial one
+	{
+		char sTempFile[LINE_MAX];
+		snprintf(sTempFile, sizeof(sTempFile), "%s.%d.tmp", sDictionary.c_str(), (int)getpid());
+		FILE* f = fopen(sTempFile, "wb");
+		if (f != NULL) {
+			bool bOK = fwrite(&m_Image[0], m_Image.size(), 1, f) == 1;
+			bOK = fclose(f) == 0 && bOK;
+			if (!bOK || rename(sTempFile, sDictionary.c_str()) < 0)
+				unlink(sTempFile);
+		}
+	}
+
+	return UseDictionary(&m_Image[0], m_Image.size(), &st);
+}
+
+bool
+CSVSysParser::ParseCSV(const char* fname, TIdStringMap& oStrings)
 {
 	FILE* f = fopen(fname, "rt");
 	if (f == NULL)
@@ -64,17 +186,81 @@ CSVSysParser::Load(const char* fname)
 			continue;
 
 		// This item worked; store it
-		m_Strings.insert(std::pair<int, std::string>(id, string_content));
+		oStrings.insert(std::pair<uint32_t, std::string>(id, string_content));
+	}
+	fclose(f);
+	return true;
+}
+
+bool
+CSVSysParser::MapDictionary(const char* fname, const struct stat* pSource)
+{
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(DictionaryHeader)) {
+		close(fd);
+		return false;
+	}
+	void* pMapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pMapping == MAP_FAILED)
+		return false;
+
+	if (!UseDictionary(static_cast<const uint8_t*>(pMapping), st.st_size, pSource)) {
+		munmap(pMapping, st.st_size);
+		return false;
 	}
+	m_Mapping = pMapping;
+	m_MappingLength = st.st_size;
+	return true;
 }
 
-const std::string&
+bool
+CSVSysParser::UseDictionary(const uint8_t* pData, size_t iLength, const struct stat* pSource)
+{
+	const DictionaryHeader& oHeader = *reinterpret_cast<const DictionaryHeader*>(pData);
+	if (iLength < sizeof(DictionaryHeader) ||
+	    memcmp(oHeader.m_Magic, s_DictionaryMagic, sizeof(oHeader.m_Magic)) != 0 ||
+	    oHeader.m_FormatVersion != s_DictionaryFormatVersion ||
+	    oHeader.m_ByteOrder != s_DictionaryByteOrder)
+		return false;
+	if (pSource != NULL &&
+	    (oHeader.m_SourceSize != (uint64_t)pSource->st_size ||
+	     oHeader.m_SourceMTime != (int64_t)pSource->st_mtim.tv_sec ||
+	     oHeader.m_SourceMTimeNSec != (int64_t)pSource->st_mtim.tv_nsec))
+		return false;
+	if (iLength != sizeof(DictionaryHeader) + (uint64_t)oHeader.m_NumEntries * sizeof(Entry) + oHeader.m_StringsLength)
+		return false;
+
+	const char* pStrings = reinterpret_cast<const char*>(pData + sizeof(DictionaryHeader) + oHeader.m_NumEntries * sizeof(Entry));
+	if (oHeader.m_StringsLength > 0 && pStrings[oHeader.m_StringsLength - 1] != '\0')
+		return false;
+
+	m_Entries = reinterpret_cast<const Entry*>(pData + sizeof(DictionaryHeader));
+	m_NumEntries = oHeader.m_NumEntries;
+	m_Strings = pStrings;
+	m_StringsLength = oHeader.m_StringsLength;
+	return true;
+}
+
+const char*
 CSVSysParser::Lookup(int n) const
 {
-	auto it = m_Strings.find(n);
-	if (it == m_Strings.end())
-		return m_Default;
-	return it->second;
+	// Binary search for the first entry not below the id
+	uint32_t iId = n;
+	uint32_t iLow = 0, iHigh = m_NumEntries;
+	while (iLow < iHigh) {
+		uint32_t iMid = iLow + (iHigh - iLow) / 2;
+		if (m_Entries[iMid].m_Id < iId)
+			iLow = iMid + 1;
+		else
+			iHigh = iMid;
+	}
+	if (iLow == m_NumEntries || m_Entries[iLow].m_Id != iId || m_Entries[iLow].m_Offset >= m_StringsLength)
+		return m_Default.c_str();
+	return m_Strings + m_Entries[iLow].m_Offset;
 }
 
 /* vim:set ts=2 sw=2: */
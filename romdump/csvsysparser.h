@@ -17,16 +17,29 @@
 #ifndef __CSVSYSPARSER_H__
 #define __CSVSYSPARSER_H__
 
+#include <stddef.h>
+#include <stdint.h>
 #include <map>
 #include <string>
+#include <vector>
 
-//! \brief Parses Sys..._name from a CSV file
+struct stat;
+
+/*! \brief Parses Sys..._name from a CSV file
+ *
+ *  As parsing the CSV file is slow, the result is stored in a binary
+ *  dictionary next to it ('sysname.csv.dict') which is used instead as long
+ *  as the CSV file's size and modification time match. The dictionary is
+ *  mapped read-only, so concurrent processes share it; it may also be
+ *  passed to Load() directly.
+ */
 class CSVSysParser
 {
 public:
 	CSVSysParser();
+	~CSVSysParser();
 
-	/*! \brief Loads strings from a CSV file
+	/*! \brief Loads strings from a CSV file or dictionary
 	 *  \param fname File to read
 	 *  \returns true on success
 	 */
@@ -38,11 +51,58 @@ public:
 	 *
 	 *  This function will return a default entry if nothing was found.
 	 */
-	const std::string& Lookup(int n) const;
+	const char* Lookup(int n) const;
 
 protected:
-	typedef std::map<int, std::string> TintStringMap;
-	TintStringMap m_Strings;
+	//! \brief Dictionary entry; these are sorted by id
+	struct Entry {
+		uint32_t m_Id;
+
+		//! \brief Offset of the \0-terminated string
+		uint32_t m_Offset;
+	};
+
+	typedef std::map<uint32_t, std::string> TIdStringMap;
+
+	/*! \brief Parses a CSV file
+	 *  \param fname File to read
+	 *  \param oStrings Receives the strings found
+	 *  \returns true on success
+	 */
+	static bool ParseCSV(const char* fname, TIdStringMap& oStrings);
+
+	/*! \brief Uses a dictionary file
+	 *  \param fname Dictionary to use
+	 *  \param pSource If not NULL, the CSV file the dictionary must have been made from
+	 *  \returns true on success
+	 */
+	bool MapDictionary(const char* fname, const struct stat* pSource);
+
+	/*! \brief Uses a dictionary image
+	 *  \param pData Image
+	 *  \param iLength Image length, in bytes
+	 *  \param pSource If not NULL, the CSV file the dictionary must have been made from
+	 *  \returns true if the image is valid
+	 */
+	bool UseDictionary(const uint8_t* pData, size_t iLength, const struct stat* pSource);
+
+	//! \brief Releases the dictionary in use
+	void Unload();
+
+	//! \brief Entries in use
+	const Entry* m_Entries;
+	uint32_t m_NumEntries;
+
+	//! \brief Strings referred to by the entries
+	const char* m_Strings;
+	uint32_t m_StringsLength;
+
+	//! \brief Mapped dictionary, if any
+	void* m_Mapping;
+	size_t m_MappingLength;
+
+	//! \brief Dictionary image, if it wasn't mapped
+	std::vector<uint8_t> m_Image;
 
 	//! \brief Default entry when nothing else is available
 	std::string m_Default;
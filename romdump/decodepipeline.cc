@@ -0,0 +1,121 @@
+/*
+ * Runes of Magic protocol analysis - parallel decoding with ordered output
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "decodepipeline.h"
+
+DecodePipeline::DecodePipeline(XHandler& oHandler, int iNumWorkers, int iNumSlots)
+	: m_Handler(oHandler), m_Submitted(0), m_Picked(0), m_Emitted(0), m_Stop(false)
+{
+	m_Slots.resize(iNumSlots);
+	for (auto it = m_Slots.begin(); it != m_Slots.end(); it++) {
+		it->m_Job = m_Handler.CreateJob();
+		it->m_Decoded = false;
+	}
+
+	for (int n = 0; n < iNumWorkers; n++)
+		m_Workers.push_back(std::thread(&DecodePipeline::DecodeThread, this, n));
+	m_Emitter = std::thread(&DecodePipeline::EmitThread, this);
+}
+
+DecodePipeline::~DecodePipeline()
+{
+	Drain();
+	{
+		std::lock_guard<std::mutex> oLock(m_Mutex);
+		m_Stop = true;
+	}
+	m_SubmittedCond.notify_all();
+	m_DecodedCond.notify_all();
+	for (auto it = m_Workers.begin(); it != m_Workers.end(); it++)
+		it->join();
+	m_Emitter.join();
+
+	for (auto it = m_Slots.begin(); it != m_Slots.end(); it++)
+		delete it->m_Job;
+}
+
+DecodePipeline::Job&
+DecodePipeline::Acquire()
+{
+	std::unique_lock<std::mutex> oLock(m_Mutex);
+	while (m_Submitted - m_Emitted >= m_Slots.size())
+		m_EmittedCond.wait(oLock);
+	return *m_Slots[m_Submitted % m_Slots.size()].m_Job;
+}
+
+void
+DecodePipeline::Submit()
+{
+	{
+		std::lock_guard<std::mutex> oLock(m_Mutex);
+		m_Slots[m_Submitted % m_Slots.size()].m_Decoded = false;
+		m_Submitted++;
+	}
+	m_SubmittedCond.notify_one();
+}
+
+void
+DecodePipeline::Drain()
+{
+	std::unique_lock<std::mutex> oLock(m_Mutex);
+	while (m_Emitted != m_Submitted)
+		m_EmittedCond.wait(oLock);
+}
+
+void
+DecodePipeline::DecodeThread(int iWorker)
+{
+	std::unique_lock<std::mutex> oLock(m_Mutex);
+	while (true) {
+		while (!m_Stop && m_Picked == m_Submitted)
+			m_SubmittedCond.wait(oLock);
+		if (m_Picked == m_Submitted)
+			break; // stopping and nothing left to do
+
+		Slot& oSlot = m_Slots[m_Picked % m_Slots.size()];
+		m_Picked++;
+		oLock.unlock();
+		m_Handler.Decode(*oSlot.m_Job, iWorker);
+		oLock.lock();
+
+		oSlot.m_Decoded = true;
+		if (&oSlot == &m_Slots[m_Emitted % m_Slots.size()])
+			m_DecodedCond.notify_one();
+	}
+}
+
+void
+DecodePipeline::EmitThread()
+{
+	std::unique_lock<std::mutex> oLock(m_Mutex);
+	while (true) {
+		Slot& oSlot = m_Slots[m_Emitted % m_Slots.size()];
+		while (!(m_Emitted != m_Submitted && oSlot.m_Decoded) && !(m_Stop && m_Emitted == m_Submitted))
+			m_DecodedCond.wait(oLock);
+		if (m_Emitted == m_Submitted)
+			break; // stopping and nothing left to do
+
+		oLock.unlock();
+		m_Handler.Emit(*oSlot.m_Job);
+		oLock.lock();
+
+		oSlot.m_Decoded = false;
+		m_Emitted++;
+		m_EmittedCond.notify_all();
+	}
+}
+
+/* vim:set ts=2 sw=2: */
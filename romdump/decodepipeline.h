@@ -0,0 +1,133 @@
+/*
+ * Runes of Magic protocol analysis - parallel decoding with ordered output
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __DECODEPIPELINE_H__
+#define __DECODEPIPELINE_H__
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*! \brief Decodes in parallel, emits in order
+ *
+ *  The caller frames the input and fills jobs in order (Acquire() and
+ *  Submit()); a number of worker threads decode the jobs in whatever order
+ *  they get to them, and a single emitter thread hands them back in the
+ *  order they were submitted.
+ *
+ *  Jobs live in a fixed ring of slots, which are reused once emitted; since
+ *  a slot isn't touched until its job is emitted, anything the job refers
+ *  to may be kept until then.
+ */
+class DecodePipeline {
+public:
+	//! \brief Work item; derive to add whatever is needed
+	class Job {
+	public:
+		virtual ~Job() { }
+	};
+
+	//! \brief Performs the actual work
+	class XHandler {
+	public:
+		virtual ~XHandler() { }
+
+		//! \brief Creates the job for a slot
+		virtual Job* CreateJob() = 0;
+
+		/*! \brief Decodes a job; called by the workers, in any order
+		 *  \param oJob Job to decode
+		 *  \param iWorker Index of the calling worker, from 0
+		 *
+		 *  A worker decodes a single job at a time, so anything kept per
+		 *  worker need not be locked.
+		 */
+		virtual void Decode(Job& oJob, int iWorker) = 0;
+
+		//! \brief Emits a decoded job; called by the emitter, in submission order
+		virtual void Emit(Job& oJob) = 0;
+	};
+
+	/*! \brief Creates the pipeline and starts all threads
+	 *  \param oHandler Handler to use; must outlive the pipeline
+	 *  \param iNumWorkers Number of decoding threads
+	 *  \param iNumSlots Maximum number of jobs in flight
+	 */
+	DecodePipeline(XHandler& oHandler, int iNumWorkers, int iNumSlots);
+
+	//! \brief Emits all submitted jobs and stops all threads
+	~DecodePipeline();
+
+	/*! \brief Retrieves the next job to fill
+	 *
+	 *  This blocks until a slot is available. The job must be passed to
+	 *  Submit() before the next Acquire().
+	 */
+	Job& Acquire();
+
+	//! \brief Hands the job obtained using Acquire() over for decoding
+	void Submit();
+
+	/*! \brief Waits until all submitted jobs are emitted
+	 *
+	 *  Afterwards, nothing is being emitted until the next Submit().
+	 */
+	void Drain();
+
+protected:
+	struct Slot {
+		Job* m_Job;
+
+		//! \brief Has the job been decoded?
+		bool m_Decoded;
+	};
+
+	//! \brief Worker thread main loop
+	void DecodeThread(int iWorker);
+
+	//! \brief Emitter thread main loop
+	void EmitThread();
+
+	XHandler& m_Handler;
+	std::vector<Slot> m_Slots;
+
+	//! \brief Number of jobs submitted, picked up for decoding and emitted
+	unsigned int m_Submitted, m_Picked, m_Emitted;
+
+	//! \brief Set once the threads are to stop
+	bool m_Stop;
+
+	//! \brief Protects all of the above
+	std::mutex m_Mutex;
+
+	//! \brief Signalled when a job is submitted
+	std::condition_variable m_SubmittedCond;
+
+	//! \brief Signalled when a job is decoded
+	std::condition_variable m_DecodedCond;
+
+	//! \brief Signalled when a job is emitted
+	std::condition_variable m_EmittedCond;
+
+	std::vector<std::thread> m_Workers;
+	std::thread m_Emitter;
+
+	DecodePipeline(const DecodePipeline&) = delete;
+	DecodePipeline& operator=(const DecodePipeline&) = delete;
+};
+
+#endif /* __DECODEPIPELINE_H__ */
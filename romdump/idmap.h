@@ -0,0 +1,345 @@
+/*
+ * Runes of Magic protocol analysis - compact map keyed by 32-bit ids
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __IDMAP_H__
+#define __IDMAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*! \brief Map from 32-bit ids to small values
+ *
+ *  This is an open-addressing hash table using linear probing; the slots
+ *  hold the key next to the entry index, so probing never touches the
+ *  entries themselves. Entries are kept in a single array.
+ *
+ *  Every Set() bumps a generation counter which is stored with the entry,
+ *  so callers can tell whether an id was reassigned since they last saw
+ *  it. Optionally, the number of entries can be bounded; the least
+ *  recently used entry is then replaced once the bound is reached.
+ */
+template<typename T> class IdMap {
+public:
+	/*! \brief Constructs an empty map
+	 *  \param iMaxEntries Maximum number of entries, 0 for no limit
+	 */
+	IdMap(int iMaxEntries = 0)
+		: m_MaxEntries(iMaxEntries), m_Generation(0), m_Head(s_None), m_Tail(s_None), m_Shift(32 - s_InitialBits)
+	{
+		m_Slots.resize(1 << s_InitialBits);
+	}
+
+	/*! \brief Changes the maximum number of entries
+	 *  \param iMaxEntries Maximum number of entries, 0 for no limit
+	 *
+	 *  This must be called before anything is added.
+	 */
+	void SetMaxEntries(int iMaxEntries) { m_MaxEntries = iMaxEntries; }
+
+	/*! \brief Adds an entry or replaces its value
+	 *  \param iKey Key to use
+	 *  \param tValue Value to store
+	 */
+	void Set(uint32_t iKey, const T& tValue);
+
+	/*! \brief Looks an entry up
+	 *  \param iKey Key to look for
+	 *  \param pGeneration If not NULL, receives the generation the value was set in
+	 *  \returns Value, or NULL if the key isn't present
+	 *
+	 *  The pointer remains valid until the next Set().
+	 */
+	const T* Find(uint32_t iKey, uint32_t* pGeneration = NULL);
+
+	/*! \brief Removes an entry
+	 *  \param iKey Key to remove
+	 *  \returns true if it was present
+	 *
+	 *  The last entry takes its place, so the entries remain in a single
+	 *  array without holes.
+	 */
+	bool Remove(uint32_t iKey);
+
+	/*! \brief Removes all entries
+	 *
+	 *  The generation counter keeps counting, so values set afterwards are
+	 *  never mistaken for ones from before.
+	 */
+	void Clear();
+
+	//! \brief Retrieves the number of entries
+	int GetSize() const { return m_Entries.size(); }
+
+	//! \brief Retrieves the generation of the most recent Set()
+	uint32_t GetGeneration() const { return m_Generation; }
+
+	/*! \brief Calls a function for every entry, least recently used first
+	 *  \param fFunc Function taking the key and the value
+	 *
+	 *  Setting the entries in this order on an empty map yields the same
+	 *  order of replacement.
+	 */
+	template<typename F> void ForEach(F fFunc) const;
+
+protected:
+	//! \brief Bits used for the initial table size
+	static const int s_InitialBits = 10;
+
+	//! \brief Marks the absence of an entry index
+	static const uint32_t s_None = 0xffffffff;
+
+	//! \brief Hash table slot
+	struct Slot {
+		Slot() : m_Key(0), m_Entry(s_None) { }
+
+		uint32_t m_Key;
+
+		//! \brief Index in m_Entries, s_None if the slot is free
+		uint32_t m_Entry;
+	};
+
+	struct Entry {
+		uint32_t m_Key;
+
+		//! \brief Generation in which the value was set
+		uint32_t m_Generation;
+
+		//! \brief More and less recently used entries, only kept if bounded
+		uint32_t m_Prev, m_Next;
+
+		T m_Value;
+	};
+
+	//! \brief Determines the preferred slot for a key (Fibonacci hashing)
+	uint32_t GetHomeSlot(uint32_t iKey) const { return (iKey * 2654435769u) >> m_Shift; }
+
+	//! \brief Retrieves the slot index mask
+	uint32_t GetMask() const { return m_Slots.size() - 1; }
+
+	//! \brief Finds the slot holding a key, or the free slot where it would go
+	uint32_t FindSlot(uint32_t iKey) const;
+
+	//! \brief Doubles the table size
+	void Grow();
+
+	//! \brief Removes a slot's entry, keeping all probe sequences intact
+	void RemoveSlot(uint32_t iSlot);
+
+	//! \brief Unlinks an entry from the recently used list
+	void Unlink(uint32_t iEntry);
+
+	//! \brief Links an entry as the most recently used
+	void LinkAtHead(uint32_t iEntry);
+
+	int m_MaxEntries;
+	uint32_t m_Generation;
+
+	//! \brief Most and least recently used entries
+	uint32_t m_Head, m_Tail;
+
+	//! \brief Shift to apply to hashes, 32 - log2(table size)
+	int m_Shift;
+
+	std::vector<Slot> m_Slots;
+	std::vector<Entry> m_Entries;
+};
+
+template<typename T> uint32_t
+IdMap<T>::FindSlot(uint32_t iKey) const
+{
+	uint32_t iMask = GetMask();
+	uint32_t iSlot = GetHomeSlot(iKey);
+	while (m_Slots[iSlot].m_Entry != s_None && m_Slots[iSlot].m_Key != iKey)
+		iSlot = (iSlot + 1) & iMask;
+	return iSlot;
+}
+
+template<typename T> const T*
+IdMap<T>::Find(uint32_t iKey, uint32_t* pGeneration)
+{
+	const Slot& oSlot = m_Slots[FindSlot(iKey)];
+	if (oSlot.m_Entry == s_None)
+		return NULL;
+
+	if (m_MaxEntries > 0 && oSlot.m_Entry != m_Head) {
+		Unlink(oSlot.m_Entry);
+		LinkAtHead(oSlot.m_Entry);
+	}
+	const Entry& oEntry = m_Entries[oSlot.m_Entry];
+	if (pGeneration != NULL)
+		*pGeneration = oEntry.m_Generation;
+	return &oEntry.m_Value;
+}
+
+template<typename T> void
+IdMap<T>::Set(uint32_t iKey, const T& tValue)
+{
+	m_Generation++;
+
+	uint32_t iSlot = FindSlot(iKey);
+	uint32_t iEntry = m_Slots[iSlot].m_Entry;
+	if (iEntry == s_None) {
+		if (m_MaxEntries > 0 && (int)m_Entries.size() >= m_MaxEntries) {
+			// Full; recycle the least recently used entry
+			iEntry = m_Tail;
+			Unlink(iEntry);
+			RemoveSlot(FindSlot(m_Entries[iEntry].m_Key));
+			iSlot = FindSlot(iKey);
+		} else {
+			// Keep the load factor at most 1/2
+			if ((m_Entries.size() + 1) * 2 > m_Slots.size()) {
+				Grow();
+				iSlot = FindSlot(iKey);
+			}
+			iEntry = m_Entries.size();
+			m_Entries.push_back(Entry());
+		}
+		m_Slots[iSlot].m_Key = iKey;
+		m_Slots[iSlot].m_Entry = iEntry;
+		m_Entries[iEntry].m_Key = iKey;
+		if (m_MaxEntries > 0)
+			LinkAtHead(iEntry);
+	} else if (m_MaxEntries > 0 && iEntry != m_Head) {
+		Unlink(iEntry);
+		LinkAtHead(iEntry);
+	}
+
+	Entry& oEntry = m_Entries[iEntry];
+	oEntry.m_Generation = m_Generation;
+	oEntry.m_Value = tValue;
+}
+
+template<typename T> bool
+IdMap<T>::Remove(uint32_t iKey)
+{
+	uint32_t iSlot = FindSlot(iKey);
+	uint32_t iEntry = m_Slots[iSlot].m_Entry;
+	if (iEntry == s_None)
+		return false;
+	RemoveSlot(iSlot);
+	if (m_MaxEntries > 0)
+		Unlink(iEntry);
+
+	uint32_t iLast = m_Entries.size() - 1;
+	if (iEntry != iLast) {
+		// Move the last entry into the hole, pointing everything at its new place
+		Entry& oEntry = m_Entries[iEntry];
+		oEntry = m_Entries[iLast];
+		m_Slots[FindSlot(oEntry.m_Key)].m_Entry = iEntry;
+		if (m_MaxEntries > 0) {
+			if (oEntry.m_Prev != s_None)
+				m_Entries[oEntry.m_Prev].m_Next = iEntry;
+			else
+				m_Head = iEntry;
+			if (oEntry.m_Next != s_None)
+				m_Entries[oEntry.m_Next].m_Prev = iEntry;
+			else
+				m_Tail = iEntry;
+		}
+	}
+	m_Entries.pop_back();
+	return true;
+}
+
+template<typename T> void
+IdMap<T>::Clear()
+{
+	m_Slots.assign(1 << s_InitialBits, Slot());
+	m_Entries.clear();
+	m_Head = s_None;
+	m_Tail = s_None;
+	m_Shift = 32 - s_InitialBits;
+}
+
+template<typename T> template<typename F> void
+IdMap<T>::ForEach(F fFunc) const
+{
+	if (m_MaxEntries == 0) {
+		// Unbounded maps don't keep track; the order doesn't matter then
+		for (auto it = m_Entries.begin(); it != m_Entries.end(); it++)
+			fFunc(it->m_Key, it->m_Value);
+		return;
+	}
+	for (uint32_t iEntry = m_Tail; iEntry != s_None; iEntry = m_Entries[iEntry].m_Prev)
+		fFunc(m_Entries[iEntry].m_Key, m_Entries[iEntry].m_Value);
+}
+
+template<typename T> void
+IdMap<T>::Grow()
+{
+	std::vector<Slot> oSlots(m_Slots.size() * 2);
+	m_Slots.swap(oSlots);
+	m_Shift--;
+
+	uint32_t iMask = GetMask();
+	for (auto it = oSlots.begin(); it != oSlots.end(); it++) {
+		if (it->m_Entry == s_None)
+			continue;
+		uint32_t iSlot = GetHomeSlot(it->m_Key);
+		while (m_Slots[iSlot].m_Entry != s_None)
+			iSlot = (iSlot + 1) & iMask;
+		m_Slots[iSlot] = *it;
+	}
+}
+
+template<typename T> void
+IdMap<T>::RemoveSlot(uint32_t iSlot)
+{
+	// Move later entries of the probe sequence back, unless they'd end up before their home slot
+	uint32_t iMask = GetMask();
+	uint32_t iNext = iSlot;
+	while (true) {
+		iNext = (iNext + 1) & iMask;
+		if (m_Slots[iNext].m_Entry == s_None)
+			break;
+		uint32_t iHome = GetHomeSlot(m_Slots[iNext].m_Key);
+		if (((iNext - iHome) & iMask) < ((iNext - iSlot) & iMask))
+			continue;
+		m_Slots[iSlot] = m_Slots[iNext];
+		iSlot = iNext;
+	}
+	m_Slots[iSlot].m_Entry = s_None;
+}
+
+template<typename T> void
+IdMap<T>::Unlink(uint32_t iEntry)
+{
+	Entry& oEntry = m_Entries[iEntry];
+	if (oEntry.m_Prev != s_None)
+		m_Entries[oEntry.m_Prev].m_Next = oEntry.m_Next;
+	else
+		m_Head = oEntry.m_Next;
+	if (oEntry.m_Next != s_None)
+		m_Entries[oEntry.m_Next].m_Prev = oEntry.m_Prev;
+	else
+		m_Tail = oEntry.m_Prev;
+}
+
+template<typename T> void
+IdMap<T>::LinkAtHead(uint32_t iEntry)
+{
+	Entry& oEntry = m_Entries[iEntry];
+	oEntry.m_Prev = s_None;
+	oEntry.m_Next = m_Head;
+	if (m_Head != s_None)
+		m_Entries[m_Head].m_Prev = iEntry;
+	else
+		m_Tail = iEntry;
+	m_Head = iEntry;
+}
+
+#endif /* __IDMAP_H__ */
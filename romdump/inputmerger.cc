@@ -0,0 +1,291 @@
+/*
+ * Runes of Magic protocol analysis - merging of multiple inputs
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <glob.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "inputmerger.h"
+#include "recordreader.h"
+#include "romlogparser.h"
+
+InputMerger::InputMerger()
+	: m_Merge(false), m_Follow(false), m_StartOffset(0), m_Current(0), m_Stopped(false), m_ExcessiveLength(0)
+{
+}
+
+InputMerger::~InputMerger()
+{
+	for (auto it = m_Inputs.begin(); it != m_Inputs.end(); it++)
+		Close(*it);
+}
+
+bool
+InputMerger::Add(const char* sPath)
+{
+	struct stat st;
+	if (stat(sPath, &st) == 0) {
+		if (!S_ISDIR(st.st_mode)) {
+			Input oInput;
+			oInput.m_Path = sPath;
+			oInput.m_File = NULL;
+			oInput.m_IsRegular = S_ISREG(st.st_mode);
+			oInput.m_LogVersion = 0;
+			oInput.m_Reader = NULL;
+			oInput.m_Timestamp = 0;
+			m_Inputs.push_back(oInput);
+			return true;
+		}
+
+		DIR* pDir = opendir(sPath);
+		if (pDir == NULL)
+			return false;
+		std::vector<std::string> oNames;
+		while (struct dirent* pEntry = readdir(pDir)) {
+			if (pEntry->d_name[0] == '.')
+				continue;
+			std::string sName = std::string(sPath) + "/" + pEntry->d_name;
+			if (stat(sName.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+				oNames.push_back(sName);
+		}
+		closedir(pDir);
+		if (oNames.empty()) {
+			errno = ENOENT;
+			return false;
+		}
+
+		std::sort(oNames.begin(), oNames.end());
+		for (auto it = oNames.begin(); it != oNames.end(); it++)
+			Add(it->c_str());
+		return true;
+	}
+
+	// Not something which exists; perhaps a pattern the shell did not expand
+	if (strpbrk(sPath, "*?[") == NULL)
+		return false;
+	glob_t g;
+	if (glob(sPath, 0, NULL, &g) != 0) {
+		errno = ENOENT;
+		return false;
+	}
+	bool bOK = true;
+	for (size_t n = 0; n < g.gl_pathc; n++)
+		bOK = Add(g.gl_pathv[n]) && bOK;
+	globfree(&g);
+	return bOK;
+}
+
+bool
+InputMerger::Open(Input& oInput)
+{
+	if (oInput.m_File != NULL)
+		return true;
+	oInput.m_File = fopen(oInput.m_Path.c_str(), "rb");
+	if (oInput.m_File == NULL) {
+		fprintf(stderr, "InputMerger::Open(): can't open '%s': %s\n", oInput.m_Path.c_str(), strerror(errno));
+		return false;
+	}
+
+	// A log which was only just created may lack its header; we can't tell what it is until it's there
+	struct stat st;
+	while (m_Follow && oInput.m_IsRegular && fstat(fileno(oInput.m_File), &st) == 0 && st.st_size < (off_t)sizeof(uint32_t))
+		usleep(s_PollInterval * 1000);
+	oInput.m_LogVersion = ROMLogParser::DetectVersion(oInput.m_File);
+	return true;
+}
+
+bool
+InputMerger::StartReading(Input& oInput)
+{
+	if (!Open(oInput))
+		return false;
+	oInput.m_Reader = new RecordReader(oInput.m_File, oInput.m_LogVersion);
+	oInput.m_Reader->SetFollow(m_Follow && (m_Merge || &oInput == &m_Inputs.back()));
+	if (&oInput == &m_Inputs.front())
+		oInput.m_Reader->SetStartOffset(m_StartOffset);
+	oInput.m_Reader->Start();
+	return true;
+}
+
+void
+InputMerger::Close(Input& oInput)
+{
+	delete oInput.m_Reader;
+	oInput.m_Reader = NULL;
+	if (oInput.m_File != NULL)
+		fclose(oInput.m_File);
+	oInput.m_File = NULL;
+}
+
+bool
+InputMerger::Start()
+{
+	/*
+	 * Find out what we are dealing with; regular files are closed again, so
+	 * we don't need all of them open at once unless we are merging.
+	 * Anything else cannot be reopened, so it's kept as-is.
+	 */
+	m_Merge = m_Inputs.size() > 1;
+	for (auto it = m_Inputs.begin(); it != m_Inputs.end(); it++) {
+		if (!Open(*it))
+			return false;
+		if (it->m_LogVersion < 3)
+			m_Merge = false;
+		if (it->m_IsRegular)
+			Close(*it);
+	}
+
+	if (!m_Merge) {
+		// Read ahead of the next input while processing the current one
+		for (int n = 0; n < 2 && n < (int)m_Inputs.size(); n++)
+			if (!StartReading(m_Inputs[n]))
+				return false;
+		return true;
+	}
+
+	for (int n = 0; n < (int)m_Inputs.size(); n++)
+		if (!StartReading(m_Inputs[n]))
+			return false;
+	for (int n = 0; n < (int)m_Inputs.size(); n++) {
+		if (Fetch(m_Inputs[n])) {
+			m_Heap.push_back(n);
+			std::push_heap(m_Heap.begin(), m_Heap.end(), [this](int a, int b) { return IsLater(a, b); });
+		} else if (!Finish(m_Inputs[n]))
+			break;
+	}
+	m_Current = -1;
+	return true;
+}
+
+bool
+InputMerger::Fetch(Input& oInput)
+{
+	return oInput.m_Reader->Next(oInput.m_Source, oInput.m_Dest, oInput.m_Data, oInput.m_Length, oInput.m_Timestamp);
+}
+
+bool
+InputMerger::Finish(Input& oInput)
+{
+	// An input which ends with an unreadable record ends everything, as it always has
+	m_ExcessiveLength = oInput.m_Reader->GetExcessiveLength();
+	Close(oInput);
+	if (m_ExcessiveLength > 0)
+		m_Stopped = true;
+	return !m_Stopped;
+}
+
+bool
+InputMerger::IsLater(int iInput1, int iInput2) const
+{
+	uint64_t iTimestamp1 = m_Inputs[iInput1].m_Timestamp;
+	uint64_t iTimestamp2 = m_Inputs[iInput2].m_Timestamp;
+	if (iTimestamp1 != iTimestamp2)
+		return iTimestamp1 > iTimestamp2;
+	return iInput1 > iInput2; // keep the order of the inputs for simultaneous records
+}
+
+bool
+InputMerger::IsDrained() const
+{
+	if (m_Current < 0 || m_Current >= (int)m_Inputs.size())
+		return false;
+	const RecordReader* pReader = m_Inputs[m_Current].m_Reader;
+	return pReader != NULL && pReader->IsDrained();
+}
+
+bool
+InputMerger::GetOffsets(off_t& iStart, off_t& iEnd) const
+{
+	if (m_Current < 0 || m_Current >= (int)m_Inputs.size() || m_Inputs[m_Current].m_Reader == NULL)
+		return false;
+	m_Inputs[m_Current].m_Reader->GetOffsets(iStart, iEnd);
+	return iStart >= 0;
+}
+
+uint64_t
+InputMerger::GetTimestamp() const
+{
+	if (m_Current < 0 || m_Current >= (int)m_Inputs.size())
+		return 0;
+	return m_Inputs[m_Current].m_Timestamp;
+}
+
+bool
+InputMerger::Seek(off_t iOffset)
+{
+	if (m_Inputs.size() != 1 || !m_Inputs.front().m_IsRegular)
+		return false;
+
+	Input& oInput = m_Inputs.front();
+	Close(oInput);
+	m_StartOffset = iOffset;
+	m_Current = 0;
+	m_Stopped = false;
+	m_ExcessiveLength = 0;
+	return StartReading(oInput);
+}
+
+bool
+InputMerger::Next(IPv4Address& oSource, IPv4Address& oDest, const char*& pData, int& iLength)
+{
+	if (m_Stopped)
+		return false;
+
+	if (!m_Merge) {
+		while (m_Current < (int)m_Inputs.size()) {
+			Input& oInput = m_Inputs[m_Current];
+			if (oInput.m_Reader != NULL && oInput.m_Reader->Next(oSource, oDest, pData, iLength, oInput.m_Timestamp))
+				return true;
+			if (oInput.m_Reader != NULL && !Finish(oInput))
+				return false;
+
+			m_Current++;
+			if (m_Current + 1 < (int)m_Inputs.size())
+				StartReading(m_Inputs[m_Current + 1]);
+		}
+		return false;
+	}
+
+	auto oLater = [this](int a, int b) { return IsLater(a, b); };
+	if (m_Current >= 0) {
+		// The record returned last is no longer needed; replace it
+		Input& oInput = m_Inputs[m_Current];
+		if (Fetch(oInput)) {
+			m_Heap.push_back(m_Current);
+			std::push_heap(m_Heap.begin(), m_Heap.end(), oLater);
+		} else if (!Finish(oInput))
+			return false;
+		m_Current = -1;
+	}
+	if (m_Heap.empty())
+		return false;
+
+	std::pop_heap(m_Heap.begin(), m_Heap.end(), oLater);
+	m_Current = m_Heap.back();
+	m_Heap.pop_back();
+
+	const Input& oInput = m_Inputs[m_Current];
+	oSource = oInput.m_Source;
+	oDest = oInput.m_Dest;
+	pData = oInput.m_Data;
+	iLength = oInput.m_Length;
+	return true;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,180 @@
+/*
+ * Runes of Magic protocol analysis - merging of multiple inputs
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __INPUTMERGER_H__
+#define __INPUTMERGER_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include "types.h"
+
+class RecordReader;
+
+/*! \brief Combines several inputs into a single stream of records
+ *
+ *  If every input is a log file with timestamps, the records are merged by
+ *  time, so logs of several proxies can be processed as one; otherwise the
+ *  inputs are processed one after another, in the order given. Each input
+ *  is read ahead using a RecordReader of its own; when concatenating, only
+ *  the current and the next input are open at any time.
+ *
+ *  When following, the inputs are expected to grow: all of them when
+ *  merging, otherwise only the last one, as earlier ones are typically
+ *  rotated logs.
+ */
+class InputMerger {
+public:
+	InputMerger();
+	~InputMerger();
+
+	/*! \brief Adds inputs
+	 *  \param sPath File, directory or glob pattern
+	 *  \returns true on success, false with errno set if nothing can be found
+	 *
+	 *  Directories add all files within them, sorted by name; hidden files
+	 *  are skipped.
+	 */
+	bool Add(const char* sPath);
+
+	/*! \brief Sets whether to wait for inputs to grow
+	 *  \param bFollow true to follow the inputs
+	 *
+	 *  This must be called before Start().
+	 */
+	void SetFollow(bool bFollow) { m_Follow = bFollow; }
+
+	/*! \brief Sets where reading of the first input starts
+	 *  \param iOffset Offset of the first record
+	 *
+	 *  This must be called before Start().
+	 */
+	void SetStartOffset(off_t iOffset) { m_StartOffset = iOffset; }
+
+	/*! \brief Opens the inputs and starts reading
+	 *  \returns true on success
+	 */
+	bool Start();
+
+	/*! \brief Retrieves the next record
+	 *  \param oSource Receives the source address
+	 *  \param oDest Receives the destination address
+	 *  \param pData Receives the record data, valid until the next call
+	 *  \param iLength Receives the record length
+	 *  \returns false once there are no more records
+	 */
+	bool Next(IPv4Address& oSource, IPv4Address& oDest, const char*& pData, int& iLength);
+
+	/*! \brief Retrieves the length of the record that ended reading, if too large
+	 *  \returns Length, or 0 if reading ended otherwise
+	 */
+	int GetExcessiveLength() const { return m_ExcessiveLength; }
+
+	//! \brief Would Next() have to wait for more data?
+	bool IsDrained() const;
+
+	/*! \brief Retrieves where the record returned last is located in its input
+	 *  \param iStart Receives the offset of its first byte
+	 *  \param iEnd Receives the offset just past it
+	 *  \returns false if there is no such record
+	 */
+	bool GetOffsets(off_t& iStart, off_t& iEnd) const;
+
+	/*! \brief Retrieves the time of the record returned last
+	 *  \returns Time in microseconds since the epoch, 0 if unknown
+	 */
+	uint64_t GetTimestamp() const;
+
+	/*! \brief Continues reading at another offset
+	 *  \param iOffset Offset of the next record
+	 *  \returns true on success
+	 *
+	 *  This is only possible with a single input, which must be a regular
+	 *  file; records read ahead are discarded.
+	 */
+	bool Seek(off_t iOffset);
+
+protected:
+	struct Input {
+		std::string m_Path;
+		FILE* m_File;
+		bool m_IsRegular;
+
+		//! \brief romproxy log file version, 0 for tcpflow output
+		int m_LogVersion;
+
+		RecordReader* m_Reader;
+
+		//! \brief Record fetched but not yet returned, when merging
+		IPv4Address m_Source;
+		IPv4Address m_Dest;
+		const char* m_Data;
+		int m_Length;
+		uint64_t m_Timestamp;
+	};
+
+	//! \brief Opens an input, if needed, and determines its format
+	bool Open(Input& oInput);
+
+	//! \brief Opens an input and starts reading it
+	bool StartReading(Input& oInput);
+
+	//! \brief Stops reading an input and closes it
+	void Close(Input& oInput);
+
+	//! \brief Fetches the next record of an input into the input itself
+	bool Fetch(Input& oInput);
+
+	//! \brief Handles the end of an input; returns false if everything must stop
+	bool Finish(Input& oInput);
+
+	//! \brief Orders inputs in the heap; the earliest record must end up on top
+	bool IsLater(int iInput1, int iInput2) const;
+
+	std::vector<Input> m_Inputs;
+
+	//! \brief Interval at which an empty input is checked when following, in ms
+	static const int s_PollInterval = 250;
+
+	//! \brief Whether records are merged by time
+	bool m_Merge;
+
+	//! \brief Whether inputs are followed as they grow
+	bool m_Follow;
+
+	off_t m_StartOffset;
+
+	//! \brief Inputs by their pending record, when merging
+	std::vector<int> m_Heap;
+
+	/*!
+	 *  When merging, the input whose record was returned last and must be
+	 *  fetched again, -1 if none; otherwise, the input being read.
+	 */
+	int m_Current;
+
+	//! \brief Set once reading must stop
+	bool m_Stopped;
+
+	int m_ExcessiveLength;
+
+	InputMerger(const InputMerger&) = delete;
+	InputMerger& operator=(const InputMerger&) = delete;
+};
+
+#endif /* __INPUTMERGER_H__ */
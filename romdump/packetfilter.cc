@@ -0,0 +1,687 @@
+/*
+ * Runes of Magic protocol analysis - packet filter expressions
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "packetfilter.h"
+#include "littleendian.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef ProtocolDefinition::Struct Struct;
+
+static void
+SkipSpace(const char*& sCurrent)
+{
+	while (isspace((unsigned char)*sCurrent))
+		sCurrent++;
+}
+
+static bool
+IsNameChar(char ch)
+{
+	return isalnum((unsigned char)ch) || ch == '_' || ch == '.' || ch == ':';
+}
+
+//! \brief Skips a token if it is next, returns whether it was
+static bool
+AcceptToken(const char*& sCurrent, const char* sToken)
+{
+	SkipSpace(sCurrent);
+	int iLength = strlen(sToken);
+	if (strncmp(sCurrent, sToken, iLength) != 0)
+		return false;
+	sCurrent += iLength;
+	return true;
+}
+
+//! \brief Does a struct, or any struct within it, transform its data?
+static bool
+HasTransformation(const Struct& oStruct)
+{
+	const Struct::TXActionPtrList& oActions = oStruct.GetActions();
+	for (auto it = oActions.begin(); it != oActions.end(); it++) {
+		if (dynamic_cast<const ProtocolDefinition::TransformationAction*>(*it) != NULL)
+			return true;
+		const ProtocolDefinition::Field* pField = dynamic_cast<const ProtocolDefinition::Field*>(*it);
+		if (pField == NULL)
+			continue;
+		const Struct* pStruct = dynamic_cast<const Struct*>(&pField->GetType());
+		if (pStruct != NULL && HasTransformation(*pStruct))
+			return true;
+	}
+	return false;
+}
+
+//! \brief Sign-extends a value of a given width, in bytes
+static int64_t
+SignExtend(uint32_t iValue, int iWidth)
+{
+	switch(iWidth) {
+		case 1:
+			return (int8_t)iValue;
+		case 2:
+			return (int16_t)iValue;
+	}
+	return (int32_t)iValue;
+}
+
+template<typename T> bool
+PacketFilter::ApplyOperator(Operator eOperator, T a, T b)
+{
+	switch(eOperator) {
+		case O_Equal:
+			return a == b;
+		case O_NotEqual:
+			return a != b;
+		case O_Less:
+			return a < b;
+		case O_LessEqual:
+			return a <= b;
+		case O_Greater:
+			return a > b;
+		case O_GreaterEqual:
+			return a >= b;
+		case O_Contains:
+			break; // strings only
+	}
+	return false;
+}
+
+PacketFilter::PacketFilter()
+	: m_Root(-1), m_Definition(NULL)
+{
+}
+
+bool
+PacketFilter::Add(const char* sExpression)
+{
+	Parser oParser;
+	oParser.m_Expression = sExpression;
+	oParser.m_Current = sExpression;
+
+	int iNode = ParseOr(oParser);
+	if (iNode < 0)
+		return false;
+	SkipSpace(oParser.m_Current);
+	if (*oParser.m_Current != '\0')
+		return ParseError(oParser, "unexpected input") >= 0;
+
+	AddRoot(iNode);
+	return true;
+}
+
+void
+PacketFilter::AddNames(const std::list<char*>& oNames, bool bExclude)
+{
+	int iNode = -1;
+	for (auto it = oNames.begin(); it != oNames.end(); it++) {
+		std::string sPacket(*it), sSubpacket;
+		std::string::size_type iColon = sPacket.find(':');
+		if (iColon != std::string::npos) {
+			sSubpacket = sPacket.substr(iColon + 1);
+			sPacket.erase(iColon);
+		}
+		int iSelector = AddSelector(sPacket, sSubpacket, true);
+		iNode = iNode < 0 ? iSelector : AddNode(Node::N_Or, iNode, iSelector);
+	}
+	if (iNode < 0)
+		return;
+
+	if (bExclude)
+		iNode = AddNode(Node::N_Not, iNode, -1);
+	AddRoot(iNode);
+}
+
+int
+PacketFilter::ParseError(const Parser& oParser, const char* sMessage)
+{
+	fprintf(stderr, "PacketFilter::Add(): %s at offset %d of '%s'\n", sMessage, (int)(oParser.m_Current - oParser.m_Expression), oParser.m_Expression);
+	return -1;
+}
+
+int
+PacketFilter::ParseOr(Parser& oParser)
+{
+	int iNode = ParseAnd(oParser);
+	while (iNode >= 0 && AcceptToken(oParser.m_Current, "||")) {
+		int iRight = ParseAnd(oParser);
+		if (iRight < 0)
+			return -1;
+		iNode = AddNode(Node::N_Or, iNode, iRight);
+	}
+	return iNode;
+}
+
+int
+PacketFilter::ParseAnd(Parser& oParser)
+{
+	int iNode = ParseUnary(oParser);
+	while (iNode >= 0 && AcceptToken(oParser.m_Current, "&&")) {
+		int iRight = ParseUnary(oParser);
+		if (iRight < 0)
+			return -1;
+		iNode = AddNode(Node::N_And, iNode, iRight);
+	}
+	return iNode;
+}
+
+int
+PacketFilter::ParseUnary(Parser& oParser)
+{
+	SkipSpace(oParser.m_Current);
+	if (oParser.m_Current[0] == '!' && oParser.m_Current[1] != '=') {
+		oParser.m_Current++;
+		int iNode = ParseUnary(oParser);
+		if (iNode < 0)
+			return -1;
+		return AddNode(Node::N_Not, iNode, -1);
+	}
+	if (AcceptToken(oParser.m_Current, "(")) {
+		int iNode = ParseOr(oParser);
+		if (iNode < 0)
+			return -1;
+		if (!AcceptToken(oParser.m_Current, ")"))
+			return ParseError(oParser, "')' expected");
+		return iNode;
+	}
+	return ParseTerm(oParser);
+}
+
+int
+PacketFilter::ParseTerm(Parser& oParser)
+{
+	SkipSpace(oParser.m_Current);
+	const char* sName = oParser.m_Current;
+	if (!isalpha((unsigned char)*sName) && *sName != '_')
+		return ParseError(oParser, "name expected");
+	while (IsNameChar(*oParser.m_Current))
+		oParser.m_Current++;
+	std::string sTerm(sName, oParser.m_Current - sName);
+
+	// Longer operators must be tried first
+	static const struct {
+		const char* m_Token;
+		Operator m_Operator;
+	} aOperators[] = {
+		{ "==", O_Equal },
+		{ "!=", O_NotEqual },
+		{ "<=", O_LessEqual },
+		{ ">=", O_GreaterEqual },
+		{ "<", O_Less },
+		{ ">", O_Greater },
+		{ "~", O_Contains },
+	};
+	int iOperator = -1;
+	for (unsigned int n = 0; n < sizeof(aOperators) / sizeof(aOperators[0]); n++) {
+		if (AcceptToken(oParser.m_Current, aOperators[n].m_Token)) {
+			iOperator = n;
+			break;
+		}
+	}
+
+	if (iOperator < 0) {
+		// Selector; a plain name may be either a packet or a subpacket
+		if (sTerm.find('.') != std::string::npos)
+			return ParseError(oParser, "comparison expected");
+		std::string::size_type iColon = sTerm.find(':');
+		if (iColon != std::string::npos)
+			return AddSelector(sTerm.substr(0, iColon), sTerm.substr(iColon + 1), false);
+		int iPacket = AddSelector(sTerm, std::string(), false);
+		int iSubpacket = AddSelector(std::string(), sTerm, false);
+		return AddNode(Node::N_Or, iPacket, iSubpacket);
+	}
+
+	if (sTerm.find(':') != std::string::npos)
+		return ParseError(oParser, "field name expected");
+
+	Compare oCompare;
+	oCompare.m_Field = sTerm;
+	oCompare.m_Operator = aOperators[iOperator].m_Operator;
+	oCompare.m_IsString = false;
+	oCompare.m_Integer = 0;
+	oCompare.m_Number = 0.0;
+
+	SkipSpace(oParser.m_Current);
+	if (*oParser.m_Current == '"') {
+		oParser.m_Current++;
+		while (*oParser.m_Current != '"') {
+			if (*oParser.m_Current == '\0')
+				return ParseError(oParser, "unterminated string");
+			if (*oParser.m_Current == '\\' && oParser.m_Current[1] != '\0')
+				oParser.m_Current++;
+			oCompare.m_String += *oParser.m_Current++;
+		}
+		oParser.m_Current++;
+		oCompare.m_IsString = true;
+		if (oCompare.m_Operator != O_Equal && oCompare.m_Operator != O_NotEqual && oCompare.m_Operator != O_Contains)
+			return ParseError(oParser, "strings can only be compared using ==, != or ~");
+	} else {
+		if (oCompare.m_Operator == O_Contains)
+			return ParseError(oParser, "string expected");
+
+		char* pEnd;
+		oCompare.m_Integer = strtoll(oParser.m_Current, &pEnd, 0);
+		oCompare.m_Number = (double)oCompare.m_Integer;
+		if (*pEnd == '.' || *pEnd == 'e' || *pEnd == 'E') {
+			oCompare.m_Number = strtod(oParser.m_Current, &pEnd);
+			oCompare.m_Integer = (int64_t)oCompare.m_Number;
+		}
+		if (pEnd == oParser.m_Current || IsNameChar(*pEnd))
+			return ParseError(oParser, "number expected");
+		oParser.m_Current = pEnd;
+	}
+
+	m_Compares.push_back(oCompare);
+	return AddNode(Node::N_Compare, m_Compares.size() - 1, -1);
+}
+
+int
+PacketFilter::AddNode(Node::Kind eKind, int iLeft, int iRight)
+{
+	Node oNode;
+	oNode.m_Kind = eKind;
+	oNode.m_Left = iLeft;
+	oNode.m_Right = iRight;
+	m_Nodes.push_back(oNode);
+	return m_Nodes.size() - 1;
+}
+
+int
+PacketFilter::AddSelector(const std::string& sPacket, const std::string& sSubpacket, bool bPrefix)
+{
+	Selector oSelector;
+	oSelector.m_Packet = sPacket;
+	oSelector.m_Subpacket = sSubpacket;
+	oSelector.m_Prefix = bPrefix;
+	m_Selectors.push_back(oSelector);
+	return AddNode(Node::N_Selector, m_Selectors.size() - 1, -1);
+}
+
+void
+PacketFilter::AddRoot(int iNode)
+{
+	m_Root = m_Root < 0 ? iNode : AddNode(Node::N_And, m_Root, iNode);
+
+	m_Code.clear();
+	CompileNode(m_Root);
+	Instruction oEnd = { Instruction::I_End, 0 };
+	m_Code.push_back(oEnd);
+}
+
+void
+PacketFilter::CompileNode(int iNode)
+{
+	const Node oNode = m_Nodes[iNode];
+	Instruction oInsn = { Instruction::I_End, oNode.m_Left };
+	switch(oNode.m_Kind) {
+		case Node::N_Selector:
+			oInsn.m_Opcode = Instruction::I_Selector;
+			m_Code.push_back(oInsn);
+			break;
+		case Node::N_Compare:
+			oInsn.m_Opcode = Instruction::I_Compare;
+			m_Code.push_back(oInsn);
+			break;
+		case Node::N_Not:
+			CompileNode(oNode.m_Left);
+			oInsn.m_Opcode = Instruction::I_Not;
+			m_Code.push_back(oInsn);
+			break;
+		case Node::N_And:
+		case Node::N_Or: {
+			// The right operand is skipped if the left one decides
+			CompileNode(oNode.m_Left);
+			int iJump = m_Code.size();
+			oInsn.m_Opcode = oNode.m_Kind == Node::N_And ? Instruction::I_JumpIfFalse : Instruction::I_JumpIfTrue;
+			m_Code.push_back(oInsn);
+			CompileNode(oNode.m_Right);
+			m_Code[iJump].m_Operand = m_Code.size();
+			break;
+		}
+	}
+}
+
+bool
+PacketFilter::ResolveField(const Struct& oStruct, const char* sPath, int iOffset, FieldRef& oRef)
+{
+	const char* sDot = strchr(sPath, '.');
+	int iNameLength = sDot != NULL ? sDot - sPath : strlen(sPath);
+
+	const Struct::TXActionPtrList& oActions = oStruct.GetActions();
+	for (auto it = oActions.begin(); it != oActions.end(); it++) {
+		if (dynamic_cast<const ProtocolDefinition::TransformationAction*>(*it) != NULL) {
+			iOffset = -1; // everything after this is transformed data
+			continue;
+		}
+		const ProtocolDefinition::Field* pField = dynamic_cast<const ProtocolDefinition::Field*>(*it);
+		if (pField == NULL)
+			continue;
+
+		const ProtocolDefinition::Type& oType = pField->GetType();
+		const Struct* pStruct = dynamic_cast<const Struct*>(&oType);
+		if ((int)strlen(pField->GetName()) == iNameLength && strncmp(pField->GetName(), sPath, iNameLength) == 0) {
+			oRef.m_Path.push_back(pField->GetIndex());
+			if (sDot != NULL)
+				return pStruct != NULL && ResolveField(*pStruct, sDot + 1, iOffset, oRef);
+			oRef.m_Type = &oType;
+			oRef.m_Offset = iOffset;
+			return true;
+		}
+
+		int iSize = pField->GetConstantSize();
+		if (iOffset >= 0)
+			iOffset = iSize > 0 && (pStruct == NULL || !HasTransformation(*pStruct)) ? iOffset + iSize : -1;
+	}
+	return false;
+}
+
+void
+PacketFilter::ResolveCompare(const Compare& oCompare, const ProtocolDefinition::Packet& oPacket, const ProtocolDefinition::Subpacket* pSubpacket, FieldRef& oRef)
+{
+	oRef.m_Kind = FieldRef::K_Missing;
+	oRef.m_Type = NULL;
+
+	// Fields of the subpacket take precedence over those of the packet
+	bool bFound = false;
+	if (pSubpacket != NULL) {
+		oRef.m_InSubpacket = true;
+		bFound = ResolveField(*pSubpacket, oCompare.m_Field.c_str(), oPacket.GetNumPacketBytes(), oRef);
+	}
+	if (!bFound) {
+		oRef.m_InSubpacket = false;
+		oRef.m_Path.clear();
+		bFound = ResolveField(oPacket, oCompare.m_Field.c_str(), 0, oRef);
+	}
+	if (!bFound)
+		return;
+
+	const ProtocolDefinition::Type* pType = oRef.m_Type;
+	bool bRaw = false;
+	oRef.m_Width = sizeof(uint32_t);
+	if (const ProtocolDefinition::unsignedType* pUnsigned = dynamic_cast<const ProtocolDefinition::unsignedType*>(pType)) {
+		oRef.m_Class = dynamic_cast<const ProtocolDefinition::signedType*>(pType) != NULL ? FieldRef::C_Signed : FieldRef::C_Unsigned;
+		oRef.m_Width = pUnsigned->GetWidth();
+		bRaw = oRef.m_Offset >= 0;
+	} else if (dynamic_cast<const ProtocolDefinition::lengthType*>(pType) != NULL || dynamic_cast<const ProtocolDefinition::unixtimeType*>(pType) != NULL)
+		oRef.m_Class = FieldRef::C_Unsigned;
+	else if (dynamic_cast<const ProtocolDefinition::floatType*>(pType) != NULL)
+		oRef.m_Class = FieldRef::C_Float;
+	else if (dynamic_cast<const ProtocolDefinition::doubleType*>(pType) != NULL)
+		oRef.m_Class = FieldRef::C_Double;
+	else if (dynamic_cast<const ProtocolDefinition::stringType*>(pType) != NULL)
+		oRef.m_Class = FieldRef::C_String;
+	else
+		return; // structs and such cannot be compared
+
+	if (oCompare.m_IsString != (oRef.m_Class == FieldRef::C_String))
+		return;
+	oRef.m_Kind = bRaw ? FieldRef::K_Raw : FieldRef::K_Value;
+}
+
+bool
+PacketFilter::Bind(ProtocolDefinition& oDefinition)
+{
+	m_Definition = &oDefinition;
+	m_Identity.clear();
+	m_Candidate.clear();
+	m_Certain.clear();
+	m_SelectorMatch.clear();
+	m_Fields.clear();
+	m_IdentityNames.clear();
+	if (m_Root < 0)
+		return true;
+
+	// Every packet is an identity by itself, as is each of its subpackets
+	const ProtocolDefinition::TPacketPtrList& oPackets = oDefinition.GetPacketTypes();
+	for (auto it = oPackets.begin(); it != oPackets.end(); it++) {
+		BindIdentity(**it, NULL);
+		const ProtocolDefinition::Packet::TSubpacketPtrList& oSubpackets = (*it)->GetSubpackets();
+		for (auto itSub = oSubpackets.begin(); itSub != oSubpackets.end(); itSub++)
+			BindIdentity(**it, *itSub);
+	}
+
+	bool bOK = true;
+	for (unsigned int n = 0; n < m_Compares.size(); n++) {
+		bool bFound = false;
+		for (unsigned int m = n; m < m_Fields.size(); m += m_Compares.size())
+			if (m_Fields[m].m_Kind != FieldRef::K_Missing)
+				bFound = true;
+		if (!bFound) {
+			fprintf(stderr, "PacketFilter::Bind(): no packet has a field '%s' which can be compared this way\n", m_Compares[n].m_Field.c_str());
+			bOK = false;
+		}
+	}
+
+	for (int n = 0; n < (int)m_Identity.size(); n++) {
+		Truth eTruth = Evaluate(m_Root, n);
+		m_Candidate.push_back(eTruth != T_False);
+		m_Certain.push_back(eTruth == T_True);
+	}
+	return bOK;
+}
+
+void
+PacketFilter::BindIdentity(const ProtocolDefinition::Packet& oPacket, const ProtocolDefinition::Subpacket* pSubpacket)
+{
+	int iIdentity = m_Identity.size();
+	m_Identity[pSubpacket != NULL ? static_cast<const Struct*>(pSubpacket) : &oPacket] = iIdentity;
+	m_IdentityNames.push_back(std::make_pair(oPacket.GetName(), pSubpacket != NULL ? pSubpacket->GetName() : ""));
+
+	for (auto it = m_Selectors.begin(); it != m_Selectors.end(); it++) {
+		const Selector& oSelector = *it;
+		bool bMatch = true;
+		if (!oSelector.m_Packet.empty()) {
+			if (oSelector.m_Prefix)
+				bMatch = strncmp(oPacket.GetName(), oSelector.m_Packet.c_str(), oSelector.m_Packet.size()) == 0;
+			else
+				bMatch = oSelector.m_Packet == oPacket.GetName();
+		}
+		if (bMatch && !oSelector.m_Subpacket.empty())
+			bMatch = pSubpacket != NULL && oSelector.m_Subpacket == pSubpacket->GetName();
+		m_SelectorMatch.push_back(bMatch);
+	}
+
+	for (auto it = m_Compares.begin(); it != m_Compares.end(); it++) {
+		m_Fields.push_back(FieldRef());
+		ResolveCompare(*it, oPacket, pSubpacket, m_Fields.back());
+	}
+}
+
+PacketFilter::Truth
+PacketFilter::Evaluate(int iNode, int iIdentity) const
+{
+	const Node& oNode = m_Nodes[iNode];
+	switch(oNode.m_Kind) {
+		case Node::N_Selector:
+			return m_SelectorMatch[iIdentity * m_Selectors.size() + oNode.m_Left] ? T_True : T_False;
+		case Node::N_Compare:
+			return m_Fields[iIdentity * m_Compares.size() + oNode.m_Left].m_Kind == FieldRef::K_Missing ? T_False : T_Unknown;
+		case Node::N_Not: {
+			Truth eTruth = Evaluate(oNode.m_Left, iIdentity);
+			if (eTruth == T_Unknown)
+				return T_Unknown;
+			return eTruth == T_True ? T_False : T_True;
+		}
+		case Node::N_And:
+		case Node::N_Or: {
+			// The outcome is decided by either operand being 'decisive'
+			Truth eDecisive = oNode.m_Kind == Node::N_And ? T_False : T_True;
+			Truth eLeft = Evaluate(oNode.m_Left, iIdentity);
+			Truth eRight = Evaluate(oNode.m_Right, iIdentity);
+			if (eLeft == eDecisive || eRight == eDecisive)
+				return eDecisive;
+			if (eLeft == T_Unknown || eRight == T_Unknown)
+				return T_Unknown;
+			return eLeft;
+		}
+	}
+	return T_Unknown;
+}
+
+bool
+PacketFilter::MayMatchNode(int iNode, const XSummary& oSummary) const
+{
+	const Node& oNode = m_Nodes[iNode];
+	switch(oNode.m_Kind) {
+		case Node::N_Selector: {
+			const Selector& oSelector = m_Selectors[oNode.m_Left];
+			if (oSelector.m_Prefix)
+				return true;
+			return oSummary.MayContain(oSelector.m_Packet.c_str(), oSelector.m_Subpacket.c_str());
+		}
+		case Node::N_Compare: {
+			// Only packets having the field can match, and values are known only of annotated ones
+			const Compare& oCompare = m_Compares[oNode.m_Left];
+			bool bByValue = oCompare.m_Operator == O_Equal && !oCompare.m_IsString && oCompare.m_Integer >= 0 && oCompare.m_Integer <= 0xffffffffLL;
+			for (unsigned int n = 0; n < m_IdentityNames.size(); n++) {
+				const FieldRef& oRef = m_Fields[n * m_Compares.size() + oNode.m_Left];
+				if (oRef.m_Kind == FieldRef::K_Missing)
+					continue;
+				if (!oSummary.MayContain(m_IdentityNames[n].first.c_str(), m_IdentityNames[n].second.c_str()))
+					continue;
+				const ProtocolDefinition::unsignedType* pType = dynamic_cast<const ProtocolDefinition::unsignedType*>(oRef.m_Type);
+				if (!bByValue || oRef.m_Class != FieldRef::C_Unsigned || pType == NULL || pType->GetAnnotation() == NULL)
+					return true;
+				if (oSummary.MayContainValue(*pType->GetAnnotation(), (uint32_t)oCompare.m_Integer))
+					return true;
+			}
+			return false;
+		}
+		case Node::N_Not:
+			return true; // it takes just one packet for which the operand is false
+		case Node::N_And:
+			return MayMatchNode(oNode.m_Left, oSummary) && MayMatchNode(oNode.m_Right, oSummary);
+		case Node::N_Or:
+			return MayMatchNode(oNode.m_Left, oSummary) || MayMatchNode(oNode.m_Right, oSummary);
+	}
+	return true;
+}
+
+bool
+PacketFilter::MayMatch(const XSummary& oSummary) const
+{
+	return m_Root < 0 || MayMatchNode(m_Root, oSummary);
+}
+
+bool
+PacketFilter::EvaluateCompare(const Compare& oCompare, const FieldRef& oRef, const uint8_t* pData, int iLength, const ProtocolDefinition::Packet& oPacket)
+{
+	if (oRef.m_Kind == FieldRef::K_Missing)
+		return false;
+
+	if (oRef.m_Kind == FieldRef::K_Raw) {
+		// Straight from the packet data, no decoding needed
+		if (oRef.m_Offset + oRef.m_Width > iLength)
+			return false;
+		uint32_t iValue;
+		switch(oRef.m_Width) {
+			case 1:
+				iValue = pData[oRef.m_Offset];
+				break;
+			case 2:
+				iValue = LittleEndian::Read16(pData + oRef.m_Offset);
+				break;
+			default:
+				iValue = LittleEndian::Read32(pData + oRef.m_Offset);
+				break;
+		}
+		int64_t iNumber = oRef.m_Class == FieldRef::C_Signed ? SignExtend(iValue, oRef.m_Width) : (int64_t)iValue;
+		return ApplyOperator(oCompare.m_Operator, iNumber, oCompare.m_Integer);
+	}
+
+	// We need the decoded value
+	if (!m_Definition->Materialize())
+		return false;
+	const Struct* pStruct = &oPacket;
+	if (oRef.m_InSubpacket)
+		pStruct = oPacket.GetSubpacket();
+	const ProtocolDefinition::Value* pValue = pStruct->GetValues();
+	if (pValue == NULL)
+		return false;
+	pValue += oRef.m_Path[0];
+	for (unsigned int n = 1; n < oRef.m_Path.size(); n++)
+		pValue = static_cast<const ProtocolDefinition::Value*>(pValue->m_Data) + oRef.m_Path[n];
+
+	switch(oRef.m_Class) {
+		case FieldRef::C_Unsigned:
+		case FieldRef::C_Signed: {
+			uint32_t iValue = *static_cast<const uint32_t*>(pValue->m_Data);
+			int64_t iNumber = oRef.m_Class == FieldRef::C_Signed ? SignExtend(iValue, oRef.m_Width) : (int64_t)iValue;
+			return ApplyOperator(oCompare.m_Operator, iNumber, oCompare.m_Integer);
+		}
+		case FieldRef::C_Float:
+			return ApplyOperator(oCompare.m_Operator, (double)*static_cast<const float*>(pValue->m_Data), oCompare.m_Number);
+		case FieldRef::C_Double:
+			return ApplyOperator(oCompare.m_Operator, *static_cast<const double*>(pValue->m_Data), oCompare.m_Number);
+		case FieldRef::C_String: {
+			const char* sValue = static_cast<const char*>(pValue->m_Data);
+			std::string sString(sValue, strnlen(sValue, pValue->m_Num));
+			if (oCompare.m_Operator == O_Contains)
+				return sString.find(oCompare.m_String) != std::string::npos;
+			return ApplyOperator(oCompare.m_Operator, sString.compare(oCompare.m_String), 0);
+		}
+	}
+	return false;
+}
+
+bool
+PacketFilter::Matches(const uint8_t* pData, int iLength, const ProtocolDefinition::Packet& oPacket)
+{
+	if (m_Root < 0)
+		return true;
+
+	const Struct* pKey = oPacket.GetSubpacket();
+	if (pKey == NULL)
+		pKey = &oPacket;
+	auto it = m_Identity.find(pKey);
+	if (it == m_Identity.end())
+		return false;
+	int iIdentity = it->second;
+	if (!m_Candidate[iIdentity])
+		return false;
+	if (m_Certain[iIdentity])
+		return true;
+
+	bool bResult = false;
+	int iPC = 0;
+	while (true) {
+		const Instruction& oInsn = m_Code[iPC++];
+		switch(oInsn.m_Opcode) {
+			case Instruction::I_Selector:
+				bResult = m_SelectorMatch[iIdentity * m_Selectors.size() + oInsn.m_Operand];
+				break;
+			case Instruction::I_Compare:
+				bResult = EvaluateCompare(m_Compares[oInsn.m_Operand], m_Fields[iIdentity * m_Compares.size() + oInsn.m_Operand], pData, iLength, oPacket);
+				break;
+			case Instruction::I_Not:
+				bResult = !bResult;
+				break;
+			case Instruction::I_JumpIfFalse:
+				if (!bResult)
+					iPC = oInsn.m_Operand;
+				break;
+			case Instruction::I_JumpIfTrue:
+				if (bResult)
+					iPC = oInsn.m_Operand;
+				break;
+			case Instruction::I_End:
+				return bResult;
+		}
+	}
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,318 @@
+/*
+ * Runes of Magic protocol analysis - packet filter expressions
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __PACKETFILTER_H__
+#define __PACKETFILTER_H__
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include "protocoldefinition.h"
+
+/*! \brief Decides which packets to display
+ *
+ *  Filters are expressions such as
+ *
+ *    ServerResponse:MoveObject && objectid == 0x1234
+ *    Chat && text ~ "wts"
+ *
+ *  A name selects a packet or subpacket of that name, 'packet:subpacket'
+ *  selects a subpacket of a given packet; 'field op value' compares a field
+ *  of the packet, where op is one of == != < <= > >= or ~ (string
+ *  contains). Terms can be combined using !, && and || and grouped using
+ *  parentheses. A comparison is false for packets lacking the field.
+ *
+ *  Expressions are compiled into bytecode once. Bind() then determines, for
+ *  every packet and subpacket, whether the expression can be true at all
+ *  and whether it is true regardless of the fields; only if neither is
+ *  known is the bytecode run. Comparisons of integer fields at a fixed
+ *  offset are done against the raw packet data; anything else decodes the
+ *  packet fields first.
+ */
+class PacketFilter {
+public:
+	/*! \brief Summary of a number of packets, such as a part of a log
+	 *
+	 *  A summary may claim to contain things which it does not, but never
+	 *  the other way around.
+	 */
+	class XSummary {
+	public:
+		virtual ~XSummary() { }
+
+		/*! \brief May a packet of a given name be present?
+		 *  \param sPacket Packet name, empty for any
+		 *  \param sSubpacket Subpacket name, empty for any
+		 */
+		virtual bool MayContain(const char* sPacket, const char* sSubpacket) const = 0;
+
+		/*! \brief May a field with a given annotation have held a value?
+		 *  \param oAnnotation Annotation of the field
+		 *  \param iValue Value of the field
+		 */
+		virtual bool MayContainValue(const ProtocolDefinition::Annotation& oAnnotation, uint32_t iValue) const = 0;
+	};
+
+	PacketFilter();
+
+	/*! \brief Adds an expression which packets must match
+	 *  \param sExpression Expression to add
+	 *  \returns true on success
+	 *
+	 *  Packets must match all expressions added; call Bind() afterwards.
+	 */
+	bool Add(const char* sExpression);
+
+	/*! \brief Adds a list of names which packets must or must not match
+	 *  \param oNames 'packet' or 'packet:subpacket' names
+	 *  \param bExclude true if packets must not match any, false if they must match one
+	 *
+	 *  Packet names match if they start with the given name; this is how
+	 *  the -i and -j options have always behaved.
+	 */
+	void AddNames(const std::list<char*>& oNames, bool bExclude);
+
+	//! \brief Is anything to be filtered?
+	bool IsEmpty() const { return m_Root < 0; }
+
+	/*! \brief Resolves the expression against protocol definitions
+	 *  \param oDefinition Definitions to use
+	 *  \returns false if a comparison refers to a field no packet has
+	 *
+	 *  This must be done whenever the definitions in use change; such
+	 *  comparisons are reported and never match.
+	 */
+	bool Bind(ProtocolDefinition& oDefinition);
+
+	/*! \brief Determines whether a classified packet matches
+	 *  \param pData Decrypted packet payload
+	 *  \param iLength Length of the payload
+	 *  \param oPacket Packet as returned by ProtocolDefinition::Classify()
+	 *  \returns true if the packet matches
+	 *
+	 *  This materializes the packet if any field comparison needs it.
+	 */
+	bool Matches(const uint8_t* pData, int iLength, const ProtocolDefinition::Packet& oPacket);
+
+	/*! \brief Determines whether any of the packets summarized may match
+	 *  \param oSummary Summary of the packets
+	 *  \returns false if none of them can match
+	 *
+	 *  Only names and equality of annotated integer fields are taken into
+	 *  account; this requires Bind() to be called.
+	 */
+	bool MayMatch(const XSummary& oSummary) const;
+
+protected:
+	//! \brief Outcome of an expression which may depend on field values
+	enum Truth {
+		T_False,
+		T_True,
+		T_Unknown
+	};
+
+	//! \brief Node of the parsed expression
+	struct Node {
+		enum Kind {
+			N_Selector,
+			N_Compare,
+			N_Not,
+			N_And,
+			N_Or
+		};
+		Kind m_Kind;
+
+		//! \brief Index of the selector or comparison, or the first operand
+		int m_Left;
+
+		//! \brief Second operand, if any
+		int m_Right;
+	};
+
+	//! \brief Selects packets by name
+	struct Selector {
+		//! \brief Packet name, empty for any
+		std::string m_Packet;
+
+		//! \brief Subpacket name, empty for any
+		std::string m_Subpacket;
+
+		//! \brief Whether the packet name need only be a prefix
+		bool m_Prefix;
+	};
+
+	enum Operator {
+		O_Equal,
+		O_NotEqual,
+		O_Less,
+		O_LessEqual,
+		O_Greater,
+		O_GreaterEqual,
+		O_Contains
+	};
+
+	//! \brief Compares a field to a constant
+	struct Compare {
+		//! \brief Field name, members of struct fields are separated by dots
+		std::string m_Field;
+
+		Operator m_Operator;
+
+		//! \brief Is the constant a string?
+		bool m_IsString;
+
+		std::string m_String;
+		int64_t m_Integer;
+		double m_Number;
+	};
+
+	//! \brief Single bytecode instruction
+	struct Instruction {
+		enum Opcode {
+			I_Selector, //!< result = selector m_Operand matches
+			I_Compare, //!< result = comparison m_Operand holds
+			I_Not, //!< result = !result
+			I_JumpIfFalse, //!< continue at m_Operand if !result
+			I_JumpIfTrue, //!< continue at m_Operand if result
+			I_End //!< done
+		};
+		Opcode m_Opcode;
+		int m_Operand;
+	};
+
+	//! \brief How a comparison reaches its field within a given (sub)packet
+	struct FieldRef {
+		enum Kind {
+			K_Missing, //!< field doesn't exist or cannot be compared
+			K_Raw, //!< integer at a fixed offset in the raw data
+			K_Value //!< decoded value
+		};
+		Kind m_Kind;
+
+		//! \brief Value class of the field
+		enum Class {
+			C_Unsigned,
+			C_Signed,
+			C_Float,
+			C_Double,
+			C_String
+		};
+		Class m_Class;
+
+		//! \brief Offset within the payload and width, for K_Raw
+		int m_Offset;
+		int m_Width;
+
+		//! \brief Whether the field is within the subpacket, for K_Value
+		bool m_InSubpacket;
+
+		//! \brief Field indices, outermost first, for K_Value
+		std::vector<int> m_Path;
+
+		//! \brief Type of the field
+		const ProtocolDefinition::Type* m_Type;
+	};
+
+	//! \brief Parser state
+	struct Parser {
+		const char* m_Expression;
+		const char* m_Current;
+	};
+
+	int ParseOr(Parser& oParser);
+	int ParseAnd(Parser& oParser);
+	int ParseUnary(Parser& oParser);
+	int ParseTerm(Parser& oParser);
+
+	//! \brief Reports a parse error, returns -1
+	int ParseError(const Parser& oParser, const char* sMessage);
+
+	//! \brief Adds a node, returning its index
+	int AddNode(Node::Kind eKind, int iLeft, int iRight);
+
+	//! \brief Adds a node selecting a packet and/or subpacket
+	int AddSelector(const std::string& sPacket, const std::string& sSubpacket, bool bPrefix);
+
+	//! \brief Adds a new requirement to the expression and compiles it
+	void AddRoot(int iNode);
+
+	//! \brief Emits the bytecode for a node
+	void CompileNode(int iNode);
+
+	/*! \brief Locates a field within a struct
+	 *  \param oStruct Struct to search
+	 *  \param sPath Field name, possibly dotted
+	 *  \param iOffset Offset of the struct within the payload, -1 if not fixed
+	 *  \param oRef Receives the location, m_Path is appended to
+	 *  \returns true if found
+	 */
+	bool ResolveField(const ProtocolDefinition::Struct& oStruct, const char* sPath, int iOffset, FieldRef& oRef);
+
+	/*! \brief Adds the next identity
+	 *  \param oPacket Packet to add
+	 *  \param pSubpacket Subpacket to add, NULL for the packet by itself
+	 */
+	void BindIdentity(const ProtocolDefinition::Packet& oPacket, const ProtocolDefinition::Subpacket* pSubpacket);
+
+	//! \brief Resolves a comparison for a packet and subpacket
+	void ResolveCompare(const Compare& oCompare, const ProtocolDefinition::Packet& oPacket, const ProtocolDefinition::Subpacket* pSubpacket, FieldRef& oRef);
+
+	//! \brief Determines the outcome of a node without looking at field values
+	Truth Evaluate(int iNode, int iIdentity) const;
+
+	//! \brief Determines whether a node may be true for any of the packets summarized
+	bool MayMatchNode(int iNode, const XSummary& oSummary) const;
+
+	//! \brief Applies a comparison operator to numbers
+	template<typename T> static bool ApplyOperator(Operator eOperator, T a, T b);
+
+	//! \brief Evaluates a comparison against a packet
+	bool EvaluateCompare(const Compare& oCompare, const FieldRef& oRef, const uint8_t* pData, int iLength, const ProtocolDefinition::Packet& oPacket);
+
+	std::vector<Node> m_Nodes;
+	std::vector<Selector> m_Selectors;
+	std::vector<Compare> m_Compares;
+
+	//! \brief Node of the entire expression, -1 if none
+	int m_Root;
+
+	std::vector<Instruction> m_Code;
+
+	//! \brief Definitions bound to
+	ProtocolDefinition* m_Definition;
+
+	//! \brief Identity by subpacket, or by packet if there is no subpacket
+	std::map<const ProtocolDefinition::Struct*, int> m_Identity;
+
+	//! \brief Identities for which the expression may be true
+	std::vector<bool> m_Candidate;
+
+	//! \brief Identities for which the expression is always true
+	std::vector<bool> m_Certain;
+
+	//! \brief Selector outcomes, by identity and selector
+	std::vector<bool> m_SelectorMatch;
+
+	//! \brief Field locations, by identity and comparison
+	std::vector<FieldRef> m_Fields;
+
+	//! \brief Packet and subpacket name, by identity; the latter is empty if there is none
+	std::vector<std::pair<std::string, std::string> > m_IdentityNames;
+};
+
+#endif /* __PACKETFILTER_H__ */
@@ -0,0 +1,296 @@
+/*
+ * Runes of Magic protocol analysis - read-ahead of capture records
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "recordreader.h"
+#include "romlogparser.h"
+#include "tcpflowparser.h"
+
+RecordReader::Queue::Queue()
+	: m_Head(0), m_Tail(0), m_Waiting(false)
+{
+}
+
+void
+RecordReader::Queue::Push(Batch* pBatch)
+{
+	unsigned int iHead = m_Head.load(std::memory_order_relaxed);
+	m_Slot[iHead % (s_NumBatches + 1)] = pBatch;
+	m_Head.store(iHead + 1);
+
+	// The consumer either sees the new head or we see it waiting
+	if (m_Waiting.load()) {
+		std::lock_guard<std::mutex> oLock(m_Mutex);
+		m_Cond.notify_one();
+	}
+}
+
+RecordReader::Batch*
+RecordReader::Queue::Pop()
+{
+	unsigned int iTail = m_Tail.load(std::memory_order_relaxed);
+	if (m_Head.load() == iTail) {
+		std::unique_lock<std::mutex> oLock(m_Mutex);
+		m_Waiting.store(true);
+		while (m_Head.load() == iTail)
+			m_Cond.wait(oLock);
+		m_Waiting.store(false);
+	}
+
+	Batch* pBatch = m_Slot[iTail % (s_NumBatches + 1)];
+	m_Tail.store(iTail + 1, std::memory_order_release);
+	return pBatch;
+}
+
+RecordReader::RecordReader(FILE* pFile, int iLogVersion)
+	: m_File(pFile), m_LogVersion(iLogVersion), m_IsRegular(false), m_AdvisedUpTo(0), m_Follow(false), m_StartOffset(0), m_NotifyFD(-1), m_Stop(false), m_Current(NULL), m_CurrentRecord(0), m_Done(false), m_LastStart(-1), m_LastEnd(-1), m_ExcessiveLength(0)
+{
+	m_Batches.resize(s_NumBatches);
+	for (auto it = m_Batches.begin(); it != m_Batches.end(); it++) {
+		it->m_Data.resize(s_BatchSize + s_MaxRecordLength);
+		m_Free.Push(&*it);
+	}
+
+	struct stat st;
+	if (fstat(fileno(m_File), &st) == 0 && S_ISREG(st.st_mode)) {
+		m_IsRegular = true;
+		posix_fadvise(fileno(m_File), 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+	m_WakeupPipe[0] = -1;
+	m_WakeupPipe[1] = -1;
+}
+
+RecordReader::~RecordReader()
+{
+	if (m_Thread.joinable()) {
+		// Keep handing batches back until the reader notices it must stop
+		m_Stop = true;
+		if (m_WakeupPipe[1] >= 0) {
+			char ch = 0;
+			if (write(m_WakeupPipe[1], &ch, 1) < 0) {
+				/* nothing; the reader will notice within the poll interval */
+			}
+		}
+		if (m_Current != NULL) {
+			// The batch in use may well be the last one there is
+			m_Done = m_Done || m_Current->m_Last;
+			m_Free.Push(m_Current);
+		}
+		while (!m_Done) {
+			Batch* pBatch = m_Full.Pop();
+			m_Done = pBatch->m_Last;
+			m_Free.Push(pBatch);
+		}
+		m_Thread.join();
+	}
+
+	if (m_NotifyFD >= 0)
+		close(m_NotifyFD);
+	for (int n = 0; n < 2; n++)
+		if (m_WakeupPipe[n] >= 0)
+			close(m_WakeupPipe[n]);
+}
+
+void
+RecordReader::Start()
+{
+	if (m_StartOffset > 0 && fseeko(m_File, m_StartOffset, SEEK_SET) < 0)
+		fprintf(stderr, "RecordReader::Start(): cannot seek to %lld: %s\n", (long long)m_StartOffset, strerror(errno));
+
+	if (m_Follow) {
+		if (pipe2(m_WakeupPipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+			fprintf(stderr, "RecordReader::Start(): cannot create pipe: %s\n", strerror(errno));
+			m_WakeupPipe[0] = -1;
+			m_WakeupPipe[1] = -1;
+		}
+
+		// Without inotify, we'll just check every now and then
+		char sPath[64];
+		snprintf(sPath, sizeof(sPath), "/proc/self/fd/%d", fileno(m_File));
+		m_NotifyFD = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+		if (m_NotifyFD >= 0 && inotify_add_watch(m_NotifyFD, sPath, IN_MODIFY) < 0) {
+			close(m_NotifyFD);
+			m_NotifyFD = -1;
+		}
+	}
+	m_Thread = std::thread(&RecordReader::ReadThread, this);
+}
+
+bool
+RecordReader::Next(IPv4Address& oSource, IPv4Address& oDest, const char*& pData, int& iLength, uint64_t& iTimestamp)
+{
+	while (m_Current == NULL || m_CurrentRecord == (int)m_Current->m_Records.size()) {
+		if (m_Current != NULL) {
+			bool bLast = m_Current->m_Last;
+			m_ExcessiveLength = m_Current->m_ExcessiveLength;
+			m_Free.Push(m_Current);
+			m_Current = NULL;
+			if (bLast) {
+				m_Done = true;
+				return false;
+			}
+		}
+		if (m_Done)
+			return false;
+		m_Current = m_Full.Pop();
+		m_CurrentRecord = 0;
+	}
+
+	const Record& oRecord = m_Current->m_Records[m_CurrentRecord++];
+	oSource = oRecord.m_Source;
+	oDest = oRecord.m_Dest;
+	pData = &m_Current->m_Data[oRecord.m_Offset];
+	iLength = oRecord.m_Length;
+	iTimestamp = oRecord.m_Timestamp;
+	m_LastStart = oRecord.m_Start;
+	m_LastEnd = oRecord.m_End;
+	return true;
+}
+
+void
+RecordReader::AdviseReadAhead()
+{
+	off_t iOffset = ftello(m_File);
+	if (iOffset < 0 || iOffset + s_ReadAheadWindow / 2 < m_AdvisedUpTo)
+		return;
+	if (m_AdvisedUpTo < iOffset)
+		m_AdvisedUpTo = iOffset;
+	posix_fadvise(fileno(m_File), m_AdvisedUpTo, iOffset + s_ReadAheadWindow - m_AdvisedUpTo, POSIX_FADV_WILLNEED);
+	m_AdvisedUpTo = iOffset + s_ReadAheadWindow;
+}
+
+bool
+RecordReader::WaitForGrowth()
+{
+	struct stat st;
+	if (fstat(fileno(m_File), &st) == 0 && st.st_size < ftello(m_File)) {
+		fprintf(stderr, "RecordReader::WaitForGrowth(): file was truncated, stopping\n");
+		return false;
+	}
+
+	struct pollfd fds[2];
+	int iNumFDs = 0;
+	if (m_WakeupPipe[0] >= 0) {
+		fds[iNumFDs].fd = m_WakeupPipe[0];
+		fds[iNumFDs].events = POLLIN;
+		iNumFDs++;
+	}
+	if (m_NotifyFD >= 0) {
+		fds[iNumFDs].fd = m_NotifyFD;
+		fds[iNumFDs].events = POLLIN;
+		iNumFDs++;
+	}
+	if (poll(fds, iNumFDs, s_PollInterval) > 0 && m_NotifyFD >= 0) {
+		char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		while (read(m_NotifyFD, buf, sizeof(buf)) > 0)
+			/* nothing, we'll just try reading again */ ;
+	}
+	return !m_Stop;
+}
+
+RecordReader::Result
+RecordReader::ReadRecord(Batch& oBatch)
+{
+	Record oRecord;
+	char* pBuffer = &oBatch.m_Data[oBatch.m_Used];
+	off_t iStart = ftello(m_File);
+	int iLength = 0;
+	if (m_LogVersion > 0) {
+		// ROM binary log file
+		int iResult = ROMLogParser::ParseHeader(m_File, oRecord.m_Source, oRecord.m_Dest, m_LogVersion, oRecord.m_Timestamp);
+		if (iResult > s_MaxRecordLength) {
+			oBatch.m_ExcessiveLength = iResult;
+			return R_End;
+		}
+		if (iResult > 0)
+			iLength = ROMLogParser::ReadPacket(m_File, pBuffer, iResult);
+	} else {
+		// TCPFlow file
+		oRecord.m_Timestamp = 0;
+		int iResult = TCPFlowParser::ParseHeader(m_File, oRecord.m_Source, oRecord.m_Dest);
+		if (iResult > 0)
+			iLength = TCPFlowParser::ParsePacket(m_File, pBuffer, s_MaxRecordLength);
+	}
+
+	/*
+	 * Running into the end of the file means the record may not have been
+	 * written completely; if we're following the file, go back to where it
+	 * started and try again later. Complete tcpflow records end with an
+	 * empty line, so they never run into the end.
+	 */
+	if (m_Follow && feof(m_File)) {
+		clearerr(m_File);
+		fseeko(m_File, iStart, SEEK_SET);
+		return R_Incomplete;
+	}
+	if (iLength <= 0)
+		return R_End;
+
+	oRecord.m_Offset = oBatch.m_Used;
+	oRecord.m_Length = iLength;
+	oRecord.m_Start = iStart;
+	oRecord.m_End = ftello(m_File);
+	oBatch.m_Records.push_back(oRecord);
+	oBatch.m_Used += iLength;
+	return R_Record;
+}
+
+void
+RecordReader::ReadThread()
+{
+	bool bLast = false;
+	while (!bLast) {
+		Batch* pBatch = m_Free.Pop();
+		pBatch->m_Used = 0;
+		pBatch->m_Records.clear();
+		pBatch->m_ExcessiveLength = 0;
+
+		if (m_IsRegular)
+			AdviseReadAhead();
+		while (!m_Stop) {
+			Result eResult = ReadRecord(*pBatch);
+			if (eResult == R_End) {
+				bLast = true;
+				break;
+			}
+			if (eResult == R_Incomplete) {
+				// Hand over what we have before waiting
+				if (!pBatch->m_Records.empty())
+					break;
+				if (!WaitForGrowth()) {
+					bLast = true;
+					break;
+				}
+				continue;
+			}
+			if (!m_IsRegular || pBatch->m_Used >= s_BatchSize)
+				break;
+		}
+		if (m_Stop)
+			bLast = true;
+
+		pBatch->m_Last = bLast;
+		m_Full.Push(pBatch);
+	}
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,239 @@
+/*
+ * Runes of Magic protocol analysis - read-ahead of capture records
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __RECORDREADER_H__
+#define __RECORDREADER_H__
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "types.h"
+
+/*! \brief Reads capture records on a thread of its own
+ *
+ *  Records are parsed from either a tcpflow output stream or a romproxy log
+ *  file into batches; these are handed over to the consumer using a bounded
+ *  queue, so reading the input overlaps with processing it. Batches are
+ *  recycled once the consumer is done with them.
+ *
+ *  Batches only fill up to their size when reading a regular file; anything
+ *  else may block for an arbitrary time, so every record is handed over
+ *  immediately.
+ *
+ *  When following a regular file, reaching its end does not end reading;
+ *  instead, the reader waits for the file to grow. Records which are only
+ *  partially written are read again once more data is available.
+ */
+class RecordReader {
+public:
+	//! \brief Largest record that can be read
+	static const int s_MaxRecordLength = 131072;
+
+	/*! \brief Creates a reader for a file
+	 *  \param pFile File to read; the caller remains owner
+	 *  \param iLogVersion romproxy log file version, 0 for tcpflow output
+	 */
+	RecordReader(FILE* pFile, int iLogVersion);
+
+	//! \brief Stops reading and waits for the thread to finish
+	~RecordReader();
+
+	/*! \brief Sets whether to wait for more data at the end of the file
+	 *  \param bFollow true to follow the file as it grows
+	 *
+	 *  Only regular files can be followed; this must be called before Start().
+	 */
+	void SetFollow(bool bFollow) { m_Follow = bFollow && m_IsRegular; }
+
+	/*! \brief Sets where reading starts
+	 *  \param iOffset Offset of the first record within the file
+	 *
+	 *  This must be called before Start().
+	 */
+	void SetStartOffset(off_t iOffset) { m_StartOffset = iOffset; }
+
+	//! \brief Starts reading
+	void Start();
+
+	/*! \brief Retrieves the next record
+	 *  \param oSource Receives the source address
+	 *  \param oDest Receives the destination address
+	 *  \param pData Receives the record data, valid until the next call
+	 *  \param iLength Receives the record length
+	 *  \param iTimestamp Receives the record time in microseconds since the epoch, 0 if unknown
+	 *  \returns false once there are no more records
+	 */
+	bool Next(IPv4Address& oSource, IPv4Address& oDest, const char*& pData, int& iLength, uint64_t& iTimestamp);
+
+	/*! \brief Retrieves the length of the record that ended reading, if too large
+	 *  \returns Length, or 0 if reading ended otherwise
+	 *
+	 *  Only meaningful once Next() returned false.
+	 */
+	int GetExcessiveLength() const { return m_ExcessiveLength; }
+
+	/*! \brief Retrieves where the record returned last is located
+	 *  \param iStart Receives the offset of its first byte
+	 *  \param iEnd Receives the offset just past it
+	 *
+	 *  The offsets are -1 if the input cannot tell.
+	 */
+	void GetOffsets(off_t& iStart, off_t& iEnd) const { iStart = m_LastStart; iEnd = m_LastEnd; }
+
+	//! \brief Would Next() have to wait for the reader?
+	bool IsDrained() const { return (m_Current == NULL || m_CurrentRecord == (int)m_Current->m_Records.size()) && m_Full.IsEmpty(); }
+
+protected:
+	//! \brief Number of bytes after which a batch is handed over
+	static const int s_BatchSize = 256 * 1024;
+
+	//! \brief Number of batches; bounds the amount of data read ahead
+	static const int s_NumBatches = 8;
+
+	//! \brief Number of bytes the kernel is asked to read ahead of us
+	static const off_t s_ReadAheadWindow = 4 * 1024 * 1024;
+
+	//! \brief Interval at which a followed file is checked, in ms; inotify misses changes on network filesystems
+	static const int s_PollInterval = 1000;
+
+	//! \brief Outcome of reading a record
+	enum Result {
+		R_Record, //!< record read
+		R_End, //!< no more records
+		R_Incomplete //!< record not completely written yet; only when following
+	};
+
+	struct Record {
+		IPv4Address m_Source;
+		IPv4Address m_Dest;
+
+		//! \brief Position of the data within the batch
+		int m_Offset;
+		int m_Length;
+
+		uint64_t m_Timestamp;
+
+		//! \brief Position within the file
+		off_t m_Start, m_End;
+	};
+
+	struct Batch {
+		std::vector<char> m_Data;
+		int m_Used;
+		std::vector<Record> m_Records;
+
+		//! \brief Set if no batches follow
+		bool m_Last;
+
+		//! \brief Length of the record that ended reading, if too large
+		int m_ExcessiveLength;
+	};
+
+	/*! \brief Hands batches from one thread to another
+	 *
+	 *  There is a single producer and a single consumer; they only synchronise
+	 *  using the positions, unless the consumer has to wait for the queue to
+	 *  become non-empty. The queue holds all batches, so pushing never waits.
+	 */
+	class Queue {
+	public:
+		Queue();
+
+		//! \brief Appends a batch; must only be called by the producer
+		void Push(Batch* pBatch);
+
+		//! \brief Removes the oldest batch, waiting for one if needed; must only be called by the consumer
+		Batch* Pop();
+
+		//! \brief Is the queue empty?
+		bool IsEmpty() const { return m_Head.load() == m_Tail.load(); }
+
+	protected:
+		Batch* m_Slot[s_NumBatches + 1];
+
+		//! \brief Positions where the next batch is pushed and popped
+		std::atomic<unsigned int> m_Head, m_Tail;
+
+		//! \brief Set while the consumer is about to wait
+		std::atomic<bool> m_Waiting;
+
+		std::mutex m_Mutex;
+		std::condition_variable m_Cond;
+	};
+
+	//! \brief Reader thread main loop
+	void ReadThread();
+
+	/*! \brief Reads a single record into a batch
+	 *  \param oBatch Batch to append the record to
+	 *  \returns Outcome
+	 */
+	Result ReadRecord(Batch& oBatch);
+
+	//! \brief Asks the kernel to read the upcoming part of the file
+	void AdviseReadAhead();
+
+	/*! \brief Waits until the file may have grown
+	 *  \returns false if reading must stop
+	 */
+	bool WaitForGrowth();
+
+	FILE* m_File;
+	int m_LogVersion;
+
+	//! \brief Whether the input is a regular file
+	bool m_IsRegular;
+
+	//! \brief Offset up to which read-ahead was requested
+	off_t m_AdvisedUpTo;
+
+	//! \brief Whether the end of the file is waited out
+	bool m_Follow;
+
+	//! \brief Offset of the first record to read, 0 to read from where the file is
+	off_t m_StartOffset;
+
+	//! \brief inotify descriptor, -1 if not following or unavailable
+	int m_NotifyFD;
+
+	//! \brief Pipe used to wake up the reader while it waits
+	int m_WakeupPipe[2];
+
+	//! \brief Batches filled by the reader, and batches the consumer is done with
+	Queue m_Full, m_Free;
+	std::vector<Batch> m_Batches;
+
+	//! \brief Set when the reader must stop
+	std::atomic<bool> m_Stop;
+
+	std::thread m_Thread;
+
+	//! \brief Consumer state: current batch, record within it, whether the last one was seen
+	Batch* m_Current;
+	int m_CurrentRecord;
+	bool m_Done;
+	off_t m_LastStart, m_LastEnd;
+	int m_ExcessiveLength;
+
+	RecordReader(const RecordReader&) = delete;
+	RecordReader& operator=(const RecordReader&) = delete;
+};
+
+#endif /* __RECORDREADER_H__ */
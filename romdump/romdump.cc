@@ -16,24 +16,48 @@
  */
 #include <ctype.h>
 #include <err.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <signal.h>
+#include <algorithm>
+#include <limits>
 #include <map>
+#include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "checkpoint.h"
 #include "connection.h"
 #include "csvsysparser.h"
 #include "dataannotation.h"
 #include "datatransformation.h"
+#include "decodepipeline.h"
 #include "flow.h"
+#include "idmap.h"
+#include "inputmerger.h"
+#include "nativedecoder.h"
+#include "outputbuffer.h"
+#include "packetfilter.h"
 #include "protocoldefinition.h"
+#include "protocoljsonsink.h"
+#include "protocolschema.h"
+#include "protocoltextsink.h"
+#include "protocolvisitor.h"
 #include "romstate.h"
-#include "romlogparser.h"
-#include "tcpflowparser.h"
+#include "segmentindex.h"
+#include "spatialindex.h"
+#include "stringpool.h"
+#include "termindex.h"
 #include "types.h"
+#include "worldstate.h"
 #include "../lib/romstructs.h"
 #include "../lib/rompack.h"
+#include "../lib/rompackettap.h"
 
 #define LINE_MAX 256
 
@@ -46,8 +70,6 @@ unsigned char hextab[16] = {
 	'8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
 };
 
-#define PRINT printf
-
 typedef std::map<Connection, Flow*> TConnectionFlowPtrMap;
 typedef std::list<char*> TCharPtrList;
 
@@ -55,13 +77,35 @@ typedef std::list<char*> TCharPtrList;
 #define DISPLAY_HEXDUMP 2
 #define DISPLAY_KEY 4
 #define SKIP_UNKNOWN 8
+#define OUTPUT_JSON 16
+#define INPUT_DECRYPTED 32
+#define SILENT 64
 
 ROMState g_State;
-ProtocolDefinition g_ProtocolDef;
-TCharPtrList g_HideTypes;
-TCharPtrList g_ShowTypes;
+ProtocolSchema g_Schema;
+PacketFilter g_Filter;
 int g_DisplayFlags;
-int g_IsROMLogFile;
+OutputBuffer* g_Output;
+ProtocolJSONSink* g_JSONSink;
+bool g_UseNativeDecoder = true;
+
+//! \brief Segment of the index being built, NULL if none; only changed while the pipeline is drained
+Segment* g_Segment;
+
+//! \brief Likewise, for the term index
+TermSegment* g_TermSegment;
+
+//! \brief Likewise, for the grid of object positions
+SpatialSegment* g_GridSegment;
+
+//! \brief Offset of the record being processed, where the packets it completes are indexed
+off_t g_RecordStart;
+
+//! \brief Time of the record being processed, in microseconds since the epoch; 0 if unknown
+uint64_t g_RecordTime;
+
+//! \brief Words a string field of every packet shown must contain in order, if any
+std::vector<std::string> g_Phrase;
 
 class SysName : public XDataAnnotation {
 public:
@@ -74,6 +118,55 @@ private:
 
 SysName g_SysNames;
 
+/*
+ * Diagnostics of a packet being decoded by a worker thread; these are kept
+ * until the packet is emitted, see EmitDiagnostics().
+ */
+static thread_local std::string* t_Diagnostics;
+
+/*
+ * Diagnostics are part of the text output, so they must go through the same
+ * buffer to keep their position; in JSON mode they go to stderr instead.
+ */
+static void
+Diagnostic(const char* fmt, ...)
+{
+	if (g_DisplayFlags & SILENT)
+		return;
+
+	va_list va;
+	va_start(va, fmt);
+	if (t_Diagnostics != NULL) {
+		char sLine[LINE_MAX];
+		va_list vaCopy;
+		va_copy(vaCopy, va);
+		int iLength = vsnprintf(sLine, sizeof(sLine), fmt, vaCopy);
+		va_end(vaCopy);
+		if (iLength < (int)sizeof(sLine)) {
+			t_Diagnostics->append(sLine, iLength);
+		} else if (iLength > 0) {
+			std::vector<char> oLine(iLength + 1);
+			vsnprintf(&oLine[0], oLine.size(), fmt, va);
+			t_Diagnostics->append(&oLine[0], iLength);
+		}
+	} else if (g_DisplayFlags & OUTPUT_JSON)
+		vfprintf(stderr, fmt, va);
+	else
+		g_Output->VPrintf(fmt, va);
+	va_end(va);
+}
+
+static void
+EmitDiagnostics(const std::string& sDiagnostics)
+{
+	if (sDiagnostics.empty() || (g_DisplayFlags & SILENT))
+		return;
+	if (g_DisplayFlags & OUTPUT_JSON)
+		fputs(sDiagnostics.c_str(), stderr);
+	else
+		g_Output->Append(sDiagnostics.c_str(), sDiagnostics.size());
+}
+
 static char
 resolve_addr(const IPv4Address& oAddress)
 {
@@ -111,7 +204,10 @@ DumpData(const uint8_t* buf, int data_len)
 		/* Display line if we need to */
 		m++;
 		if (m == BYTES_PER_LINE) {
-			printf("%04x: %s\n", (n - m) + 1, output);
+			g_Output->AppendHex((n - m) + 1, 4);
+			g_Output->Append(": ", 2);
+			g_Output->Append(output, BYTES_PER_LINE * 4 + HEX_ASCII_SPACER);
+			g_Output->AppendChar('\n');
 			m = 0;
 		}
 	}
@@ -122,62 +218,228 @@ DumpData(const uint8_t* buf, int data_len)
 		for (unsigned int n = m * 3; n < BYTES_PER_LINE * 3; n++) {
 			output[n] = ' ';
 		}
-		printf("%04x: %s\n", data_len - m, output);
+		g_Output->AppendHex(data_len - m, 4);
+		g_Output->Append(": ", 2);
+		g_Output->Append(output);
+		g_Output->AppendChar('\n');
 	}
 }
 
-static bool
-PacketMatchesList(ProtocolDefinition::Packet& oPacket, const TCharPtrList& oList)
-{
-	for (auto it = oList.begin(); it != oList.end(); it++) {
-		int packet_len, subpacket_len;
-		const char* ptr = strchr(*it, ':');
-		if (ptr == NULL) {
-			packet_len = strlen(*it);
-			subpacket_len = -1;
-		} else {
-			packet_len = ptr - *it;
-			subpacket_len = strlen(*it) - packet_len - 1 /* : */;
-		}
+//! \brief Outcome of DecodePacket()
+struct DecodedPacket {
+	bool m_HeaderChecksumOK;
+	bool m_DataChecksumOK;
+	bool m_MissingKey;
 
-		if (strncmp(oPacket.GetName(), *it, packet_len) != 0)
-			continue;
+	//! \brief Whether the packet is not to be displayed
+	bool m_Skip;
 
-		if (subpacket_len > 0) {
-			const ProtocolDefinition::Subpacket* pSubpacket = oPacket.GetSubpacket();
-			if (pSubpacket == NULL)
-				continue;
+	//! \brief Decoded packet, NULL if unknown
+	ProtocolDefinition::Packet* m_Packet;
 
-			if (strcmp(pSubpacket->GetName(), *it + packet_len + 1) != 0)
-				continue;
-		}
+	//! \brief Copy of the packet to use instead, if it was decoded in parallel
+	const ProtocolDefinition::DetachedPacket* m_Detached;
+};
 
-		// We have a match!
-		return true;
-	}
+//! \brief Reports a packet decoded by DecodePacket() to a visitor
+static void
+AcceptPacket(const DecodedPacket& oResult, XProtocolVisitor& oVisitor)
+{
+	if (oResult.m_Detached != NULL)
+		oResult.m_Detached->Accept(oVisitor);
+	else
+		oResult.m_Packet->Accept(oVisitor);
+}
 
-	return false;
+//! \brief Retrieves the subpacket of a packet decoded by DecodePacket(), if any
+static const ProtocolDefinition::Subpacket*
+GetSubpacket(const DecodedPacket& oResult)
+{
+	if (oResult.m_Detached != NULL)
+		return oResult.m_Detached->GetSubpacket();
+	return oResult.m_Packet->GetSubpacket();
 }
 
 static void
-AnalyzePacket(Flow& oFlow, struct ROM::Packet* p, int sequence)
+WriteJSONPacket(const Connection& oConn, struct ROM::Packet* p, int sequence, const DecodedPacket& oResult)
+{
+	unsigned int data_len = p->p_length - sizeof(struct ROM::Packet);
+	char sSource[IPv4Address::s_MaxFormatLength], sDest[IPv4Address::s_MaxFormatLength];
+	oConn.GetSource().Format(sSource);
+	oConn.GetDest().Format(sDest);
+
+	g_JSONSink->BeginRecord();
+	g_JSONSink->AddUnsigned("seq", sequence);
+	g_JSONSink->AddString("src", sSource);
+	g_JSONSink->AddString("dst", sDest);
+	g_JSONSink->AddUnsigned("length", data_len);
+	g_JSONSink->AddUnsigned("flag", p->p_flag);
+	g_JSONSink->AddUnsigned("key", p->p_keynum);
+	g_JSONSink->AddUnsigned("pseq", p->p_seq);
+	g_JSONSink->AddBool("header_checksum_ok", oResult.m_HeaderChecksumOK);
+	g_JSONSink->AddBool("data_checksum_ok", oResult.m_DataChecksumOK);
+	if (oResult.m_MissingKey)
+		g_JSONSink->AddString("warning", "no key available");
+	if (oResult.m_Packet != NULL)
+		AcceptPacket(oResult, *g_JSONSink);
+	if (oResult.m_Packet == NULL || (g_DisplayFlags & DISPLAY_HEXDUMP))
+		g_JSONSink->AddHexData("data", p->p_data, data_len);
+	g_JSONSink->EndRecord();
+}
+
+/*
+ * Everything needed to decode packets: the protocol definitions, the filter
+ * bound to them and the native decoder generated for them, if any. Decoding
+ * fills the definitions in place, so decoders running in parallel need
+ * private definitions; these collect their annotations rather than applying
+ * them, as they must be applied in packet order.
+ */
+class Decoder {
+public:
+	Decoder(bool bPrivate);
+	~Decoder();
+
+	/*
+	 * Switches to the most recently published protocol definitions, if they
+	 * changed; this is only done between packets, so the previous definitions
+	 * are no longer in use once we let go of them.
+	 */
+	void Update();
+
+	/*
+	 * Finds out which packet this is, without decoding the fields yet; that is
+	 * left to Materialize(), once we know the packet isn't filtered out. If a
+	 * decoder generated for the definitions in use is linked in, it is used to
+	 * classify the packet; anything else is left to the interpreter entirely.
+	 */
+	ProtocolDefinition::Packet* Classify(const uint8_t* pData, int iLength);
+
+	/*
+	 * Decodes the fields of the packet returned by Classify(); this is only
+	 * done for packets which are actually displayed. The native decoder's
+	 * Decode() functions fill the fields in place of the interpreter, if it
+	 * is in use.
+	 */
+	ProtocolDefinition::Packet* Materialize(const uint8_t* pData, int iLength, ProtocolDefinition::Packet* pPacket);
+
+	ProtocolDefinition* GetDefinition() const { return m_Definition.get(); }
+	const ProtocolSchema::TDefinitionPtr& GetSharedDefinition() const { return m_Definition; }
+	PacketFilter& GetFilter() { return m_Filter; }
+
+protected:
+	bool m_Private;
+	ProtocolSchema::TDefinitionPtr m_Definition;
+	unsigned int m_Generation;
+	PacketFilter m_Filter;
+	const NativeDecoder::Registry* m_NativeDecoder;
+	NativeDecoder::Context* m_NativeContext;
+};
+
+Decoder::Decoder(bool bPrivate)
+	: m_Private(bPrivate), m_Generation(0), m_NativeDecoder(NULL), m_NativeContext(NULL)
+{
+}
+
+Decoder::~Decoder()
+{
+	if (m_Definition != NULL)
+		m_Definition->SetNativeDecoder(NULL);
+	delete m_NativeContext;
+}
+
+void
+Decoder::Update()
+{
+	if (g_Schema.GetGeneration() == m_Generation)
+		return;
+
+	// Detached packets may keep the previous definitions around
+	ProtocolSchema::TDefinitionPtr pPrevious(m_Definition);
+	if (m_Private) {
+		if (g_Schema.GetGeneration() == m_Generation)
+			return;
+		ProtocolSchema::TDefinitionPtr pDefinition = g_Schema.Instantiate(m_Generation);
+		if (pDefinition == NULL)
+			return; // keep what we have
+		pDefinition->SetDeferAnnotations(true);
+		m_Definition = pDefinition;
+	} else if (!g_Schema.Refresh(m_Definition, m_Generation))
+		return;
+	if (m_Definition != NULL) {
+		m_Filter = g_Filter;
+		m_Filter.Bind(*m_Definition);
+	}
+
+	if (m_Definition == pPrevious)
+		return;
+
+	// The native decoder is bound to the definitions, so it is set up anew
+	if (pPrevious != NULL)
+		pPrevious->SetNativeDecoder(NULL);
+	delete m_NativeContext;
+	m_NativeContext = NULL;
+	m_NativeDecoder = NULL;
+	if (m_Definition == NULL || !g_UseNativeDecoder)
+		return;
+	const NativeDecoder::Registry* pNativeDecoder = NativeDecoder::Find(m_Definition->GetFingerprint());
+	if (pNativeDecoder == NULL)
+		return;
+	m_NativeContext = new NativeDecoder::Context(*pNativeDecoder);
+	if (!m_NativeContext->Bind(*m_Definition)) {
+		Diagnostic("Decoder::Update(): native decoder does not fit the definitions, interpreting\n");
+		delete m_NativeContext;
+		m_NativeContext = NULL;
+		return;
+	}
+	m_NativeDecoder = pNativeDecoder;
+	m_Definition->SetNativeDecoder(m_NativeContext);
+}
+
+ProtocolDefinition::Packet*
+Decoder::Classify(const uint8_t* pData, int iLength)
+{
+	if (m_Definition == NULL)
+		return NULL;
+	if (m_NativeDecoder != NULL) {
+		int iPacket, iSubpacket;
+		if (!NativeDecoder::Classify(*m_NativeDecoder, *m_NativeContext, pData, iLength, iPacket, iSubpacket))
+			return NULL;
+		ProtocolDefinition::Packet* pPacket = m_Definition->Classify(pData, iLength, iPacket, iSubpacket);
+		if (pPacket != NULL)
+			return pPacket;
+		Diagnostic("ClassifyPacket(): native decoder disagrees with the definitions, interpreting\n");
+		return m_Definition->Process(pData, iLength);
+	}
+	return m_Definition->Classify(pData, iLength);
+}
+
+ProtocolDefinition::Packet*
+Decoder::Materialize(const uint8_t* pData, int iLength, ProtocolDefinition::Packet* pPacket)
+{
+	if (m_Definition->Materialize())
+		return pPacket;
+	Diagnostic("MaterializePacket(): packet does not decode after all, interpreting\n");
+	return m_Definition->Process(pData, iLength);
+}
+
+//! \brief Decoder used when not decoding in parallel
+Decoder g_Decoder(false);
+
+/*
+ * Handles everything which depends on the packets before this one: keepalive
+ * packets are skipped and key packets update the key. Returns false if there
+ * is nothing more to do with the packet, otherwise the key to decrypt it with
+ * is returned, along with whether we have actually seen one.
+ */
+static bool
+FramePacket(struct ROM::Packet* p, uint8_t& iKey, bool& bHaveKey)
 {
 	// Skip keepalive packets unless instructed not to (they don't really give useful information)
 	if ((p->p_flag & (ROM_PACKET_FLAG_ALIVE_REQUEST | ROM_PACKET_FLAG_ALIVE_REPLY)) != 0 /* keepalive */ &&
 	    (g_DisplayFlags & DISPLAY_SHOW_KEEPALIVE) == 0)
-		return;
+		return false;
 
-	const Connection& oConn = oFlow.GetConnection();
 	unsigned int data_len = p->p_length - sizeof(struct ROM::Packet);
-
-	if (0) {
-		char s[1024];
-		sprintf(s, "dump%04u.bin", sequence);
-		FILE* f = fopen(s, "wb");
-		fwrite(p, p->p_length, 1, f);
-		fclose(f);
-	}
-		
 	if (p->p_flag & ROM_PACKET_FLAG_KEY) {
 		if (data_len != ROM_KEY_LENGTH)
 			errx(1, "key packet with wrong length (got %u, expected %u)", data_len, ROM_KEY_LENGTH);
@@ -186,25 +448,83 @@ AnalyzePacket(Flow& oFlow, struct ROM::Packet* p, int sequence)
 			g_State.m_Key[n] = (p->p_data[n] + 8) ^ 8;
 		g_State.m_HaveKey = true;
 		if ((g_DisplayFlags & DISPLAY_KEY) == 0)
-			return; // nothing to see here
+			return false; // nothing to see here
 	}
 
-	bool bHeaderChecksumOK = false;
+	/* Fetch the key; it must have be known to us by now */
+	iKey = p->p_keynum != 0xff ? g_State.m_Key[p->p_keynum] : 8;
+	bHaveKey = g_State.m_HaveKey;
+	return true;
+}
+
+//! \brief Looks for the words of g_Phrase within the string fields of a packet
+class PhraseSink : public XProtocolVisitor {
+public:
+	PhraseSink() : m_Found(false) { }
+
+	virtual void BeginPacket(const ProtocolDefinition::Packet& oPacket) { }
+	virtual void EndPacket(const ProtocolDefinition::Packet& oPacket) { }
+	virtual void BeginSubpacket(const ProtocolDefinition::Subpacket& oSubpacket) { }
+	virtual void EndSubpacket(const ProtocolDefinition::Subpacket& oSubpacket) { }
+	virtual void BeginStruct(const ProtocolDefinition::Struct& oStruct) { }
+	virtual void EndStruct(const ProtocolDefinition::Struct& oStruct) { }
+	virtual void BeginField(const ProtocolDefinition::Field& oField, const ProtocolDefinition::Value& oValue, bool bLast) { }
+	virtual void EndField(const ProtocolDefinition::Field& oField, bool bLast) { }
+	virtual void VisitUnsigned(const ProtocolDefinition::unsignedType& oType, const ProtocolDefinition::Value& oValue) { }
+	virtual void VisitSigned(const ProtocolDefinition::signedType& oType, const ProtocolDefinition::Value& oValue) { }
+	virtual void VisitLength(const ProtocolDefinition::lengthType& oType, const ProtocolDefinition::Value& oValue) { }
+	virtual void VisitUnixTime(const ProtocolDefinition::unixtimeType& oType, const ProtocolDefinition::Value& oValue) { }
+	virtual void VisitString(const ProtocolDefinition::stringType& oType, const ProtocolDefinition::Value& oValue)
+	{
+		if (m_Found)
+			return;
+		m_Words.clear();
+		TermIndex::Tokenize(oType.GetValue(oValue), oType.GetLength(), m_Words);
+		m_Found = std::search(m_Words.begin(), m_Words.end(), g_Phrase.begin(), g_Phrase.end()) != m_Words.end();
+	}
+	virtual void VisitFloat(const ProtocolDefinition::floatType& oType, const ProtocolDefinition::Value& oValue) { }
+	virtual void VisitDouble(const ProtocolDefinition::doubleType& oType, const ProtocolDefinition::Value& oValue) { }
+
+	bool IsFound() const { return m_Found; }
+
+protected:
+	bool m_Found;
+	std::vector<std::string> m_Words;
+};
+
+//! \brief Determines whether a packet contains the phrase being looked for
+static bool
+ContainsPhrase(const ProtocolDefinition::Packet& oPacket)
+{
+	PhraseSink oSink;
+	oPacket.Accept(oSink);
+	return oSink.IsFound();
+}
+
+/*
+ * Decrypts and decodes a packet passed by FramePacket(); this only depends on
+ * the packet itself, so it can be done in parallel using private decoders.
+ */
+static void
+DecodePacket(Decoder& oDecoder, struct ROM::Packet* p, uint8_t key, bool bHaveKey, DecodedPacket& oResult)
+{
+	unsigned int data_len = p->p_length - sizeof(struct ROM::Packet);
+
 	{
 		/* Verify header checksum */
 		uint8_t cksum = 0;
 		for (unsigned int n = 0; n < 11; n++)
 			cksum += ((uint8_t*)p)[n];
-		bHeaderChecksumOK = (uint8_t)(cksum - p->p_header_checksum) == p->p_header_checksum;
+		oResult.m_HeaderChecksumOK = (uint8_t)(cksum - p->p_header_checksum) == p->p_header_checksum;
 	}
 
-	bool bDataChecksumOK = true; // XXX we don't check in the unencrypted case
-	if (p->p_flag == ROM_PACKET_FLAG_ENCRYPTED) {
-		/* Fetch the key; it must have be known to us by now */
-		uint8_t key = p->p_keynum != 0xff ? g_State.m_Key[p->p_keynum] : 8;
-
-		if (!g_State.m_HaveKey) {
-			PRINT(" [warning: no key available]");
+	oResult.m_DataChecksumOK = true; // XXX we don't check in the unencrypted case
+	oResult.m_MissingKey = false;
+	if (p->p_flag == ROM_PACKET_FLAG_ENCRYPTED && (g_DisplayFlags & INPUT_DECRYPTED) == 0) {
+		if (!bHaveKey) {
+			oResult.m_MissingKey = true;
+			if ((g_DisplayFlags & OUTPUT_JSON) == 0)
+				Diagnostic(" [warning: no key available]");
 		}
 
 		/* Decrypt (well, it's just plain mangling) */
@@ -219,44 +539,129 @@ AnalyzePacket(Flow& oFlow, struct ROM::Packet* p, int sequence)
 			cksum += key;
 			cksum -= p->p_header_checksum;
 			cksum -= p->p_data_checksum;
-			bDataChecksumOK = cksum == p->p_data_checksum;
+			oResult.m_DataChecksumOK = cksum == p->p_data_checksum;
 		}
 	}
 
 	// See what the packet definitions make of it
-	bool bSkipPacket = false;
-	ProtocolDefinition::Packet* pPacket = NULL;
+	oResult.m_Skip = false;
+	oResult.m_Packet = NULL;
+	oResult.m_Detached = NULL;
 	if (p->p_flag == ROM_PACKET_FLAG_ENCRYPTED) {
-		pPacket = g_ProtocolDef.Process(p->p_data, data_len);
+		oDecoder.Update();
+		oResult.m_Packet = oDecoder.Classify(p->p_data, data_len);
 
 		// If we need to skip this packet, do it
-		if (pPacket != NULL) {
-			bSkipPacket = PacketMatchesList(*pPacket, g_HideTypes);
-			// If it isn't hidden, see if this is among the list we have to show - but
-			// only if the list isn't empty (we'll show everything if it's empty)
-			if (!bSkipPacket && !g_ShowTypes.empty() && !PacketMatchesList(*pPacket, g_ShowTypes))
-				bSkipPacket = true;
+		if (oResult.m_Packet != NULL) {
+			oResult.m_Skip = !oDecoder.GetFilter().Matches(p->p_data, data_len, *oResult.m_Packet);
+			if (!oResult.m_Skip || g_Segment != NULL || g_TermSegment != NULL) // the indices need every packet
+				oResult.m_Packet = oDecoder.Materialize(p->p_data, data_len, oResult.m_Packet);
+			if (!oResult.m_Skip && oResult.m_Packet != NULL && !g_Phrase.empty())
+				oResult.m_Skip = !ContainsPhrase(*oResult.m_Packet);
 		}
 	}
 
-	if (pPacket == NULL && (g_DisplayFlags & SKIP_UNKNOWN) != 0)
-			bSkipPacket = true;
+	if (oResult.m_Packet == NULL && (g_DisplayFlags & SKIP_UNKNOWN) != 0)
+			oResult.m_Skip = true;
+}
+
+//! \brief Collects whatever the indices being built need of a packet
+class SegmentSink : public XProtocolVisitor {
+public:
+	SegmentSink(Segment* pSegment, TermSegment* pTerms, off_t iRecord, int iSequence)
+		: m_Segment(pSegment), m_Terms(pTerms), m_Record(iRecord), m_Sequence(iSequence)
+	{
+	}
+
+	virtual void BeginPacket(const ProtocolDefinition::Packet& oPacket) { }
+	virtual void EndPacket(const ProtocolDefinition::Packet& oPacket) { }
+	virtual void BeginSubpacket(const ProtocolDefinition::Subpacket& oSubpacket) { }
+	virtual void EndSubpacket(const ProtocolDefinition::Subpacket& oSubpacket) { }
+	virtual void BeginStruct(const ProtocolDefinition::Struct& oStruct) { }
+	virtual void EndStruct(const ProtocolDefinition::Struct& oStruct) { }
+	virtual void BeginField(const ProtocolDefinition::Field& oField, const ProtocolDefinition::Value& oValue, bool bLast) { }
+	virtual void EndField(const ProtocolDefinition::Field& oField, bool bLast) { }
+	virtual void VisitUnsigned(const ProtocolDefinition::unsignedType& oType, const ProtocolDefinition::Value& oValue)
+	{
+		if (m_Segment != NULL && oType.GetAnnotation() != NULL)
+			m_Segment->AddValue(*oType.GetAnnotation(), oType.GetValue(oValue, 0));
+	}
+	virtual void VisitSigned(const ProtocolDefinition::signedType& oType, const ProtocolDefinition::Value& oValue) { }
+	virtual void VisitLength(const ProtocolDefinition::lengthType& oType, const ProtocolDefinition::Value& oValue) { }
+	virtual void VisitUnixTime(const ProtocolDefinition::unixtimeType& oType, const ProtocolDefinition::Value& oValue) { }
+	virtual void VisitString(const ProtocolDefinition::stringType& oType, const ProtocolDefinition::Value& oValue)
+	{
+		if (m_Terms != NULL)
+			m_Terms->Add(oType.GetValue(oValue), oType.GetLength(), m_Record, m_Sequence);
+	}
+	virtual void VisitFloat(const ProtocolDefinition::floatType& oType, const ProtocolDefinition::Value& oValue) { }
+	virtual void VisitDouble(const ProtocolDefinition::doubleType& oType, const ProtocolDefinition::Value& oValue) { }
+
+protected:
+	Segment* m_Segment;
+	TermSegment* m_Terms;
+	off_t m_Record;
+	int m_Sequence;
+};
 
-	if (bSkipPacket)
+//! \brief Adds a packet decoded by DecodePacket() to the segments being indexed
+static void
+IndexPacket(const DecodedPacket& oResult, off_t iRecord, int sequence)
+{
+	const ProtocolDefinition::Packet* pPacket = oResult.m_Packet;
+	if (pPacket == NULL) {
+		// Filters never select these, but they are shown regardless
+		if (g_Segment != NULL)
+			g_Segment->AddUnknown();
+		return;
+	}
+	if (g_Segment != NULL) {
+		const ProtocolDefinition::Subpacket* pSubpacket = GetSubpacket(oResult);
+		g_Segment->AddPacket(pPacket->GetName(), pSubpacket != NULL ? pSubpacket->GetName() : NULL);
+	}
+	SegmentSink oSink(g_Segment, g_TermSegment, iRecord, sequence);
+	AcceptPacket(oResult, oSink);
+}
+
+//! \brief Displays a packet decoded by DecodePacket(), which was completed by the record at iRecord
+static void
+EmitPacket(const Connection& oConn, struct ROM::Packet* p, int sequence, off_t iRecord, const DecodedPacket& oResult)
+{
+	if (g_Segment != NULL || g_TermSegment != NULL)
+		IndexPacket(oResult, iRecord, sequence);
+	if (oResult.m_Skip || (g_DisplayFlags & SILENT))
 		return; // nothing to see here...
 
-	PRINT(">>> %d: %s -> %s len %u flag 0x%x key %u seq %u",
-	 sequence,
-	 oConn.GetSource().ToString().c_str(),
-	 oConn.GetDest().ToString().c_str(),
-	 data_len,
-	 p->p_flag, p->p_keynum, p->p_seq);
+	unsigned int data_len = p->p_length - sizeof(struct ROM::Packet);
+	ProtocolDefinition::Packet* pPacket = oResult.m_Packet;
+	if (g_DisplayFlags & OUTPUT_JSON) {
+		WriteJSONPacket(oConn, p, sequence, oResult);
+		return;
+	}
+
+	{
+		char sAddress[IPv4Address::s_MaxFormatLength];
+		g_Output->Append(">>> ", 4);
+		g_Output->AppendSigned(sequence);
+		g_Output->Append(": ", 2);
+		g_Output->Append(sAddress, oConn.GetSource().Format(sAddress));
+		g_Output->Append(" -> ", 4);
+		g_Output->Append(sAddress, oConn.GetDest().Format(sAddress));
+		g_Output->Append(" len ", 5);
+		g_Output->AppendUnsigned(data_len);
+		g_Output->Append(" flag 0x", 8);
+		g_Output->AppendHex(p->p_flag);
+		g_Output->Append(" key ", 5);
+		g_Output->AppendUnsigned(p->p_keynum);
+		g_Output->Append(" seq ", 5);
+		g_Output->AppendUnsigned(p->p_seq);
+	}
 
-	if (!bHeaderChecksumOK)
-		PRINT(" header checksum BAD");
-	if (!bDataChecksumOK)
-		PRINT(" data checksum BAD");
-	PRINT("\n");
+	if (!oResult.m_HeaderChecksumOK)
+		g_Output->Append(" header checksum BAD");
+	if (!oResult.m_DataChecksumOK)
+		g_Output->Append(" data checksum BAD");
+	g_Output->AppendChar('\n');
 
 	// Enable below for dump with headers
 #if 0
@@ -268,15 +673,158 @@ AnalyzePacket(Flow& oFlow, struct ROM::Packet* p, int sequence)
 
 
 	if (pPacket != NULL) {
-		pPacket->Print(0);
-		PRINT("\n");
+		ProtocolTextSink oSink(*g_Output, 0);
+		AcceptPacket(oResult, oSink);
+		g_Output->AppendChar('\n');
 	}
 
 	if (pPacket == NULL || (g_DisplayFlags & DISPLAY_HEXDUMP)) {
 		DumpData(buf, data_len);
 	}
 
-	PRINT("\n");
+	g_Output->AppendChar('\n');
+	g_Output->Batch();
+}
+
+/*
+ * Packet being decoded in parallel; framing is done by the main thread, which
+ * copies the packet as the flow buffer is reused afterwards. The worker moves
+ * on to the next packet once this one is decoded, so the values and the
+ * annotations it collected are detached from its definitions.
+ */
+class PacketJob : public DecodePipeline::Job {
+public:
+	const Connection* m_Connection;
+	int m_Sequence;
+	off_t m_Record;
+	uint64_t m_Time;
+	uint8_t m_Key;
+	bool m_HaveKey;
+	std::vector<uint8_t> m_Data;
+
+	DecodedPacket m_Result;
+	std::string m_Diagnostics;
+
+	//! \brief Definitions the packet was decoded with, kept in case they are reloaded
+	ProtocolSchema::TDefinitionPtr m_Definition;
+	ProtocolDefinition::DetachedPacket m_Detached;
+};
+
+//! \brief Decodes packets using a private decoder per worker
+class PacketJobHandler : public DecodePipeline::XHandler {
+public:
+	PacketJobHandler(int iNumWorkers);
+	virtual ~PacketJobHandler();
+
+	virtual DecodePipeline::Job* CreateJob();
+	virtual void Decode(DecodePipeline::Job& oJob, int iWorker);
+	virtual void Emit(DecodePipeline::Job& oJob);
+
+protected:
+	std::vector<Decoder*> m_Decoders;
+};
+
+PacketJobHandler::PacketJobHandler(int iNumWorkers)
+{
+	for (int n = 0; n < iNumWorkers; n++)
+		m_Decoders.push_back(new Decoder(true));
+}
+
+PacketJobHandler::~PacketJobHandler()
+{
+	for (auto it = m_Decoders.begin(); it != m_Decoders.end(); it++)
+		delete *it;
+}
+
+DecodePipeline::Job*
+PacketJobHandler::CreateJob()
+{
+	return new PacketJob;
+}
+
+void
+PacketJobHandler::Decode(DecodePipeline::Job& oJob, int iWorker)
+{
+	PacketJob& oPacketJob = static_cast<PacketJob&>(oJob);
+	Decoder& oDecoder = *m_Decoders[iWorker];
+	oPacketJob.m_Diagnostics.clear();
+	t_Diagnostics = &oPacketJob.m_Diagnostics;
+	DecodePacket(oDecoder, (struct ROM::Packet*)&oPacketJob.m_Data[0], oPacketJob.m_Key, oPacketJob.m_HaveKey, oPacketJob.m_Result);
+	t_Diagnostics = NULL;
+
+	// Only copy the values if anything is going to look at them
+	DecodedPacket& oResult = oPacketJob.m_Result;
+	oPacketJob.m_Definition = oDecoder.GetSharedDefinition();
+	if (oPacketJob.m_Definition != NULL) {
+		bool bNeeded = oResult.m_Packet != NULL && (!oResult.m_Skip || g_Segment != NULL || g_TermSegment != NULL);
+		oPacketJob.m_Definition->Detach(bNeeded ? oResult.m_Packet : NULL, oPacketJob.m_Detached);
+		oResult.m_Detached = &oPacketJob.m_Detached;
+	}
+}
+
+void
+PacketJobHandler::Emit(DecodePipeline::Job& oJob)
+{
+	PacketJob& oPacketJob = static_cast<PacketJob&>(oJob);
+	EmitDiagnostics(oPacketJob.m_Diagnostics);
+
+	// Annotations must see the packets in order, so they are applied here
+	if (g_GridSegment != NULL)
+		g_GridSegment->SetPacket(oPacketJob.m_Record, oPacketJob.m_Time);
+	if (oPacketJob.m_Result.m_Detached != NULL)
+		oPacketJob.m_Detached.ApplyAnnotations();
+	EmitPacket(*oPacketJob.m_Connection, (struct ROM::Packet*)&oPacketJob.m_Data[0], oPacketJob.m_Sequence, oPacketJob.m_Record, oPacketJob.m_Result);
+}
+
+//! \brief Decoders used by g_Pipeline
+PacketJobHandler* g_JobHandler;
+
+//! \brief Pipeline decoding packets in parallel, NULL if not used
+DecodePipeline* g_Pipeline;
+
+//! \brief Waits until all output of the pipeline is written, if any
+static void
+DrainPipeline()
+{
+	if (g_Pipeline != NULL)
+		g_Pipeline->Drain();
+}
+
+static void
+AnalyzePacket(Flow& oFlow, struct ROM::Packet* p, int sequence)
+{
+	if (0) {
+		char s[1024];
+		sprintf(s, "dump%04u.bin", sequence);
+		FILE* f = fopen(s, "wb");
+		fwrite(p, p->p_length, 1, f);
+		fclose(f);
+	}
+
+	uint8_t key;
+	bool bHaveKey;
+	if (!FramePacket(p, key, bHaveKey))
+		return;
+
+	if (g_Pipeline != NULL) {
+		PacketJob& oJob = static_cast<PacketJob&>(g_Pipeline->Acquire());
+		oJob.m_Connection = &oFlow.GetConnection();
+		oJob.m_Sequence = sequence;
+		oJob.m_Record = g_RecordStart;
+		oJob.m_Time = g_RecordTime;
+		oJob.m_Key = key;
+		oJob.m_HaveKey = bHaveKey;
+		oJob.m_Data.assign((const uint8_t*)p, (const uint8_t*)p + p->p_length);
+		g_Pipeline->Submit();
+		return;
+	}
+
+	// Positions are indexed as the annotations are applied, while decoding
+	if (g_GridSegment != NULL)
+		g_GridSegment->SetPacket(g_RecordStart, g_RecordTime);
+	DecodedPacket oResult;
+	DecodePacket(g_Decoder, p, key, bHaveKey, oResult);
+	EmitPacket(oFlow.GetConnection(), p, sequence, g_RecordStart, oResult);
 }
 
 static void
@@ -289,7 +837,9 @@ AnalyzeFlow(Flow& oFlow, int& sequence)
 		struct ROM::Packet* p = (struct ROM::Packet*)pData;
 		if (p->p_length > 131072) {
 				// XXX Figure out the exact value
-				printf("AnalyzeFlow(): obscenely large packet length %u, aborting\n", p->p_length);
+				DrainPipeline();
+				Diagnostic("AnalyzeFlow(): obscenely large packet length %u, aborting\n", p->p_length);
+				g_Output->Flush();
 				abort();
 		}
 
@@ -310,28 +860,45 @@ class ROMPacking : public XDataTransformation {
 public:
 	virtual bool Apply(const uint8_t* pSource, int iSourceLen, uint8_t* pDest, int& oDestLen);
 	virtual int EstimateBufferSize(const uint8_t* pSource, int iSourceLen);
+
+protected:
+	/*! \brief Determines how much of the source is packed data
+	 *  \param pSource Source data
+	 *  \param iSourceLen Source length, in bytes
+	 *  \returns Number of bytes to unpack
+	 */
+	static int GetPackedLength(const uint8_t* pSource, int iSourceLen);
 };
 
-bool
-ROMPacking::Apply(const uint8_t* pSource, int iSourceLen, uint8_t* pDest, int& oDestLen)
+int
+ROMPacking::GetPackedLength(const uint8_t* pSource, int iSourceLen)
 {
-	if (iSourceLen == 0)
-		return true; // nothing to do
-
 	// For some reason, some packets are packed with an extra xx xx xx xx 11 10
 	// 00 00 trailer. We must discard it from the input. No idea why this is done
 	if (iSourceLen > 8 &&
 			pSource[iSourceLen - 4] == 0x11 &&
 			pSource[iSourceLen - 3] == 0x10 &&
 			pSource[iSourceLen - 2] == 0x00 &&
-			pSource[iSourceLen - 1] == 0x00) {
-		printf("wonky\n");
-		iSourceLen -= 8;
+			pSource[iSourceLen - 1] == 0x00)
+		return iSourceLen - 8;
+	return iSourceLen;
+}
+
+bool
+ROMPacking::Apply(const uint8_t* pSource, int iSourceLen, uint8_t* pDest, int& oDestLen)
+{
+	if (iSourceLen == 0) {
+		oDestLen = 0;
+		return true; // nothing to do
 	}
 
+	int iPackedLen = GetPackedLength(pSource, iSourceLen);
+	if (iPackedLen != iSourceLen)
+		Diagnostic("wonky\n");
+
 	int iOutLen;
-	if (!ROMPack::Unpack(pSource, iSourceLen, pDest, &iOutLen)) {
-		printf("ROMPACK UNPACK FAILURE!!!\n");
+	if (!ROMPack::Unpack(pSource, iPackedLen, pDest, &iOutLen)) {
+		Diagnostic("ROMPACK UNPACK FAILURE!!!\n");
 		return false;
 	}
 
@@ -354,29 +921,156 @@ ROMPacking::Apply(const uint8_t* pSource, int iSourceLen, uint8_t* pDest, int& o
 int
 ROMPacking::EstimateBufferSize(const uint8_t* pSource, int iSourceLen)
 {
-	return 1024 * 1024; // XXX crude, but never saw something that large
+	if (iSourceLen == 0)
+		return 0;
+
+	int iPackedLen = GetPackedLength(pSource, iSourceLen);
+	int iOutLen = ROMPack::GetUnpackedLength(pSource, iPackedLen);
+	if (iOutLen < 0) {
+		// Apply() will not be called; report what it would have
+		if (iPackedLen != iSourceLen)
+			Diagnostic("wonky\n");
+		Diagnostic("ROMPACK UNPACK FAILURE!!!\n");
+	}
+	return iOutLen;
+}
+
+/*
+ * Fetches the next packet published by romproxy; packets which were lost
+ * because we fell behind are reported, but the flows remain usable as every
+ * record holds a complete packet.
+ */
+static bool
+NextTapPacket(ROMPacketTapReader& oTap, IPv4Address& oSource, IPv4Address& oDest, const char*& pData, int& iLength)
+{
+	ROMTap::Record oRecord;
+	const struct ROM::Packet* p;
+	bool bResult = oTap.Next(oRecord, p);
+
+	uint64_t iLost = oTap.TakeLostBytes();
+	if (iLost > 0) {
+		DrainPipeline();
+		Diagnostic("WARNING: lost %llu bytes of packets, not keeping up with romproxy\n", (unsigned long long)iLost);
+	}
+	if (!bResult)
+		return false;
+
+	oSource = IPv4Address(oRecord.tr_source_ip, oRecord.tr_source_port);
+	oDest = IPv4Address(oRecord.tr_dest_ip, oRecord.tr_dest_port);
+	pData = (const char*)p;
+	iLength = p->p_length;
+	return true;
+}
+
+//! \brief Parses a size, optionally followed by k, M or G
+static bool
+ParseSize(const char* sValue, off_t& iSize)
+{
+	char* ptr;
+	iSize = (off_t)strtoll(sValue, &ptr, 10);
+	switch(*ptr) {
+		case 'k': case 'K': iSize <<= 10; ptr++; break;
+		case 'm': case 'M': iSize <<= 20; ptr++; break;
+		case 'g': case 'G': iSize <<= 30; ptr++; break;
+	}
+	return ptr != sValue && *ptr == '\0' && iSize >= 0;
+}
+
+/*! \brief Parses the arguments of -N
+ *
+ *  These are zone,x,y,z,radius optionally followed by ,from,to in seconds
+ *  since the epoch.
+ */
+static bool
+ParseNearQuery(const char* sValue, SpatialQuery& oQuery)
+{
+	double fValue[7];
+	int n = 0;
+	for (const char* ptr = sValue; n < 7; n++) {
+		char* end;
+		fValue[n] = strtod(ptr, &end);
+		if (end == ptr || !isfinite(fValue[n]))
+			return false;
+		if (*end == '\0') {
+			n++;
+			break;
+		}
+		if (*end != ',')
+			return false;
+		ptr = end + 1;
+	}
+	if ((n != 5 && n != 7) || fValue[0] < 0 || fValue[0] > UINT32_MAX || fValue[4] < 0)
+		return false;
+
+	oQuery.m_Zone = (uint32_t)fValue[0];
+	oQuery.m_X = fValue[1];
+	oQuery.m_Y = fValue[2];
+	oQuery.m_Z = fValue[3];
+	oQuery.m_Radius = fValue[4];
+	oQuery.m_From = 0;
+	oQuery.m_To = 0;
+	if (n == 7) {
+		if (fValue[5] < 0 || fValue[6] < fValue[5])
+			return false;
+		oQuery.m_From = (uint64_t)(fValue[5] * 1000000.0);
+		oQuery.m_To = (uint64_t)(fValue[6] * 1000000.0);
+		if (oQuery.m_To == 0)
+			oQuery.m_To = 1; // 0 would mean there is no window
+	}
+	return true;
 }
 
 static void
 usage(const char* progname)
 {	
-	fprintf(stderr, "usage: %s [-hkuxyo?] [-d protocol.xml] [-i filter] [-j filter] [-s sysfile.csv] [-v version] file.txt\n", progname);
+	fprintf(stderr, "usage: %s [-hfknuwxyoJ?] [-c checkpoints] [-C interval] [-d protocol.xml] [-e expression] [-G index] [-i filter] [-I index] [-j filter] [-m count] [-N query] [-q phrase] [-r position] [-s sysfile.csv] [-t threads] [-T index] [-v version] [-W position] file ...\n", progname);
+	fprintf(stderr, "       %s [options] --shm /name\n", progname);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "  -h, -?             this help\n");
+	fprintf(stderr, "  -c checkpoints     save the decoding state to the checkpoints file now and then\n");
+	fprintf(stderr, "  -C interval        bytes of input between checkpoints (default: 64M)\n");
 	fprintf(stderr, "  -d protocol.xml    use supplied protocol definitions\n");
+	fprintf(stderr, "  -e expression      only accept packets matching expression\n");
+	fprintf(stderr, "  -f                 keep reading the last file (or all merged ones) as it grows\n");
+	fprintf(stderr, "  -G index           keep the positions of all objects in the index file\n");
 	fprintf(stderr, "  -k                 display keepalive request/replies\n");
+	fprintf(stderr, "  -m count           remember names of at most count objects\n");
+	fprintf(stderr, "                     (default: all, least recently used are forgotten first)\n");
+	fprintf(stderr, "  -n                 never use the compiled-in native decoder\n");
+	fprintf(stderr, "  -N zone,x,y,z,r[,from,to]\n");
+	fprintf(stderr, "                     only list the objects within r of x,y,z in zone according to\n");
+	fprintf(stderr, "                     the -G index, optionally between two unix times\n");
 	fprintf(stderr, "  -o                 print offsets of fields within packets\n");
 	fprintf(stderr, "  -x                 always display hexdump of packet\n");
 	fprintf(stderr, "                     (default: only if no definition available)\n");
 	fprintf(stderr, "  -y                 display key exchange packets\n");
 	fprintf(stderr, "  -i [filter]        ignore packets matching [filter]\n");
+	fprintf(stderr, "  -I index           summarize the input between checkpoints in the index file;\n");
+	fprintf(stderr, "                     with -e or -j, skip parts which cannot hold any matches\n");
 	fprintf(stderr, "  -j [filter]        only accept packets matching [filter]\n");
+	fprintf(stderr, "  -q phrase          only accept packets with a string containing the words of phrase\n");
+	fprintf(stderr, "  -r position        resume from the last checkpoint before position, showing\n");
+	fprintf(stderr, "                     packets from there on; 'end' resumes at the last checkpoint\n");
 	fprintf(stderr, "  -s sysfile.csv     use Sys_... ID definitions\n");
+	fprintf(stderr, "  -t threads         decode packets using the given number of threads\n");
+	fprintf(stderr, "  -T index           keep the words of all strings in the index file; with -q,\n");
+	fprintf(stderr, "                     go straight to the packets which may contain the phrase\n");
 	fprintf(stderr, "  -u                 ignore unrecognized packets\n");
 	fprintf(stderr, "  -v version         use the given protocol version\n");
+	fprintf(stderr, "  -w                 reload protocol definitions when they change\n");
+	fprintf(stderr, "  -W position        only print the objects in the world as of position, resuming\n");
+	fprintf(stderr, "                     from the last checkpoint before it; 'end' for the whole input\n");
+	fprintf(stderr, "  -J                 write JSON Lines, one object per packet\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  --shm /name        read packets live from the shared memory tap of romproxy -p /name\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "files are tcpflow output or romproxy logs; directories and glob patterns may be given\n");
+	fprintf(stderr, "romproxy logs with timestamps are merged by time, anything else is processed in the order given\n");
 	fprintf(stderr, "filter are comma-separated and match by packet type. A subpacket can be matched by using 'packet:subpacket'\n");
+	fprintf(stderr, "expressions combine packet names and field comparisons using !, && and ||, e.g.\n");
+	fprintf(stderr, "  'ServerResponse:MoveObject && objectid == 0x1234' or 'Chat && message ~ \"wts\"'\n");
 	fprintf(stderr, "default version will be the highest available\n");
+	fprintf(stderr, "protocol definitions are reloaded on SIGHUP\n");
 }
 
 static void
@@ -403,7 +1097,7 @@ SysName::Load(const char* fname)
 const char*
 SysName::Lookup(uint32_t value)
 {
-	return m_Parser.Lookup(value).c_str(); // safe because const string&
+	return m_Parser.Lookup(value);
 }
 
 class StatName : public XDataAnnotation {
@@ -418,74 +1112,74 @@ StatName::Lookup(uint32_t value)
 	return g_SysNames.Lookup(500000 + value);
 }
 
-static ProtocolDefinition::Field*
-FindFieldByName(ProtocolDefinition::Struct* pStruct, const char* name)
-{
-	auto actions = pStruct->GetActions();
-	for (auto it = actions.begin(); it != actions.end(); it++) {
-		ProtocolDefinition::Field* pField = dynamic_cast<ProtocolDefinition::Field*>(*it);
-		if (pField == NULL)
-			continue;
-
-		if (strcmp(pField->GetName(), name) == 0)
-			return pField;
-	}
-
-	return NULL;
-}
-
 class ObjectIdStore : public XDataAnnotation
 {
 public:
 	virtual const char* Lookup(uint32_t value);
 
-	virtual void Apply(ProtocolDefinition::Type* pType);
+	virtual bool Bind(const ProtocolDefinition::Struct& oStruct, Binding*& pBinding);
+	virtual void Apply(const Binding* pBinding, const ProtocolDefinition::Value* pValues);
+
+	/*! \brief Limits the number of objects remembered
+	 *  \param iMaxObjects Maximum number of objects, 0 for no limit
+	 */
+	void SetMaxObjects(int iMaxObjects) { m_Ids.SetMaxEntries(iMaxObjects); }
+
+	//! \brief Stores all names in a checkpoint
+	void Save(Checkpoint& oCheckpoint) const;
+
+	//! \brief Restores the names stored by Save(), forgetting all others
+	bool Restore(Checkpoint& oCheckpoint);
 
 protected:
-	typedef std::map<int, std::string> TintStringMap;
-	TintStringMap m_Ids;
+	//! \brief Fields used by Apply()
+	class Fields : public Binding {
+	public:
+		BoundField<ProtocolDefinition::unsignedType> m_ObjectId;
+		BoundField<ProtocolDefinition::Type> m_Race;
+		BoundField<ProtocolDefinition::stringType> m_Name;
+	};
+
+	//! \brief Object names by id; the names are pooled, as they repeat a lot
+	IdMap<const char*> m_Ids;
+	StringPool m_Names;
 };
 
 const char*
 ObjectIdStore::Lookup(uint32_t value)
 {
-	auto it = m_Ids.find(value);
-	if (it == m_Ids.end())
+	const char* const* pName = m_Ids.Find(value);
+	if (pName == NULL)
 		return "?";
-	return it->second.c_str();
+	return *pName;
 }
 
-void
-ObjectIdStore::Apply(ProtocolDefinition::Type* pType)
+bool
+ObjectIdStore::Bind(const ProtocolDefinition::Struct& oStruct, Binding*& pBinding)
 {
-	/*
-	 * XXX This entire function is an entire kludge which should be made without all the casts and
-	 *     diving into pType's internals...
-	 */
-	ProtocolDefinition::Struct* pStruct = dynamic_cast<ProtocolDefinition::Struct*>(pType);
-
-	auto pCharIdField = FindFieldByName(pStruct, "objectid");
-	auto pRaceIdField = FindFieldByName(pStruct, "race");
-	auto pNameIdField = FindFieldByName(pStruct, "name");
-	if (pCharIdField == NULL || pRaceIdField == NULL || pNameIdField == NULL) {
-		fprintf(stderr, "warning: applying 'objectid' annotation without required fields objectid/raceid/name, skipping\n");
-		return;
+	Fields* pFields = new Fields;
+	if (!pFields->m_ObjectId.Bind(oStruct, "objectid") || !pFields->m_Race.Bind(oStruct, "race") || !pFields->m_Name.Bind(oStruct, "name")) {
+		fprintf(stderr, "warning: 'objectid' annotation in '%s' needs unsigned field objectid, field race and string field name, skipping\n", oStruct.GetName());
+		delete pFields;
+		return false;
 	}
+	pBinding = pFields;
+	return true;
+}
 
-	auto pCharIdValue = dynamic_cast<ProtocolDefinition::unsignedType*>(&pCharIdField->GetType());
-	auto pNameValue = dynamic_cast<ProtocolDefinition::stringType*>(&pNameIdField->GetType());
-	if (pCharIdValue == NULL || pNameValue == NULL) {
-		fprintf(stderr, "warning: applying 'objectid' annotation with incorrect field types, skipping\n");
-		return;
-	}
-	unsigned int objectid = pCharIdValue->GetValue(0);
+void
+ObjectIdStore::Apply(const Binding* pBinding, const ProtocolDefinition::Value* pValues)
+{
+	const Fields& oFields = *static_cast<const Fields*>(pBinding);
+	unsigned int objectid = oFields.m_ObjectId.GetType().GetValue(oFields.m_ObjectId.GetValue(pValues), 0);
 
 	char value[256];
-	if (pNameValue->GetValue()[0] != '\0') {
-		strncpy(value, pNameValue->GetValue(), sizeof(value) - 1);
+	const char* name = oFields.m_Name.GetType().GetValue(oFields.m_Name.GetValue(pValues));
+	if (name[0] != '\0') {
+		strncpy(value, name, sizeof(value) - 1);
 		value[sizeof(value) - 1] = '\0';
 	} else {
-		pRaceIdField->GetType().GetHumanReadableContent(value, sizeof(value));
+		oFields.m_Race.GetType().GetHumanReadableContent(oFields.m_Race.GetValue(pValues), value, sizeof(value));
 
 		// XXX Kludge away the <id> thing if it exists
 		char* ptr = strrchr(value, '<');
@@ -500,8 +1194,33 @@ ObjectIdStore::Apply(ProtocolDefinition::Type* pType)
 		}
 	}
 
-	// We got it, we can store it
-	m_Ids.insert(std::pair<int, std::string>(objectid, value));
+	// We got it, we can store it; ids are reused, so this replaces any previous name
+	m_Ids.Set(objectid, m_Names.Intern(value));
+}
+
+void
+ObjectIdStore::Save(Checkpoint& oCheckpoint) const
+{
+	oCheckpoint.PutUnsigned(m_Ids.GetSize());
+	m_Ids.ForEach([&oCheckpoint](uint32_t iObjectId, const char* sName) {
+		oCheckpoint.PutUnsigned(iObjectId);
+		oCheckpoint.PutString(sName);
+	});
+}
+
+bool
+ObjectIdStore::Restore(Checkpoint& oCheckpoint)
+{
+	m_Ids.Clear();
+	uint32_t iCount;
+	oCheckpoint.GetUnsigned(iCount);
+	for (uint32_t n = 0; n < iCount && oCheckpoint.IsOK(); n++) {
+		uint32_t iObjectId;
+		std::string sName;
+		if (oCheckpoint.GetUnsigned(iObjectId) && oCheckpoint.GetString(sName))
+			m_Ids.Set(iObjectId, m_Names.Intern(sName.c_str()));
+	}
+	return oCheckpoint.IsOK();
 }
 
 class CharId2ObjectIdAnnotation : public XDataAnnotation
@@ -512,80 +1231,508 @@ public:
 	}
 	virtual const char* Lookup(uint32_t value);
 
-	virtual void Apply(ProtocolDefinition::Type* pType);
+	virtual bool Bind(const ProtocolDefinition::Struct& oStruct, Binding*& pBinding);
+	virtual void Apply(const Binding* pBinding, const ProtocolDefinition::Value* pValues);
+
+	/*! \brief Limits the number of characters remembered
+	 *  \param iMaxObjects Maximum number of characters, 0 for no limit
+	 */
+	void SetMaxObjects(int iMaxObjects) { m_Ids.SetMaxEntries(iMaxObjects); }
+
+	//! \brief Stores all characters in a checkpoint
+	void Save(Checkpoint& oCheckpoint) const;
+
+	//! \brief Restores the characters stored by Save(), forgetting all others
+	bool Restore(Checkpoint& oCheckpoint);
 
 protected:
-	typedef std::map<int, int> TintStringMap;
-	TintStringMap m_Ids;
+	//! \brief Fields used by Apply()
+	class Fields : public Binding {
+	public:
+		BoundField<ProtocolDefinition::unsignedType> m_CharId;
+		BoundField<ProtocolDefinition::unsignedType> m_ObjectId;
+	};
+
+	//! \brief Object ids by character id
+	IdMap<uint32_t> m_Ids;
 	ObjectIdStore& m_ObjectStore;
 };
 
 const char*
 CharId2ObjectIdAnnotation::Lookup(uint32_t value)
 {
-	auto it = m_Ids.find(value);
-	if (it == m_Ids.end())
+	const uint32_t* pObjectId = m_Ids.Find(value);
+	if (pObjectId == NULL)
 		return "?";
-	return m_ObjectStore.Lookup(it->second);
+	return m_ObjectStore.Lookup(*pObjectId);
+}
+
+bool
+CharId2ObjectIdAnnotation::Bind(const ProtocolDefinition::Struct& oStruct, Binding*& pBinding)
+{
+	Fields* pFields = new Fields;
+	if (!pFields->m_CharId.Bind(oStruct, "charid") || !pFields->m_ObjectId.Bind(oStruct, "objectid")) {
+		fprintf(stderr, "warning: 'charid' annotation in '%s' needs unsigned fields charid and objectid, skipping\n", oStruct.GetName());
+		delete pFields;
+		return false;
+	}
+	pBinding = pFields;
+	return true;
 }
 
 void
-CharId2ObjectIdAnnotation::Apply(ProtocolDefinition::Type* pType)
+CharId2ObjectIdAnnotation::Apply(const Binding* pBinding, const ProtocolDefinition::Value* pValues)
 {
-	/*
-	 * XXX This entire function is an entire kludge which should be made without all the casts and
-	 *     diving into pType's internals...
-	 */
-	ProtocolDefinition::Struct* pStruct = dynamic_cast<ProtocolDefinition::Struct*>(pType);
+	const Fields& oFields = *static_cast<const Fields*>(pBinding);
+	unsigned int charid = oFields.m_CharId.GetType().GetValue(oFields.m_CharId.GetValue(pValues), 0);
+	unsigned int objectid = oFields.m_ObjectId.GetType().GetValue(oFields.m_ObjectId.GetValue(pValues), 0);
+
+	// We got it, we can store it
+	m_Ids.Set(charid, objectid);
+}
+
+void
+CharId2ObjectIdAnnotation::Save(Checkpoint& oCheckpoint) const
+{
+	oCheckpoint.PutUnsigned(m_Ids.GetSize());
+	m_Ids.ForEach([&oCheckpoint](uint32_t iCharId, uint32_t iObjectId) {
+		oCheckpoint.PutUnsigned(iCharId);
+		oCheckpoint.PutUnsigned(iObjectId);
+	});
+}
+
+bool
+CharId2ObjectIdAnnotation::Restore(Checkpoint& oCheckpoint)
+{
+	m_Ids.Clear();
+	uint32_t iCount;
+	oCheckpoint.GetUnsigned(iCount);
+	for (uint32_t n = 0; n < iCount && oCheckpoint.IsOK(); n++) {
+		uint32_t iCharId, iObjectId;
+		if (oCheckpoint.GetUnsigned(iCharId) && oCheckpoint.GetUnsigned(iObjectId))
+			m_Ids.Set(iCharId, iObjectId);
+	}
+	return oCheckpoint.IsOK();
+}
+
+/*
+ * Identifies the input a checkpoint belongs to, by the data leading up to
+ * the position; resuming a different file would give nonsense.
+ */
+static uint32_t
+InputFingerprint(const char* sPath, off_t iOffset)
+{
+	char buf[64];
+	int iLength = iOffset < (off_t)sizeof(buf) ? (int)iOffset : (int)sizeof(buf);
+	int fd = open(sPath, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (pread(fd, buf, iLength, iOffset - iLength) != iLength)
+		iLength = 0;
+	close(fd);
+	return Checkpoint::Hash(buf, iLength);
+}
+
+//! \brief Writes everything needed to continue decoding at a position in the input
+static bool
+SaveCheckpoint(CheckpointFile& oFile, const char* sInput, off_t iOffset, int sequence, const TConnectionFlowPtrMap& flows, const ObjectIdStore& oObjectStore, const CharId2ObjectIdAnnotation& oCharIdStore, const WorldState& oWorld)
+{
+	// Annotations are applied as packets are written
+	DrainPipeline();
+
+	Checkpoint oCheckpoint;
+	oCheckpoint.SetInputOffset(iOffset);
+	oCheckpoint.PutUnsigned(InputFingerprint(sInput, iOffset));
+	oCheckpoint.PutUnsigned(sequence);
+	oCheckpoint.PutUnsigned(g_State.m_HaveKey);
+	oCheckpoint.PutBytes(g_State.m_Key, ROMState::s_KeySize);
+
+	// Only the part of the flows that is not yet processed matters
+	oCheckpoint.PutUnsigned(flows.size());
+	for (auto it = flows.begin(); it != flows.end(); it++) {
+		IPv4Address oSource = it->first.GetSource(), oDest = it->first.GetDest();
+		Flow* pFlow = it->second;
+		oCheckpoint.PutUnsigned(oSource.Address());
+		oCheckpoint.PutUnsigned(oSource.Port());
+		oCheckpoint.PutUnsigned(oDest.Address());
+		oCheckpoint.PutUnsigned(oDest.Port());
+		oCheckpoint.PutBytes(pFlow->GetData() + pFlow->CurrentDataOffset(), pFlow->GetDataLength() - pFlow->CurrentDataOffset());
+	}
+
+	oObjectStore.Save(oCheckpoint);
+	oCharIdStore.Save(oCheckpoint);
+	oWorld.Save(oCheckpoint);
+	return oFile.Save(oCheckpoint);
+}
 
-	auto pCharIdField = FindFieldByName(pStruct, "charid");
-	auto pObjectIdField = FindFieldByName(pStruct, "objectid");
-	if (pCharIdField == NULL || pObjectIdField == NULL) {
-		fprintf(stderr, "warning: applying 'charid' annotation without required field objectid, skipping\n");
+//! \brief Restores what SaveCheckpoint() wrote, replacing the current state
+static bool
+RestoreCheckpoint(Checkpoint& oCheckpoint, const char* sInput, int& sequence, TConnectionFlowPtrMap& flows, ObjectIdStore& oObjectStore, CharId2ObjectIdAnnotation& oCharIdStore, WorldState& oWorld)
+{
+	uint32_t iFingerprint;
+	if (!oCheckpoint.GetUnsigned(iFingerprint) || iFingerprint != InputFingerprint(sInput, oCheckpoint.GetInputOffset())) {
+		fprintf(stderr, "checkpoint at %lld does not belong to '%s'\n", (long long)oCheckpoint.GetInputOffset(), sInput);
+		return false;
+	}
+
+	// Whatever was going on before doesn't matter anymore
+	for (auto it = flows.begin(); it != flows.end(); it++)
+		delete it->second;
+	flows.clear();
+
+	uint32_t iSequence, iHaveKey;
+	std::vector<char> oKey;
+	oCheckpoint.GetUnsigned(iSequence);
+	oCheckpoint.GetUnsigned(iHaveKey);
+	if (!oCheckpoint.GetBytes(oKey) || oKey.size() != ROMState::s_KeySize)
+		return false;
+	sequence = iSequence;
+	g_State.m_HaveKey = iHaveKey != 0;
+	memcpy(g_State.m_Key, &oKey[0], ROMState::s_KeySize);
+
+	uint32_t iNumFlows;
+	oCheckpoint.GetUnsigned(iNumFlows);
+	for (uint32_t n = 0; n < iNumFlows && oCheckpoint.IsOK(); n++) {
+		uint32_t iSourceAddress, iSourcePort, iDestAddress, iDestPort;
+		std::vector<char> oData;
+		oCheckpoint.GetUnsigned(iSourceAddress);
+		oCheckpoint.GetUnsigned(iSourcePort);
+		oCheckpoint.GetUnsigned(iDestAddress);
+		oCheckpoint.GetUnsigned(iDestPort);
+		if (!oCheckpoint.GetBytes(oData))
+			break;
+
+		Connection oConnection(IPv4Address(iSourceAddress, iSourcePort), IPv4Address(iDestAddress, iDestPort));
+		auto oResult = flows.insert(std::pair<Connection, Flow*>(oConnection, NULL));
+		Flow* pFlow = new Flow(oResult.first->first, 262000 /* XXX */);
+		oResult.first->second = pFlow;
+		if (!oData.empty())
+			pFlow->Append(&oData[0], oData.size());
+	}
+
+	return oObjectStore.Restore(oCheckpoint) && oCharIdStore.Restore(oCheckpoint) && oWorld.Restore(oCheckpoint);
+}
+
+/*
+ * Continues decoding at the last checkpoint before a position, showing the
+ * packets from there on; returns false if there is no such checkpoint.
+ */
+static bool
+JumpTo(off_t iPosition, CheckpointFile& oCheckpoints, InputMerger& oInput, const char* sInput, int& sequence, TConnectionFlowPtrMap& flows, ObjectIdStore& oObjectStore, CharId2ObjectIdAnnotation& oCharIdStore, WorldState& oWorld, off_t& iResumedAt)
+{
+	DrainPipeline();
+	Checkpoint oCheckpoint;
+	if (!oCheckpoints.Load(iPosition, oCheckpoint))
+		return false;
+	if (!RestoreCheckpoint(oCheckpoint, sInput, sequence, flows, oObjectStore, oCharIdStore, oWorld))
+		errx(1, "can't restore checkpoint");
+	if (!oInput.Seek(oCheckpoint.GetInputOffset()))
+		errx(1, "can't seek to %lld", (long long)oCheckpoint.GetInputOffset());
+
+	iResumedAt = oCheckpoint.GetInputOffset();
+	if (iResumedAt < iPosition)
+		g_DisplayFlags |= SILENT;
+	return true;
+}
+
+//! \brief Determines whether a segment may hold anything that is to be shown
+static bool
+IsWanted(const Segment& oSegment, const PacketFilter& oFilter)
+{
+	if (oSegment.HasUnknown() && (g_DisplayFlags & SKIP_UNKNOWN) == 0)
+		return true;
+	return oFilter.MayMatch(oSegment);
+}
+
+/*
+ * Finds the first segment at or after an offset which is wanted, along with
+ * the wanted segments directly following it; returns false if there are
+ * none.
+ */
+static bool
+FindMatchingSegments(const SegmentIndex& oIndex, const PacketFilter& oFilter, off_t iOffset, off_t& iStart, off_t& iEnd)
+{
+	const std::vector<Segment>& oSegments = oIndex.GetSegments();
+	auto it = oSegments.begin();
+	while (it != oSegments.end() && (it->GetEnd() <= iOffset || !IsWanted(*it, oFilter)))
+		it++;
+	if (it == oSegments.end())
+		return false;
+
+	iStart = it->GetStart();
+	for (; it != oSegments.end() && IsWanted(*it, oFilter); it++)
+		iEnd = it->GetEnd();
+	return true;
+}
+
+/*
+ * Finds the next part of the input at or after an offset which may hold
+ * anything to be shown, according to the segment index if there is a filter
+ * and the term index if there is a search; returns false if there is none.
+ */
+static bool
+FindWanted(const SegmentIndex& oIndex, const PacketFilter* pFilter, TermSearch* pSearch, off_t iOffset, off_t& iStart, off_t& iEnd)
+{
+	while (true) {
+		iStart = iOffset;
+		iEnd = std::numeric_limits<off_t>::max();
+		if (pFilter != NULL && !FindMatchingSegments(oIndex, *pFilter, iOffset, iStart, iEnd))
+			return false;
+		if (pSearch == NULL)
+			return true;
+
+		off_t iHitStart, iHitEnd;
+		if (!pSearch->FindNext(std::max(iOffset, iStart), iHitStart, iHitEnd))
+			return false;
+		if (iHitStart < iEnd) {
+			iStart = std::max(iStart, iHitStart);
+			iEnd = std::min(iEnd, iHitEnd);
+			return true;
+		}
+		iOffset = iHitStart; // not within the segments the filter may match
+	}
+}
+
+//! \brief Starts indexing at an offset, if the index reaches that far
+static void
+StartIndexing(SegmentIndex& oIndex, Segment& oSegment, off_t iOffset)
+{
+	// Like checkpoints, anything after where we start is redone
+	oIndex.Truncate(iOffset);
+	if (oIndex.GetEnd() != iOffset) {
+		fprintf(stderr, "index ends at %lld, not extending it\n", (long long)oIndex.GetEnd());
 		return;
 	}
+	oSegment.Clear(iOffset);
+	g_Segment = &oSegment;
+}
 
-	auto pCharIdValue = dynamic_cast<ProtocolDefinition::unsignedType*>(&pCharIdField->GetType());
-	auto pObjectIdValue = dynamic_cast<ProtocolDefinition::unsignedType*>(&pObjectIdField->GetType());
-	if (pCharIdValue == NULL || pObjectIdField == NULL) {
-		fprintf(stderr, "warning: applying 'charid' annotation with incorrect field types, skipping\n");
+//! \brief Starts indexing terms at an offset, if the index reaches that far
+static void
+StartIndexing(TermIndex& oIndex, TermSegment& oSegment, off_t iOffset)
+{
+	oIndex.Truncate(iOffset);
+	if (oIndex.GetEnd() != iOffset) {
+		fprintf(stderr, "term index ends at %lld, not extending it\n", (long long)oIndex.GetEnd());
 		return;
 	}
-	unsigned int charid = pCharIdValue->GetValue(0);
-	unsigned int objectid = pObjectIdValue->GetValue(0);
+	oSegment.Clear(iOffset);
+	g_TermSegment = &oSegment;
+}
 
-	// We got it, we can store it
-	m_Ids.insert(std::pair<int, int>(charid, objectid));
+//! \brief Starts indexing object positions at an offset, if the index reaches that far
+static void
+StartIndexing(SpatialIndex& oIndex, SpatialSegment& oSegment, WorldState& oWorld, off_t iOffset)
+{
+	oIndex.Truncate(iOffset);
+	if (oIndex.GetEnd() != iOffset) {
+		fprintf(stderr, "grid index ends at %lld, not extending it\n", (long long)oIndex.GetEnd());
+		return;
+	}
+	oSegment.Clear(iOffset);
+	g_GridSegment = &oSegment;
+	oWorld.SetListener(&oSegment);
+}
+
+//! \brief Completes the segments being indexed, if any, and starts the next ones
+static void
+NextSegment(SegmentIndex& oIndex, TermIndex& oTerms, SpatialIndex& oGrid, WorldState& oWorld, off_t iOffset)
+{
+	// Packets are added as they are written
+	DrainPipeline();
+	if (g_Segment != NULL) {
+		g_Segment->Finish(iOffset);
+		if (oIndex.Append(*g_Segment))
+			g_Segment->Clear(iOffset);
+		else
+			g_Segment = NULL;
+	}
+	if (g_TermSegment != NULL) {
+		g_TermSegment->Finish(iOffset);
+		if (oTerms.Append(*g_TermSegment))
+			g_TermSegment->Clear(iOffset);
+		else
+			g_TermSegment = NULL;
+	}
+	if (g_GridSegment != NULL) {
+		g_GridSegment->Finish(iOffset);
+		if (oGrid.Append(*g_GridSegment))
+			g_GridSegment->Clear(iOffset);
+		else {
+			g_GridSegment = NULL;
+			oWorld.SetListener(NULL);
+		}
+	}
+}
+
+//! \brief Prints a time in microseconds since the epoch as seconds
+static void
+PrintTime(uint64_t iTime)
+{
+	if (iTime != 0)
+		g_Output->Printf(" time %llu.%06u", (unsigned long long)(iTime / 1000000), (unsigned int)(iTime % 1000000));
+}
+
+/*! \brief Lists the objects the grid index has near a point, first seen first
+ *
+ *  Every object is listed once, along with when it was seen there first and
+ *  last and how close it came; segments which cannot be read are skipped.
+ */
+static void
+ListNearby(SpatialIndex& oGrid, const SpatialQuery& oQuery, XDataAnnotation& oObjectNames)
+{
+	struct Nearby {
+		uint32_t m_Count;
+		SpatialObservation m_First, m_Last;
+		double m_Closest;
+	};
+	IdMap<uint32_t> oRows;
+	std::vector<Nearby> oNearby;
+	std::vector<SpatialObservation> oHits;
+	const std::vector<SpatialIndex::Block>& oBlocks = oGrid.GetBlocks();
+	for (int n = 0; n < (int)oBlocks.size(); n++) {
+		if (!oGrid.Search(n, oQuery, oHits)) {
+			fprintf(stderr, "grid segment at %lld is damaged, skipping it\n", (long long)oBlocks[n].m_Start);
+			continue;
+		}
+		// Hits are grouped by cell, so the input order has to be restored
+		std::stable_sort(oHits.begin(), oHits.end(), [](const SpatialObservation& a, const SpatialObservation& b) {
+			return a.o_record < b.o_record;
+		});
+		for (auto it = oHits.begin(); it != oHits.end(); it++) {
+			double dx = (double)it->o_x - oQuery.m_X, dy = (double)it->o_y - oQuery.m_Y, dz = (double)it->o_z - oQuery.m_Z;
+			double fDistance = sqrt(dx * dx + dy * dy + dz * dz);
+			const uint32_t* pRow = oRows.Find(it->o_object);
+			if (pRow == NULL) {
+				oRows.Set(it->o_object, oNearby.size());
+				Nearby oNew;
+				oNew.m_Count = 0;
+				oNew.m_First = *it;
+				oNew.m_Closest = fDistance;
+				oNearby.push_back(oNew);
+				pRow = oRows.Find(it->o_object);
+			}
+			Nearby& oObject = oNearby[*pRow];
+			oObject.m_Count++;
+			oObject.m_Last = *it;
+			oObject.m_Closest = std::min(oObject.m_Closest, fDistance);
+		}
+	}
+
+	g_Output->Printf("%u objects\n", (unsigned int)oNearby.size());
+	for (auto it = oNearby.begin(); it != oNearby.end(); it++) {
+		g_Output->Printf("0x%x '%s' seen %u times, closest %.2f; first at offset %llu", it->m_First.o_object, oObjectNames.Lookup(it->m_First.o_object), it->m_Count, it->m_Closest, (unsigned long long)it->m_First.o_record);
+		PrintTime(it->m_First.o_time);
+		g_Output->Printf(", last at offset %llu", (unsigned long long)it->m_Last.o_record);
+		PrintTime(it->m_Last.o_time);
+		g_Output->Printf("\n");
+	}
+}
+
+static void
+sighup(int)
+{
+	g_Schema.RequestReload();
 }
 
 int
 main(int argc, char** argv)
 {
-	g_ProtocolDef.RegisterTransformation("rompack", *new ROMPacking);
-	g_ProtocolDef.RegisterAnnotation("sys_name", g_SysNames);
-	g_ProtocolDef.RegisterAnnotation("stat_name", *new StatName);
+	g_Schema.RegisterTransformation("rompack", *new ROMPacking);
+	g_Schema.RegisterAnnotation("sys_name", g_SysNames);
+	g_Schema.RegisterAnnotation("stat_name", *new StatName);
 	ObjectIdStore* pObjectStore = new ObjectIdStore;
-	g_ProtocolDef.RegisterAnnotation("objectid", *pObjectStore);
-	g_ProtocolDef.RegisterAnnotation("charid", *new CharId2ObjectIdAnnotation(*pObjectStore));
-
+	g_Schema.RegisterAnnotation("objectid", *pObjectStore);
+	CharId2ObjectIdAnnotation* pCharIdStore = new CharId2ObjectIdAnnotation(*pObjectStore);
+	g_Schema.RegisterAnnotation("charid", *pCharIdStore);
+	WorldState* pWorld = new WorldState;
+
+	int num_threads = 0;
+	bool bFollow = false;
+	const char* shm_name = NULL;
+	const char* checkpoint_file = NULL;
+	off_t checkpoint_interval = 64 << 20;
+	const char* resume_at = NULL;
+	const char* index_file = NULL;
+	const char* terms_file = NULL;
+	const char* world_at = NULL;
+	const char* grid_file = NULL;
+	const char* near_query = NULL;
 	{
+		static const struct option oLongOptions[] = {
+			{ "shm", required_argument, NULL, 'S' },
+			{ NULL, 0, NULL, 0 }
+		};
 		int opt;
 		int protocol_ver = -1;
 		const char* protocol_def = NULL;
-		while ((opt = getopt(argc, argv, "?hd:i:j:ks:uv:xyo")) != -1) {
+		bool bWatch = false;
+		TCharPtrList oHideTypes, oShowTypes;
+		while ((opt = getopt_long(argc, argv, "?hc:C:d:e:fG:i:I:j:km:nN:q:r:s:t:T:uv:wW:xyoJ", oLongOptions, NULL)) != -1) {
 			switch(opt) {
+				case 'c':
+					checkpoint_file = optarg;
+					break;
+				case 'C':
+					if (!ParseSize(optarg, checkpoint_interval) || checkpoint_interval == 0)
+						errx(1, "checkpoint interval '%s' cannot be parsed", optarg);
+					break;
 				case 'd':
 					protocol_def = optarg;
 					break;
+				case 'r':
+					resume_at = optarg;
+					break;
+				case 'e':
+					if (!g_Filter.Add(optarg))
+						errx(1, "can't parse filter expression");
+					break;
+				case 'f':
+					bFollow = true;
+					break;
+				case 'G':
+					grid_file = optarg;
+					break;
 				case 'k':
 					g_DisplayFlags |= DISPLAY_SHOW_KEEPALIVE;
 					break;
+				case 'm': {
+					char* ptr;
+					int max_objects = (int)strtol(optarg, &ptr, 10);
+					if (*ptr != '\0' || max_objects < 0)
+						errx(1, "object count '%s' cannot be parsed", optarg);
+					pObjectStore->SetMaxObjects(max_objects);
+					pCharIdStore->SetMaxObjects(max_objects);
+					break;
+				}
+				case 'n':
+					g_UseNativeDecoder = false;
+					break;
+				case 'N':
+					near_query = optarg;
+					break;
+				case 'q':
+					TermIndex::Tokenize(optarg, strlen(optarg), g_Phrase);
+					if (g_Phrase.empty())
+						errx(1, "phrase '%s' has no words", optarg);
+					g_DisplayFlags |= SKIP_UNKNOWN; // these cannot contain it
+					break;
 				case 'i':
-					parse_list(optarg, g_HideTypes);
+					parse_list(optarg, oHideTypes);
+					break;
+				case 'I':
+					index_file = optarg;
 					break;
 				case 'j':
-					parse_list(optarg, g_ShowTypes);
+					parse_list(optarg, oShowTypes);
+					break;
+				case 't': {
+					char* ptr;
+					num_threads = (int)strtol(optarg, &ptr, 10);
+					if (*ptr != '\0' || num_threads < 0)
+						errx(1, "thread count '%s' cannot be parsed", optarg);
 					break;
+				}
 				case 'u':
 					g_DisplayFlags |= SKIP_UNKNOWN;
 					break;
@@ -599,8 +1746,23 @@ main(int argc, char** argv)
 					if (!g_SysNames.Load(optarg))
 						errx(1, "can't load sys names");
 					break;
+				case 'S':
+					shm_name = optarg;
+					break;
+				case 'T':
+					terms_file = optarg;
+					break;
 				case 'o':
-					g_ProtocolDef.SetPrintDataOffset(true);
+					ProtocolDefinition::SetPrintDataOffset(true);
+					break;
+				case 'J':
+					g_DisplayFlags |= OUTPUT_JSON;
+					break;
+				case 'w':
+					bWatch = true;
+					break;
+				case 'W':
+					world_at = optarg;
 					break;
 				case 'v': {
 					char* ptr;
@@ -617,66 +1779,230 @@ main(int argc, char** argv)
 			}
 		}
 
-		if (protocol_def != NULL && !g_ProtocolDef.Load(protocol_def, protocol_ver))
-			errx(1, "can't load protocol definitions");
+		g_Filter.AddNames(oShowTypes, false);
+		g_Filter.AddNames(oHideTypes, true);
+
+		// Keeping track of the world is only worth it if it's shown or saved
+		pWorld->Register(g_Schema, world_at != NULL || grid_file != NULL || checkpoint_file != NULL);
+		if (protocol_def != NULL) {
+			if (!g_Schema.Load(protocol_def, protocol_ver))
+				errx(1, "can't load protocol definitions");
+			if (!g_Schema.StartWatching(bWatch))
+				errx(1, "can't watch protocol definitions");
+			signal(SIGHUP, sighup);
+
+			// Reloaded definitions may lack a field, but at first it must be a typo
+			PacketFilter oFilter(g_Filter);
+			if (!oFilter.Bind(*g_Schema.Get()))
+				errx(1, "filter expression refers to unknown fields");
+		}
+		g_Decoder.Update();
 	}
 
-	if (optind >= argc) {
-		fprintf(stderr, "missing file to process\n");
+	if ((shm_name == NULL) == (optind >= argc)) {
+		fprintf(stderr, shm_name == NULL ? "missing file to process\n" : "files cannot be processed along with --shm\n");
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	FILE* f = fopen(argv[optind], "rb");
-	if (f == NULL)
-		err(1, "can't open '%s'", argv[optind]);
+	if (checkpoint_file != NULL || resume_at != NULL || index_file != NULL || terms_file != NULL || grid_file != NULL) {
+		if (checkpoint_file == NULL || shm_name != NULL || argc - optind != 1)
+			errx(1, "checkpoints and indices need -c and a single file to process");
+	}
 
-	// See if this is a ROM binary log file
-	{
-		struct ROM::LoggerHeader lh;
-		g_IsROMLogFile = 0;
-		if (fread(&lh, sizeof(lh), 1, f)) {
-			if (lh.lh_magic == ROM_LOGGER_HEADER_MAGIC_1)
-				g_IsROMLogFile = 1;
-			else if (lh.lh_magic == ROM_LOGGER_HEADER_MAGIC_2)
-				g_IsROMLogFile = 2;
-		} else {
-			// Not a ROM binary log file
-			rewind(f);
-		}
+	// Looking at the world means decoding everything up to the position quietly
+	off_t iWorldAt = -1;
+	if (world_at != NULL) {
+		if (shm_name != NULL || argc - optind != 1 || resume_at != NULL || (g_DisplayFlags & OUTPUT_JSON))
+			errx(1, "-W needs a single file to process and cannot be combined with -r or -J");
+		iWorldAt = std::numeric_limits<off_t>::max();
+		if (strcmp(world_at, "end") != 0 && !ParseSize(world_at, iWorldAt))
+			errx(1, "position '%s' cannot be parsed", world_at);
+		g_DisplayFlags |= SILENT;
+	}
+
+	// Likewise, a query of the grid index first brings it up to date
+	SpatialQuery oNearQuery;
+	if (near_query != NULL) {
+		if (grid_file == NULL || resume_at != NULL || world_at != NULL || bFollow || (g_DisplayFlags & OUTPUT_JSON))
+			errx(1, "-N needs -G and cannot be combined with -f, -r, -W or -J");
+		if (!ParseNearQuery(near_query, oNearQuery))
+			errx(1, "query '%s' cannot be parsed", near_query);
+		g_DisplayFlags |= SILENT;
+	}
+
+	/*
+	 * Segments of the indices end where checkpoints are saved. If there is a
+	 * filter or a phrase to look for, parts which cannot hold anything to
+	 * show are skipped by jumping to the next checkpoint worth decoding; only
+	 * past the indices is anything saved.
+	 */
+	SegmentIndex oIndex;
+	Segment oSegment;
+	TermIndex oTerms;
+	TermSegment oTermSegment;
+	SpatialIndex oGrid;
+	SpatialSegment oGridSegment;
+	if (index_file != NULL && !oIndex.Open(index_file))
+		return EXIT_FAILURE;
+	if (terms_file != NULL && !oTerms.Open(terms_file))
+		return EXIT_FAILURE;
+	if (grid_file != NULL && !oGrid.Open(grid_file))
+		return EXIT_FAILURE;
+	off_t iIndexEnd = std::numeric_limits<off_t>::max();
+	if (index_file != NULL)
+		iIndexEnd = std::min(iIndexEnd, oIndex.GetEnd());
+	if (terms_file != NULL)
+		iIndexEnd = std::min(iIndexEnd, oTerms.GetEnd());
+	if (grid_file != NULL)
+		iIndexEnd = std::min(iIndexEnd, oGrid.GetEnd());
+
+	// Find where to start; the state itself is restored once everything is set up
+	CheckpointFile oCheckpoints;
+	Checkpoint oCheckpoint;
+	bool bResume = false;
+	off_t iShowFrom = 0;
+	if (checkpoint_file != NULL) {
+		if (!oCheckpoints.Open(checkpoint_file))
+			return EXIT_FAILURE;
+		if (resume_at != NULL) {
+			iShowFrom = std::numeric_limits<off_t>::max();
+			if (strcmp(resume_at, "end") != 0 && !ParseSize(resume_at, iShowFrom))
+				errx(1, "position '%s' cannot be parsed", resume_at);
+			bResume = oCheckpoints.Load(iShowFrom, oCheckpoint);
+			if (!bResume && iShowFrom != std::numeric_limits<off_t>::max())
+				fprintf(stderr, "no checkpoint before %lld, starting from the beginning\n", (long long)iShowFrom);
+			if (iShowFrom == std::numeric_limits<off_t>::max())
+				iShowFrom = 0;
+			if (iShowFrom > oCheckpoint.GetInputOffset())
+				g_DisplayFlags |= SILENT;
+		} else if (iWorldAt >= 0)
+			bResume = oCheckpoints.Load(iWorldAt, oCheckpoint);
+		else if (near_query != NULL)
+			bResume = oCheckpoints.Load(iIndexEnd, oCheckpoint);
+	}
+	if (iWorldAt >= 0 || near_query != NULL)
+		iShowFrom = std::numeric_limits<off_t>::max(); // never show a packet
+	off_t iStartOffset = bResume ? oCheckpoint.GetInputOffset() : 0;
+
+	const PacketFilter* pQueryFilter = index_file != NULL && !g_Filter.IsEmpty() ? &g_Decoder.GetFilter() : NULL;
+	TermSearch* pSearch = terms_file != NULL && !g_Phrase.empty() ? new TermSearch(oTerms, g_Phrase) : NULL;
+	bool bQuery = (pQueryFilter != NULL || pSearch != NULL) && iIndexEnd > iStartOffset && iWorldAt < 0 && near_query == NULL;
+	bool bRecording = checkpoint_file != NULL && !bQuery && iWorldAt < 0;
+	if (bRecording && index_file != NULL)
+		StartIndexing(oIndex, oSegment, iStartOffset);
+	if (bRecording && terms_file != NULL)
+		StartIndexing(oTerms, oTermSegment, iStartOffset);
+	if (bRecording && grid_file != NULL)
+		StartIndexing(oGrid, oGridSegment, *pWorld, iStartOffset);
+
+	InputMerger oInput;
+	ROMPacketTapReader oTap;
+	if (shm_name != NULL) {
+		if (!oTap.Open(shm_name))
+			err(1, "can't attach to '%s'", shm_name);
+		g_DisplayFlags |= INPUT_DECRYPTED;
+	} else {
+		for (int n = optind; n < argc; n++)
+			if (!oInput.Add(argv[n]))
+				err(1, "can't open '%s'", argv[n]);
+		oInput.SetFollow(bFollow);
+		if (bResume)
+			oInput.SetStartOffset(oCheckpoint.GetInputOffset());
+		if (!oInput.Start())
+			return EXIT_FAILURE;
+	}
+
+	g_Output = &OutputBuffer::GetStdout();
+	if (g_DisplayFlags & OUTPUT_JSON) {
+		// Keep stdout clean for the records; diagnostics go to stderr
+		g_JSONSink = new ProtocolJSONSink(*g_Output);
+	}
+
+	if (num_threads > 0) {
+		// Keep a few packets per thread in flight, so they need not wait for each other
+		g_JobHandler = new PacketJobHandler(num_threads);
+		g_Pipeline = new DecodePipeline(*g_JobHandler, num_threads, num_threads * 4);
 	}
 
 	TConnectionFlowPtrMap flows;
 	
 	int sequence = 1;
-	char pBuffer[131072];
-	bool bOK = true;
-	while(bOK) {
+	off_t iNextCheckpoint = checkpoint_interval, iLastCheckpoint = -1, iEnd = iStartOffset;
+	off_t iQueryEnd = iStartOffset;
+	if (bResume) {
+		if (!RestoreCheckpoint(oCheckpoint, argv[optind], sequence, flows, *pObjectStore, *pCharIdStore, *pWorld))
+			errx(1, "can't restore checkpoint");
+		iLastCheckpoint = oCheckpoint.GetInputOffset();
+		iNextCheckpoint = iLastCheckpoint + checkpoint_interval;
+	}
+
+	while(true) {
 		IPv4Address oSource, oDest;
-		int iLength = 0;
-		if (g_IsROMLogFile) {
-			// ROM binary log file
-			int iResult = ROMLogParser::ParseHeader(f, oSource, oDest, g_IsROMLogFile >= 2);
-			bOK = iResult >= 0;
-			if (!bOK || iResult == 0)
-				break;
-			if (iResult <= sizeof(pBuffer)) {
-				iLength = ROMLogParser::ReadPacket(f, pBuffer, iResult);
-			} else {
-				PRINT("excessive packet size %u, aborting\n", iResult);
-				iLength = 0;
+		const char* pBuffer;
+		int iLength;
+		if (shm_name != NULL) {
+			if (oTap.IsDrained()) {
+				DrainPipeline();
+				g_Output->Flush();
 			}
+			if (!NextTapPacket(oTap, oSource, oDest, pBuffer, iLength))
+				break;
 		} else {
-			// TCPFlow file
-			int iResult = TCPFlowParser::ParseHeader(f, oSource, oDest);
-			bOK = iResult >= 0;
-			if (!bOK || iResult == 0)
+			if (bQuery && iEnd >= iQueryEnd) {
+				off_t iQueryStart, iResumedAt;
+				if (!FindWanted(oIndex, pQueryFilter, pSearch, iEnd, iQueryStart, iQueryEnd) || iQueryStart >= iIndexEnd) {
+					// Nothing left to find in the indices; what follows is new
+					iQueryStart = iIndexEnd;
+					bQuery = false;
+				}
+				iQueryEnd = std::min(iQueryEnd, iIndexEnd);
+				iQueryStart = std::max(iQueryStart, iShowFrom);
+				if ((iQueryStart > iEnd || !bQuery) && JumpTo(iQueryStart, oCheckpoints, oInput, argv[optind], sequence, flows, *pObjectStore, *pCharIdStore, *pWorld, iResumedAt)) {
+					iShowFrom = iQueryStart;
+					iEnd = iResumedAt;
+					if (!bQuery) {
+						bRecording = true;
+						iLastCheckpoint = iEnd;
+						iNextCheckpoint = iEnd + checkpoint_interval;
+						if (index_file != NULL)
+							StartIndexing(oIndex, oSegment, iEnd);
+						if (terms_file != NULL)
+							StartIndexing(oTerms, oTermSegment, iEnd);
+						if (grid_file != NULL)
+							StartIndexing(oGrid, oGridSegment, *pWorld, iEnd);
+					}
+				}
+			}
+			if (bFollow && oInput.IsDrained()) {
+				// We may have to wait a while; make sure everything so far is seen
+				DrainPipeline();
+				g_Output->Flush();
+			}
+			if (!oInput.Next(oSource, oDest, pBuffer, iLength)) {
+				if (oInput.GetExcessiveLength() > 0) {
+					DrainPipeline();
+					Diagnostic("excessive packet size %u, aborting\n", oInput.GetExcessiveLength());
+				}
 				break;
-			iLength = TCPFlowParser::ParsePacket(f, pBuffer, sizeof(pBuffer));
+			}
+		}
+
+		if (checkpoint_file != NULL || iWorldAt >= 0) {
+			off_t iStart;
+			bool bOffsets = oInput.GetOffsets(iStart, iEnd);
+			if (bOffsets && iWorldAt >= 0 && iStart >= iWorldAt)
+				break; // everything before the position is in
+			if (bOffsets && (g_DisplayFlags & SILENT) && iStart >= iShowFrom) {
+				// Everything before this must remain unseen
+				DrainPipeline();
+				g_DisplayFlags &= ~SILENT;
+			}
+			if (g_Segment != NULL)
+				g_Segment->AddTime(oInput.GetTimestamp());
+			g_RecordStart = iStart;
+			g_RecordTime = oInput.GetTimestamp();
 		}
-		bOK = iLength >= 0;
-		if (!bOK || iLength == 0)
-			break;
 
 		std::pair<TConnectionFlowPtrMap::iterator, bool> oResult = flows.insert(std::pair<Connection, Flow*>(Connection(oSource, oDest), NULL));
 		if (oResult.second) {
@@ -695,15 +2021,39 @@ main(int argc, char** argv)
 		 * as well.
 		 */
 		AnalyzeFlow(*pFlow, sequence);
+
+		if (bRecording && iEnd >= iNextCheckpoint) {
+			SaveCheckpoint(oCheckpoints, argv[optind], iEnd, sequence, flows, *pObjectStore, *pCharIdStore, *pWorld);
+			NextSegment(oIndex, oTerms, oGrid, *pWorld, iEnd);
+			iLastCheckpoint = iEnd;
+			iNextCheckpoint = iEnd + checkpoint_interval;
+		}
 	}
 
+	// The next run can continue where this one ends
+	if (bRecording && iEnd > iLastCheckpoint) {
+		SaveCheckpoint(oCheckpoints, argv[optind], iEnd, sequence, flows, *pObjectStore, *pCharIdStore, *pWorld);
+		NextSegment(oIndex, oTerms, oGrid, *pWorld, iEnd);
+	}
+
+	// All packets must be written before anything else is
+	delete g_Pipeline;
+	g_Pipeline = NULL;
+	delete g_JobHandler;
+	g_JobHandler = NULL;
+
+	if (iWorldAt >= 0)
+		pWorld->Print(*g_Output, *pObjectStore, g_SysNames);
+	if (near_query != NULL)
+		ListNearby(oGrid, oNearQuery, *pObjectStore);
+
 	// Walk through the flows and see if they are completed; while here, clean 'm up!
 	for (TConnectionFlowPtrMap::iterator it = flows.begin(); it != flows.end(); it++) {
 		Flow* pFlow = it->second;
 		if (pFlow->CurrentDataOffset() != pFlow->GetDataLength()) {
 			const Connection& oConn = pFlow->GetConnection();
 			int iLeft = pFlow->GetDataLength() - pFlow->CurrentDataOffset();
-			PRINT("WARNING: %s -> %s still has %u bytes of unprocessed data left!\n",
+			Diagnostic("WARNING: %s -> %s still has %u bytes of unprocessed data left!\n",
 			 oConn.GetSource().ToString().c_str(),
 			 oConn.GetDest().ToString().c_str(),
 			 iLeft);
@@ -712,12 +2062,14 @@ main(int argc, char** argv)
 			if (iLeft >= sizeof(struct ROM::Packet)) {
 				const char* pData = pFlow->GetData() + pFlow->CurrentDataOffset();
 				struct ROM::Packet* p = (struct ROM::Packet*)pData;
-				PRINT("first flow packet length: %u bytes\n", p->p_length);
+				Diagnostic("first flow packet length: %u bytes\n", p->p_length);
 			}
 		}
 		delete pFlow;
 	}
 
+	delete g_JSONSink;
+	g_Output->Flush();
 	return EXIT_SUCCESS;
 }
 
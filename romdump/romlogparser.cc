@@ -25,7 +25,25 @@
 #define LINE_MAX 256
 
 int
-ROMLogParser::ParseHeader(FILE* pFile, IPv4Address& oSourceAddress, IPv4Address& oDestAddress, bool v2)
+ROMLogParser::DetectVersion(FILE* pFile)
+{
+	struct ROM::LoggerHeader lh;
+	if (!fread(&lh, sizeof(lh), 1, pFile)) {
+		// Not a ROM binary log file
+		rewind(pFile);
+		return 0;
+	}
+	if (lh.lh_magic == ROM_LOGGER_HEADER_MAGIC_1)
+		return 1;
+	if (lh.lh_magic == ROM_LOGGER_HEADER_MAGIC_2)
+		return 2;
+	if (lh.lh_magic == ROM_LOGGER_HEADER_MAGIC_3)
+		return 3;
+	return 0;
+}
+
+int
+ROMLogParser::ParseHeader(FILE* pFile, IPv4Address& oSourceAddress, IPv4Address& oDestAddress, int iVersion, uint64_t& iTimestamp)
 {
 	struct ROM::LoggerPacket lp;
 	if (!fread(&lp, sizeof(lp), 1, pFile))
@@ -35,10 +53,18 @@ ROMLogParser::ParseHeader(FILE* pFile, IPv4Address& oSourceAddress, IPv4Address&
 	oSourceAddress.Port() = lp.lp_source_port;
 	oDestAddress.Address() = lp.lp_dest_ip;
 	oDestAddress.Port() = lp.lp_dest_port;
-	if (!v2) {
+	if (iVersion < 2) {
 		fseek(pFile, -2, SEEK_CUR);
 		lp.lp_len2 = 0;
 	}
+
+	iTimestamp = 0;
+	if (iVersion >= 3) {
+		struct ROM::LoggerTimestamp lt;
+		if (!fread(&lt, sizeof(lt), 1, pFile))
+			return 0;
+		iTimestamp = lt.lt_timestamp;
+	}
 	return lp.lp_len1 + (lp.lp_len2 << 16);
 }
 
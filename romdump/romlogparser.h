@@ -17,6 +17,7 @@
 #ifndef __ROMLOGPARSER_H__
 #define __ROMLOGPARSER_H__
 
+#include <stdint.h>
 #include <stdio.h> // for FILE
 
 class IPv4Address;
@@ -26,14 +27,24 @@ class ROMLogParser
 public:
 	ROMLogParser();
 
+	/*! \brief Determines whether a file is a ROM log file
+	 *  \param pFile File to check, positioned at the start
+	 *  \returns Log file version, or 0 if not a log file
+	 *
+	 *  The file is positioned after the header afterwards; for anything but
+	 *  a log file, this skips the first four bytes.
+	 */
+	static int DetectVersion(FILE* pFile);
+
 	/*! \brief Parses a header structure
 	  * \param pFile File to parse
 	 *  \param oSourceAddress Source address on success
 	 *  \param oDestAddress Destination address on success
-	 *  \param v2 If set, this is a version 2+ header
+	 *  \param iVersion Log file version, see DetectVersion()
+	 *  \param iTimestamp Receives the packet time in microseconds since the epoch, 0 if unknown
 	 *  \returns -1 on end of file, 0 on failure, next packet length on success
 	 */
-	static int ParseHeader(FILE* pFile, IPv4Address& oSourceAddress, IPv4Address& oDestAddress, bool v2);
+	static int ParseHeader(FILE* pFile, IPv4Address& oSourceAddress, IPv4Address& oDestAddress, int iVersion, uint64_t& iTimestamp);
 
 	/*! \brief Parses a packet
 	  * \param pFile File to parse
@@ -0,0 +1,104 @@
+/*
+ * Runes of Magic protocol analysis - append-only files of segments
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "segmentfile.h"
+
+SegmentFile::SegmentFile()
+	: m_File(NULL)
+{
+}
+
+SegmentFile::~SegmentFile()
+{
+	if (m_File != NULL)
+		fclose(m_File);
+}
+
+bool
+SegmentFile::Open(const char* sPath, uint32_t iMagic, uint32_t iVersion, const char* sKind)
+{
+	m_Path = sPath;
+	m_File = fopen(sPath, "r+b");
+	if (m_File == NULL && errno == ENOENT)
+		m_File = fopen(sPath, "w+b");
+	if (m_File == NULL) {
+		fprintf(stderr, "SegmentFile::Open(): cannot open '%s': %s\n", sPath, strerror(errno));
+		return false;
+	}
+
+	uint32_t iHeader[2];
+	if (fread(iHeader, sizeof(iHeader), 1, m_File) != 1) {
+		// Empty, so it's ours to initialize
+		iHeader[0] = iMagic;
+		iHeader[1] = iVersion;
+		rewind(m_File);
+		if (fwrite(iHeader, sizeof(iHeader), 1, m_File) != 1 || fflush(m_File) != 0) {
+			fprintf(stderr, "SegmentFile::Open(): cannot write '%s': %s\n", sPath, strerror(errno));
+			return false;
+		}
+	} else if (iHeader[0] != iMagic || iHeader[1] != iVersion) {
+		fprintf(stderr, "SegmentFile::Open(): '%s' is not a %s\n", sPath, sKind);
+		return false;
+	}
+	return true;
+}
+
+off_t
+SegmentFile::GetSize() const
+{
+	struct stat st;
+	if (fstat(fileno(m_File), &st) < 0) {
+		fprintf(stderr, "SegmentFile::GetSize(): cannot stat '%s': %s\n", m_Path.c_str(), strerror(errno));
+		return -1;
+	}
+	return st.st_size;
+}
+
+uint32_t
+SegmentFile::Hash(const Part* pParts, int iNumParts)
+{
+	uint32_t iHash = 0;
+	for (int n = 0; n < iNumParts; n++)
+		iHash ^= Checkpoint::Hash(static_cast<const char*>(pParts[n].m_Data), pParts[n].m_Length);
+	return iHash;
+}
+
+bool
+SegmentFile::Append(off_t iOffset, const void* pHeader, size_t iHeaderLength, const Part* pParts, int iNumParts)
+{
+	// Anything beyond what we know to be good belongs to an earlier run
+	if (fflush(m_File) != 0 || ftruncate(fileno(m_File), iOffset) != 0) {
+		fprintf(stderr, "SegmentFile::Append(): cannot truncate '%s': %s\n", m_Path.c_str(), strerror(errno));
+		return false;
+	}
+
+	fseeko(m_File, iOffset, SEEK_SET);
+	bool bOK = fwrite(pHeader, iHeaderLength, 1, m_File) == 1;
+	for (int n = 0; bOK && n < iNumParts; n++)
+		bOK = pParts[n].m_Length == 0 || fwrite(pParts[n].m_Data, pParts[n].m_Length, 1, m_File) == 1;
+	if (!bOK || fflush(m_File) != 0) {
+		fprintf(stderr, "SegmentFile::Append(): cannot write '%s': %s\n", m_Path.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,87 @@
+/*
+ * Runes of Magic protocol analysis - append-only files of segments
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SEGMENTFILE_H__
+#define __SEGMENTFILE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <string>
+
+/*! \brief File of segments which are only ever appended
+ *
+ *  The file starts with a magic number and a version, followed by the
+ *  segments; every segment is a header followed by a number of parts, and
+ *  carries a checksum of those parts. The owner scans the segments and keeps
+ *  track of where the last intact one ends; anything beyond is removed by the
+ *  next Append(), so a segment that was only partially written is replaced.
+ */
+class SegmentFile {
+public:
+	//! \brief Data following the header of a segment
+	struct Part {
+		const void* m_Data;
+		size_t m_Length;
+	};
+
+	SegmentFile();
+	~SegmentFile();
+
+	/*! \brief Opens the file, creating and initializing it if needed
+	 *  \param sPath Path to use
+	 *  \param iMagic Magic number identifying the kind of file
+	 *  \param iVersion Version of the file format
+	 *  \param sKind Kind of file, for messages
+	 *  \returns true on success
+	 */
+	bool Open(const char* sPath, uint32_t iMagic, uint32_t iVersion, const char* sKind);
+
+	//! \brief Retrieves the file, positioned wherever it was last used
+	FILE* GetFile() const { return m_File; }
+
+	//! \brief Retrieves the offset of the first segment
+	off_t GetStart() const { return 2 * sizeof(uint32_t); }
+
+	//! \brief Retrieves the current size of the file, -1 on failure
+	off_t GetSize() const;
+
+	/*! \brief Hashes the parts of a segment
+	 *  \param pParts Parts to hash
+	 *  \param iNumParts Number of parts
+	 *  \returns Checksum to store in the header
+	 */
+	static uint32_t Hash(const Part* pParts, int iNumParts);
+
+	/*! \brief Appends a segment, replacing anything beyond the given offset
+	 *  \param iOffset End of the last intact segment
+	 *  \param pHeader Header of the segment
+	 *  \param iHeaderLength Length of the header in bytes
+	 *  \param pParts Parts following the header
+	 *  \param iNumParts Number of parts
+	 *  \returns true on success
+	 */
+	bool Append(off_t iOffset, const void* pHeader, size_t iHeaderLength, const Part* pParts, int iNumParts);
+
+protected:
+	FILE* m_File;
+	std::string m_Path;
+
+	SegmentFile(const SegmentFile&) = delete;
+	SegmentFile& operator=(const SegmentFile&) = delete;
+};
+
+#endif /* __SEGMENTFILE_H__ */
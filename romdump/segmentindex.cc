@@ -0,0 +1,260 @@
+/*
+ * Runes of Magic protocol analysis - index of input segments
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <algorithm>
+#include "segmentindex.h"
+
+#define INDEX_FILE_MAGIC 0x494d6f52 /* RoMI */
+#define INDEX_FILE_VERSION 1
+#define SEGMENT_MAGIC 0x4d474553 /* SEGM */
+#define SEGMENT_FLAG_UNKNOWN 1
+
+//! \brief Precedes the filters of every segment
+struct SegmentIndex::Header {
+	uint32_t h_magic;
+	//! \brief Checksum of the filters
+	uint32_t h_hash;
+	uint64_t h_start;
+	uint64_t h_end;
+	uint64_t h_first_time;
+	uint64_t h_last_time;
+	uint32_t h_name_bytes;
+	uint32_t h_value_bytes;
+	uint32_t h_flags;
+	uint32_t h_reserved;
+};
+
+//! \brief Hashes a name as 'packet:subpacket' (FNV-1a)
+static uint64_t
+HashName(const char* sPacket, const char* sSubpacket)
+{
+	uint64_t iHash = 14695981039346656037ull;
+	for (const char* s = sPacket; *s != '\0'; s++)
+		iHash = (iHash ^ (uint8_t)*s) * 1099511628211ull;
+	iHash = (iHash ^ ':') * 1099511628211ull;
+	for (const char* s = sSubpacket; *s != '\0'; s++)
+		iHash = (iHash ^ (uint8_t)*s) * 1099511628211ull;
+	return iHash;
+}
+
+//! \brief Hashes a value; ids tend to be sequential, so the bits must be mixed well
+static uint64_t
+HashValue(uint32_t iValue)
+{
+	uint64_t iHash = iValue + 0x9e3779b97f4a7c15ull;
+	iHash = (iHash ^ (iHash >> 30)) * 0xbf58476d1ce4e5b9ull;
+	iHash = (iHash ^ (iHash >> 27)) * 0x94d049bb133111ebull;
+	return iHash ^ (iHash >> 31);
+}
+
+Segment::Segment()
+	: m_Start(0), m_End(0), m_FirstTime(0), m_LastTime(0), m_Unknown(false)
+{
+}
+
+void
+Segment::Clear(off_t iStart)
+{
+	m_Start = iStart;
+	m_End = iStart;
+	m_FirstTime = 0;
+	m_LastTime = 0;
+	m_Unknown = false;
+	m_Names.assign(s_NameBits / 8, 0);
+	m_Values.clear();
+	m_PendingValues.clear();
+}
+
+bool
+Segment::TestBits(const std::vector<uint8_t>& oBits, uint64_t iHash, int iNumHashes)
+{
+	if (oBits.empty())
+		return false;
+	uint32_t iMask = oBits.size() * 8 - 1;
+	uint32_t iBit = (uint32_t)iHash, iStep = (uint32_t)(iHash >> 32) | 1;
+	for (int n = 0; n < iNumHashes; n++, iBit += iStep)
+		if ((oBits[(iBit & iMask) / 8] & (1 << (iBit & 7))) == 0)
+			return false;
+	return true;
+}
+
+void
+Segment::SetBits(std::vector<uint8_t>& oBits, uint64_t iHash, int iNumHashes)
+{
+	uint32_t iMask = oBits.size() * 8 - 1;
+	uint32_t iBit = (uint32_t)iHash, iStep = (uint32_t)(iHash >> 32) | 1;
+	for (int n = 0; n < iNumHashes; n++, iBit += iStep)
+		oBits[(iBit & iMask) / 8] |= 1 << (iBit & 7);
+}
+
+void
+Segment::AddPacket(const char* sPacket, const char* sSubpacket)
+{
+	// A name may select the packet, the subpacket or both
+	SetBits(m_Names, HashName(sPacket, ""), s_NameHashes);
+	if (sSubpacket == NULL)
+		return;
+	SetBits(m_Names, HashName("", sSubpacket), s_NameHashes);
+	SetBits(m_Names, HashName(sPacket, sSubpacket), s_NameHashes);
+}
+
+void
+Segment::AddValue(const ProtocolDefinition::Annotation& oAnnotation, uint32_t iValue)
+{
+	if (IsIndexed(oAnnotation))
+		m_PendingValues.push_back(iValue);
+}
+
+void
+Segment::AddTime(uint64_t iTimestamp)
+{
+	if (iTimestamp == 0)
+		return;
+	if (m_FirstTime == 0 || iTimestamp < m_FirstTime)
+		m_FirstTime = iTimestamp;
+	if (iTimestamp > m_LastTime)
+		m_LastTime = iTimestamp;
+}
+
+void
+Segment::Finish(off_t iEnd)
+{
+	m_End = iEnd;
+
+	// Objects show up in many packets; size the filter by the distinct ones
+	std::sort(m_PendingValues.begin(), m_PendingValues.end());
+	m_PendingValues.erase(std::unique(m_PendingValues.begin(), m_PendingValues.end()), m_PendingValues.end());
+	m_Values.clear();
+	if (!m_PendingValues.empty()) {
+		size_t iNumBits = 64;
+		while (iNumBits < m_PendingValues.size() * s_BitsPerValue)
+			iNumBits *= 2;
+		m_Values.assign(iNumBits / 8, 0);
+		for (auto it = m_PendingValues.begin(); it != m_PendingValues.end(); it++)
+			SetBits(m_Values, HashValue(*it), s_ValueHashes);
+	}
+	std::vector<uint32_t>().swap(m_PendingValues);
+}
+
+bool
+Segment::MayContain(const char* sPacket, const char* sSubpacket) const
+{
+	return TestBits(m_Names, HashName(sPacket, sSubpacket), s_NameHashes);
+}
+
+bool
+Segment::MayContainValue(const ProtocolDefinition::Annotation& oAnnotation, uint32_t iValue) const
+{
+	if (!IsIndexed(oAnnotation))
+		return true;
+	return TestBits(m_Values, HashValue(iValue), s_ValueHashes);
+}
+
+bool
+Segment::IsIndexed(const ProtocolDefinition::Annotation& oAnnotation)
+{
+	return strcmp(oAnnotation.GetName(), "objectid") == 0 || strcmp(oAnnotation.GetName(), "charid") == 0;
+}
+
+SegmentIndex::SegmentIndex()
+{
+}
+
+bool
+SegmentIndex::Open(const char* sPath)
+{
+	if (!m_File.Open(sPath, INDEX_FILE_MAGIC, INDEX_FILE_VERSION, "segment index"))
+		return false;
+
+	// Segments must follow each other; anything after one that doesn't is of no use
+	m_Segments.clear();
+	m_Offsets.assign(1, m_File.GetStart());
+	fseeko(m_File.GetFile(), m_Offsets.back(), SEEK_SET);
+	Segment oSegment;
+	while (ReadSegment(oSegment) && oSegment.GetStart() == GetEnd()) {
+		m_Segments.push_back(oSegment);
+		m_Offsets.push_back(ftello(m_File.GetFile()));
+	}
+	return true;
+}
+
+bool
+SegmentIndex::ReadSegment(Segment& oSegment)
+{
+	FILE* pFile = m_File.GetFile();
+	Header oHeader;
+	if (fread(&oHeader, sizeof(oHeader), 1, pFile) != 1 || oHeader.h_magic != SEGMENT_MAGIC)
+		return false;
+	if (oHeader.h_end < oHeader.h_start || oHeader.h_name_bytes != Segment::s_NameBits / 8 || oHeader.h_value_bytes > (1u << 28))
+		return false;
+
+	oSegment.m_Start = oHeader.h_start;
+	oSegment.m_End = oHeader.h_end;
+	oSegment.m_FirstTime = oHeader.h_first_time;
+	oSegment.m_LastTime = oHeader.h_last_time;
+	oSegment.m_Unknown = (oHeader.h_flags & SEGMENT_FLAG_UNKNOWN) != 0;
+	oSegment.m_Names.resize(oHeader.h_name_bytes);
+	oSegment.m_Values.resize(oHeader.h_value_bytes);
+	oSegment.m_PendingValues.clear();
+	if (fread(&oSegment.m_Names[0], oHeader.h_name_bytes, 1, pFile) != 1)
+		return false;
+	if (oHeader.h_value_bytes > 0 && fread(&oSegment.m_Values[0], oHeader.h_value_bytes, 1, pFile) != 1)
+		return false;
+	SegmentFile::Part oParts[] = {
+		{ oSegment.m_Names.data(), oSegment.m_Names.size() },
+		{ oSegment.m_Values.data(), oSegment.m_Values.size() }
+	};
+	return SegmentFile::Hash(oParts, 2) == oHeader.h_hash;
+}
+
+void
+SegmentIndex::Truncate(off_t iOffset)
+{
+	while (!m_Segments.empty() && m_Segments.back().GetEnd() > iOffset) {
+		m_Segments.pop_back();
+		m_Offsets.pop_back();
+	}
+}
+
+bool
+SegmentIndex::Append(const Segment& oSegment)
+{
+	SegmentFile::Part oParts[] = {
+		{ oSegment.m_Names.data(), oSegment.m_Names.size() },
+		{ oSegment.m_Values.data(), oSegment.m_Values.size() }
+	};
+
+	Header oHeader;
+	oHeader.h_magic = SEGMENT_MAGIC;
+	oHeader.h_hash = SegmentFile::Hash(oParts, 2);
+	oHeader.h_start = oSegment.GetStart();
+	oHeader.h_end = oSegment.GetEnd();
+	oHeader.h_first_time = oSegment.GetFirstTime();
+	oHeader.h_last_time = oSegment.GetLastTime();
+	oHeader.h_name_bytes = oSegment.m_Names.size();
+	oHeader.h_value_bytes = oSegment.m_Values.size();
+	oHeader.h_flags = oSegment.HasUnknown() ? SEGMENT_FLAG_UNKNOWN : 0;
+	oHeader.h_reserved = 0;
+	if (!m_File.Append(m_Offsets.back(), &oHeader, sizeof(oHeader), oParts, 2))
+		return false;
+
+	m_Segments.push_back(oSegment);
+	m_Offsets.push_back(m_Offsets.back() + sizeof(oHeader) + oHeader.h_name_bytes + oHeader.h_value_bytes);
+	return true;
+}
+
+/* vim:set ts=2 sw=2: */
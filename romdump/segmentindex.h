@@ -0,0 +1,168 @@
+/*
+ * Runes of Magic protocol analysis - index of input segments
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SEGMENTINDEX_H__
+#define __SEGMENTINDEX_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <vector>
+#include "packetfilter.h"
+#include "segmentfile.h"
+
+/*! \brief Summary of the packets within a segment of the input
+ *
+ *  Packet and subpacket names are kept in a Bloom filter of fixed size, as
+ *  there are only a few hundred of them. Values of fields annotated as
+ *  object or character ids are kept in a Bloom filter sized to the number
+ *  of distinct values once the segment is complete.
+ */
+class Segment : public PacketFilter::XSummary {
+	friend class SegmentIndex;
+public:
+	Segment();
+
+	/*! \brief Starts a new, empty segment
+	 *  \param iStart Input offset at which it starts
+	 */
+	void Clear(off_t iStart);
+
+	/*! \brief Adds a packet
+	 *  \param sPacket Packet name
+	 *  \param sSubpacket Subpacket name, NULL if none
+	 */
+	void AddPacket(const char* sPacket, const char* sSubpacket);
+
+	//! \brief Adds a packet which could not be decoded
+	void AddUnknown() { m_Unknown = true; }
+
+	/*! \brief Adds the value of a field
+	 *  \param oAnnotation Annotation of the field
+	 *  \param iValue Value of the field
+	 *
+	 *  Only values of fields with an annotation for which IsIndexed() holds
+	 *  are kept.
+	 */
+	void AddValue(const ProtocolDefinition::Annotation& oAnnotation, uint32_t iValue);
+
+	/*! \brief Adds the time of a record
+	 *  \param iTimestamp Time in microseconds since the epoch, 0 if unknown
+	 */
+	void AddTime(uint64_t iTimestamp);
+
+	/*! \brief Completes the segment
+	 *  \param iEnd Input offset just past it
+	 */
+	void Finish(off_t iEnd);
+
+	off_t GetStart() const { return m_Start; }
+	off_t GetEnd() const { return m_End; }
+
+	//! \brief Time of the first and last record, 0 if unknown
+	uint64_t GetFirstTime() const { return m_FirstTime; }
+	uint64_t GetLastTime() const { return m_LastTime; }
+
+	//! \brief Were there packets which could not be decoded?
+	bool HasUnknown() const { return m_Unknown; }
+
+	virtual bool MayContain(const char* sPacket, const char* sSubpacket) const;
+	virtual bool MayContainValue(const ProtocolDefinition::Annotation& oAnnotation, uint32_t iValue) const;
+
+	//! \brief Are values of fields with the given annotation kept?
+	static bool IsIndexed(const ProtocolDefinition::Annotation& oAnnotation);
+
+protected:
+	//! \brief Number of bits used for names
+	static const int s_NameBits = 16384;
+
+	//! \brief Number of bits set per name
+	static const int s_NameHashes = 2;
+
+	//! \brief Number of bits set per value
+	static const int s_ValueHashes = 4;
+
+	//! \brief Minimum number of bits per distinct value
+	static const int s_BitsPerValue = 16;
+
+	//! \brief Tests or sets the bits of a key in a filter; the hash halves are combined (double hashing)
+	static bool TestBits(const std::vector<uint8_t>& oBits, uint64_t iHash, int iNumHashes);
+	static void SetBits(std::vector<uint8_t>& oBits, uint64_t iHash, int iNumHashes);
+
+	off_t m_Start, m_End;
+	uint64_t m_FirstTime, m_LastTime;
+	bool m_Unknown;
+
+	std::vector<uint8_t> m_Names;
+	std::vector<uint8_t> m_Values;
+
+	//! \brief Values added so far, until Finish() builds m_Values
+	std::vector<uint32_t> m_PendingValues;
+};
+
+/*! \brief Sidecar file summarizing consecutive segments of an input
+ *
+ *  Segments are appended as they are completed; like checkpoints, every
+ *  segment carries a checksum and one that was only partially written is
+ *  ignored.
+ */
+class SegmentIndex {
+public:
+	SegmentIndex();
+
+	/*! \brief Opens the file, creating it if needed, and loads all segments
+	 *  \param sPath Path to use
+	 *  \returns true on success
+	 */
+	bool Open(const char* sPath);
+
+	//! \brief Retrieves the segments, in input order
+	const std::vector<Segment>& GetSegments() const { return m_Segments; }
+
+	//! \brief Retrieves the offset up to which the input is covered
+	off_t GetEnd() const { return m_Segments.empty() ? 0 : m_Segments.back().GetEnd(); }
+
+	/*! \brief Discards segments ending after an offset
+	 *  \param iOffset Offset to keep segments up to
+	 *
+	 *  Nothing is removed from the file until the next Append().
+	 */
+	void Truncate(off_t iOffset);
+
+	/*! \brief Appends a completed segment
+	 *  \param oSegment Segment to store; it must start where the index ends
+	 *  \returns true on success
+	 */
+	bool Append(const Segment& oSegment);
+
+protected:
+	struct Header;
+
+	//! \brief Reads the segment at the current position
+	bool ReadSegment(Segment& oSegment);
+
+	SegmentFile m_File;
+
+	//! \brief Offset of every segment within the file, and the end of the last
+	std::vector<off_t> m_Offsets;
+
+	std::vector<Segment> m_Segments;
+
+	SegmentIndex(const SegmentIndex&) = delete;
+	SegmentIndex& operator=(const SegmentIndex&) = delete;
+};
+
+#endif /* __SEGMENTINDEX_H__ */
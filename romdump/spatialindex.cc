@@ -0,0 +1,270 @@
+/*
+ * Runes of Magic protocol analysis - index of object positions
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <math.h>
+#include <algorithm>
+#include "spatialindex.h"
+
+#define SPATIAL_FILE_MAGIC 0x474d6f52 /* RoMG */
+#define SPATIAL_FILE_VERSION 1
+#define SPATIAL_SEGMENT_MAGIC 0x44495247 /* GRID */
+
+//! \brief Precedes the contents of every segment
+struct SpatialIndex::Header {
+	uint32_t h_magic;
+	//! \brief Checksum of the cell table
+	uint32_t h_hash;
+	uint64_t h_start;
+	uint64_t h_end;
+	uint64_t h_first_time;
+	uint64_t h_last_time;
+	uint32_t h_num_cells;
+	uint32_t h_num_observations;
+};
+
+//! \brief Entry of the cell table, which is sorted by zone, x and z
+struct SpatialIndex::Cell {
+	uint32_t c_zone;
+	int32_t c_x;
+	int32_t c_z;
+	uint32_t c_first_observation;
+	uint32_t c_num_observations;
+	//! \brief Checksum of the observations
+	uint32_t c_hash;
+};
+
+SpatialSegment::SpatialSegment()
+	: m_Start(0), m_End(0), m_Record(0), m_Time(0)
+{
+}
+
+void
+SpatialSegment::Clear(off_t iStart)
+{
+	m_Start = iStart;
+	m_End = iStart;
+	m_Entries.clear();
+}
+
+void
+SpatialSegment::ObjectMoved(uint32_t iZone, uint32_t iObjectId, float fX, float fY, float fZ)
+{
+	// Garbage can't be near anything, so there's no point in keeping it
+	if (!isfinite(fX) || !isfinite(fY) || !isfinite(fZ))
+		return;
+
+	Entry oEntry;
+	oEntry.m_Zone = iZone;
+	oEntry.m_X = SpatialIndex::GetCell(fX);
+	oEntry.m_Z = SpatialIndex::GetCell(fZ);
+	oEntry.m_Observation.o_record = m_Record;
+	oEntry.m_Observation.o_time = m_Time;
+	oEntry.m_Observation.o_object = iObjectId;
+	oEntry.m_Observation.o_x = fX;
+	oEntry.m_Observation.o_y = fY;
+	oEntry.m_Observation.o_z = fZ;
+	m_Entries.push_back(oEntry);
+}
+
+SpatialIndex::SpatialIndex()
+	: m_FileEnd(0)
+{
+}
+
+int32_t
+SpatialIndex::GetCell(float fCoord)
+{
+	double fCell = floor((double)fCoord / s_CellSize);
+	if (fCell < INT32_MIN)
+		return INT32_MIN;
+	if (fCell > INT32_MAX)
+		return INT32_MAX;
+	return (int32_t)fCell;
+}
+
+bool
+SpatialIndex::Open(const char* sPath)
+{
+	if (!m_File.Open(sPath, SPATIAL_FILE_MAGIC, SPATIAL_FILE_VERSION, "spatial index"))
+		return false;
+
+	// As with the term index, checksums are only verified when searching
+	off_t iFileSize = m_File.GetSize();
+	if (iFileSize < 0)
+		return false;
+	m_Blocks.clear();
+	m_FileEnd = m_File.GetStart();
+	FILE* pFile = m_File.GetFile();
+	Header oHeader;
+	while (fseeko(pFile, m_FileEnd, SEEK_SET) == 0 && fread(&oHeader, sizeof(oHeader), 1, pFile) == 1) {
+		off_t iSize = sizeof(oHeader) + (off_t)oHeader.h_num_cells * sizeof(Cell) + (off_t)oHeader.h_num_observations * sizeof(SpatialObservation);
+		if (oHeader.h_magic != SPATIAL_SEGMENT_MAGIC || (off_t)oHeader.h_start != GetEnd() || oHeader.h_end < oHeader.h_start || m_FileEnd + iSize > iFileSize)
+			break;
+		Block oBlock;
+		oBlock.m_Start = oHeader.h_start;
+		oBlock.m_End = oHeader.h_end;
+		oBlock.m_Offset = m_FileEnd;
+		oBlock.m_FirstTime = oHeader.h_first_time;
+		oBlock.m_LastTime = oHeader.h_last_time;
+		m_Blocks.push_back(oBlock);
+		m_FileEnd += iSize;
+	}
+	return true;
+}
+
+void
+SpatialIndex::Truncate(off_t iOffset)
+{
+	while (!m_Blocks.empty() && m_Blocks.back().m_End > iOffset) {
+		m_FileEnd = m_Blocks.back().m_Offset;
+		m_Blocks.pop_back();
+	}
+}
+
+bool
+SpatialIndex::Append(const SpatialSegment& oSegment)
+{
+	// Group by cell; a stable sort keeps the observations of every cell in input order
+	std::vector<SpatialSegment::Entry> oEntries(oSegment.m_Entries);
+	std::stable_sort(oEntries.begin(), oEntries.end(), [](const SpatialSegment::Entry& a, const SpatialSegment::Entry& b) {
+		if (a.m_Zone != b.m_Zone)
+			return a.m_Zone < b.m_Zone;
+		if (a.m_X != b.m_X)
+			return a.m_X < b.m_X;
+		return a.m_Z < b.m_Z;
+	});
+
+	std::vector<Cell> oCells;
+	std::vector<SpatialObservation> oObservations;
+	uint64_t iFirstTime = 0, iLastTime = 0;
+	for (auto it = oEntries.begin(); it != oEntries.end(); it++) {
+		if (oCells.empty() || oCells.back().c_zone != it->m_Zone || oCells.back().c_x != it->m_X || oCells.back().c_z != it->m_Z) {
+			Cell oCell;
+			oCell.c_zone = it->m_Zone;
+			oCell.c_x = it->m_X;
+			oCell.c_z = it->m_Z;
+			oCell.c_first_observation = oObservations.size();
+			oCell.c_num_observations = 0;
+			oCell.c_hash = 0;
+			oCells.push_back(oCell);
+		}
+		oCells.back().c_num_observations++;
+		oObservations.push_back(it->m_Observation);
+
+		uint64_t iTime = it->m_Observation.o_time;
+		if (iTime != 0 && (iFirstTime == 0 || iTime < iFirstTime))
+			iFirstTime = iTime;
+		if (iTime > iLastTime)
+			iLastTime = iTime;
+	}
+	for (auto it = oCells.begin(); it != oCells.end(); it++) {
+		SegmentFile::Part oCell = { &oObservations[it->c_first_observation], it->c_num_observations * sizeof(SpatialObservation) };
+		it->c_hash = SegmentFile::Hash(&oCell, 1);
+	}
+
+	SegmentFile::Part oParts[] = {
+		{ oCells.data(), oCells.size() * sizeof(Cell) },
+		{ oObservations.data(), oObservations.size() * sizeof(SpatialObservation) }
+	};
+
+	// The observations are covered by the checksums of their cells
+	Header oHeader;
+	oHeader.h_magic = SPATIAL_SEGMENT_MAGIC;
+	oHeader.h_hash = SegmentFile::Hash(oParts, 1);
+	oHeader.h_start = oSegment.GetStart();
+	oHeader.h_end = oSegment.GetEnd();
+	oHeader.h_first_time = iFirstTime;
+	oHeader.h_last_time = iLastTime;
+	oHeader.h_num_cells = oCells.size();
+	oHeader.h_num_observations = oObservations.size();
+	if (!m_File.Append(m_FileEnd, &oHeader, sizeof(oHeader), oParts, 2))
+		return false;
+
+	Block oBlock;
+	oBlock.m_Start = oSegment.GetStart();
+	oBlock.m_End = oSegment.GetEnd();
+	oBlock.m_Offset = m_FileEnd;
+	oBlock.m_FirstTime = iFirstTime;
+	oBlock.m_LastTime = iLastTime;
+	m_Blocks.push_back(oBlock);
+	m_FileEnd += sizeof(oHeader) + oCells.size() * sizeof(Cell) + oObservations.size() * sizeof(SpatialObservation);
+	return true;
+}
+
+bool
+SpatialIndex::Search(int iBlock, const SpatialQuery& oQuery, std::vector<SpatialObservation>& oHits)
+{
+	oHits.clear();
+
+	// Observations without a time never fall within a window
+	const Block& oBlock = m_Blocks[iBlock];
+	if (oQuery.m_To != 0 && (oBlock.m_FirstTime == 0 || oBlock.m_FirstTime > oQuery.m_To || oBlock.m_LastTime < oQuery.m_From))
+		return true;
+
+	FILE* pFile = m_File.GetFile();
+	Header oHeader;
+	fseeko(pFile, oBlock.m_Offset, SEEK_SET);
+	if (fread(&oHeader, sizeof(oHeader), 1, pFile) != 1)
+		return false;
+	std::vector<Cell> oTable(oHeader.h_num_cells);
+	if (!oTable.empty() && fread(&oTable[0], oTable.size() * sizeof(Cell), 1, pFile) != 1)
+		return false;
+	SegmentFile::Part oTablePart = { oTable.data(), oTable.size() * sizeof(Cell) };
+	if (SegmentFile::Hash(&oTablePart, 1) != oHeader.h_hash)
+		return false;
+
+	/*
+	 * The cells within reach form a rectangle; those of a single x are
+	 * adjacent in the table, so we walk from the first one that may be of
+	 * interest and skip the ones beyond the z range.
+	 */
+	int32_t iMinX = GetCell(oQuery.m_X - oQuery.m_Radius), iMaxX = GetCell(oQuery.m_X + oQuery.m_Radius);
+	int32_t iMinZ = GetCell(oQuery.m_Z - oQuery.m_Radius), iMaxZ = GetCell(oQuery.m_Z + oQuery.m_Radius);
+	auto it = std::lower_bound(oTable.begin(), oTable.end(), oQuery, [&](const Cell& oCell, const SpatialQuery& q) {
+		if (oCell.c_zone != q.m_Zone)
+			return oCell.c_zone < q.m_Zone;
+		return oCell.c_x < iMinX;
+	});
+	off_t iObservations = oBlock.m_Offset + sizeof(oHeader) + oTable.size() * sizeof(Cell);
+	double fRadius = (double)oQuery.m_Radius * oQuery.m_Radius;
+	std::vector<SpatialObservation> oCell;
+	for (; it != oTable.end() && it->c_zone == oQuery.m_Zone && it->c_x <= iMaxX; it++) {
+		if (it->c_z < iMinZ || it->c_z > iMaxZ)
+			continue;
+		if ((uint64_t)it->c_first_observation + it->c_num_observations > oHeader.h_num_observations)
+			return false;
+		oCell.resize(it->c_num_observations);
+		fseeko(pFile, iObservations + (off_t)it->c_first_observation * sizeof(SpatialObservation), SEEK_SET);
+		if (!oCell.empty() && fread(&oCell[0], oCell.size() * sizeof(SpatialObservation), 1, pFile) != 1)
+			return false;
+		SegmentFile::Part oCellPart = { oCell.data(), oCell.size() * sizeof(SpatialObservation) };
+		if (SegmentFile::Hash(&oCellPart, 1) != it->c_hash)
+			return false;
+
+		for (auto itObs = oCell.begin(); itObs != oCell.end(); itObs++) {
+			if (oQuery.m_To != 0 && (itObs->o_time == 0 || itObs->o_time < oQuery.m_From || itObs->o_time > oQuery.m_To))
+				continue;
+			double dx = (double)itObs->o_x - oQuery.m_X;
+			double dy = (double)itObs->o_y - oQuery.m_Y;
+			double dz = (double)itObs->o_z - oQuery.m_Z;
+			if (dx * dx + dy * dy + dz * dz <= fRadius)
+				oHits.push_back(*itObs);
+		}
+	}
+	return true;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,169 @@
+/*
+ * Runes of Magic protocol analysis - index of object positions
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SPATIALINDEX_H__
+#define __SPATIALINDEX_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <vector>
+#include "segmentfile.h"
+#include "worldstate.h"
+
+//! \brief Position of an object at some point, as stored
+struct SpatialObservation {
+	//! \brief Offset of the record which completed the packet
+	uint64_t o_record;
+	//! \brief Time of the record, in microseconds since the epoch; 0 if unknown
+	uint64_t o_time;
+	uint32_t o_object;
+	float o_x, o_y, o_z;
+};
+
+//! \brief Objects within a distance of a point, optionally during some time
+struct SpatialQuery {
+	uint32_t m_Zone;
+	float m_X, m_Y, m_Z;
+	float m_Radius;
+	//! \brief Time window in microseconds since the epoch, inclusive; m_To is 0 if there is none
+	uint64_t m_From, m_To;
+};
+
+//! \brief Positions of objects within a segment of the input
+class SpatialSegment : public WorldState::XListener {
+	friend class SpatialIndex;
+public:
+	SpatialSegment();
+
+	/*! \brief Starts a new, empty segment
+	 *  \param iStart Input offset at which it starts
+	 */
+	void Clear(off_t iStart);
+
+	/*! \brief Sets the packet whose positions are reported next
+	 *  \param iRecord Offset of the record which completed the packet
+	 *  \param iTime Time of the record, in microseconds since the epoch
+	 *
+	 *  Packets must be set in input order.
+	 */
+	void SetPacket(off_t iRecord, uint64_t iTime) { m_Record = iRecord; m_Time = iTime; }
+
+	virtual void ObjectMoved(uint32_t iZone, uint32_t iObjectId, float fX, float fY, float fZ);
+
+	/*! \brief Completes the segment
+	 *  \param iEnd Input offset just past it
+	 */
+	void Finish(off_t iEnd) { m_End = iEnd; }
+
+	off_t GetStart() const { return m_Start; }
+	off_t GetEnd() const { return m_End; }
+
+protected:
+	//! \brief Observation along with the grid cell it is in
+	struct Entry {
+		uint32_t m_Zone;
+		int32_t m_X, m_Z;
+		SpatialObservation m_Observation;
+	};
+
+	off_t m_Start, m_End;
+	off_t m_Record;
+	uint64_t m_Time;
+
+	//! \brief Observations in input order
+	std::vector<Entry> m_Entries;
+};
+
+/*! \brief Sidecar file with the positions of objects in every segment of an input
+ *
+ *  Every zone is divided in square cells along the ground (x and z), each
+ *  s_CellSize units wide. Segments are appended as they are completed; each
+ *  holds a table of the cells in use, sorted by zone and location, and the
+ *  observations grouped by cell, in input order. Only the headers are read
+ *  up front; a search reads the cell table and just the cells near the
+ *  point of interest.
+ */
+class SpatialIndex {
+public:
+	//! \brief Location of a segment within the file
+	struct Block {
+		off_t m_Start, m_End;
+		off_t m_Offset;
+		//! \brief Times of the first and last observations, 0 if there are none
+		uint64_t m_FirstTime, m_LastTime;
+	};
+
+	SpatialIndex();
+
+	/*! \brief Determines the grid cell of a coordinate
+	 *  \param fCoord X or z coordinate
+	 *  \returns Cell number; coordinates which are out of range end up in the outer cells
+	 */
+	static int32_t GetCell(float fCoord);
+
+	/*! \brief Opens the file, creating it if needed, and loads all segment headers
+	 *  \param sPath Path to use
+	 *  \returns true on success
+	 */
+	bool Open(const char* sPath);
+
+	//! \brief Retrieves the segments, in input order
+	const std::vector<Block>& GetBlocks() const { return m_Blocks; }
+
+	//! \brief Retrieves the offset up to which the input is covered
+	off_t GetEnd() const { return m_Blocks.empty() ? 0 : m_Blocks.back().m_End; }
+
+	/*! \brief Discards segments ending after an offset
+	 *  \param iOffset Offset to keep segments up to
+	 *
+	 *  Nothing is removed from the file until the next Append().
+	 */
+	void Truncate(off_t iOffset);
+
+	/*! \brief Appends a completed segment
+	 *  \param oSegment Segment to store; it must start where the index ends
+	 *  \returns true on success
+	 */
+	bool Append(const SpatialSegment& oSegment);
+
+	/*! \brief Finds the observations of a segment matching a query
+	 *  \param iBlock Segment to search
+	 *  \param oQuery What to look for
+	 *  \param oHits Receives the observations, grouped by cell
+	 *  \returns true on success, false if the segment cannot be read
+	 */
+	bool Search(int iBlock, const SpatialQuery& oQuery, std::vector<SpatialObservation>& oHits);
+
+	//! \brief Width of the grid cells
+	static const int s_CellSize = 128;
+
+protected:
+	struct Header;
+	struct Cell;
+
+	SegmentFile m_File;
+
+	//! \brief Offset just past the last segment within the file
+	off_t m_FileEnd;
+
+	std::vector<Block> m_Blocks;
+
+	SpatialIndex(const SpatialIndex&) = delete;
+	SpatialIndex& operator=(const SpatialIndex&) = delete;
+};
+
+#endif /* __SPATIALINDEX_H__ */
@@ -0,0 +1,108 @@
+/*
+ * Runes of Magic protocol analysis - interned strings
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stringpool.h"
+#include <string.h>
+
+StringPool::StringPool()
+	: m_NumStrings(0), m_Free(NULL), m_FreeLeft(0)
+{
+	Slot oSlot = { 0, NULL };
+	m_Slots.resize(1024, oSlot);
+}
+
+StringPool::~StringPool()
+{
+	for (auto it = m_Chunks.begin(); it != m_Chunks.end(); it++)
+		delete[] *it;
+}
+
+const char*
+StringPool::Intern(const char* sString)
+{
+	// FNV-1a
+	uint32_t iHash = 2166136261u;
+	int iLength = 0;
+	for (/* nothing */; sString[iLength] != '\0'; iLength++)
+		iHash = (iHash ^ (uint8_t)sString[iLength]) * 16777619u;
+
+	uint32_t iMask = m_Slots.size() - 1;
+	uint32_t iSlot = iHash & iMask;
+	while (m_Slots[iSlot].m_String != NULL) {
+		const Slot& oSlot = m_Slots[iSlot];
+		if (oSlot.m_Hash == iHash && strcmp(oSlot.m_String, sString) == 0)
+			return oSlot.m_String;
+		iSlot = (iSlot + 1) & iMask;
+	}
+
+	// Keep the load factor at most 1/2
+	if ((m_NumStrings + 1) * 2 > (int)m_Slots.size()) {
+		Grow();
+		iMask = m_Slots.size() - 1;
+		iSlot = iHash & iMask;
+		while (m_Slots[iSlot].m_String != NULL)
+			iSlot = (iSlot + 1) & iMask;
+	}
+
+	m_Slots[iSlot].m_Hash = iHash;
+	m_Slots[iSlot].m_String = Store(sString, iLength);
+	m_NumStrings++;
+	return m_Slots[iSlot].m_String;
+}
+
+const char*
+StringPool::Store(const char* sString, int iLength)
+{
+	int iSize = iLength + 1;
+	if (iSize > m_FreeLeft) {
+		// Oversized strings get a chunk of their own, so the current one can still be filled
+		if (iSize > s_ChunkSize / 4) {
+			char* pChunk = new char[iSize];
+			m_Chunks.push_back(pChunk);
+			memcpy(pChunk, sString, iSize);
+			return pChunk;
+		}
+		m_Free = new char[s_ChunkSize];
+		m_FreeLeft = s_ChunkSize;
+		m_Chunks.push_back(m_Free);
+	}
+
+	char* pString = m_Free;
+	memcpy(pString, sString, iSize);
+	m_Free += iSize;
+	m_FreeLeft -= iSize;
+	return pString;
+}
+
+void
+StringPool::Grow()
+{
+	Slot oEmpty = { 0, NULL };
+	std::vector<Slot> oSlots(m_Slots.size() * 2, oEmpty);
+	m_Slots.swap(oSlots);
+
+	uint32_t iMask = m_Slots.size() - 1;
+	for (auto it = oSlots.begin(); it != oSlots.end(); it++) {
+		if (it->m_String == NULL)
+			continue;
+		uint32_t iSlot = it->m_Hash & iMask;
+		while (m_Slots[iSlot].m_String != NULL)
+			iSlot = (iSlot + 1) & iMask;
+		m_Slots[iSlot] = *it;
+	}
+}
+
+/* vim:set ts=2 sw=2: */
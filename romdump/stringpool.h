@@ -0,0 +1,78 @@
+/*
+ * Runes of Magic protocol analysis - interned strings
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __STRINGPOOL_H__
+#define __STRINGPOOL_H__
+
+#include <stdint.h>
+#include <vector>
+
+/*! \brief Keeps a single copy of every distinct string
+ *
+ *  Strings are stored back-to-back in large chunks and are never freed
+ *  until the pool is destroyed, so the pointers handed out remain valid
+ *  and equal strings yield equal pointers.
+ */
+class StringPool {
+public:
+	StringPool();
+	~StringPool();
+
+	/*! \brief Retrieves the pooled copy of a string
+	 *  \param sString String to look up, \0-terminated
+	 *  \returns Pooled copy, valid for the lifetime of the pool
+	 */
+	const char* Intern(const char* sString);
+
+	//! \brief Retrieves the number of distinct strings
+	int GetSize() const { return m_NumStrings; }
+
+protected:
+	//! \brief Size of a chunk of string storage, in bytes
+	static const int s_ChunkSize = 64 * 1024;
+
+	//! \brief Hash table slot
+	struct Slot {
+		uint32_t m_Hash;
+
+		//! \brief Pooled string, NULL if the slot is free
+		const char* m_String;
+	};
+
+	//! \brief Copies a string into the pool storage
+	const char* Store(const char* sString, int iLength);
+
+	//! \brief Doubles the table size
+	void Grow();
+
+	//! \brief Hash table; the size is a power of two
+	std::vector<Slot> m_Slots;
+
+	//! \brief Number of strings stored
+	int m_NumStrings;
+
+	//! \brief All chunks of string storage
+	std::vector<char*> m_Chunks;
+
+	//! \brief Free space in the current chunk
+	char* m_Free;
+	int m_FreeLeft;
+
+	StringPool(const StringPool&) = delete;
+	StringPool& operator=(const StringPool&) = delete;
+};
+
+#endif /* __STRINGPOOL_H__ */
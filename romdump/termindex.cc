@@ -0,0 +1,281 @@
+/*
+ * Runes of Magic protocol analysis - full-text index of string fields
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <ctype.h>
+#include <algorithm>
+#include "termindex.h"
+
+#define TERM_FILE_MAGIC 0x544d6f52 /* RoMT */
+#define TERM_FILE_VERSION 1
+#define TERM_SEGMENT_MAGIC 0x4d524554 /* TERM */
+
+//! \brief Precedes the contents of every segment
+struct TermIndex::Header {
+	uint32_t h_magic;
+	//! \brief Checksum of everything following the header
+	uint32_t h_hash;
+	uint64_t h_start;
+	uint64_t h_end;
+	uint32_t h_num_terms;
+	uint32_t h_num_postings;
+	uint32_t h_text_bytes;
+	uint32_t h_reserved;
+};
+
+//! \brief Entry of the term table, which is sorted by text
+struct TermIndex::Term {
+	uint32_t t_text;
+	uint32_t t_length;
+	uint32_t t_first_posting;
+	uint32_t t_num_postings;
+};
+
+TermSegment::TermSegment()
+	: m_Start(0), m_End(0)
+{
+}
+
+void
+TermSegment::Clear(off_t iStart)
+{
+	m_Start = iStart;
+	m_End = iStart;
+	m_Terms.clear();
+}
+
+void
+TermSegment::Add(const char* pData, size_t iLength, off_t iRecord, int iSequence)
+{
+	std::vector<std::string> oTerms;
+	TermIndex::Tokenize(pData, iLength, oTerms);
+	for (auto it = oTerms.begin(); it != oTerms.end(); it++) {
+		std::vector<TermPosting>& oPostings = m_Terms[*it];
+		if (!oPostings.empty() && oPostings.back().p_record == (uint64_t)iRecord)
+			continue;
+		TermPosting oPosting;
+		oPosting.p_record = iRecord;
+		oPosting.p_sequence = iSequence;
+		oPosting.p_reserved = 0;
+		oPostings.push_back(oPosting);
+	}
+}
+
+TermIndex::TermIndex()
+	: m_FileEnd(0)
+{
+}
+
+void
+TermIndex::Tokenize(const char* pData, size_t iLength, std::vector<std::string>& oTerms)
+{
+	std::string sTerm;
+	for (size_t n = 0; ; n++) {
+		uint8_t ch = n < iLength ? pData[n] : '\0';
+		if (isalnum(ch) || ch >= 0x80) {
+			if (sTerm.size() < s_MaxTermLength)
+				sTerm += tolower(ch);
+			continue;
+		}
+		if (!sTerm.empty())
+			oTerms.push_back(sTerm);
+		if (ch == '\0')
+			break;
+		sTerm.clear();
+	}
+}
+
+bool
+TermIndex::Open(const char* sPath)
+{
+	if (!m_File.Open(sPath, TERM_FILE_MAGIC, TERM_FILE_VERSION, "term index"))
+		return false;
+
+	/*
+	 * Segments must follow each other and be complete; checksums are only
+	 * verified when a segment is searched, as reading everything would take
+	 * about as long as reading the input.
+	 */
+	off_t iFileSize = m_File.GetSize();
+	if (iFileSize < 0)
+		return false;
+	m_Blocks.clear();
+	m_FileEnd = m_File.GetStart();
+	FILE* pFile = m_File.GetFile();
+	Header oHeader;
+	while (fseeko(pFile, m_FileEnd, SEEK_SET) == 0 && fread(&oHeader, sizeof(oHeader), 1, pFile) == 1) {
+		off_t iSize = sizeof(oHeader) + (off_t)oHeader.h_num_terms * sizeof(Term) + (off_t)oHeader.h_num_postings * sizeof(TermPosting) + oHeader.h_text_bytes;
+		if (oHeader.h_magic != TERM_SEGMENT_MAGIC || (off_t)oHeader.h_start != GetEnd() || oHeader.h_end < oHeader.h_start || m_FileEnd + iSize > iFileSize)
+			break;
+		Block oBlock;
+		oBlock.m_Start = oHeader.h_start;
+		oBlock.m_End = oHeader.h_end;
+		oBlock.m_Offset = m_FileEnd;
+		m_Blocks.push_back(oBlock);
+		m_FileEnd += iSize;
+	}
+	return true;
+}
+
+void
+TermIndex::Truncate(off_t iOffset)
+{
+	while (!m_Blocks.empty() && m_Blocks.back().m_End > iOffset) {
+		m_FileEnd = m_Blocks.back().m_Offset;
+		m_Blocks.pop_back();
+	}
+}
+
+bool
+TermIndex::Append(const TermSegment& oSegment)
+{
+	// The map is sorted already, which is the order the table must be in
+	std::vector<Term> oTerms;
+	std::vector<TermPosting> oPostings;
+	std::string sText;
+	for (auto it = oSegment.m_Terms.begin(); it != oSegment.m_Terms.end(); it++) {
+		Term oTerm;
+		oTerm.t_text = sText.size();
+		oTerm.t_length = it->first.size();
+		oTerm.t_first_posting = oPostings.size();
+		oTerm.t_num_postings = it->second.size();
+		oTerms.push_back(oTerm);
+		sText += it->first;
+		oPostings.insert(oPostings.end(), it->second.begin(), it->second.end());
+	}
+
+	SegmentFile::Part oParts[] = {
+		{ oTerms.data(), oTerms.size() * sizeof(Term) },
+		{ oPostings.data(), oPostings.size() * sizeof(TermPosting) },
+		{ sText.data(), sText.size() }
+	};
+
+	Header oHeader;
+	oHeader.h_magic = TERM_SEGMENT_MAGIC;
+	oHeader.h_hash = SegmentFile::Hash(oParts, 3);
+	oHeader.h_start = oSegment.GetStart();
+	oHeader.h_end = oSegment.GetEnd();
+	oHeader.h_num_terms = oTerms.size();
+	oHeader.h_num_postings = oPostings.size();
+	oHeader.h_text_bytes = sText.size();
+	oHeader.h_reserved = 0;
+	if (!m_File.Append(m_FileEnd, &oHeader, sizeof(oHeader), oParts, 3))
+		return false;
+
+	Block oBlock;
+	oBlock.m_Start = oSegment.GetStart();
+	oBlock.m_End = oSegment.GetEnd();
+	oBlock.m_Offset = m_FileEnd;
+	m_Blocks.push_back(oBlock);
+	m_FileEnd += sizeof(oHeader) + oTerms.size() * sizeof(Term) + oPostings.size() * sizeof(TermPosting) + sText.size();
+	return true;
+}
+
+bool
+TermIndex::Search(int iBlock, const std::vector<std::string>& oTerms, std::vector<TermPosting>& oHits)
+{
+	oHits.clear();
+
+	FILE* pFile = m_File.GetFile();
+	Header oHeader;
+	fseeko(pFile, m_Blocks[iBlock].m_Offset, SEEK_SET);
+	if (fread(&oHeader, sizeof(oHeader), 1, pFile) != 1)
+		return false;
+	std::vector<Term> oTable(oHeader.h_num_terms);
+	std::vector<TermPosting> oPostings(oHeader.h_num_postings);
+	std::string sText(oHeader.h_text_bytes, '\0');
+	if ((!oTable.empty() && fread(&oTable[0], oTable.size() * sizeof(Term), 1, pFile) != 1) ||
+	    (!oPostings.empty() && fread(&oPostings[0], oPostings.size() * sizeof(TermPosting), 1, pFile) != 1) ||
+	    (!sText.empty() && fread(&sText[0], sText.size(), 1, pFile) != 1))
+		return false;
+	SegmentFile::Part oParts[] = {
+		{ oTable.data(), oTable.size() * sizeof(Term) },
+		{ oPostings.data(), oPostings.size() * sizeof(TermPosting) },
+		{ sText.data(), sText.size() }
+	};
+	if (SegmentFile::Hash(oParts, 3) != oHeader.h_hash)
+		return false;
+
+	for (auto itTerm = oTerms.begin(); itTerm != oTerms.end(); itTerm++) {
+		auto itFound = std::lower_bound(oTable.begin(), oTable.end(), *itTerm, [&](const Term& oTerm, const std::string& sTerm) {
+			return sText.compare(oTerm.t_text, oTerm.t_length, sTerm) < 0;
+		});
+		if (itFound == oTable.end() || sText.compare(itFound->t_text, itFound->t_length, *itTerm) != 0 ||
+		    itFound->t_first_posting + itFound->t_num_postings > oPostings.size()) {
+			oHits.clear();
+			return true;
+		}
+
+		// Both lists are in input order, so they can be merged
+		auto itFirst = oPostings.begin() + itFound->t_first_posting;
+		auto itLast = itFirst + itFound->t_num_postings;
+		if (itTerm == oTerms.begin()) {
+			oHits.assign(itFirst, itLast);
+			continue;
+		}
+		std::vector<TermPosting> oKept;
+		auto itHit = oHits.begin();
+		for (auto it = itFirst; it != itLast && itHit != oHits.end(); ) {
+			if (it->p_record < itHit->p_record)
+				it++;
+			else if (itHit->p_record < it->p_record)
+				itHit++;
+			else {
+				oKept.push_back(*itHit++);
+				it++;
+			}
+		}
+		oHits.swap(oKept);
+	}
+	return true;
+}
+
+TermSearch::TermSearch(TermIndex& oIndex, const std::vector<std::string>& oTerms)
+	: m_Index(oIndex), m_Terms(oTerms), m_Block(-1), m_Unreadable(false)
+{
+}
+
+bool
+TermSearch::FindNext(off_t iOffset, off_t& iStart, off_t& iEnd)
+{
+	const std::vector<TermIndex::Block>& oBlocks = m_Index.GetBlocks();
+	for (int n = 0; n < (int)oBlocks.size(); n++) {
+		if (oBlocks[n].m_End <= iOffset)
+			continue;
+		if (n != m_Block) {
+			m_Block = n;
+			m_Unreadable = !m_Index.Search(n, m_Terms, m_Hits);
+			if (m_Unreadable)
+				fprintf(stderr, "TermSearch::FindNext(): segment at %lld is damaged, searching it by hand\n", (long long)oBlocks[n].m_Start);
+		}
+		if (m_Unreadable) {
+			iStart = oBlocks[n].m_Start;
+			iEnd = oBlocks[n].m_End;
+			return true;
+		}
+
+		auto it = std::lower_bound(m_Hits.begin(), m_Hits.end(), (uint64_t)iOffset, [](const TermPosting& oPosting, uint64_t iRecord) {
+			return oPosting.p_record < iRecord;
+		});
+		if (it != m_Hits.end()) {
+			iStart = it->p_record;
+			iEnd = iStart + 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,180 @@
+/*
+ * Runes of Magic protocol analysis - full-text index of string fields
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __TERMINDEX_H__
+#define __TERMINDEX_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "segmentfile.h"
+
+//! \brief Occurrence of a term, as stored
+struct TermPosting {
+	//! \brief Offset of the record which completed the packet
+	uint64_t p_record;
+	//! \brief Sequence number of the packet, as shown
+	uint32_t p_sequence;
+	uint32_t p_reserved;
+};
+
+//! \brief Terms used within a segment of the input, along with where
+class TermSegment {
+	friend class TermIndex;
+public:
+	TermSegment();
+
+	/*! \brief Starts a new, empty segment
+	 *  \param iStart Input offset at which it starts
+	 */
+	void Clear(off_t iStart);
+
+	/*! \brief Adds the terms of a string
+	 *  \param pData String to add
+	 *  \param iLength Length of the string
+	 *  \param iRecord Offset of the record which completed the packet
+	 *  \param iSequence Sequence number of the packet
+	 *
+	 *  Packets must be added in input order.
+	 */
+	void Add(const char* pData, size_t iLength, off_t iRecord, int iSequence);
+
+	/*! \brief Completes the segment
+	 *  \param iEnd Input offset just past it
+	 */
+	void Finish(off_t iEnd) { m_End = iEnd; }
+
+	off_t GetStart() const { return m_Start; }
+	off_t GetEnd() const { return m_End; }
+
+protected:
+	off_t m_Start, m_End;
+
+	//! \brief Occurrences by term; each record is listed once per term
+	std::map<std::string, std::vector<TermPosting> > m_Terms;
+};
+
+/*! \brief Sidecar file with the terms of every segment of an input
+ *
+ *  Segments are appended as they are completed; each holds a sorted table
+ *  of its terms, all occurrences and the text of the terms. Only the
+ *  headers are read up front; the rest is read when searched.
+ */
+class TermIndex {
+public:
+	//! \brief Location of a segment within the file
+	struct Block {
+		off_t m_Start, m_End;
+		off_t m_Offset;
+	};
+
+	TermIndex();
+
+	/*! \brief Splits a string into terms
+	 *  \param pData String to split
+	 *  \param iLength Length of the string; it ends early at a '\0'
+	 *  \param oTerms Receives the terms, in order
+	 *
+	 *  Terms are runs of letters and digits, in lower case; any byte beyond
+	 *  ASCII counts as a letter, so UTF-8 text is kept together.
+	 */
+	static void Tokenize(const char* pData, size_t iLength, std::vector<std::string>& oTerms);
+
+	/*! \brief Opens the file, creating it if needed, and loads all segment headers
+	 *  \param sPath Path to use
+	 *  \returns true on success
+	 */
+	bool Open(const char* sPath);
+
+	//! \brief Retrieves the segments, in input order
+	const std::vector<Block>& GetBlocks() const { return m_Blocks; }
+
+	//! \brief Retrieves the offset up to which the input is covered
+	off_t GetEnd() const { return m_Blocks.empty() ? 0 : m_Blocks.back().m_End; }
+
+	/*! \brief Discards segments ending after an offset
+	 *  \param iOffset Offset to keep segments up to
+	 *
+	 *  Nothing is removed from the file until the next Append().
+	 */
+	void Truncate(off_t iOffset);
+
+	/*! \brief Appends a completed segment
+	 *  \param oSegment Segment to store; it must start where the index ends
+	 *  \returns true on success
+	 */
+	bool Append(const TermSegment& oSegment);
+
+	/*! \brief Finds the records of a segment holding all given terms
+	 *  \param iBlock Segment to search
+	 *  \param oTerms Terms to look for
+	 *  \param oHits Receives one occurrence per record, in input order
+	 *  \returns true on success, false if the segment cannot be read
+	 */
+	bool Search(int iBlock, const std::vector<std::string>& oTerms, std::vector<TermPosting>& oHits);
+
+	//! \brief Terms are cut off at this length
+	static const size_t s_MaxTermLength = 32;
+
+protected:
+	struct Header;
+	struct Term;
+
+	SegmentFile m_File;
+
+	//! \brief Offset just past the last segment within the file
+	off_t m_FileEnd;
+
+	std::vector<Block> m_Blocks;
+
+	TermIndex(const TermIndex&) = delete;
+	TermIndex& operator=(const TermIndex&) = delete;
+};
+
+/*! \brief Walks through the records holding all of a number of terms
+ *
+ *  The hits of the segment being walked through are kept, so the segments
+ *  are read one by one, as needed.
+ */
+class TermSearch {
+public:
+	TermSearch(TermIndex& oIndex, const std::vector<std::string>& oTerms);
+
+	/*! \brief Finds the next part of the input which may hold the terms
+	 *  \param iOffset Offset to search from
+	 *  \param iStart Receives the start of the part
+	 *  \param iEnd Receives the end of the part
+	 *  \returns false if there is none
+	 *
+	 *  This is normally a single record; a segment which cannot be read is
+	 *  returned as a whole.
+	 */
+	bool FindNext(off_t iOffset, off_t& iStart, off_t& iEnd);
+
+protected:
+	TermIndex& m_Index;
+	std::vector<std::string> m_Terms;
+
+	//! \brief Segment whose hits are in m_Hits, -1 if none
+	int m_Block;
+	std::vector<TermPosting> m_Hits;
+	bool m_Unreadable;
+};
+
+#endif /* __TERMINDEX_H__ */
@@ -15,18 +15,39 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "types.h"
-#include <stdio.h>
+
+static char*
+FormatDecimal(char* sOut, unsigned int iValue)
+{
+	char tmp[5];
+	int n = 0;
+	do {
+		tmp[n++] = '0' + iValue % 10;
+		iValue /= 10;
+	} while (iValue > 0);
+	while (n > 0)
+		*sOut++ = tmp[--n];
+	return sOut;
+}
+
+int
+IPv4Address::Format(char* sOut) const
+{
+	char* ptr = sOut;
+	ptr = FormatDecimal(ptr, m_Address >> 24); *ptr++ = '.';
+	ptr = FormatDecimal(ptr, (m_Address >> 16) & 0xff); *ptr++ = '.';
+	ptr = FormatDecimal(ptr, (m_Address >>  8) & 0xff); *ptr++ = '.';
+	ptr = FormatDecimal(ptr, m_Address & 0xff); *ptr++ = ':';
+	ptr = FormatDecimal(ptr, m_Port);
+	*ptr = '\0';
+	return ptr - sOut;
+}
 
 std::string
 IPv4Address::ToString() const
 {
-	char sTemp[64];
-	sprintf(sTemp, "%d.%d.%d.%d:%d",
-	 m_Address >> 24,
-	 (m_Address >> 16) & 0xff,
-	 (m_Address >>  8) & 0xff,
-	 m_Address & 0xff,
-	 m_Port);
+	char sTemp[s_MaxFormatLength];
+	Format(sTemp);
 	return sTemp;
 }
 
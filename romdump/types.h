@@ -46,8 +46,16 @@ public:
 		return m_Address < oRHS.m_Address;
 	}
 
+	//! \brief Maximum length of a formatted address, including \0
+	static const int s_MaxFormatLength = 22;
+
+	/*! \brief Formats the address as a.b.c.d:port
+	 *  \param sOut Output buffer, must hold s_MaxFormatLength bytes
+	 *  \returns Number of characters written, excluding the \0
+	 */
+	int Format(char* sOut) const;
+
 	std::string ToString() const;
-	
 
 protected:
 	ipv4_addr_t m_Address;
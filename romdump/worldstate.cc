@@ -0,0 +1,488 @@
+/*
+ * Runes of Magic protocol analysis - state of the game world
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "checkpoint.h"
+#include "outputbuffer.h"
+#include "protocolschema.h"
+#include "worldstate.h"
+
+//! \brief Annotation names, by event type
+static const char* const s_EventNames[] = {
+	"world_create",
+	"world_destroy",
+	"world_position",
+	"world_stats",
+	"world_max_stats",
+	"world_speed",
+	"world_died",
+	"world_revive",
+	"world_target",
+	"world_buff",
+	"world_zone"
+};
+
+const uint32_t WorldState::s_None;
+
+//! \brief Stores a column as a single value
+template<typename T> static void
+PutColumn(Checkpoint& oCheckpoint, const std::vector<T>& oColumn)
+{
+	oCheckpoint.PutBytes(oColumn.data(), oColumn.size() * sizeof(T));
+}
+
+//! \brief Restores a column stored by PutColumn()
+template<typename T> static bool
+GetColumn(Checkpoint& oCheckpoint, std::vector<T>& oColumn, size_t iCount)
+{
+	std::vector<char> oData;
+	if (!oCheckpoint.GetBytes(oData) || oData.size() != iCount * sizeof(T))
+		return false;
+	oColumn.resize(iCount);
+	if (iCount > 0)
+		memcpy(&oColumn[0], &oData[0], oData.size());
+	return true;
+}
+
+//! \brief Retrieves the first value of a field, unless the packet ended before it
+template<typename T, typename V> static bool
+GetFirst(const XDataAnnotation::BoundField<T>& oField, const ProtocolDefinition::Value* pValues, V& oResult)
+{
+	const ProtocolDefinition::Value& oValue = oField.GetValue(pValues);
+	if (oValue.m_Num <= 0)
+		return false;
+	oResult = oField.GetType().GetValue(oValue, 0);
+	return true;
+}
+
+bool
+WorldState::Event::Bind(const ProtocolDefinition::Struct& oStruct, Binding*& pBinding)
+{
+	if (!m_World.m_Track)
+		return false;
+
+	Fields* pFields = new Fields;
+	bool bOK = false;
+	switch(m_Type) {
+		case E_Create:
+			bOK = pFields->m_ObjectId.Bind(oStruct, "objectid") && pFields->m_Race.Bind(oStruct, "race") &&
+			      pFields->m_Level.Bind(oStruct, "level1") &&
+			      pFields->m_X.Bind(oStruct, "x") && pFields->m_Y.Bind(oStruct, "y") && pFields->m_Z.Bind(oStruct, "z") &&
+			      pFields->m_Angle.Bind(oStruct, "angle") && pFields->m_Speed.Bind(oStruct, "speed") &&
+			      pFields->m_HP.Bind(oStruct, "cur_hp") && pFields->m_MaxHP.Bind(oStruct, "max_hp") &&
+			      pFields->m_MP.Bind(oStruct, "cur_mp") && pFields->m_MaxMP.Bind(oStruct, "max_mp");
+			break;
+		case E_Destroy:
+		case E_Revive:
+			bOK = pFields->m_ObjectId.Bind(oStruct, "objectid");
+			break;
+		case E_Position:
+			bOK = pFields->m_ObjectId.Bind(oStruct, "objectid") &&
+			      pFields->m_X.Bind(oStruct, "x") && pFields->m_Y.Bind(oStruct, "y") && pFields->m_Z.Bind(oStruct, "z");
+			pFields->m_Angle.Bind(oStruct, "angle"); // not always present
+			break;
+		case E_Stats:
+			bOK = pFields->m_ObjectId.Bind(oStruct, "objectid") && pFields->m_HP.Bind(oStruct, "hp") && pFields->m_MP.Bind(oStruct, "mp");
+			break;
+		case E_MaxStats:
+			bOK = pFields->m_ObjectId.Bind(oStruct, "objectid") && pFields->m_MaxHP.Bind(oStruct, "max_hp") && pFields->m_MaxMP.Bind(oStruct, "max_mp");
+			break;
+		case E_Speed:
+			bOK = pFields->m_ObjectId.Bind(oStruct, "objectid") && pFields->m_Speed.Bind(oStruct, "speed");
+			break;
+		case E_Died:
+			bOK = pFields->m_ObjectId.Bind(oStruct, "target_id");
+			break;
+		case E_Target:
+			bOK = pFields->m_ObjectId.Bind(oStruct, "objectid") && pFields->m_Target.Bind(oStruct, "objectid_target");
+			break;
+		case E_Buff:
+			bOK = pFields->m_ObjectId.Bind(oStruct, "objectid1") && pFields->m_Buff.Bind(oStruct, "buffid") && pFields->m_Target.Bind(oStruct, "objectid2");
+			break;
+		case E_Zone:
+			bOK = pFields->m_Zone.Bind(oStruct, "zoneid");
+			break;
+		default:
+			break;
+	}
+	if (!bOK) {
+		fprintf(stderr, "warning: '%s' annotation in '%s' lacks fields it needs, skipping\n", s_EventNames[m_Type], oStruct.GetName());
+		delete pFields;
+		return false;
+	}
+	pBinding = pFields;
+	return true;
+}
+
+void
+WorldState::Event::Apply(const Binding* pBinding, const ProtocolDefinition::Value* pValues)
+{
+	// Fields the packet ended before are left alone
+	const Fields& oFields = *static_cast<const Fields*>(pBinding);
+	if (m_Type == E_Zone) {
+		GetFirst(oFields.m_Zone, pValues, m_World.m_Zone);
+		return;
+	}
+
+	uint32_t iObjectId;
+	if (!GetFirst(oFields.m_ObjectId, pValues, iObjectId))
+		return;
+	if (m_Type == E_Destroy) {
+		m_World.Remove(iObjectId);
+		return;
+	}
+
+	// Ids are reused, so nothing of a previous object may linger
+	WorldState& w = m_World;
+	if (m_Type == E_Create)
+		w.Remove(iObjectId);
+	int iRow = w.Touch(iObjectId);
+	switch(m_Type) {
+		case E_Create:
+			w.m_Flags[iRow] = s_FlagCreated;
+			GetFirst(oFields.m_Race, pValues, w.m_Race[iRow]);
+			GetFirst(oFields.m_Level, pValues, w.m_Level[iRow]);
+			GetFirst(oFields.m_Speed, pValues, w.m_Speed[iRow]);
+			GetFirst(oFields.m_HP, pValues, w.m_HP[iRow]);
+			GetFirst(oFields.m_MaxHP, pValues, w.m_MaxHP[iRow]);
+			GetFirst(oFields.m_MP, pValues, w.m_MP[iRow]);
+			GetFirst(oFields.m_MaxMP, pValues, w.m_MaxMP[iRow]);
+			// fall through
+		case E_Position: {
+			float fX, fY, fZ;
+			if (!GetFirst(oFields.m_X, pValues, fX) || !GetFirst(oFields.m_Y, pValues, fY) || !GetFirst(oFields.m_Z, pValues, fZ))
+				break;
+			w.m_Flags[iRow] |= s_FlagPlaced;
+			w.m_X[iRow] = fX;
+			w.m_Y[iRow] = fY;
+			w.m_Z[iRow] = fZ;
+			if (oFields.m_Angle.IsBound())
+				GetFirst(oFields.m_Angle, pValues, w.m_Angle[iRow]);
+			w.m_ObjectZone[iRow] = w.m_Zone;
+			if (w.m_Listener != NULL)
+				w.m_Listener->ObjectMoved(w.m_Zone, iObjectId, fX, fY, fZ);
+			break;
+		}
+		case E_Stats:
+			GetFirst(oFields.m_HP, pValues, w.m_HP[iRow]);
+			GetFirst(oFields.m_MP, pValues, w.m_MP[iRow]);
+			break;
+		case E_MaxStats:
+			GetFirst(oFields.m_MaxHP, pValues, w.m_MaxHP[iRow]);
+			GetFirst(oFields.m_MaxMP, pValues, w.m_MaxMP[iRow]);
+			break;
+		case E_Speed:
+			GetFirst(oFields.m_Speed, pValues, w.m_Speed[iRow]);
+			break;
+		case E_Died:
+			w.m_Flags[iRow] |= s_FlagDead;
+			break;
+		case E_Revive:
+			w.m_Flags[iRow] &= ~s_FlagDead;
+			break;
+		case E_Target:
+			GetFirst(oFields.m_Target, pValues, w.m_Target[iRow]);
+			break;
+		case E_Buff: {
+			uint32_t iBuffId, iSourceId;
+			if (GetFirst(oFields.m_Buff, pValues, iBuffId) && GetFirst(oFields.m_Target, pValues, iSourceId))
+				w.AddBuff(iRow, iBuffId, iSourceId);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+WorldState::WorldState()
+	: m_FreeBuff(s_None), m_Listener(NULL), m_Zone(0), m_Track(false)
+{
+	for (int n = 0; n < E_Count; n++)
+		m_Events.push_back(new Event(*this, (EventType)n));
+}
+
+WorldState::~WorldState()
+{
+	for (auto it = m_Events.begin(); it != m_Events.end(); it++)
+		delete *it;
+}
+
+void
+WorldState::Register(ProtocolSchema& oSchema, bool bTrack)
+{
+	m_Track = bTrack;
+	for (int n = 0; n < E_Count; n++)
+		oSchema.RegisterAnnotation(s_EventNames[n], *m_Events[n]);
+}
+
+void
+WorldState::Clear()
+{
+	m_Rows.Clear();
+	m_Ids.clear();
+	m_Flags.clear();
+	m_Race.clear();
+	m_Level.clear();
+	m_X.clear();
+	m_Y.clear();
+	m_Z.clear();
+	m_Angle.clear();
+	m_ObjectZone.clear();
+	m_Speed.clear();
+	m_HP.clear();
+	m_MaxHP.clear();
+	m_MP.clear();
+	m_MaxMP.clear();
+	m_Target.clear();
+	m_FirstBuff.clear();
+	m_BuffIds.clear();
+	m_BuffSources.clear();
+	m_NextBuff.clear();
+	m_FreeBuff = s_None;
+	m_Zone = 0;
+}
+
+int
+WorldState::FindObject(uint32_t iObjectId)
+{
+	const uint32_t* pRow = m_Rows.Find(iObjectId);
+	return pRow != NULL ? (int)*pRow : -1;
+}
+
+int
+WorldState::Touch(uint32_t iObjectId)
+{
+	const uint32_t* pRow = m_Rows.Find(iObjectId);
+	if (pRow != NULL)
+		return *pRow;
+
+	int iRow = m_Ids.size();
+	m_Rows.Set(iObjectId, iRow);
+	m_Ids.push_back(iObjectId);
+	m_Flags.push_back(0);
+	m_Race.push_back(0);
+	m_Level.push_back(0);
+	m_X.push_back(0.0f);
+	m_Y.push_back(0.0f);
+	m_Z.push_back(0.0f);
+	m_Angle.push_back(0.0f);
+	m_ObjectZone.push_back(0);
+	m_Speed.push_back(0.0f);
+	m_HP.push_back(0);
+	m_MaxHP.push_back(0);
+	m_MP.push_back(0);
+	m_MaxMP.push_back(0);
+	m_Target.push_back(0);
+	m_FirstBuff.push_back(s_None);
+	return iRow;
+}
+
+void
+WorldState::Remove(uint32_t iObjectId)
+{
+	const uint32_t* pRow = m_Rows.Find(iObjectId);
+	if (pRow == NULL)
+		return;
+	uint32_t iRow = *pRow;
+	m_Rows.Remove(iObjectId);
+
+	// Hand the buffs back
+	uint32_t iBuff = m_FirstBuff[iRow];
+	while (iBuff != s_None) {
+		uint32_t iNext = m_NextBuff[iBuff];
+		m_NextBuff[iBuff] = m_FreeBuff;
+		m_FreeBuff = iBuff;
+		iBuff = iNext;
+	}
+
+	// The last row fills the hole
+	uint32_t iLast = m_Ids.size() - 1;
+	if (iRow != iLast) {
+		m_Ids[iRow] = m_Ids[iLast];
+		m_Flags[iRow] = m_Flags[iLast];
+		m_Race[iRow] = m_Race[iLast];
+		m_Level[iRow] = m_Level[iLast];
+		m_X[iRow] = m_X[iLast];
+		m_Y[iRow] = m_Y[iLast];
+		m_Z[iRow] = m_Z[iLast];
+		m_Angle[iRow] = m_Angle[iLast];
+		m_ObjectZone[iRow] = m_ObjectZone[iLast];
+		m_Speed[iRow] = m_Speed[iLast];
+		m_HP[iRow] = m_HP[iLast];
+		m_MaxHP[iRow] = m_MaxHP[iLast];
+		m_MP[iRow] = m_MP[iLast];
+		m_MaxMP[iRow] = m_MaxMP[iLast];
+		m_Target[iRow] = m_Target[iLast];
+		m_FirstBuff[iRow] = m_FirstBuff[iLast];
+		m_Rows.Set(m_Ids[iRow], iRow);
+	}
+	m_Ids.pop_back();
+	m_Flags.pop_back();
+	m_Race.pop_back();
+	m_Level.pop_back();
+	m_X.pop_back();
+	m_Y.pop_back();
+	m_Z.pop_back();
+	m_Angle.pop_back();
+	m_ObjectZone.pop_back();
+	m_Speed.pop_back();
+	m_HP.pop_back();
+	m_MaxHP.pop_back();
+	m_MP.pop_back();
+	m_MaxMP.pop_back();
+	m_Target.pop_back();
+	m_FirstBuff.pop_back();
+}
+
+void
+WorldState::AddBuff(int iRow, uint32_t iBuffId, uint32_t iSourceId)
+{
+	for (uint32_t iBuff = m_FirstBuff[iRow]; iBuff != s_None; iBuff = m_NextBuff[iBuff])
+		if (m_BuffIds[iBuff] == iBuffId) {
+			m_BuffSources[iBuff] = iSourceId;
+			return;
+		}
+
+	uint32_t iBuff = m_FreeBuff;
+	if (iBuff != s_None) {
+		m_FreeBuff = m_NextBuff[iBuff];
+	} else {
+		iBuff = m_BuffIds.size();
+		m_BuffIds.push_back(0);
+		m_BuffSources.push_back(0);
+		m_NextBuff.push_back(s_None);
+	}
+	m_BuffIds[iBuff] = iBuffId;
+	m_BuffSources[iBuff] = iSourceId;
+	m_NextBuff[iBuff] = m_FirstBuff[iRow];
+	m_FirstBuff[iRow] = iBuff;
+}
+
+void
+WorldState::Save(Checkpoint& oCheckpoint) const
+{
+	oCheckpoint.PutUnsigned(m_Zone);
+	oCheckpoint.PutUnsigned(m_Ids.size());
+	PutColumn(oCheckpoint, m_Ids);
+	PutColumn(oCheckpoint, m_Flags);
+	PutColumn(oCheckpoint, m_Race);
+	PutColumn(oCheckpoint, m_Level);
+	PutColumn(oCheckpoint, m_X);
+	PutColumn(oCheckpoint, m_Y);
+	PutColumn(oCheckpoint, m_Z);
+	PutColumn(oCheckpoint, m_Angle);
+	PutColumn(oCheckpoint, m_ObjectZone);
+	PutColumn(oCheckpoint, m_Speed);
+	PutColumn(oCheckpoint, m_HP);
+	PutColumn(oCheckpoint, m_MaxHP);
+	PutColumn(oCheckpoint, m_MP);
+	PutColumn(oCheckpoint, m_MaxMP);
+	PutColumn(oCheckpoint, m_Target);
+
+	// Buffs are stored by object row, last added first, without the free ones
+	std::vector<uint32_t> oRows, oBuffIds, oSources;
+	for (uint32_t iRow = 0; iRow < m_Ids.size(); iRow++)
+		for (uint32_t iBuff = m_FirstBuff[iRow]; iBuff != s_None; iBuff = m_NextBuff[iBuff]) {
+			oRows.push_back(iRow);
+			oBuffIds.push_back(m_BuffIds[iBuff]);
+			oSources.push_back(m_BuffSources[iBuff]);
+		}
+	oCheckpoint.PutUnsigned(oRows.size());
+	PutColumn(oCheckpoint, oRows);
+	PutColumn(oCheckpoint, oBuffIds);
+	PutColumn(oCheckpoint, oSources);
+}
+
+bool
+WorldState::Restore(Checkpoint& oCheckpoint)
+{
+	Clear();
+	uint32_t iZone, iCount;
+	if (!oCheckpoint.GetUnsigned(iZone) ||
+	    !oCheckpoint.GetUnsigned(iCount) ||
+	    !GetColumn(oCheckpoint, m_Ids, iCount) ||
+	    !GetColumn(oCheckpoint, m_Flags, iCount) ||
+	    !GetColumn(oCheckpoint, m_Race, iCount) ||
+	    !GetColumn(oCheckpoint, m_Level, iCount) ||
+	    !GetColumn(oCheckpoint, m_X, iCount) ||
+	    !GetColumn(oCheckpoint, m_Y, iCount) ||
+	    !GetColumn(oCheckpoint, m_Z, iCount) ||
+	    !GetColumn(oCheckpoint, m_Angle, iCount) ||
+	    !GetColumn(oCheckpoint, m_ObjectZone, iCount) ||
+	    !GetColumn(oCheckpoint, m_Speed, iCount) ||
+	    !GetColumn(oCheckpoint, m_HP, iCount) ||
+	    !GetColumn(oCheckpoint, m_MaxHP, iCount) ||
+	    !GetColumn(oCheckpoint, m_MP, iCount) ||
+	    !GetColumn(oCheckpoint, m_MaxMP, iCount) ||
+	    !GetColumn(oCheckpoint, m_Target, iCount)) {
+		Clear();
+		return false;
+	}
+	m_Zone = iZone;
+	m_FirstBuff.assign(iCount, s_None);
+	for (uint32_t iRow = 0; iRow < iCount; iRow++)
+		m_Rows.Set(m_Ids[iRow], iRow);
+
+	uint32_t iNumBuffs;
+	std::vector<uint32_t> oRows, oBuffIds, oSources;
+	if (!oCheckpoint.GetUnsigned(iNumBuffs) ||
+	    !GetColumn(oCheckpoint, oRows, iNumBuffs) ||
+	    !GetColumn(oCheckpoint, oBuffIds, iNumBuffs) ||
+	    !GetColumn(oCheckpoint, oSources, iNumBuffs)) {
+		Clear();
+		return false;
+	}
+	// Adding puts them first, so this yields the original order
+	for (uint32_t n = iNumBuffs; n > 0; n--)
+		if (oRows[n - 1] < iCount)
+			AddBuff(oRows[n - 1], oBuffIds[n - 1], oSources[n - 1]);
+	return true;
+}
+
+void
+WorldState::Print(OutputBuffer& oOutput, XDataAnnotation& oObjectNames, XDataAnnotation& oSysNames) const
+{
+	std::vector<uint32_t> oRows(m_Ids.size());
+	for (uint32_t iRow = 0; iRow < oRows.size(); iRow++)
+		oRows[iRow] = iRow;
+	std::sort(oRows.begin(), oRows.end(), [this](uint32_t a, uint32_t b) { return m_Ids[a] < m_Ids[b]; });
+
+	oOutput.Printf("zone %u, %u objects\n", m_Zone, (unsigned int)oRows.size());
+	for (auto it = oRows.begin(); it != oRows.end(); it++) {
+		uint32_t iRow = *it;
+		oOutput.Printf("0x%x '%s'", m_Ids[iRow], oObjectNames.Lookup(m_Ids[iRow]));
+		if (m_Flags[iRow] & s_FlagCreated) {
+			const char* sRace = oSysNames.Lookup(m_Race[iRow]);
+			oOutput.Printf(" race 0x%x '%s' level %u", m_Race[iRow], sRace != NULL ? sRace : "?", m_Level[iRow]);
+		}
+		if (m_Flags[iRow] & s_FlagPlaced)
+			oOutput.Printf(" zone %u at %.2f %.2f %.2f angle %.2f", m_ObjectZone[iRow], m_X[iRow], m_Y[iRow], m_Z[iRow], m_Angle[iRow]);
+		oOutput.Printf(" speed %.2f hp %u/%u mp %u/%u", m_Speed[iRow], m_HP[iRow], m_MaxHP[iRow], m_MP[iRow], m_MaxMP[iRow]);
+		if (m_Flags[iRow] & s_FlagDead)
+			oOutput.Append(" dead");
+		if (m_Target[iRow] != 0)
+			oOutput.Printf(" target 0x%x", m_Target[iRow]);
+		oOutput.AppendChar('\n');
+		for (uint32_t iBuff = m_FirstBuff[iRow]; iBuff != s_None; iBuff = m_NextBuff[iBuff]) {
+			const char* sBuff = oSysNames.Lookup(m_BuffIds[iBuff]);
+			oOutput.Printf("  buff %u '%s' from 0x%x\n", m_BuffIds[iBuff], sBuff != NULL ? sBuff : "?", m_BuffSources[iBuff]);
+		}
+	}
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,213 @@
+/*
+ * Runes of Magic protocol analysis - state of the game world
+ * Copyright (C) 2013-2015 Rink Springer <rink@rink.nu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __WORLDSTATE_H__
+#define __WORLDSTATE_H__
+
+#include <stdint.h>
+#include <vector>
+#include "dataannotation.h"
+#include "idmap.h"
+
+class Checkpoint;
+class OutputBuffer;
+class ProtocolSchema;
+
+/*! \brief Objects of the game world, as far as the packets tell
+ *
+ *  The state is updated by annotations on the subpackets which create,
+ *  move, change and destroy objects; these are applied in packet order,
+ *  just like the object names. Objects are kept in a table with a column
+ *  per property, where the rows of destroyed objects are filled by the
+ *  last one, so walking through a property touches nothing else. Objects
+ *  which are updated without being created first are added as well.
+ */
+class WorldState {
+public:
+	//! \brief Receives the positions of objects as they change
+	class XListener {
+	public:
+		virtual ~XListener() { }
+
+		/*! \brief Called whenever an object is placed or moves
+		 *  \param iZone Zone the object is in, 0 if unknown
+		 *  \param iObjectId Object id
+		 *  \param fX X coordinate
+		 *  \param fY Y coordinate, which is the height
+		 *  \param fZ Z coordinate
+		 */
+		virtual void ObjectMoved(uint32_t iZone, uint32_t iObjectId, float fX, float fY, float fZ) = 0;
+	};
+
+	WorldState();
+	~WorldState();
+
+	/*! \brief Registers the annotations updating the state
+	 *  \param oSchema Schema to register them with
+	 *  \param bTrack Should the state be kept at all?
+	 *
+	 *  These are world_create, world_destroy, world_position, world_stats,
+	 *  world_max_stats, world_speed, world_died, world_revive, world_target,
+	 *  world_buff and world_zone; see Bind() for the fields each needs. If
+	 *  the state isn't kept, they are only registered so the definitions can
+	 *  be loaded, and never bind, so they cost nothing while decoding.
+	 */
+	void Register(ProtocolSchema& oSchema, bool bTrack);
+
+	/*! \brief Sets who is told about objects moving
+	 *  \param pListener Listener to use, NULL for none
+	 */
+	void SetListener(XListener* pListener) { m_Listener = pListener; }
+
+	//! \brief Retrieves the zone entered last, 0 if unknown
+	uint32_t GetZone() const { return m_Zone; }
+
+	//! \brief Forgets all objects
+	void Clear();
+
+	//! \brief Retrieves the number of objects
+	int GetNumObjects() const { return m_Ids.size(); }
+
+	/*! \brief Finds the row of an object
+	 *  \param iObjectId Object id to look for
+	 *  \returns Row, or -1 if the object is unknown
+	 */
+	int FindObject(uint32_t iObjectId);
+
+	uint32_t GetObjectId(int iRow) const { return m_Ids[iRow]; }
+	float GetX(int iRow) const { return m_X[iRow]; }
+	float GetY(int iRow) const { return m_Y[iRow]; }
+	float GetZ(int iRow) const { return m_Z[iRow]; }
+	uint32_t GetObjectZone(int iRow) const { return m_ObjectZone[iRow]; }
+
+	//! \brief Stores all objects in a checkpoint
+	void Save(Checkpoint& oCheckpoint) const;
+
+	//! \brief Restores the objects stored by Save(), forgetting all others
+	bool Restore(Checkpoint& oCheckpoint);
+
+	/*! \brief Lists all objects by id
+	 *  \param oOutput Buffer to write to
+	 *  \param oObjectNames Annotation providing object names
+	 *  \param oSysNames Annotation providing names of races and buffs
+	 */
+	void Print(OutputBuffer& oOutput, XDataAnnotation& oObjectNames, XDataAnnotation& oSysNames) const;
+
+	//! \brief Object was seen being created, rather than only updated
+	static const uint32_t s_FlagCreated = 1;
+	//! \brief Position is known
+	static const uint32_t s_FlagPlaced = 2;
+	//! \brief Object died and was not revived since
+	static const uint32_t s_FlagDead = 4;
+
+protected:
+	//! \brief What an annotation does
+	enum EventType {
+		E_Create,
+		E_Destroy,
+		E_Position,
+		E_Stats,
+		E_MaxStats,
+		E_Speed,
+		E_Died,
+		E_Revive,
+		E_Target,
+		E_Buff,
+		E_Zone,
+		E_Count
+	};
+
+	//! \brief Annotation handing one type of event to us
+	class Event : public XDataAnnotation {
+	public:
+		Event(WorldState& oWorld, EventType eType) : m_World(oWorld), m_Type(eType) { }
+
+		virtual const char* Lookup(uint32_t value) { return "?"; }
+		virtual bool Bind(const ProtocolDefinition::Struct& oStruct, Binding*& pBinding);
+		virtual void Apply(const Binding* pBinding, const ProtocolDefinition::Value* pValues);
+
+	protected:
+		WorldState& m_World;
+		EventType m_Type;
+	};
+
+	//! \brief Fields used by Event::Apply(); which are bound depends on the event
+	class Fields : public XDataAnnotation::Binding {
+	public:
+		XDataAnnotation::BoundField<ProtocolDefinition::unsignedType> m_ObjectId;
+		XDataAnnotation::BoundField<ProtocolDefinition::unsignedType> m_Race;
+		XDataAnnotation::BoundField<ProtocolDefinition::unsignedType> m_Level;
+		XDataAnnotation::BoundField<ProtocolDefinition::floatType> m_X, m_Y, m_Z, m_Angle;
+		XDataAnnotation::BoundField<ProtocolDefinition::floatType> m_Speed;
+		XDataAnnotation::BoundField<ProtocolDefinition::unsignedType> m_HP, m_MaxHP, m_MP, m_MaxMP;
+		XDataAnnotation::BoundField<ProtocolDefinition::unsignedType> m_Target;
+		XDataAnnotation::BoundField<ProtocolDefinition::unsignedType> m_Buff;
+		XDataAnnotation::BoundField<ProtocolDefinition::unsignedType> m_Zone;
+	};
+
+	//! \brief Marks the absence of a row
+	static const uint32_t s_None = 0xffffffff;
+
+	//! \brief Finds the row of an object, adding one if needed
+	int Touch(uint32_t iObjectId);
+
+	//! \brief Removes the row of an object along with its buffs
+	void Remove(uint32_t iObjectId);
+
+	//! \brief Adds a buff to an object, or updates who applied it
+	void AddBuff(int iRow, uint32_t iBuffId, uint32_t iSourceId);
+
+	//! \brief Row of every object, by id
+	IdMap<uint32_t> m_Rows;
+
+	//! \name Properties of the objects, by row
+	//! \{
+	std::vector<uint32_t> m_Ids;
+	std::vector<uint32_t> m_Flags;
+	std::vector<uint32_t> m_Race;
+	std::vector<uint32_t> m_Level;
+	std::vector<float> m_X, m_Y, m_Z, m_Angle;
+	//! \brief Zone the object was last placed in
+	std::vector<uint32_t> m_ObjectZone;
+	std::vector<float> m_Speed;
+	std::vector<uint32_t> m_HP, m_MaxHP, m_MP, m_MaxMP;
+	std::vector<uint32_t> m_Target;
+	//! \brief First buff, s_None if none
+	std::vector<uint32_t> m_FirstBuff;
+	//! \}
+
+	//! \name Buffs, linked per object; unused rows are linked from m_FreeBuff
+	//! \{
+	std::vector<uint32_t> m_BuffIds;
+	std::vector<uint32_t> m_BuffSources;
+	std::vector<uint32_t> m_NextBuff;
+	uint32_t m_FreeBuff;
+	//! \}
+
+	std::vector<Event*> m_Events;
+	XListener* m_Listener;
+
+	//! \brief Zone entered last, 0 if unknown
+	uint32_t m_Zone;
+
+	//! \brief Is the state kept at all?
+	bool m_Track;
+
+	WorldState(const WorldState&) = delete;
+	WorldState& operator=(const WorldState&) = delete;
+};
+
+#endif /* __WORLDSTATE_H__ */
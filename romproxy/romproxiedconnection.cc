@@ -20,6 +20,7 @@
 #include "../lib/romstructs.h"
 #include "romconnection.h"
 #include "rompacketlogger.h"
+#include "rompackettap.h"
 #include "romproxy.h"
 
 /*
@@ -36,9 +37,11 @@
  *
  */
 
+uint32_t ROMProxiedConnection::s_NextTapId = 1;
+
 ROMProxiedConnection::ROMProxiedConnection(const Address& clientaddr, const Address& remoteaddr)
 	: ProxiedConnection(clientaddr, remoteaddr),
-	  m_LocalCallback(*this), m_RemoteCallback(*this)
+	  m_LocalCallback(*this), m_RemoteCallback(*this), m_TapId(s_NextTapId++)
 {
 	m_LocalConnection = new ROMConnection(GetLocalClient(), m_LocalCallback);
 	m_RemoteConnection = new ROMConnection(GetRemoteClient(), m_RemoteCallback);
@@ -101,7 +104,10 @@ ROMProxiedConnection::OnRemotePacket(struct ROM::Packet* p)
 {
 	if (g_ROMProxy->GetDebugLevel() > 3)
 		fprintf(stderr, "ROMProxiedConnection::OnRemotePacket()\n");
-		m_LocalConnection->SendPacket(p);
+
+	// Sending encrypts the packet in place, so it must be published first
+	Tap(ROM_TAP_SERVER_TO_CLIENT, p);
+	m_LocalConnection->SendPacket(p);
 
 	if (g_ROMProxy->MustLogProxyClientTraffic())
 		g_ROMProxy->GetLogger()->Write(GetLocalClient().GetRemoteAddress(), GetLocalClient().GetLocalAddress(), p);
@@ -129,6 +135,7 @@ ROMProxiedConnection::OnLocalPacket(struct ROM::Packet* p)
 	if (g_ROMProxy->GetDebugLevel() > 3)
 		fprintf(stderr, "ROMProxiedConnection::OnLocalPacket()\n");
 
+	Tap(ROM_TAP_CLIENT_TO_SERVER, p);
 	m_RemoteConnection->SendPacket(p);
 	if (g_ROMProxy->MustLogProxyServerTraffic())
 		g_ROMProxy->GetLogger()->Write(GetRemoteClient().GetLocalAddress(), GetRemoteClient().GetRemoteAddress(), p);
@@ -144,6 +151,22 @@ ROMProxiedConnection::OnLocalRawPacket(const struct ROM::Packet* p)
 		g_ROMProxy->GetLogger()->Write(GetLocalClient().GetLocalAddress(), GetLocalClient().GetRemoteAddress(), p);
 }
 
+void
+ROMProxiedConnection::Tap(int direction, const struct ROM::Packet* p)
+{
+	ROMPacketTap* tap = g_ROMProxy->GetTap();
+	if (tap == NULL)
+		return;
+
+	// Always as seen by the client; it only ever talks to us
+	const Address& client = GetLocalClient().GetRemoteAddress();
+	const Address& server = GetLocalClient().GetLocalAddress();
+	if (direction == ROM_TAP_CLIENT_TO_SERVER)
+		tap->Write(m_TapId, direction, client, server, p);
+	else
+		tap->Write(m_TapId, direction, server, client, p);
+}
+
 ROMProxiedConnection::LocalCallback::LocalCallback(ROMProxiedConnection& connection)
 	: m_Connection(connection)
 {
@@ -17,6 +17,7 @@
 #ifndef __ROMPROTOCOLPROXY_H__
 #define __ROMPROTOCOLPROXY_H__
 
+#include <stdint.h>
 #include "proxiedconnection.h"
 #include "romconnectioncallback.h"
 
@@ -40,6 +41,12 @@ protected:
 	virtual void OnLocalRawPacket(const struct ROM::Packet* p);
 	virtual void OnRemoteRawPacket(const struct ROM::Packet* p);
 
+	/*! \brief Publishes a decrypted packet to the shared memory tap, if any
+	 *  \param direction ROM_TAP_CLIENT_TO_SERVER or ROM_TAP_SERVER_TO_CLIENT
+	 *  \param p Packet to publish
+	 */
+	void Tap(int direction, const struct ROM::Packet* p);
+
 private:
 	//! \brief Callbacks used for the local connection
 	class LocalCallback : public ROMConnectionCallback {
@@ -78,6 +85,12 @@ private:
 
 	//! \brief Remote connection callbacks
 	RemoteCallback m_RemoteCallback;
+
+	//! \brief Identifies the connection in the tap
+	uint32_t m_TapId;
+
+	//! \brief Next identifier to hand out
+	static uint32_t s_NextTapId;
 };
 
 #endif /* __ROMPROTOCOLPROXY_H__ */
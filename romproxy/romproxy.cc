@@ -25,6 +25,7 @@
 #include <list>
 #include "address.h"
 #include "rompacketlogger.h"
+#include "rompackettap.h"
 #include "romproxy.h"
 #include "gameproxy.h"
 #include "loginproxy.h"
@@ -34,7 +35,7 @@ ROMProxy* g_ROMProxy = NULL;
 void
 ROMProxy::usage(const char* progname)
 {
-	fprintf(stderr, "usage: %s [-h?cs] [-b ip[:port]] [-d level] [-l log.rom] loginserver:port\n", progname);
+	fprintf(stderr, "usage: %s [-h?cs] [-b ip[:port]] [-d level] [-l log.rom] [-p /name] loginserver:port\n", progname);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "  -h, -?             this help\n");
 	fprintf(stderr, "  -b ip:port         bind to the given hostname:service\n");
@@ -42,13 +43,14 @@ ROMProxy::usage(const char* progname)
 	fprintf(stderr, "  -d level           set debug level\n");
 	fprintf(stderr, "  -s                 log server <-> proxy traffic\n");
 	fprintf(stderr, "  -l log.rom         log packets to log.rom\n");
+	fprintf(stderr, "  -p /name           publish decrypted packets to shared memory /name\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "loginserver:port is the login server to proxy\n");
 	fprintf(stderr, "If neither -c nor -s is supplied, -c will be assumed\n");
 }
 
 ROMProxy::ROMProxy()
-	: m_quit(false), m_LogProxyServer(false), m_LogProxyClient(false), m_DebugLevel(0)
+	: m_logger(NULL), m_tap(NULL), m_quit(false), m_LogProxyServer(false), m_LogProxyClient(false), m_DebugLevel(0)
 {
 }
 
@@ -75,9 +77,10 @@ ROMProxy::Run(int argc, char** argv)
 {
 	char* bind_addr = NULL;
 	char* log_file = NULL;
+	char* tap_name = NULL;
 	{
 		int opt;
-		while ((opt = getopt(argc, argv, "?hb:cd:l:s")) != -1) {
+		while ((opt = getopt(argc, argv, "?hb:cd:l:p:s")) != -1) {
 			switch(opt) {
 				case 'h':
 				case '?':
@@ -102,6 +105,9 @@ ROMProxy::Run(int argc, char** argv)
 				case 'l':
 					log_file = optarg;
 					break;
+				case 'p':
+					tap_name = optarg;
+					break;
 			}
 		}
 	}
@@ -155,6 +161,12 @@ ROMProxy::Run(int argc, char** argv)
 			m_LogProxyClient = true;
 	}
 
+	if (tap_name != NULL) {
+		m_tap = new ROMPacketTap;
+		if (!m_tap->Open(tap_name))
+			err(1, "cannot create shared memory tap");
+	}
+
 	LoginProxy loginproxy(localserver_address, loginserver_address);
 	if (!loginproxy.Initialize())
 			err(1, "cannot create local server");
@@ -193,6 +205,8 @@ ROMProxy::Run(int argc, char** argv)
 
 	delete m_logger;
 	m_logger = NULL;
+	delete m_tap;
+	m_tap = NULL;
 	return 0;
 }
 
@@ -21,6 +21,7 @@
 
 class Proxy;
 class ROMPacketLogger;
+class ROMPacketTap;
 
 //! \brief Main ROM proxy
 class ROMProxy {
@@ -40,6 +41,9 @@ public:
 	//! \brief Retrieve the logger, if any
 	ROMPacketLogger* GetLogger() const;
 
+	//! \brief Retrieve the shared memory tap, if any
+	ROMPacketTap* GetTap() const;
+
 	/*! \brief Are we to log proxy<->server traffic?
 	 *  \returns true if so
 	 */
@@ -79,6 +83,9 @@ private:
 	//! \brief Logger in use
 	ROMPacketLogger* m_logger;
 
+	//! \brief Shared memory tap in use
+	ROMPacketTap* m_tap;
+
 	//! \brief Current bind address
 	Address m_BindAddress;
 
@@ -107,6 +114,12 @@ ROMProxy::GetLogger() const
 	return m_logger;
 }
 
+inline ROMPacketTap*
+ROMProxy::GetTap() const
+{
+	return m_tap;
+}
+
 inline bool
 ROMProxy::MustLogProxyServerTraffic() const
 {